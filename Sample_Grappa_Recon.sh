@@ -11,6 +11,11 @@
 # acc_factor_PE2;
 # reference_lines_PE1;
 # reference_lines_PE2;
+# virtual_channels;		(smallest number of virtual coils retaining VirtualCoilEnergyFraction of the energy)
+# last_virtual_channel;	(virtual_channels - 1)
+# readout_block_start;		(out-of-core script only)
+# readout_block_last;		(out-of-core script only)
+# readout_block_size;		(out-of-core script only)
 
 
 debug=false
@@ -20,8 +25,8 @@ if "$debug"; then
 fi
 
 bart cc -S reference_data cc_mat
-# Compress coils to 12 virtual channels
-bart extract 4 0 11 cc_mat cc_mat_P
+# Compress coils to as many virtual channels as needed to retain most of their energy
+bart extract 4 0 $last_virtual_channel cc_mat cc_mat_P
 
 bart fmac -C -s 8 reference_data cc_mat_P reference_data_cc
 bart transpose 3 4 reference_data_cc cc_reference_data
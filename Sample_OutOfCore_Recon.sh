@@ -0,0 +1,44 @@
+#!/bin/bash
+
+# List of available default parameters
+# recon_matrix_x;
+# recon_matrix_y;
+# recon_matrix_z;
+# FOV_x;
+# FOV_y;
+# FOV_z;
+# acc_factor_PE1;
+# acc_factor_PE2;
+# reference_lines_PE1;
+# reference_lines_PE2;
+# virtual_channels;		(smallest number of virtual coils retaining VirtualCoilEnergyFraction of the energy)
+# last_virtual_channel;	(virtual_channels - 1)
+# readout_block_start;		(out-of-core script only)
+# readout_block_last;		(out-of-core script only)
+# readout_block_size;		(out-of-core script only)
+
+
+# Out-of-core reconstruction (see OutOfCoreBartCommandScript_name): run on each
+# block of readout positions, input_data being inverse Fourier transformed along
+# the readout while reference_data is the whole calibration k-space.
+# The output must keep the readout positions of the block.
+# The commands only depending on reference_data and not on the block (here
+# the ecalib computing maps_full) run once for all the blocks.
+
+debug=false
+
+if "$debug"; then
+	set -x
+fi
+
+bart ecalib -c0.7 -k7 -r$reference_lines_PE1 -m1 -S reference_data maps_full
+# Sensitivities of the readout positions of the block
+bart extract 0 $readout_block_start $readout_block_last maps_full maps
+
+# The readout positions of the block are independent, back to "k-space" along the readout
+bart fft -u 1 input_data kspace
+bart pics -l1 -r0.1 -i150 kspace maps ims
+
+if "$debug";then
+	set +x
+fi
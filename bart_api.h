@@ -78,6 +78,15 @@ extern "C" void register_mem_cfl_non_managed(const char* name, unsigned int D, c
  */
 extern "C" int in_mem_bart_main(int argc, char* argv[], char* out);
 
+//! Deallocate some memory CFL
+/*!
+ *  The memory is freed if the CFL owns it (see register_mem_cfl_malloc and
+ *  register_mem_cfl_new)
+ *
+ *  \param name       Name used to refer to in-memory CFL
+ */
+extern "C" void deallocate_mem_cfl(const char* name);
+
 //! Deallocate any memory CFLs
 /*!
  * \note It is safe to call this function multiple times.
@@ -0,0 +1,259 @@
+/****************************************************************************************************************************
+ * Description: Coroutine-based execution of BART jobs (C++20)
+ ****************************************************************************************************************************/
+
+#include "bart_async.h"
+
+#ifdef BART_ASYNC_EXECUTION
+
+#include "log.h"
+#include <algorithm>
+
+namespace internal {
+     // How often the coroutines waiting for a BART instance or a memory quota check whether they got cancelled
+     constexpr std::chrono::milliseconds ASYNC_POLL_INTERVAL(50);
+
+     // Destroys its frame once done
+     struct DetachedTask
+     {
+	  struct promise_type
+	  {
+	       DetachedTask get_return_object() noexcept { return {}; }
+	       std::suspend_never initial_suspend() noexcept { return {}; }
+	       std::suspend_never final_suspend() noexcept { return {}; }
+	       void return_void() noexcept {}
+	       void unhandled_exception() noexcept { std::terminate(); }
+	  };
+     };
+
+     DetachedTask run_detached(Gadgetron::BartExecutor& executor, Gadgetron::BartTask<void> task)
+     {
+	  co_await executor.schedule();
+	  try {
+	       co_await std::move(task);
+	  }
+	  catch (const std::exception& e) {
+	       GERROR("BART coroutine failed: %s\n", e.what());
+	  }
+	  catch (...) {
+	       GERROR("BART coroutine failed\n");
+	  }
+     }
+}
+
+namespace Gadgetron {
+
+     BartExecutor& BartExecutor::get()
+     {
+	  static BartExecutor executor;
+	  return executor;
+     }
+
+     BartExecutor::~BartExecutor()
+     {
+	  {
+	       std::lock_guard<std::mutex> lock(mtx_);
+	       is_stopping_ = true;
+	  }
+	  cv_.notify_all();
+	  timer_cv_.notify_all();
+	  for (auto& t: threads_)
+	       t.join();
+	  if (timer_thread_.joinable())
+	       timer_thread_.join();
+     }
+
+     void BartExecutor::configure(size_t threads)
+     {
+	  std::lock_guard<std::mutex> lock(mtx_);
+	  if (!threads_.empty()) {
+	       if (threads != 0 && threads != threads_.size())
+		    GWARN("BART executor already running %lu thread(s); ignoring new configuration\n", threads_.size());
+	       return;
+	  }
+
+	  if (threads == 0)
+	       threads = std::max(std::thread::hardware_concurrency(), 1u);
+	  for (size_t k = 0; k < threads; ++k)
+	       threads_.emplace_back([this] { work(); });
+	  timer_thread_ = std::thread([this] { keep_time(); });
+     }
+
+     size_t BartExecutor::size() const
+     {
+	  std::lock_guard<std::mutex> lock(mtx_);
+	  return threads_.size();
+     }
+
+     void BartExecutor::post(std::coroutine_handle<> h)
+     {
+	  {
+	       std::lock_guard<std::mutex> lock(mtx_);
+	       ready_.push_back(h);
+	  }
+	  cv_.notify_one();
+     }
+
+     void BartExecutor::post_at(std::chrono::steady_clock::time_point when, std::coroutine_handle<> h)
+     {
+	  {
+	       std::lock_guard<std::mutex> lock(mtx_);
+	       timers_.emplace(when, h);
+	  }
+	  timer_cv_.notify_one();
+     }
+
+     void BartExecutor::spawn(BartTask<void> task)
+     {
+	  // Nobody configured the executor: as many threads as the hardware
+	  configure(0);
+	  internal::run_detached(*this, std::move(task));
+     }
+
+     void BartExecutor::work()
+     {
+	  std::unique_lock<std::mutex> lock(mtx_);
+	  while (true) {
+	       cv_.wait(lock, [this] { return is_stopping_ || !ready_.empty(); });
+	       if (is_stopping_)
+		    return;
+	       auto h = ready_.front();
+	       ready_.pop_front();
+	       lock.unlock();
+	       h.resume();
+	       lock.lock();
+	  }
+     }
+
+     void BartExecutor::keep_time()
+     {
+	  std::unique_lock<std::mutex> lock(mtx_);
+	  while (!is_stopping_) {
+	       const auto now = std::chrono::steady_clock::now();
+	       while (!timers_.empty() && timers_.begin()->first <= now) {
+		    ready_.push_back(timers_.begin()->second);
+		    timers_.erase(timers_.begin());
+		    cv_.notify_one();
+	       }
+
+	       // The jobs waiting for an instance do not poll for their cancellation themselves
+	       lock.unlock();
+	       BartInstancePool::get().dispatch();
+	       lock.lock();
+
+	       auto until = now + internal::ASYNC_POLL_INTERVAL;
+	       if (!timers_.empty())
+		    until = std::min(until, timers_.begin()->first);
+	       timer_cv_.wait_until(lock, until);
+	  }
+     }
+
+     // =========================================================================
+
+     void BartEvent::set()
+     {
+	  std::vector<std::coroutine_handle<>> waiters;
+	  {
+	       std::lock_guard<std::mutex> lock(mtx_);
+	       is_set_ = true;
+	       waiters.swap(waiters_);
+	  }
+	  for (auto h: waiters)
+	       executor_.post(h);
+     }
+
+     bool BartEvent::is_set() const
+     {
+	  std::lock_guard<std::mutex> lock(mtx_);
+	  return is_set_;
+     }
+
+     bool BartEvent::add_waiter(std::coroutine_handle<> h)
+     {
+	  std::lock_guard<std::mutex> lock(mtx_);
+	  if (is_set_)
+	       return false;
+	  waiters_.push_back(h);
+	  return true;
+     }
+
+     // =========================================================================
+
+     BartTask<BartFairShare::Reservation> reserve_memory(BartExecutor& executor, const BartJob& job, size_t bytes)
+     {
+	  auto& fair_share = BartFairShare::get();
+	  auto reservation = fair_share.try_reserve(job.schedule.tenant, bytes, true);
+	  while (!reservation && !is_cancelled(job)) {
+	       co_await executor.sleep_for(internal::ASYNC_POLL_INTERVAL);
+	       reservation = fair_share.try_reserve(job.schedule.tenant, bytes, false);
+	  }
+	  co_return reservation;
+     }
+
+     BartTask<bool> run_bart_job_async(BartExecutor& executor, const BartJob& job, size_t bytes, std::function<bool(const BartJobOutput&)> extract)
+     {
+	  const auto reservation = co_await reserve_memory(executor, job, bytes);
+	  if (!reservation)
+	       co_return false;
+
+	  auto lease = co_await acquire_instance(executor, job.schedule, job.cancellation.get());
+	  if (!lease)
+	       co_return false;
+
+	  // The in-memory CFLs go whichever way the job ends
+	  struct MemCflGuard
+	  {
+	       BartInstancePool::Lease& lease;
+	       ~MemCflGuard()
+		    {
+			 if (lease)
+			      lease->deallocate_all_mem_cfl();
+		    }
+	  } mem_guard{lease};
+
+	  BartJobRunner runner(job);
+	  if (!runner.start(*lease))
+	       co_return false;
+
+	  while (!runner.is_done()) {
+	       if (runner.is_waiting()) {
+		    // Another job computes the same calibration, the instance goes to the other jobs meanwhile
+		    runner.park(lease);
+		    while (runner.is_waiting()) {
+			 if (is_cancelled(job)) {
+			      GDEBUG("BART job cancelled while waiting for its calibration\n");
+			      co_return false;
+			 }
+			 co_await executor.sleep_for(internal::ASYNC_POLL_INTERVAL);
+		    }
+		    lease = co_await acquire_instance(executor, job.schedule, job.cancellation.get());
+		    if (!lease) {
+			 GDEBUG("BART job cancelled while waiting for an instance\n");
+			 co_return false;
+		    }
+		    runner.resume(*lease);
+	       }
+
+	       if (runner.should_yield(lease)) {
+		    runner.park(lease);
+		    lease = co_await acquire_instance(executor, job.schedule, job.cancellation.get());
+		    if (!lease) {
+			 GDEBUG("BART job cancelled while preempted\n");
+			 co_return false;
+		    }
+		    runner.resume(*lease);
+	       }
+
+	       if (!runner.run_next(*lease))
+		    co_return false;
+
+	       // Let the other coroutines in between two commands
+	       co_await executor.schedule();
+	  }
+
+	  BartJobOutput output;
+	  co_return runner.finish(*lease, output) && extract(output);
+     }
+} // namespace Gadgetron
+
+#endif // BART_ASYNC_EXECUTION
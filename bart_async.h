@@ -0,0 +1,353 @@
+/****************************************************************************************************************************
+ * Description: Coroutine-based execution of BART jobs (C++20)
+ *
+ * A reconstruction is written as a coroutine (BartTask) made of awaitable
+ * steps: staging its inputs, waiting for the memory quota of its tenant and
+ * for a BART instance, running each command, waiting for other jobs it depends
+ * on (BartEvent) or for some blocking I/O, extracting its output.
+ * The coroutines are multiplexed onto the few threads of a BartExecutor: a job
+ * waiting for anything but the CPU does not hold any thread, and the points
+ * where it resumes are where it checks for its cancellation.
+ *
+ * A BART command itself still runs to completion on the executor thread that
+ * starts it.
+ *
+ * Only available when compiled as C++20 with coroutine support
+ * (BART_ASYNC_EXECUTION defined).
+ ****************************************************************************************************************************/
+
+#ifndef BART_ASYNC_H
+#define BART_ASYNC_H
+
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#define BART_ASYNC_EXECUTION 1
+#endif
+#endif
+
+#ifdef BART_ASYNC_EXECUTION
+
+#include "bart_executor.h"
+#include "bart_fair_share.h"
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace Gadgetron {
+
+     template <typename T>
+     class BartTask;
+
+     namespace detail {
+	  struct BartTaskPromiseBase
+	  {
+	       std::coroutine_handle<> continuation;
+	       std::exception_ptr error;
+
+	       std::suspend_always initial_suspend() noexcept { return {}; }
+
+	       // Resume whoever awaits the task (symmetric transfer, no stack growth)
+	       struct FinalAwaiter
+	       {
+		    bool await_ready() noexcept { return false; }
+		    template <typename Promise>
+		    std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> h) noexcept
+		    {
+			 const auto continuation = h.promise().continuation;
+			 return continuation ? continuation : std::noop_coroutine();
+		    }
+		    void await_resume() noexcept {}
+	       };
+	       FinalAwaiter final_suspend() noexcept { return {}; }
+
+	       void unhandled_exception() { error = std::current_exception(); }
+	  };
+
+	  template <typename T>
+	  struct BartTaskPromise : BartTaskPromiseBase
+	  {
+	       std::optional<T> value;
+
+	       BartTask<T> get_return_object();
+	       void return_value(T v) { value = std::move(v); }
+
+	       T result()
+	       {
+		    if (error)
+			 std::rethrow_exception(error);
+		    return std::move(*value);
+	       }
+	  };
+
+	  template <>
+	  struct BartTaskPromise<void> : BartTaskPromiseBase
+	  {
+	       BartTask<void> get_return_object();
+	       void return_void() {}
+
+	       void result()
+	       {
+		    if (error)
+			 std::rethrow_exception(error);
+	       }
+	  };
+     } // namespace detail
+
+     //! Lazily started coroutine: runs when awaited (or spawned on a BartExecutor)
+     template <typename T = void>
+     class [[nodiscard]] BartTask
+     {
+     public:
+	  using promise_type = detail::BartTaskPromise<T>;
+	  using Handle = std::coroutine_handle<promise_type>;
+
+	  BartTask() = default;
+	  explicit BartTask(Handle h) : h_(h) {}
+	  BartTask(BartTask&& other) noexcept : h_(std::exchange(other.h_, nullptr)) {}
+	  BartTask& operator=(BartTask&& other) noexcept
+	  {
+	       if (this != &other) {
+		    if (h_)
+			 h_.destroy();
+		    h_ = std::exchange(other.h_, nullptr);
+	       }
+	       return *this;
+	  }
+	  BartTask(const BartTask&) = delete;
+	  BartTask& operator=(const BartTask&) = delete;
+	  ~BartTask()
+	  {
+	       if (h_)
+		    h_.destroy();
+	  }
+
+	  struct Awaiter
+	  {
+	       Handle h;
+
+	       bool await_ready() const noexcept { return !h || h.done(); }
+	       std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+	       {
+		    h.promise().continuation = awaiting;
+		    return h;
+	       }
+	       T await_resume() { return h.promise().result(); }
+	  };
+
+	  Awaiter operator co_await() && noexcept { return Awaiter{h_}; }
+
+     private:
+	  Handle h_;
+     };
+
+     namespace detail {
+	  template <typename T>
+	  BartTask<T> BartTaskPromise<T>::get_return_object()
+	  {
+	       return BartTask<T>(std::coroutine_handle<BartTaskPromise<T>>::from_promise(*this));
+	  }
+
+	  inline BartTask<void> BartTaskPromise<void>::get_return_object()
+	  {
+	       return BartTask<void>(std::coroutine_handle<BartTaskPromise<void>>::from_promise(*this));
+	  }
+     } // namespace detail
+
+     //! Small fixed pool of threads the coroutines are resumed on
+     class BartExecutor
+     {
+     public:
+	  //! Process-wide executor
+	  static BartExecutor& get();
+
+	  //! Start the threads (0 for the number of hardware threads), only once per process
+	  void configure(size_t threads);
+
+	  size_t size() const;
+
+	  //! Resume a coroutine on one of the threads
+	  void post(std::coroutine_handle<> h);
+
+	  //! co_await: continue on one of the threads
+	  auto schedule()
+	  {
+	       struct Awaiter
+	       {
+		    BartExecutor& executor;
+		    bool await_ready() const noexcept { return false; }
+		    void await_suspend(std::coroutine_handle<> h) { executor.post(h); }
+		    void await_resume() const noexcept {}
+	       };
+	       return Awaiter{*this};
+	  }
+
+	  //! co_await: continue on one of the threads after some time, without holding any
+	  auto sleep_for(std::chrono::steady_clock::duration duration)
+	  {
+	       struct Awaiter
+	       {
+		    BartExecutor& executor;
+		    std::chrono::steady_clock::time_point when;
+		    bool await_ready() const noexcept { return false; }
+		    void await_suspend(std::coroutine_handle<> h) { executor.post_at(when, h); }
+		    void await_resume() const noexcept {}
+	       };
+	       return Awaiter{*this, std::chrono::steady_clock::now() + duration};
+	  }
+
+	  //! co_await: run some blocking call (eg. I/O) on a thread of its own, then continue on one of the threads
+	  auto offload(std::function<void()> call)
+	  {
+	       struct Awaiter
+	       {
+		    BartExecutor& executor;
+		    std::function<void()> call;
+		    bool await_ready() const noexcept { return false; }
+		    void await_suspend(std::coroutine_handle<> h)
+		    {
+			 std::thread([this, h] {
+				   call();
+				   executor.post(h);
+			      }).detach();
+		    }
+		    void await_resume() const noexcept {}
+	       };
+	       return Awaiter{*this, std::move(call)};
+	  }
+
+	  //! Run a task to completion in the background
+	  void spawn(BartTask<void> task);
+
+	  //! Run a task on the executor and wait for its result (not from a thread of the executor)
+	  template <typename T>
+	  T run(BartTask<T> task)
+	  {
+	       auto result = std::make_shared<std::promise<T>>();
+	       auto future = result->get_future();
+	       spawn(forward_result(std::move(task), result));
+	       return future.get();
+	  }
+
+	  BartExecutor(const BartExecutor&) = delete;
+	  BartExecutor& operator=(const BartExecutor&) = delete;
+
+     private:
+	  BartExecutor() = default;
+	  ~BartExecutor();
+
+	  void post_at(std::chrono::steady_clock::time_point when, std::coroutine_handle<> h);
+	  void work();
+	  void keep_time();
+
+	  template <typename T>
+	  static BartTask<void> forward_result(BartTask<T> task, std::shared_ptr<std::promise<T>> result)
+	  {
+	       try {
+		    if constexpr (std::is_void_v<T>) {
+			 co_await std::move(task);
+			 result->set_value();
+		    }
+		    else {
+			 result->set_value(co_await std::move(task));
+		    }
+	       }
+	       catch (...) {
+		    result->set_exception(std::current_exception());
+	       }
+	  }
+
+	  mutable std::mutex mtx_;
+	  std::condition_variable cv_;
+	  std::condition_variable timer_cv_;
+	  bool is_stopping_ = false;
+	  std::deque<std::coroutine_handle<>> ready_;
+	  std::multimap<std::chrono::steady_clock::time_point, std::coroutine_handle<>> timers_;
+	  std::vector<std::thread> threads_;
+	  std::thread timer_thread_;
+     };
+
+     //! One-shot event some coroutines wait for (eg. a calibration being computed by another job)
+     class BartEvent
+     {
+     public:
+	  explicit BartEvent(BartExecutor& executor = BartExecutor::get()) : executor_(executor) {}
+
+	  //! Resume all the waiting coroutines (on the executor)
+	  void set();
+
+	  bool is_set() const;
+
+	  //! co_await: continue once the event is set
+	  auto wait()
+	  {
+	       struct Awaiter
+	       {
+		    BartEvent& event;
+		    bool await_ready() const { return event.is_set(); }
+		    bool await_suspend(std::coroutine_handle<> h) { return event.add_waiter(h); }
+		    void await_resume() const noexcept {}
+	       };
+	       return Awaiter{*this};
+	  }
+
+     private:
+	  //! False if already set (the coroutine goes on)
+	  bool add_waiter(std::coroutine_handle<> h);
+
+	  BartExecutor& executor_;
+	  mutable std::mutex mtx_;
+	  bool is_set_ = false;
+	  std::vector<std::coroutine_handle<>> waiters_;
+     };
+
+     //! co_await: BART instance for a job (empty if the job got cancelled while waiting)
+     inline auto acquire_instance(BartExecutor& executor, const BartSchedulingInfo& info, const BartCancellationToken* token)
+     {
+	  struct Awaiter
+	  {
+	       BartExecutor& executor;
+	       const BartSchedulingInfo& info;
+	       const BartCancellationToken* token;
+	       BartInstancePool::Lease lease;
+
+	       bool await_ready() const noexcept { return false; }
+	       void await_suspend(std::coroutine_handle<> h)
+	       {
+		    BartInstancePool::get().acquire_async(info, token, [this, h](BartInstancePool::Lease l) {
+			      lease = std::move(l);
+			      executor.post(h);
+			 });
+	       }
+	       BartInstancePool::Lease await_resume() { return std::move(lease); }
+	  };
+	  return Awaiter{executor, info, token, BartInstancePool::Lease()};
+     }
+
+     //! Memory reservation of a job against the quota of its tenant (not admitted if the job got cancelled while waiting)
+     BartTask<BartFairShare::Reservation> reserve_memory(BartExecutor& executor, const BartJob& job, size_t bytes);
+
+     //! Execute a job (see run_bart_job()) as a sequence of awaitable steps
+     /*!
+      * The job waits for the memory quota of its tenant (reserving bytes) and for
+      * a BART instance, then runs its commands, giving its instance up when
+      * preempted. extract is called with the output while the job still holds
+      * its instance, whose in-memory CFLs are deallocated afterwards.
+      */
+     BartTask<bool> run_bart_job_async(BartExecutor& executor, const BartJob& job, size_t bytes, std::function<bool(const BartJobOutput&)> extract);
+} // namespace Gadgetron
+
+#endif // BART_ASYNC_EXECUTION
+
+#endif //BART_ASYNC_H
@@ -0,0 +1,172 @@
+/****************************************************************************************************************************
+ * Description: gadgetron_bart_benchmark, speed/accuracy benchmark of the BART scripts
+ *
+ * Numerical phantoms (modified Shepp-Logan, with synthetic coil sensitivities)
+ * are undersampled the way the BartGadget receives them (every acc_factor_PE1/2
+ * line, with reference_lines_PE1/2 of separate calibration data) and
+ * reconstructed by the scripts, staged and run exactly as the gadget does.
+ * The latency of each reconstruction is reported alongside its NRMSE against
+ * the phantom, as JSON so that runs can be compared.
+ * Everything is generated from the seed: no data is needed and two runs with
+ * the same seed reconstruct the same k-space.
+ ****************************************************************************************************************************/
+
+#include "bart_benchmark_data.h"
+#include "bart_executor.h"
+#include "log.h"
+#include <boost/program_options.hpp>
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace po = boost::program_options;
+
+#ifndef BART_BENCHMARK_SCRIPT_DIR
+#define BART_BENCHMARK_SCRIPT_DIR "."
+#endif
+
+namespace internal {
+     using Gadgetron::BartPhantomCase;
+
+     struct BenchmarkResult
+     {
+	  std::string script;
+	  std::string case_name;
+	  bool ok = false;
+	  std::vector<double> latencies;	// ms, one per repetition
+	  double nrmse = 0;
+     };
+
+     BenchmarkResult run_case(const BartPhantomCase& c, const std::string& script, const std::vector<std::string>& script_commands,
+			      uint64_t seed, double noise, size_t repeats)
+     {
+	  BenchmarkResult result;
+	  result.script = script;
+	  result.case_name = c.name;
+
+	  Gadgetron::BartBenchmarkDataset dataset;
+	  if (!Gadgetron::make_phantom_dataset(c, seed, noise, dataset))
+	       return result;
+
+	  const auto run = Gadgetron::run_benchmark_script(dataset, dataset.parameters, script_commands, repeats);
+	  result.ok = run.ok;
+	  result.latencies = run.latencies;
+	  if (run.ok)
+	       result.nrmse = Gadgetron::magnitude_nrmse(run.image, dataset.truth);
+	  return result;
+     }
+
+     void write_json(std::ostream& out, uint64_t seed, double noise, const std::vector<BartPhantomCase>& cases, const std::vector<BenchmarkResult>& results)
+     {
+	  out << std::setprecision(6) << "{\n  \"seed\": " << seed << ",\n  \"noise\": " << noise << ",\n  \"results\": [";
+	  for (size_t i = 0; i < results.size(); ++i) {
+	       const auto& r = results[i];
+	       const auto& c = *std::find_if(cases.begin(), cases.end(), [&](const BartPhantomCase& c) { return c.name == r.case_name; });
+	       auto sorted = r.latencies;
+	       std::sort(sorted.begin(), sorted.end());
+
+	       out << (i ? "," : "") << "\n    {\"script\": " << Gadgetron::json_string(r.script) << ", \"case\": " << Gadgetron::json_string(r.case_name)
+		   << ", \"matrix\": [" << c.nx << ", " << c.ny << ", " << c.nz << "], \"coils\": " << c.coils
+		   << ", \"acc_factor_PE1\": " << c.acc1 << ", \"acc_factor_PE2\": " << c.acc2
+		   << ", \"reference_lines_PE1\": " << c.ref1 << ", \"reference_lines_PE2\": " << c.ref2
+		   << ", \"status\": " << (r.ok ? "\"ok\"" : "\"failed\"");
+	       if (r.ok) {
+		    out << ", \"nrmse\": " << r.nrmse << ", \"latency_ms\": {\"min\": " << sorted.front()
+			<< ", \"median\": " << sorted[sorted.size() / 2] << ", \"runs\": [";
+		    for (size_t k = 0; k < r.latencies.size(); ++k)
+			 out << (k ? ", " : "") << r.latencies[k];
+		    out << "]}";
+	       }
+	       out << "}";
+	  }
+	  out << "\n  ]\n}\n";
+     }
+}
+
+int main(int argc, char** argv)
+{
+     std::string scripts_dir;
+     std::vector<std::string> scripts;
+     std::vector<std::string> case_specs;
+     std::string output_path;
+     uint64_t seed(1);
+     double noise(0);
+     size_t repeats(3);
+
+     po::options_description desc("Allowed options");
+     desc.add_options()
+	  ("help,h", "Produce help message")
+	  ("scripts-dir,d", po::value<std::string>(&scripts_dir)->default_value(BART_BENCHMARK_SCRIPT_DIR), "Directory of the BART scripts")
+	  ("script,s", po::value<std::vector<std::string>>(&scripts)->composing(), "BART script to benchmark (repeatable, defaults to the bundled GRAPPA scripts)")
+	  ("case,c", po::value<std::vector<std::string>>(&case_specs)->composing(), "Phantom <nx>x<ny>x<nz>/<coils>/<acc_factor_PE1>x<acc_factor_PE2>/<reference_lines_PE1>x<reference_lines_PE2> (repeatable)")
+	  ("seed", po::value<uint64_t>(&seed)->default_value(1), "Seed of the coil sensitivities and of the noise")
+	  ("noise", po::value<double>(&noise)->default_value(0.), "Standard deviation of the noise, relative to the RMS of the k-space")
+	  ("repeats,r", po::value<size_t>(&repeats)->default_value(3), "Number of reconstructions of each phantom timed")
+	  ("output,o", po::value<std::string>(&output_path)->default_value("bart_benchmark.json"), "JSON file the results are written to (- for the standard output)");
+
+     po::variables_map vm;
+     try
+     {
+	  po::store(po::parse_command_line(argc, argv, desc), vm);
+	  po::notify(vm);
+     }
+     catch (const po::error& e)
+     {
+	  std::cerr << e.what() << std::endl << desc << std::endl;
+	  return 1;
+     }
+
+     if (vm.count("help")) {
+	  std::cout << desc << std::endl;
+	  return 0;
+     }
+
+     if (scripts.empty())
+	  scripts = {"Sample_Grappa_Recon.sh", "Sample_Grappa_Recon_Standard.sh"};
+     if (case_specs.empty())
+	  case_specs = {"128x128x1/8/2x1/24x1", "128x128x1/8/3x1/24x1", "64x64x32/8/2x2/20x12"};
+
+     std::vector<Gadgetron::BartPhantomCase> cases;
+     for (const auto& spec: case_specs) {
+	  Gadgetron::BartPhantomCase c;
+	  if (!Gadgetron::parse_phantom_case(spec, c)) {
+	       std::cerr << "Invalid case: " << spec << std::endl;
+	       return 1;
+	  }
+	  cases.push_back(c);
+     }
+
+     if (!Gadgetron::BartInstancePool::get().configure(1, "")) {
+	  GERROR("Unable to setup BART\n");
+	  return 1;
+     }
+
+     std::vector<internal::BenchmarkResult> results;
+     for (const auto& script: scripts) {
+	  std::vector<std::string> commands;
+	  if (!Gadgetron::load_bart_script(scripts_dir + "/" + script, commands))
+	       return 1;
+	  for (const auto& c: cases) {
+	       results.push_back(internal::run_case(c, script, commands, seed, noise, std::max<size_t>(repeats, 1)));
+	       const auto& r = results.back();
+	       std::cerr << script << " " << c.name << ": " << (r.ok ? "NRMSE " + std::to_string(r.nrmse) : std::string("failed")) << std::endl;
+	  }
+     }
+
+     if (output_path == "-") {
+	  internal::write_json(std::cout, seed, noise, cases, results);
+     }
+     else {
+	  std::ofstream out(output_path);
+	  internal::write_json(out, seed, noise, cases, results);
+	  if (!out) {
+	       GERROR("Unable to write %s\n", output_path.c_str());
+	       return 1;
+	  }
+     }
+     return std::all_of(results.begin(), results.end(), [](const internal::BenchmarkResult& r) { return r.ok; }) ? 0 : 1;
+}
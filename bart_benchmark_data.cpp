@@ -0,0 +1,341 @@
+/****************************************************************************************************************************
+ * Description: Datasets of the BART script benchmark and tuner
+ ****************************************************************************************************************************/
+
+#include "bart_benchmark_data.h"
+#include "bart_coil_compression.h"
+#include "bart_executor.h"
+#include "log.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <random>
+#include <sstream>
+
+namespace internal {
+     using Gadgetron::BartInstancePool;
+     using Gadgetron::BartPhantomCase;
+
+     // Reproducible on every platform (the distributions of <random> are implementation defined)
+     class Random
+     {
+     public:
+	  explicit Random(uint64_t seed) : gen_(seed) {}
+
+	  double uniform() { return (gen_() >> 11) * (1.0 / 9007199254740992.0); }
+
+	  std::complex<float> normal()
+	       {
+		    // Box-Muller
+		    const auto u1 = std::max(uniform(), 1e-300);
+		    const auto u2 = uniform();
+		    const auto r = std::sqrt(-2 * std::log(u1));
+		    return {static_cast<float>(r * std::cos(2 * M_PI * u2)), static_cast<float>(r * std::sin(2 * M_PI * u2))};
+	       }
+
+     private:
+	  std::mt19937_64 gen_;
+     };
+
+     // Modified Shepp-Logan: ellipsoids (intensity, semi-axes a b c, center x y z, rotation in the xy plane in degrees)
+     const double SHEPP_LOGAN[10][8] = {
+	  { 1.0, .6900, .920, .810,  0.00,  0.0000,  0.00,   0},
+	  {-0.8, .6624, .874, .780,  0.00, -0.0184,  0.00,   0},
+	  {-0.2, .1100, .310, .220,  0.22,  0.0000,  0.00, -18},
+	  {-0.2, .1600, .410, .280, -0.22,  0.0000,  0.00,  18},
+	  { 0.1, .2100, .250, .410,  0.00,  0.3500, -0.15,   0},
+	  { 0.1, .0460, .046, .050,  0.00,  0.1000,  0.25,   0},
+	  { 0.1, .0460, .046, .050,  0.00, -0.1000,  0.25,   0},
+	  { 0.1, .0460, .023, .050, -0.08, -0.6050,  0.00,   0},
+	  { 0.1, .0230, .023, .020,  0.00, -0.6060,  0.00,   0},
+	  { 0.1, .0230, .046, .020,  0.06, -0.6050,  0.00,   0}};
+
+     // Position of a voxel in [-1, 1)
+     double coordinate(long i, long n)
+     {
+	  return n > 1 ? 2. * (i - n / 2) / n : 0.;
+     }
+
+     std::vector<float> make_phantom(const BartPhantomCase& c)
+     {
+	  std::vector<float> phantom(c.nx * c.ny * c.nz, 0.f);
+	  for (long z = 0; z < c.nz; ++z) {
+	       for (long y = 0; y < c.ny; ++y) {
+		    for (long x = 0; x < c.nx; ++x) {
+			 const auto px = coordinate(x, c.nx), py = coordinate(y, c.ny), pz = coordinate(z, c.nz);
+			 double value = 0;
+			 for (const auto& e: SHEPP_LOGAN) {
+			      const auto phi = e[7] * M_PI / 180;
+			      const auto dx = px - e[4], dy = py - e[5], dz = pz - e[6];
+			      const auto u = (dx * std::cos(phi) + dy * std::sin(phi)) / e[1];
+			      const auto v = (-dx * std::sin(phi) + dy * std::cos(phi)) / e[2];
+			      const auto w = c.nz > 1 ? dz / e[3] : 0.;
+			      if (u * u + v * v + w * w <= 1)
+				   value += e[0];
+			 }
+			 phantom[x + c.nx * (y + c.ny * z)] = static_cast<float>(value);
+		    }
+	       }
+	  }
+	  return phantom;
+     }
+
+     // Smooth complex sensitivities of coils spread around the object, normalized to a unit sum of squares
+     std::vector<std::complex<float>> make_sensitivities(const BartPhantomCase& c, Random& random)
+     {
+	  const auto num_voxels = c.nx * c.ny * c.nz;
+	  std::vector<std::complex<float>> maps(num_voxels * c.coils);
+	  for (long k = 0; k < c.coils; ++k) {
+	       const auto angle = 2 * M_PI * k / c.coils;
+	       const auto cx = 1.5 * std::cos(angle), cy = 1.5 * std::sin(angle);
+	       const auto cz = c.nz > 1 ? (k % 2 ? .5 : -.5) : 0.;
+	       const auto phase = 2 * M_PI * random.uniform();
+	       for (long z = 0; z < c.nz; ++z) {
+		    for (long y = 0; y < c.ny; ++y) {
+			 for (long x = 0; x < c.nx; ++x) {
+			      const auto dx = coordinate(x, c.nx) - cx, dy = coordinate(y, c.ny) - cy, dz = coordinate(z, c.nz) - cz;
+			      const auto magnitude = std::exp(-(dx * dx + dy * dy + dz * dz) / (2 * 1.2 * 1.2));
+			      maps[x + c.nx * (y + c.ny * (z + c.nz * k))] = std::polar(static_cast<float>(magnitude), static_cast<float>(phase + .5 * (dx + dy)));
+			 }
+		    }
+	       }
+	  }
+	  for (long p = 0; p < num_voxels; ++p) {
+	       float sos = 0;
+	       for (long k = 0; k < c.coils; ++k)
+		    sos += std::norm(maps[p + num_voxels * k]);
+	       for (long k = 0; k < c.coils; ++k)
+		    maps[p + num_voxels * k] /= std::sqrt(sos);
+	  }
+	  return maps;
+     }
+
+     // Fully sampled multi-coil k-space of the phantom, with the Fourier transform of BART itself
+     bool make_kspace(const BartPhantomCase& c, const std::vector<float>& phantom, const std::vector<std::complex<float>>& maps,
+		      std::vector<std::complex<float>>& kspace)
+     {
+	  std::vector<std::complex<float>> coil_images(maps.size());
+	  for (size_t i = 0; i < maps.size(); ++i)
+	       coil_images[i] = phantom[i % phantom.size()] * maps[i];
+
+	  Gadgetron::BartJob job;
+	  job.inputs.push_back({"coil_images", {c.nx, c.ny, c.nz, c.coils}, coil_images.data(), nullptr});
+	  job.commands.push_back("bart fft -u 7 coil_images kspace");
+
+	  auto bart = BartInstancePool::get().acquire();
+	  Gadgetron::BartJobOutput output;
+	  const auto ok = run_bart_job(bart, job, output);
+	  if (ok)
+	       kspace.assign(output.data, output.data + maps.size());
+	  bart->deallocate_all_mem_cfl();
+	  return ok;
+     }
+
+     // BART file as [E0,E1,E2,CHA,N,S,LOC] (the dimensions beyond must be 1)
+     bool read_bart_file(const std::string& path, std::vector<long>& dims, std::vector<std::complex<float>>& data)
+     {
+	  std::ifstream hdr(path + ".hdr");
+	  std::string line;
+	  std::vector<long> all_dims;
+	  while (hdr && std::getline(hdr, line)) {
+	       if (line.empty() || line[0] == '#')
+		    continue;
+	       std::istringstream in(line);
+	       long d;
+	       while (in >> d)
+		    all_dims.push_back(d);
+	       break;
+	  }
+	  if (all_dims.empty()) {
+	       GERROR("Failed to read the header of %s\n", path.c_str());
+	       return false;
+	  }
+	  all_dims.resize(std::max<size_t>(all_dims.size(), 7), 1);
+	  if (std::any_of(all_dims.begin() + 7, all_dims.end(), [](long d) { return d != 1; })) {
+	       GERROR("%s has more than 7 dimensions\n", path.c_str());
+	       return false;
+	  }
+	  dims.assign(all_dims.begin(), all_dims.begin() + 7);
+
+	  size_t size = 1;
+	  for (auto d: dims)
+	       size *= d;
+	  data.resize(size);
+	  std::ifstream cfl(path + ".cfl", std::ifstream::binary);
+	  if (!cfl.read(reinterpret_cast<char*>(data.data()), size * sizeof(std::complex<float>))) {
+	       GERROR("Failed to read the data of %s\n", path.c_str());
+	       return false;
+	  }
+	  return true;
+     }
+
+     void set_parameters(Gadgetron::BartBenchmarkDataset& dataset, uint16_t acc1, uint16_t acc2, const Gadgetron::BartCoilCompression& coil_compression)
+     {
+	  auto& dp = dataset.parameters;
+	  dp = Gadgetron::Default_parameters{};
+	  dp.recon_matrix_x = static_cast<uint16_t>(dataset.dims[0]);
+	  dp.recon_matrix_y = static_cast<uint16_t>(dataset.dims[1]);
+	  dp.recon_matrix_z = static_cast<uint16_t>(dataset.dims[2]);
+	  dp.FOV_x = dp.FOV_y = 256;
+	  dp.FOV_z = static_cast<uint16_t>(dataset.dims[2] > 1 ? 256 : 5);
+	  dp.acc_factor_PE1 = acc1;
+	  dp.acc_factor_PE2 = acc2;
+	  dp.reference_lines_PE1 = static_cast<uint16_t>(dataset.ref_dims[1]);
+	  dp.reference_lines_PE2 = static_cast<uint16_t>(dataset.ref_dims[2]);
+	  // As the BartGadget
+	  dp.virtual_channels = static_cast<uint16_t>(Gadgetron::select_virtual_coils(Gadgetron::coil_compression_energies(dataset.ref_dims, dataset.ref.data()),
+										       coil_compression.energy_fraction, coil_compression.min_channels, coil_compression.max_channels));
+	  dp.last_virtual_channel = dp.virtual_channels - 1;
+	  Gadgetron::set_readout_block(dp, 0, dataset.dims[0]);
+     }
+}
+
+namespace Gadgetron {
+
+     bool parse_phantom_case(const std::string& spec, BartPhantomCase& c)
+     {
+	  c.name = spec;
+	  char s1, s2, s3, x1, x2, x3, x4;
+	  std::istringstream in(spec);
+	  in >> c.nx >> x1 >> c.ny >> x2 >> c.nz >> s1 >> c.coils >> s2 >> c.acc1 >> x3 >> c.acc2 >> s3 >> c.ref1 >> x4 >> c.ref2;
+	  return in && x1 == 'x' && x2 == 'x' && x3 == 'x' && x4 == 'x' && s1 == '/' && s2 == '/' && s3 == '/'
+	       && c.nx > 0 && c.ny > 0 && c.nz > 0 && c.coils > 0 && c.acc1 > 0 && c.acc2 > 0
+	       && c.ref1 > 0 && c.ref1 <= c.ny && c.ref2 > 0 && c.ref2 <= c.nz;
+     }
+
+     bool make_phantom_dataset(const BartPhantomCase& c, uint64_t seed, double noise, BartBenchmarkDataset& dataset,
+			       const BartCoilCompression& coil_compression)
+     {
+	  internal::Random random(seed);
+	  const auto maps = internal::make_sensitivities(c, random);
+	  dataset.name = c.name;
+	  dataset.truth = internal::make_phantom(c);
+	  std::vector<std::complex<float>> kspace;
+	  if (!internal::make_kspace(c, dataset.truth, maps, kspace))
+	       return false;
+
+	  if (noise > 0) {
+	       double power = 0;
+	       for (const auto& v: kspace)
+		    power += std::norm(v);
+	       const auto sigma = static_cast<float>(noise * std::sqrt(power / kspace.size()));
+	       for (auto& v: kspace)
+		    v += sigma * random.normal();
+	  }
+
+	  // Undersampled data and separate calibration data
+	  const auto first1 = c.ny / 2 - c.ref1 / 2, first2 = c.nz / 2 - c.ref2 / 2;
+	  dataset.data.assign(kspace.size(), 0.f);
+	  dataset.ref.assign(c.nx * c.ref1 * c.ref2 * c.coils, 0.f);
+	  for (long k = 0; k < c.coils; ++k) {
+	       for (long z = 0; z < c.nz; ++z) {
+		    for (long y = 0; y < c.ny; ++y) {
+			 const auto line = kspace.begin() + c.nx * (y + c.ny * (z + c.nz * k));
+			 if (y % c.acc1 == 0 && z % c.acc2 == 0)
+			      std::copy(line, line + c.nx, dataset.data.begin() + (line - kspace.begin()));
+			 if (y >= first1 && y < first1 + c.ref1 && z >= first2 && z < first2 + c.ref2)
+			      std::copy(line, line + c.nx, dataset.ref.begin() + c.nx * ((y - first1) + c.ref1 * ((z - first2) + c.ref2 * k)));
+		    }
+	       }
+	  }
+	  dataset.dims = {c.nx, c.ny, c.nz, c.coils, 1, 1, 1};
+	  dataset.ref_dims = {c.nx, c.ref1, c.ref2, c.coils, 1, 1, 1};
+	  internal::set_parameters(dataset, static_cast<uint16_t>(c.acc1), static_cast<uint16_t>(c.acc2), coil_compression);
+	  return true;
+     }
+
+     bool load_captured_dataset(const std::string& data_path, const std::string& ref_path, uint16_t acc1, uint16_t acc2, BartBenchmarkDataset& dataset,
+				const BartCoilCompression& coil_compression)
+     {
+	  dataset.name = data_path;
+	  dataset.truth.clear();
+	  if (!internal::read_bart_file(data_path, dataset.dims, dataset.data) || !internal::read_bart_file(ref_path, dataset.ref_dims, dataset.ref))
+	       return false;
+	  if (dataset.ref_dims[0] != dataset.dims[0] || dataset.ref_dims[3] != dataset.dims[3]) {
+	       GERROR("The readout or the coils of %s and %s differ\n", data_path.c_str(), ref_path.c_str());
+	       return false;
+	  }
+	  internal::set_parameters(dataset, acc1, acc2, coil_compression);
+	  return true;
+     }
+
+     double BartBenchmarkRun::median_latency() const
+     {
+	  if (latencies.empty())
+	       return 0;
+	  auto sorted = latencies;
+	  std::sort(sorted.begin(), sorted.end());
+	  return sorted[sorted.size() / 2];
+     }
+
+     BartBenchmarkRun run_benchmark_script(const BartBenchmarkDataset& dataset, const Default_parameters& parameters,
+					   const std::vector<std::string>& script_commands, size_t repeats)
+     {
+	  BartBenchmarkRun result;
+	  const auto& DIMS = dataset.dims;
+
+	  // Staged as by the BartGadget
+	  BartJob job;
+	  job.inputs.push_back({"meas_gadgetron_ref", dataset.ref_dims, const_cast<std::complex<float>*>(dataset.ref.data()), nullptr});
+	  job.inputs.push_back({"meas_gadgetron", DIMS, const_cast<std::complex<float>*>(dataset.data.data()), nullptr});
+	  job.commands = staging_commands(DIMS, DIMS[0], true, false);
+	  for (auto line: script_commands) {
+	       replace_default_parameters(line, parameters);
+	       job.commands.push_back(line);
+	  }
+
+	  for (size_t r = 0; r < std::max<size_t>(repeats, 1); ++r) {
+	       auto bart = BartInstancePool::get().acquire();
+	       BartJobOutput output;
+	       const auto start = std::chrono::steady_clock::now();
+	       const auto ok = run_bart_job(bart, job, output);
+	       result.latencies.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+
+	       result.ok = ok && output.dims[0] == DIMS[0] && output.dims[1] == DIMS[1] && output.dims[2] == DIMS[2];
+	       if (ok && !result.ok)
+		    GERROR("%s: the output is not %ldx%ldx%ld\n", dataset.name.c_str(), DIMS[0], DIMS[1], DIMS[2]);
+
+	       if (result.ok && r == 0)
+		    result.image.assign(output.data, output.data + DIMS[0] * DIMS[1] * DIMS[2]);
+	       bart->deallocate_all_mem_cfl();
+	       if (!result.ok)
+		    break;
+	  }
+	  return result;
+     }
+
+     double magnitude_nrmse(const std::vector<std::complex<float>>& image, const std::vector<float>& reference)
+     {
+	  double rt = 0, rr = 0;
+	  for (size_t i = 0; i < reference.size(); ++i) {
+	       rt += std::abs(image[i]) * reference[i];
+	       rr += std::norm(image[i]);
+	  }
+	  const auto scale = rr > 0 ? rt / rr : 0.;
+	  double err = 0, ref = 0;
+	  for (size_t i = 0; i < reference.size(); ++i) {
+	       const auto d = scale * std::abs(image[i]) - reference[i];
+	       err += d * d;
+	       ref += reference[i] * reference[i];
+	  }
+	  return std::sqrt(err / ref);
+     }
+
+     std::string json_string(const std::string& str)
+     {
+	  std::ostringstream out;
+	  out << '"';
+	  for (auto ch: str) {
+	       if (ch == '"' || ch == '\\')
+		    out << '\\' << ch;
+	       else if (static_cast<unsigned char>(ch) < 0x20)
+		    out << "\\u" << std::hex << std::setw(4) << std::setfill('0') << static_cast<int>(ch) << std::dec;
+	       else
+		    out << ch;
+	  }
+	  out << '"';
+	  return out.str();
+     }
+} // namespace Gadgetron
@@ -0,0 +1,87 @@
+/****************************************************************************************************************************
+ * Description: Datasets of the BART script benchmark and tuner
+ *
+ * Numerical phantoms (modified Shepp-Logan, with synthetic coil sensitivities)
+ * undersampled the way the BartGadget receives them (every acc_factor_PE1/2
+ * line, with reference_lines_PE1/2 of separate calibration data), or captured
+ * datasets saved as BART files, and the reconstruction of a dataset by a
+ * script, staged and run exactly as the gadget does.
+ * Phantoms are generated from a seed only: two runs with the same seed
+ * reconstruct the same k-space, on any platform.
+ ****************************************************************************************************************************/
+
+#ifndef BART_BENCHMARK_DATA_H
+#define BART_BENCHMARK_DATA_H
+
+#include "bart_script.h"
+#include <complex>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace Gadgetron {
+
+     struct BartPhantomCase
+     {
+	  std::string name;		//!< As parsed, eg. 128x128x1/8/2x1/24x1
+	  long nx, ny, nz;
+	  long coils;
+	  long acc1, acc2;
+	  long ref1, ref2;
+     };
+
+     //! Case "<nx>x<ny>x<nz>/<coils>/<acc_factor_PE1>x<acc_factor_PE2>/<reference_lines_PE1>x<reference_lines_PE2>"
+     bool parse_phantom_case(const std::string& spec, BartPhantomCase& c);
+
+     struct BartBenchmarkDataset
+     {
+	  std::string name;
+	  std::vector<long> dims;			//!< [E0,E1,E2,CHA,N,S,LOC]
+	  std::vector<std::complex<float>> data;
+	  std::vector<long> ref_dims;			//!< [E0,E1,E2,CHA,N,S,LOC]
+	  std::vector<std::complex<float>> ref;
+	  std::vector<float> truth;			//!< Magnitude image [E0,E1,E2] (empty for captured datasets)
+	  Default_parameters parameters;
+     };
+
+     //! Coil compression properties of the BartGadget ($virtual_channels of the datasets)
+     struct BartCoilCompression
+     {
+	  double energy_fraction = 0.95;		//!< VirtualCoilEnergyFraction
+	  int min_channels = 1;				//!< MinVirtualChannels
+	  int max_channels = 0;				//!< MaxVirtualChannels
+     };
+
+     //! \param noise Standard deviation of the noise, relative to the RMS of the k-space
+     bool make_phantom_dataset(const BartPhantomCase& c, uint64_t seed, double noise, BartBenchmarkDataset& dataset,
+			       const BartCoilCompression& coil_compression = BartCoilCompression());
+
+     //! Undersampled data and calibration data saved as BART files (<name>.hdr and <name>.cfl)
+     bool load_captured_dataset(const std::string& data_path, const std::string& ref_path, uint16_t acc1, uint16_t acc2, BartBenchmarkDataset& dataset,
+				const BartCoilCompression& coil_compression = BartCoilCompression());
+
+     struct BartBenchmarkRun
+     {
+	  bool ok = false;
+	  std::vector<double> latencies;		//!< ms, one per repetition
+	  std::vector<std::complex<float>> image;	//!< First image (first set of maps) of the output, [E0,E1,E2]
+
+	  double median_latency() const;
+     };
+
+     //! Reconstruct the dataset repeats times with a script (parameters not substituted yet)
+     /*!
+      * \param parameters Substituted in the script (usually those of the dataset)
+      */
+     BartBenchmarkRun run_benchmark_script(const BartBenchmarkDataset& dataset, const Default_parameters& parameters,
+					   const std::vector<std::string>& script_commands, size_t repeats);
+
+     //! NRMSE of the magnitude, after the least squares scaling of the image (the scale of a script output is arbitrary)
+     double magnitude_nrmse(const std::vector<std::complex<float>>& image, const std::vector<float>& reference);
+
+     //! Quoted and escaped
+     std::string json_string(const std::string& str);
+} // namespace Gadgetron
+
+#endif //BART_BENCHMARK_DATA_H
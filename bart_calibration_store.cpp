@@ -0,0 +1,355 @@
+/****************************************************************************************************************************
+ * Description: Persistent store of BART calibration results
+ ****************************************************************************************************************************/
+
+#include "bart_calibration_store.h"
+#include "bart_disk_cache.h"
+#include "log.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <numeric>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif /* !_WIN32 */
+
+namespace internal {
+     constexpr uint32_t CALIBRATION_MAGIC = 0x4c414342;	// "BCAL"
+     constexpr uint32_t CALIBRATION_VERSION = 1;
+     constexpr size_t CALIBRATION_ALIGNMENT = 64;
+     constexpr size_t MAX_CFL_NAME = 64;
+     constexpr size_t CFL_DIMS = 16;
+     constexpr uint64_t MAX_SHAPE_SIZE = 1024;
+     constexpr uint64_t MAX_FINGERPRINT_SAMPLES = 1UL << 24;
+     constexpr uint64_t MAX_CALIBRATION_CFLS = 1024;
+
+     // Central samples kept per calibration input along E0, E1 and E2 (all the coils are kept)
+     constexpr long FINGERPRINT_EXTENT[3] = {16, 16, 4};
+
+     struct FileHeader
+     {
+	  uint32_t magic;
+	  uint32_t version;
+	  uint64_t key;
+	  uint64_t shape_size;		// followed by the shape of the fingerprint (int64_t)
+	  uint64_t num_samples;		// then its samples (complex<float>)
+	  uint64_t num_cfls;		// then the CflRecords
+     };
+
+     struct CflRecord
+     {
+	  char name[MAX_CFL_NAME];
+	  int64_t dims[CFL_DIMS];
+	  uint64_t offset;		// from the start of the file
+     };
+
+     size_t align(size_t offset)
+     {
+	  return (offset + CALIBRATION_ALIGNMENT - 1) / CALIBRATION_ALIGNMENT * CALIBRATION_ALIGNMENT;
+     }
+
+     size_t get_number_of_elements(const std::vector<long>& dims)
+     {
+	  return std::accumulate(dims.begin(), dims.end(), size_t(1), std::multiplies<size_t>());
+     }
+
+     // Advance end past count items if they fit within size, without overflowing
+     bool skip_items(uint64_t count, size_t item_size, size_t size, size_t& end)
+     {
+	  if (end > size || count > (size - end) / item_size)
+	       return false;
+	  end += count * item_size;
+	  return true;
+     }
+
+     // Bytes of a stored CFL, false if its dimensions are invalid
+     bool get_number_of_bytes(const int64_t (&dims)[CFL_DIMS], size_t& bytes)
+     {
+	  bytes = sizeof(std::complex<float>);
+	  for (auto d: dims) {
+	       if (d < 1 || static_cast<uint64_t>(d) > SIZE_MAX / bytes)
+		    return false;
+	       bytes *= static_cast<size_t>(d);
+	  }
+	  return true;
+     }
+}
+
+namespace Gadgetron {
+
+     void BartCalibrationFingerprint::add(const std::vector<long>& dims, const std::complex<float>* data)
+     {
+	  std::vector<long> full(internal::CFL_DIMS, 1);
+	  std::copy_n(dims.begin(), std::min(dims.size(), full.size()), full.begin());
+
+	  long extent[3], start[3];
+	  for (auto i = 0; i < 3; ++i) {
+	       extent[i] = std::min(full[i], internal::FINGERPRINT_EXTENT[i]);
+	       start[i] = full[i] / 2 - extent[i] / 2;
+	       shape.push_back(extent[i]);
+	  }
+	  shape.push_back(full[3]);
+
+	  // First image of all the coils
+	  for (long c = 0; c < full[3]; ++c)
+	       for (long z = 0; z < extent[2]; ++z)
+		    for (long y = 0; y < extent[1]; ++y)
+			 for (long x = 0; x < extent[0]; ++x)
+			      samples.push_back(data[(start[0] + x) + full[0] * ((start[1] + y) + full[1] * ((start[2] + z) + full[2] * c))]);
+     }
+
+     float BartCalibrationFingerprint::similarity(const BartCalibrationFingerprint& other) const
+     {
+	  if (shape != other.shape || samples.size() != other.samples.size() || samples.empty())
+	       return 0.f;
+
+	  std::complex<double> dot(0);
+	  double norm_a(0), norm_b(0);
+	  for (size_t i = 0; i < samples.size(); ++i) {
+	       dot += std::conj(std::complex<double>(samples[i])) * std::complex<double>(other.samples[i]);
+	       norm_a += std::norm(samples[i]);
+	       norm_b += std::norm(other.samples[i]);
+	  }
+	  if (norm_a <= 0 || norm_b <= 0)
+	       return 0.f;
+	  return static_cast<float>(std::abs(dot) / std::sqrt(norm_a * norm_b));
+     }
+
+     // =========================================================================
+
+     BartCalibrationStore& BartCalibrationStore::get()
+     {
+	  static BartCalibrationStore store;
+	  return store;
+     }
+
+     bool BartCalibrationStore::configure(const std::string& directory, size_t max_bytes, float threshold)
+     {
+	  std::lock_guard<std::mutex> lock(mtx_);
+	  if (is_configured_) {
+	       if (directory != directory_)
+		    GWARN("BART calibration store already configured in %s, ignoring %s\n", directory_.c_str(), directory.c_str());
+	       return !directory_.empty();
+	  }
+	  is_configured_ = true;
+
+#ifdef _WIN32
+	  GERROR("The BART calibration store is not supported on Windows\n");
+	  return false;
+#else
+	  if (!prepare_cache_directory(directory)) {
+	       return false;
+	  }
+
+	  directory_ = directory;
+	  max_bytes_ = max_bytes;
+	  threshold_ = threshold;
+	  return true;
+#endif /* _WIN32 */
+     }
+
+     bool BartCalibrationStore::is_enabled() const
+     {
+	  std::lock_guard<std::mutex> lock(mtx_);
+	  return !directory_.empty();
+     }
+
+     std::string BartCalibrationStore::path_of(uint64_t key) const
+     {
+	  return cache_file_path(directory_, key, ".cal");
+     }
+
+#ifndef _WIN32
+
+     BartCalibrationStore::Entry::~Entry()
+     {
+	  munmap(data_, size_);
+     }
+
+     std::shared_ptr<const BartCalibrationStore::Entry> BartCalibrationStore::lookup(uint64_t key, const BartCalibrationFingerprint& fingerprint)
+     {
+	  std::string path;
+	  float threshold;
+	  {
+	       std::lock_guard<std::mutex> lock(mtx_);
+	       if (directory_.empty())
+		    return nullptr;
+	       path = path_of(key);
+	       threshold = threshold_;
+	  }
+
+	  int fd = ::open(path.c_str(), O_RDONLY);
+	  if (fd < 0)
+	       return nullptr;
+
+	  struct stat st;
+	  if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(internal::FileHeader)) {
+	       ::close(fd);
+	       return nullptr;
+	  }
+
+	  // Private mapping: BART may write into its inputs without affecting the store
+	  const auto size = static_cast<size_t>(st.st_size);
+	  auto data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	  ::close(fd);
+	  if (data == MAP_FAILED) {
+	       GERROR("Unable to map BART calibration %s: %s\n", path.c_str(), std::strerror(errno));
+	       return nullptr;
+	  }
+	  auto entry = std::make_shared<Entry>(data, size);
+
+	  // Parse (and check) the entry
+	  auto base = static_cast<char*>(data);
+	  internal::FileHeader header;
+	  std::memcpy(&header, base, sizeof(header));
+	  auto offset = sizeof(header);
+	  auto end = offset;
+	  if (header.magic != internal::CALIBRATION_MAGIC || header.version != internal::CALIBRATION_VERSION || header.key != key
+	      || header.shape_size > internal::MAX_SHAPE_SIZE || header.num_samples > internal::MAX_FINGERPRINT_SAMPLES
+	      || header.num_cfls > internal::MAX_CALIBRATION_CFLS
+	      || !internal::skip_items(header.shape_size, sizeof(int64_t), size, end)
+	      || !internal::skip_items(header.num_samples, sizeof(std::complex<float>), size, end)
+	      || !internal::skip_items(header.num_cfls, sizeof(internal::CflRecord), size, end))
+	  {
+	       GWARN("Ignoring invalid BART calibration %s\n", path.c_str());
+	       return nullptr;
+	  }
+
+	  BartCalibrationFingerprint stored;
+	  for (uint64_t i = 0; i < header.shape_size; ++i, offset += sizeof(int64_t)) {
+	       int64_t v;
+	       std::memcpy(&v, base + offset, sizeof(v));
+	       stored.shape.push_back(static_cast<long>(v));
+	  }
+	  stored.samples.resize(header.num_samples);
+	  std::memcpy(stored.samples.data(), base + offset, header.num_samples * sizeof(std::complex<float>));
+	  offset += header.num_samples * sizeof(std::complex<float>);
+
+	  const auto similarity = stored.similarity(fingerprint);
+	  if (similarity < threshold) {
+	       GDEBUG("BART calibration %s not reused: calibration data changed (similarity %f < %f)\n", path.c_str(), similarity, threshold);
+	       return nullptr;
+	  }
+
+	  for (uint64_t i = 0; i < header.num_cfls; ++i, offset += sizeof(internal::CflRecord)) {
+	       internal::CflRecord record;
+	       std::memcpy(&record, base + offset, sizeof(record));
+	       Cfl cfl{std::string(record.name, strnlen(record.name, sizeof(record.name))),
+		       std::vector<long>(record.dims, record.dims + internal::CFL_DIMS), nullptr};
+	       size_t bytes(0);
+	       if (!internal::get_number_of_bytes(record.dims, bytes) || record.offset > size || bytes > size - record.offset) {
+		    GWARN("Ignoring truncated BART calibration %s\n", path.c_str());
+		    return nullptr;
+	       }
+	       cfl.data = reinterpret_cast<std::complex<float>*>(base + record.offset);
+	       entry->cfls.push_back(std::move(cfl));
+	  }
+
+	  // Most recently used
+	  touch_cache_file(path);
+
+	  GDEBUG("Reusing BART calibration %s (similarity %f)\n", path.c_str(), similarity);
+	  return entry;
+     }
+
+     bool BartCalibrationStore::insert(uint64_t key, const BartCalibrationFingerprint& fingerprint, const std::vector<Cfl>& cfls)
+     {
+	  std::string path;
+	  {
+	       std::lock_guard<std::mutex> lock(mtx_);
+	       if (directory_.empty())
+		    return false;
+	       path = path_of(key);
+	  }
+
+	  internal::FileHeader header{internal::CALIBRATION_MAGIC, internal::CALIBRATION_VERSION, key,
+		    fingerprint.shape.size(), fingerprint.samples.size(), cfls.size()};
+
+	  // Layout of the file
+	  std::vector<internal::CflRecord> records(cfls.size());
+	  auto offset = internal::align(sizeof(header) + header.shape_size * sizeof(int64_t)
+					+ header.num_samples * sizeof(std::complex<float>)
+					+ header.num_cfls * sizeof(internal::CflRecord));
+	  for (size_t i = 0; i < cfls.size(); ++i) {
+	       if (cfls[i].name.size() >= internal::MAX_CFL_NAME || cfls[i].dims.size() > internal::CFL_DIMS) {
+		    GWARN("Unable to store BART calibration output %s\n", cfls[i].name.c_str());
+		    return false;
+	       }
+	       auto& record = records[i];
+	       std::memset(&record, 0, sizeof(record));
+	       std::strncpy(record.name, cfls[i].name.c_str(), sizeof(record.name) - 1);
+	       std::fill_n(record.dims, internal::CFL_DIMS, 1);
+	       std::copy(cfls[i].dims.begin(), cfls[i].dims.end(), record.dims);
+	       record.offset = offset;
+	       offset = internal::align(offset + internal::get_number_of_elements(cfls[i].dims) * sizeof(std::complex<float>));
+	  }
+
+	  // Written aside and renamed, so that concurrent readers never see a partial entry
+	  std::string tmp_path;
+	  if (!create_temporary_cache_file(path, tmp_path))
+	       return false;
+	  {
+	       std::ofstream file(tmp_path, std::ofstream::binary);
+	       file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	       for (auto v: fingerprint.shape) {
+		    int64_t tmp(v);
+		    file.write(reinterpret_cast<const char*>(&tmp), sizeof(tmp));
+	       }
+	       file.write(reinterpret_cast<const char*>(fingerprint.samples.data()), fingerprint.samples.size() * sizeof(std::complex<float>));
+	       file.write(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(internal::CflRecord));
+	       for (size_t i = 0; i < cfls.size(); ++i) {
+		    file.seekp(records[i].offset);
+		    file.write(reinterpret_cast<const char*>(cfls[i].data), internal::get_number_of_elements(cfls[i].dims) * sizeof(std::complex<float>));
+	       }
+	       if (!file) {
+		    GERROR("Unable to write BART calibration %s\n", tmp_path.c_str());
+		    file.close();
+		    std::remove(tmp_path.c_str());
+		    return false;
+	       }
+	  }
+	  if (std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+	       GERROR("Unable to store BART calibration %s: %s\n", path.c_str(), std::strerror(errno));
+	       std::remove(tmp_path.c_str());
+	       return false;
+	  }
+	  GDEBUG("Stored BART calibration %s (%lu bytes)\n", path.c_str(), offset);
+
+	  evict();
+	  return true;
+     }
+
+     void BartCalibrationStore::evict()
+     {
+	  std::lock_guard<std::mutex> lock(mtx_);
+	  if (max_bytes_ == 0)
+	       return;
+
+	  // The modification time of an entry is its last use (shared with the other processes using the directory)
+	  evict_least_recently_used(directory_, ".cal", max_bytes_);
+     }
+
+#else
+
+     BartCalibrationStore::Entry::~Entry() {}
+
+     std::shared_ptr<const BartCalibrationStore::Entry> BartCalibrationStore::lookup(uint64_t, const BartCalibrationFingerprint&)
+     {
+	  return nullptr;
+     }
+
+     bool BartCalibrationStore::insert(uint64_t, const BartCalibrationFingerprint&, const std::vector<Cfl>&)
+     {
+	  return false;
+     }
+
+     void BartCalibrationStore::evict() {}
+
+#endif /* !_WIN32 */
+}
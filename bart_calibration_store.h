@@ -0,0 +1,102 @@
+/****************************************************************************************************************************
+ * Description: Persistent store of BART calibration results
+ *
+ * The series of an exam often share their geometry and coil setup, but every
+ * job recomputes its coil compression and sensitivity maps from scratch.
+ * The outputs of the calibration commands of a job (those only depending on its
+ * calibration k-space) are kept on the local disk, keyed by the coil
+ * configuration, the geometry and the commands themselves, and memory-mapped
+ * back into the BART instance of any later job with the same key.
+ * An entry is only reused if the calibration k-space of the new job is similar
+ * enough to the one it was computed from (see BartCalibrationFingerprint).
+ ****************************************************************************************************************************/
+
+#ifndef BART_CALIBRATION_STORE_H
+#define BART_CALIBRATION_STORE_H
+
+#include <complex>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace Gadgetron {
+
+     //! Summary of the calibration k-space of a job (the central samples of each coil)
+     class BartCalibrationFingerprint
+     {
+     public:
+	  void add(const std::vector<long>& dims, const std::complex<float>* data);
+
+	  //! Normalized correlation with another fingerprint (0 if the shapes differ)
+	  float similarity(const BartCalibrationFingerprint& other) const;
+
+	  std::vector<long> shape;
+	  std::vector<std::complex<float>> samples;
+     };
+
+     class BartCalibrationStore
+     {
+     public:
+	  struct Cfl
+	  {
+	       std::string name;
+	       std::vector<long> dims;		//!< 16D
+	       std::complex<float>* data;
+	  };
+
+	  //! Memory-mapped entry (copy-on-write), the CFLs are valid as long as it exists
+	  class Entry
+	  {
+	  public:
+	       Entry(void* data, size_t size) : data_(data), size_(size) {}
+	       Entry(const Entry&) = delete;
+	       Entry& operator=(const Entry&) = delete;
+	       ~Entry();
+
+	       std::vector<Cfl> cfls;
+
+	  private:
+	       void* data_;
+	       size_t size_;
+	  };
+
+	  //! Process-wide store
+	  static BartCalibrationStore& get();
+
+	  /*!
+	   * \param directory    Directory of the entries (must be on a local file system)
+	   * \param max_bytes    Size of the store, least recently used entries are removed beyond it
+	   * \param threshold    Minimal similarity of the calibration k-space for an entry to be reused
+	   *
+	   * The store can only be configured once per process.
+	   */
+	  bool configure(const std::string& directory, size_t max_bytes, float threshold);
+
+	  bool is_enabled() const;
+
+	  //! Entry for this key, if valid for the given calibration k-space
+	  std::shared_ptr<const Entry> lookup(uint64_t key, const BartCalibrationFingerprint& fingerprint);
+
+	  bool insert(uint64_t key, const BartCalibrationFingerprint& fingerprint, const std::vector<Cfl>& cfls);
+
+	  BartCalibrationStore(const BartCalibrationStore&) = delete;
+	  BartCalibrationStore& operator=(const BartCalibrationStore&) = delete;
+
+     private:
+	  BartCalibrationStore() = default;
+
+	  std::string path_of(uint64_t key) const;
+	  void evict();
+
+	  mutable std::mutex mtx_;
+	  bool is_configured_ = false;
+	  std::string directory_;
+	  size_t max_bytes_ = 0;
+	  float threshold_ = 1.f;
+     };
+} // namespace Gadgetron
+
+#endif //BART_CALIBRATION_STORE_H
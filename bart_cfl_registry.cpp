@@ -0,0 +1,93 @@
+/****************************************************************************************************************************
+ * Description: Hash-indexed registry of the in-memory CFLs of a BART instance
+ ****************************************************************************************************************************/
+
+#include "bart_cfl_registry.h"
+#include <atomic>
+#include <functional>
+#include <numeric>
+#include <sstream>
+
+namespace internal {
+     // Added by each registry once done with, not to share a cache line between the threads on every lookup
+     std::atomic<uint64_t> total_lookups(0);
+     std::atomic<uint64_t> total_instance_loads(0);
+     std::atomic<uint64_t> total_names(0);
+     std::atomic<uint64_t> total_collisions(0);
+}
+
+namespace Gadgetron {
+
+     size_t BartCflRegistry::Cfl::bytes() const
+     {
+	  return std::accumulate(dims.begin(), dims.end(), size_t(1), std::multiplies<size_t>()) * sizeof(std::complex<float>);
+     }
+
+     BartCflRegistry::~BartCflRegistry()
+     {
+	  internal::total_lookups += counters_.lookups;
+	  internal::total_instance_loads += counters_.instance_loads;
+	  internal::total_names += counters_.names;
+	  internal::total_collisions += counters_.collisions;
+     }
+
+     void BartCflRegistry::rebind(BartInstance& bart)
+     {
+	  bart_ = &bart;
+	  invalidate_all();
+     }
+
+     BartCflRegistry::Handle BartCflRegistry::intern(const std::string& name)
+     {
+	  const auto found = handles_.find(name);
+	  if (found != handles_.end())
+	       return found->second;
+
+	  const auto handle = static_cast<Handle>(entries_.size());
+	  handles_.emplace(name, handle);
+	  entries_.push_back(Entry{name, false, Cfl()});
+	  ++counters_.names;
+	  if (handles_.bucket_size(handles_.bucket(name)) > 1)
+	       ++counters_.collisions;
+	  return handle;
+     }
+
+     const BartCflRegistry::Cfl* BartCflRegistry::find(Handle handle)
+     {
+	  ++counters_.lookups;
+	  auto& entry = entries_[handle];
+	  if (!entry.is_loaded) {
+	       ++counters_.instance_loads;
+	       entry.cfl.dims.assign(16, 1);
+	       entry.cfl.data = nullptr;
+	       if (bart_ != nullptr && !entry.name.empty() && entry.name[0] != '-')
+		    entry.cfl.data = static_cast<std::complex<float>*>(bart_->load_mem_cfl(entry.name.c_str(), entry.cfl.dims.size(), entry.cfl.dims.data()));
+	       entry.is_loaded = true;
+	  }
+	  return entry.cfl.data != nullptr ? &entry.cfl : nullptr;
+     }
+
+     void BartCflRegistry::invalidate_all()
+     {
+	  for (auto& entry: entries_)
+	       entry.is_loaded = false;
+     }
+
+     BartCflRegistry::Counters BartCflRegistry::totals()
+     {
+	  Counters totals;
+	  totals.lookups = internal::total_lookups;
+	  totals.instance_loads = internal::total_instance_loads;
+	  totals.names = internal::total_names;
+	  totals.collisions = internal::total_collisions;
+	  return totals;
+     }
+
+     std::string BartCflRegistry::describe(const Counters& counters)
+     {
+	  std::ostringstream description;
+	  description << counters.lookups << " lookups, " << counters.instance_loads << " loaded from BART, "
+		      << counters.names << " names (" << counters.collisions << " collisions)";
+	  return description.str();
+     }
+} // namespace Gadgetron
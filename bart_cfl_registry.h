@@ -0,0 +1,95 @@
+/****************************************************************************************************************************
+ * Description: Hash-indexed registry of the in-memory CFLs of a BART instance
+ *
+ * BART searches its list of in-memory CFLs by name on every load_mem_cfl(),
+ * and the executor looks the operands of each command up several times (tuner
+ * signature, progress, accounting, memory of the job, in-place execution).
+ * The registry interns the names into handles, stable for its lifetime, which
+ * a job resolves once for all its commands, and caches the dimensions and
+ * data of each CFL: loaded from the instance on first use, forgotten whenever
+ * a command may have registered the CFL again.
+ *
+ * A registry is used by a single thread at a time.
+ ****************************************************************************************************************************/
+
+#ifndef BART_CFL_REGISTRY_H
+#define BART_CFL_REGISTRY_H
+
+#include "bart_instance.h"
+#include <complex>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace Gadgetron {
+
+     class BartCflRegistry
+     {
+     public:
+	  typedef uint32_t Handle;
+
+	  struct Cfl
+	  {
+	       std::vector<long> dims;
+	       std::complex<float>* data = nullptr;
+
+	       size_t bytes() const;
+	  };
+
+	  struct Counters
+	  {
+	       uint64_t lookups = 0;
+	       uint64_t instance_loads = 0;	//!< Lookups not served by the registry
+	       uint64_t names = 0;
+	       uint64_t collisions = 0;		//!< Names interned into an already used bucket of the hash map
+	  };
+
+	  BartCflRegistry() = default;
+	  explicit BartCflRegistry(BartInstance& bart) : bart_(&bart) {}
+	  ~BartCflRegistry();
+
+	  //! Look the CFLs up in another instance (eg. once a preempted job resumes), the handles are kept
+	  void rebind(BartInstance& bart);
+
+	  BartInstance& instance() const { return *bart_; }
+
+	  Handle intern(const std::string& name);
+	  const std::string& name(Handle handle) const { return entries_[handle].name; }
+
+	  //! nullptr if the instance has no in-memory CFL of this name
+	  const Cfl* find(Handle handle);
+	  const Cfl* find(const std::string& name) { return find(intern(name)); }
+
+	  //! The CFL may have been registered again
+	  void invalidate(Handle handle) { entries_[handle].is_loaded = false; }
+	  void invalidate(const std::string& name) { invalidate(intern(name)); }
+	  void invalidate_all();
+
+	  Counters counters() const { return counters_; }
+
+	  //! Of all the registries of the process so far
+	  static Counters totals();
+
+	  //! eg. "120 lookups, 14 loaded from BART, 9 names (0 collisions)"
+	  static std::string describe(const Counters& counters);
+
+	  BartCflRegistry(const BartCflRegistry&) = delete;
+	  BartCflRegistry& operator=(const BartCflRegistry&) = delete;
+
+     private:
+	  struct Entry
+	  {
+	       std::string name;
+	       bool is_loaded = false;
+	       Cfl cfl;
+	  };
+
+	  BartInstance* bart_ = nullptr;
+	  std::unordered_map<std::string, Handle> handles_;
+	  std::vector<Entry> entries_;
+	  Counters counters_;
+     };
+} // namespace Gadgetron
+
+#endif //BART_CFL_REGISTRY_H
@@ -0,0 +1,121 @@
+/****************************************************************************************************************************
+ * Description: Selection of the number of virtual coils of the coil compression
+ ****************************************************************************************************************************/
+
+#include "bart_coil_compression.h"
+#include "bart_cpu_dispatch.h"
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <numeric>
+
+namespace internal {
+     constexpr int MAX_JACOBI_SWEEPS = 50;
+
+     // Eigenvalues of a real symmetric matrix (cyclic Jacobi, the matrix is destroyed)
+     std::vector<double> symmetric_eigenvalues(std::vector<double>& a, size_t n)
+     {
+	  auto at = [&a, n](size_t i, size_t j) -> double& { return a[i * n + j]; };
+
+	  for (int sweep = 0; sweep < MAX_JACOBI_SWEEPS; ++sweep) {
+	       double off(0), diag(0);
+	       for (size_t i = 0; i < n; ++i) {
+		    diag += at(i, i) * at(i, i);
+		    for (size_t j = i + 1; j < n; ++j)
+			 off += at(i, j) * at(i, j);
+	       }
+	       if (off <= 1e-24 * diag)
+		    break;
+
+	       for (size_t p = 0; p < n; ++p) {
+		    for (size_t q = p + 1; q < n; ++q) {
+			 if (at(p, q) == 0)
+			      continue;
+			 const auto theta = (at(q, q) - at(p, p)) / (2 * at(p, q));
+			 const auto t = (theta >= 0 ? 1. : -1.) / (std::abs(theta) + std::sqrt(theta * theta + 1));
+			 const auto c = 1 / std::sqrt(t * t + 1);
+			 const auto s = t * c;
+			 for (size_t k = 0; k < n; ++k) {
+			      const auto kp = at(k, p), kq = at(k, q);
+			      at(k, p) = c * kp - s * kq;
+			      at(k, q) = s * kp + c * kq;
+			 }
+			 for (size_t k = 0; k < n; ++k) {
+			      const auto pk = at(p, k), qk = at(q, k);
+			      at(p, k) = c * pk - s * qk;
+			      at(q, k) = s * pk + c * qk;
+			 }
+		    }
+	       }
+	  }
+
+	  std::vector<double> eigenvalues(n);
+	  for (size_t i = 0; i < n; ++i)
+	       eigenvalues[i] = at(i, i);
+	  return eigenvalues;
+     }
+}
+
+namespace Gadgetron {
+
+     std::vector<double> coil_compression_energies(const std::vector<long>& dims, const std::complex<float>* data)
+     {
+	  if (dims.size() < 4)
+	       return {};
+
+	  const auto num_coils = static_cast<size_t>(dims[3]);
+	  const auto image_size = static_cast<size_t>(dims[0] * dims[1] * dims[2]);
+	  const auto num_images = static_cast<size_t>(std::accumulate(dims.begin() + 4, dims.end(), 1L, std::multiplies<long>()));
+
+	  // Coil covariance C = A^H A, A being [samples x coils]
+	  std::vector<std::complex<double>> cov(num_coils * num_coils);
+	  const auto& kernels = bart_kernels();
+	  for (size_t n = 0; n < num_images; ++n)
+	       kernels.coil_covariance(data + n * image_size * num_coils, image_size, num_coils, cov.data());
+
+	  // The eigenvalues of the Hermitian C are those of the real symmetric [Re -Im; Im Re], twice each
+	  const auto n = 2 * num_coils;
+	  std::vector<double> real(n * n);
+	  for (size_t i = 0; i < num_coils; ++i) {
+	       for (size_t j = i; j < num_coils; ++j) {
+		    const auto c = cov[i * num_coils + j];
+		    real[i * n + j] = real[j * n + i] = real[(i + num_coils) * n + j + num_coils] = real[(j + num_coils) * n + i + num_coils] = c.real();
+		    real[(i + num_coils) * n + j] = c.imag();
+		    real[(j + num_coils) * n + i] = -c.imag();
+		    real[i * n + j + num_coils] = -c.imag();
+		    real[j * n + i + num_coils] = c.imag();
+	       }
+	  }
+
+	  auto eigenvalues = internal::symmetric_eigenvalues(real, n);
+	  std::sort(eigenvalues.begin(), eigenvalues.end(), std::greater<double>());
+
+	  std::vector<double> energies(num_coils);
+	  for (size_t i = 0; i < num_coils; ++i)
+	       energies[i] = std::max(eigenvalues[2 * i], 0.);
+	  return energies;
+     }
+
+     size_t select_virtual_coils(const std::vector<double>& energies, double energy_fraction)
+     {
+	  const auto total = std::accumulate(energies.begin(), energies.end(), 0.);
+	  if (energies.empty() || total <= 0)
+	       return energies.size();
+
+	  double retained(0);
+	  for (size_t i = 0; i < energies.size(); ++i) {
+	       retained += energies[i];
+	       if (retained >= energy_fraction * total)
+		    return i + 1;
+	  }
+	  return energies.size();
+     }
+
+     size_t select_virtual_coils(const std::vector<double>& energies, double energy_fraction, int min_coils, int max_coils)
+     {
+	  const auto num_coils = static_cast<int>(energies.size());
+	  const auto count = static_cast<int>(select_virtual_coils(energies, energy_fraction));
+	  const auto max_count = max_coils > 0 ? std::min(max_coils, num_coils) : num_coils;
+	  return static_cast<size_t>(std::max(std::min(count, max_count), std::min(std::max(min_coils, 1), num_coils)));
+     }
+}
@@ -0,0 +1,27 @@
+/****************************************************************************************************************************
+ * Description: Selection of the number of virtual coils of the coil compression
+ ****************************************************************************************************************************/
+
+#ifndef BART_COIL_COMPRESSION_H
+#define BART_COIL_COMPRESSION_H
+
+#include <complex>
+#include <cstddef>
+#include <vector>
+
+namespace Gadgetron {
+
+     //! Squared singular values (ie. energies) of the coil compression of some k-space, in decreasing order
+     /*!
+      * \param dims  At least [E0,E1,E2,CHA], any further dimension being considered as more samples
+      */
+     std::vector<double> coil_compression_energies(const std::vector<long>& dims, const std::complex<float>* data);
+
+     //! Smallest number of virtual coils retaining at least some fraction of the energy
+     size_t select_virtual_coils(const std::vector<double>& energies, double energy_fraction);
+
+     //! Likewise, within [min_coils, max_coils] (max_coils 0 for the number of coils), as $virtual_channels
+     size_t select_virtual_coils(const std::vector<double>& energies, double energy_fraction, int min_coils, int max_coils);
+} // namespace Gadgetron
+
+#endif //BART_COIL_COMPRESSION_H
@@ -0,0 +1,117 @@
+/****************************************************************************************************************************
+ * Description: Accounting of the memory traffic of BART jobs
+ ****************************************************************************************************************************/
+
+#include "bart_copy_accounting.h"
+#include "log.h"
+#include <algorithm>
+#include <cstdio>
+#include <sstream>
+
+namespace internal {
+     // BART commands only moving data around: their output is a copy of (part of) their inputs
+     const std::set<std::string> DATA_MOVEMENT_TOOLS{"copy", "crop", "extract", "fcopy", "flip", "join", "permute",
+						     "repmat", "reshape", "resize", "slice", "squeeze", "transpose", "zeropad"};
+
+     // Commands padding their input with zeros when growing it
+     const std::set<std::string> PADDING_TOOLS{"resize", "zeropad"};
+
+     std::string megabytes(uint64_t bytes)
+     {
+	  char buff[32];
+	  snprintf(buff, sizeof(buff), "%.1f MB", bytes / 1048576.0);
+	  return buff;
+     }
+}
+
+namespace Gadgetron {
+
+     void BartCopyAccounting::set_strict(std::set<std::string> allowed_stages)
+     {
+	  std::lock_guard<std::mutex> lock(mtx_);
+	  is_strict_ = true;
+	  allowed_stages_ = std::move(allowed_stages);
+     }
+
+     BartCopyAccounting::Counters& BartCopyAccounting::counters(const std::string& stage)
+     {
+	  auto it = index_.find(stage);
+	  if (it == index_.end()) {
+	       it = index_.emplace(stage, stages_.size()).first;
+	       stages_.emplace_back(stage, Counters());
+	  }
+	  return stages_[it->second].second;
+     }
+
+     void BartCopyAccounting::allocated(const std::string& stage, size_t bytes)
+     {
+	  std::lock_guard<std::mutex> lock(mtx_);
+	  counters(stage).allocated += bytes;
+     }
+
+     void BartCopyAccounting::copied(const std::string& stage, size_t bytes, bool is_full_buffer)
+     {
+	  std::lock_guard<std::mutex> lock(mtx_);
+	  auto& c = counters(stage);
+	  c.copied += bytes;
+	  if (is_strict_ && is_full_buffer && !allowed_stages_.count(stage)) {
+	       ++c.full_buffer_copies;
+	       GWARN("Unexpected full-buffer copy: %s copied %s\n", stage.c_str(), internal::megabytes(bytes).c_str());
+	  }
+     }
+
+     void BartCopyAccounting::zeroed(const std::string& stage, size_t bytes)
+     {
+	  std::lock_guard<std::mutex> lock(mtx_);
+	  counters(stage).zeroed += bytes;
+     }
+
+     void BartCopyAccounting::command(const std::string& tool, size_t input_bytes, size_t output_bytes)
+     {
+	  const auto stage = "bart " + tool;
+	  allocated(stage, output_bytes);
+	  if (!internal::DATA_MOVEMENT_TOOLS.count(tool))
+	       return;
+	  if (internal::PADDING_TOOLS.count(tool) && output_bytes > input_bytes) {
+	       copied(stage, input_bytes, true);
+	       zeroed(stage, output_bytes - input_bytes);
+	  }
+	  else {
+	       copied(stage, output_bytes, output_bytes >= input_bytes);
+	  }
+     }
+
+     std::vector<std::pair<std::string, BartCopyAccounting::Counters>> BartCopyAccounting::stages() const
+     {
+	  std::lock_guard<std::mutex> lock(mtx_);
+	  return stages_;
+     }
+
+     BartCopyAccounting::Counters BartCopyAccounting::total() const
+     {
+	  Counters total;
+	  for (const auto& stage: stages()) {
+	       total.allocated += stage.second.allocated;
+	       total.copied += stage.second.copied;
+	       total.zeroed += stage.second.zeroed;
+	       total.full_buffer_copies += stage.second.full_buffer_copies;
+	  }
+	  return total;
+     }
+
+     std::string BartCopyAccounting::report() const
+     {
+	  std::ostringstream report;
+	  auto line = [&](const std::string& name, const Counters& c) {
+	       report << "  " << name << ": " << internal::megabytes(c.allocated) << " allocated, " << internal::megabytes(c.copied)
+		      << " copied, " << internal::megabytes(c.zeroed) << " zeroed";
+	       if (c.full_buffer_copies > 0)
+		    report << " (" << c.full_buffer_copies << " unexpected full-buffer copies)";
+	       report << "\n";
+	  };
+	  for (const auto& stage: stages())
+	       line(stage.first, stage.second);
+	  line("total", total());
+	  return report.str();
+     }
+} // namespace Gadgetron
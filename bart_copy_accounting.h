@@ -0,0 +1,63 @@
+/****************************************************************************************************************************
+ * Description: Accounting of the memory traffic of BART jobs
+ *
+ * Counts the bytes allocated, copied and zeroed by a job, per stage of the
+ * gadget (staging of the inputs, extraction of the images, caches, ...) and per
+ * BART command (estimated from the sizes of its operands), so that the time not
+ * spent computing can be attributed and zero-copy work verified.
+ ****************************************************************************************************************************/
+
+#ifndef BART_COPY_ACCOUNTING_H
+#define BART_COPY_ACCOUNTING_H
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace Gadgetron {
+
+     class BartCopyAccounting
+     {
+     public:
+	  struct Counters
+	  {
+	       uint64_t allocated = 0;
+	       uint64_t copied = 0;
+	       uint64_t zeroed = 0;
+	       uint64_t full_buffer_copies = 0;	//!< Unexpected copies of whole buffers (strict mode)
+	  };
+
+	  //! Strict mode: copies of whole buffers are flagged, unless made by one of these stages
+	  void set_strict(std::set<std::string> allowed_stages);
+
+	  void allocated(const std::string& stage, size_t bytes);
+	  void copied(const std::string& stage, size_t bytes, bool is_full_buffer);
+	  void zeroed(const std::string& stage, size_t bytes);
+
+	  //! BART command (eg. "fcopy"), from the size of its inputs and output
+	  void command(const std::string& tool, size_t input_bytes, size_t output_bytes);
+
+	  //! Stages in the order they were first seen
+	  std::vector<std::pair<std::string, Counters>> stages() const;
+	  Counters total() const;
+
+	  //! One line per stage, eg. "  bart fcopy: 12.0 MB allocated, 12.0 MB copied, 0.0 MB zeroed"
+	  std::string report() const;
+
+     private:
+	  Counters& counters(const std::string& stage);
+
+	  mutable std::mutex mtx_;
+	  std::vector<std::pair<std::string, Counters>> stages_;
+	  std::map<std::string, size_t> index_;
+	  bool is_strict_ = false;
+	  std::set<std::string> allowed_stages_;
+     };
+} // namespace Gadgetron
+
+#endif //BART_COPY_ACCOUNTING_H
@@ -0,0 +1,326 @@
+/****************************************************************************************************************************
+ * Description: Runtime CPU dispatch of the native kernels of the BartGadget
+ ****************************************************************************************************************************/
+
+#include "bart_cpu_dispatch.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <vector>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BART_CPU_DISPATCH 1
+#define BART_KERNEL_BODY inline __attribute__((always_inline))
+#define BART_KERNEL_AVX2 __attribute__((target("avx2,fma")))
+#define BART_KERNEL_AVX512 __attribute__((target("avx512f,avx512dq,avx512bw,avx512vl,fma,prefer-vector-width=512")))
+#else
+#define BART_KERNEL_BODY inline
+#endif
+
+// The elementwise kernels may run in place: an element is read before being written, never by another iteration
+#if defined(__clang__)
+#define BART_KERNEL_ELEMENTWISE _Pragma("clang loop vectorize(assume_safety)")
+#elif defined(__GNUC__)
+#define BART_KERNEL_ELEMENTWISE _Pragma("GCC ivdep")
+#else
+#define BART_KERNEL_ELEMENTWISE
+#endif
+
+namespace internal {
+     using Gadgetron::BartCpuVariant;
+     using Gadgetron::BartKernels;
+
+     // Independent partial sums, so that the reductions vectorize without reassociating floating point additions
+     constexpr size_t KERNEL_LANES = 8;
+     // Samples of every coil processed together (32 coils x 1024 samples fit in a 256 KiB L2 cache)
+     constexpr size_t KERNEL_TILE = 1024;
+
+     // The bodies are compiled once per variant, inlined into functions targeting each instruction set
+
+     BART_KERNEL_BODY void coil_covariance_body(const std::complex<float>* block, size_t image_size, size_t num_coils, std::complex<double>* cov)
+     {
+	  const auto num_pairs = num_coils * (num_coils + 1) / 2;
+	  std::vector<double> acc(2 * KERNEL_LANES * num_pairs, 0.);
+	  const auto data = reinterpret_cast<const float*>(block);
+
+	  for (size_t tile = 0; tile < image_size; tile += KERNEL_TILE) {
+	       const auto end = std::min(tile + KERNEL_TILE, image_size);
+	       const auto vector_end = tile + (end - tile) / KERNEL_LANES * KERNEL_LANES;
+	       auto pair = acc.data();
+	       for (size_t i = 0; i < num_coils; ++i) {
+		    const auto a = data + 2 * image_size * i;
+		    for (size_t j = i; j < num_coils; ++j, pair += 2 * KERNEL_LANES) {
+			 const auto b = data + 2 * image_size * j;
+			 double re[KERNEL_LANES], im[KERNEL_LANES];
+			 std::copy(pair, pair + KERNEL_LANES, re);
+			 std::copy(pair + KERNEL_LANES, pair + 2 * KERNEL_LANES, im);
+			 for (size_t p = tile; p < vector_end; p += KERNEL_LANES) {
+			      for (size_t l = 0; l < KERNEL_LANES; ++l) {
+				   const double ar = a[2 * (p + l)], ai = a[2 * (p + l) + 1];
+				   const double br = b[2 * (p + l)], bi = b[2 * (p + l) + 1];
+				   re[l] += ar * br + ai * bi;
+				   im[l] += ar * bi - ai * br;
+			      }
+			 }
+			 for (size_t p = vector_end; p < end; ++p) {
+			      const double ar = a[2 * p], ai = a[2 * p + 1], br = b[2 * p], bi = b[2 * p + 1];
+			      re[0] += ar * br + ai * bi;
+			      im[0] += ar * bi - ai * br;
+			 }
+			 std::copy(re, re + KERNEL_LANES, pair);
+			 std::copy(im, im + KERNEL_LANES, pair + KERNEL_LANES);
+		    }
+	       }
+	  }
+
+	  auto pair = acc.data();
+	  for (size_t i = 0; i < num_coils; ++i) {
+	       for (size_t j = i; j < num_coils; ++j, pair += 2 * KERNEL_LANES) {
+		    double re(0), im(0);
+		    for (size_t l = 0; l < KERNEL_LANES; ++l) {
+			 re += pair[l];
+			 im += pair[KERNEL_LANES + l];
+		    }
+		    cov[i * num_coils + j] += std::complex<double>(re, im);
+	       }
+	  }
+     }
+
+     BART_KERNEL_BODY void root_sum_of_squares_body(const std::complex<float>* images, size_t image_size, size_t num_coils, std::complex<float>* out)
+     {
+	  const auto data = reinterpret_cast<const float*>(images);
+	  float sos[KERNEL_TILE];
+	  for (size_t tile = 0; tile < image_size; tile += KERNEL_TILE) {
+	       const auto count = std::min(KERNEL_TILE, image_size - tile);
+	       std::fill(sos, sos + count, 0.f);
+	       for (size_t c = 0; c < num_coils; ++c) {
+		    const auto coil = data + 2 * (image_size * c + tile);
+		    for (size_t p = 0; p < count; ++p)
+			 sos[p] += coil[2 * p] * coil[2 * p] + coil[2 * p + 1] * coil[2 * p + 1];
+	       }
+	       for (size_t p = 0; p < count; ++p)
+		    out[tile + p] = std::sqrt(sos[p]);
+	  }
+     }
+
+     BART_KERNEL_BODY void scale_body(std::complex<float> factor, const std::complex<float>* in, size_t size, std::complex<float>* out)
+     {
+	  const auto x = reinterpret_cast<const float*>(in);
+	  const auto y = reinterpret_cast<float*>(out);
+	  const auto fr = factor.real(), fi = factor.imag();
+	  BART_KERNEL_ELEMENTWISE
+	  for (size_t p = 0; p < size; ++p) {
+	       const auto re = x[2 * p], im = x[2 * p + 1];
+	       y[2 * p] = fr * re - fi * im;
+	       y[2 * p + 1] = fr * im + fi * re;
+	  }
+     }
+
+     BART_KERNEL_BODY void conjugate_body(const std::complex<float>* in, size_t size, std::complex<float>* out)
+     {
+	  const auto x = reinterpret_cast<const float*>(in);
+	  const auto y = reinterpret_cast<float*>(out);
+	  BART_KERNEL_ELEMENTWISE
+	  for (size_t p = 0; p < size; ++p) {
+	       y[2 * p] = x[2 * p];
+	       y[2 * p + 1] = -x[2 * p + 1];
+	  }
+     }
+
+     BART_KERNEL_BODY void saxpy_body(std::complex<float> factor, const std::complex<float>* x, const std::complex<float>* y, size_t size, std::complex<float>* out)
+     {
+	  const auto a = reinterpret_cast<const float*>(x);
+	  const auto b = reinterpret_cast<const float*>(y);
+	  const auto c = reinterpret_cast<float*>(out);
+	  const auto fr = factor.real(), fi = factor.imag();
+	  BART_KERNEL_ELEMENTWISE
+	  for (size_t p = 0; p < size; ++p) {
+	       const auto re = a[2 * p], im = a[2 * p + 1];
+	       c[2 * p] = fr * re - fi * im + b[2 * p];
+	       c[2 * p + 1] = fr * im + fi * re + b[2 * p + 1];
+	  }
+     }
+
+     // Plain products: std::complex checks for infinities and NaNs on every element
+     BART_KERNEL_BODY void multiply_body(const std::complex<float>* x, const std::complex<float>* y, bool conj_y, size_t size, std::complex<float>* out)
+     {
+	  const auto a = reinterpret_cast<const float*>(x);
+	  const auto b = reinterpret_cast<const float*>(y);
+	  const auto c = reinterpret_cast<float*>(out);
+	  const auto sign = conj_y ? -1.f : 1.f;
+	  BART_KERNEL_ELEMENTWISE
+	  for (size_t p = 0; p < size; ++p) {
+	       const auto ar = a[2 * p], ai = a[2 * p + 1];
+	       const auto br = b[2 * p], bi = sign * b[2 * p + 1];
+	       c[2 * p] = ar * br - ai * bi;
+	       c[2 * p + 1] = ar * bi + ai * br;
+	  }
+     }
+
+     void coil_covariance_generic(const std::complex<float>* block, size_t image_size, size_t num_coils, std::complex<double>* cov)
+     {
+	  coil_covariance_body(block, image_size, num_coils, cov);
+     }
+
+     void root_sum_of_squares_generic(const std::complex<float>* images, size_t image_size, size_t num_coils, std::complex<float>* out)
+     {
+	  root_sum_of_squares_body(images, image_size, num_coils, out);
+     }
+
+     void scale_generic(std::complex<float> factor, const std::complex<float>* in, size_t size, std::complex<float>* out)
+     {
+	  scale_body(factor, in, size, out);
+     }
+
+     void conjugate_generic(const std::complex<float>* in, size_t size, std::complex<float>* out)
+     {
+	  conjugate_body(in, size, out);
+     }
+
+     void saxpy_generic(std::complex<float> factor, const std::complex<float>* x, const std::complex<float>* y, size_t size, std::complex<float>* out)
+     {
+	  saxpy_body(factor, x, y, size, out);
+     }
+
+     void multiply_generic(const std::complex<float>* x, const std::complex<float>* y, bool conj_y, size_t size, std::complex<float>* out)
+     {
+	  multiply_body(x, y, conj_y, size, out);
+     }
+
+#ifdef BART_CPU_DISPATCH
+     BART_KERNEL_AVX2 void coil_covariance_avx2(const std::complex<float>* block, size_t image_size, size_t num_coils, std::complex<double>* cov)
+     {
+	  coil_covariance_body(block, image_size, num_coils, cov);
+     }
+
+     BART_KERNEL_AVX2 void root_sum_of_squares_avx2(const std::complex<float>* images, size_t image_size, size_t num_coils, std::complex<float>* out)
+     {
+	  root_sum_of_squares_body(images, image_size, num_coils, out);
+     }
+
+     BART_KERNEL_AVX2 void scale_avx2(std::complex<float> factor, const std::complex<float>* in, size_t size, std::complex<float>* out)
+     {
+	  scale_body(factor, in, size, out);
+     }
+
+     BART_KERNEL_AVX2 void conjugate_avx2(const std::complex<float>* in, size_t size, std::complex<float>* out)
+     {
+	  conjugate_body(in, size, out);
+     }
+
+     BART_KERNEL_AVX2 void saxpy_avx2(std::complex<float> factor, const std::complex<float>* x, const std::complex<float>* y, size_t size, std::complex<float>* out)
+     {
+	  saxpy_body(factor, x, y, size, out);
+     }
+
+     BART_KERNEL_AVX2 void multiply_avx2(const std::complex<float>* x, const std::complex<float>* y, bool conj_y, size_t size, std::complex<float>* out)
+     {
+	  multiply_body(x, y, conj_y, size, out);
+     }
+
+     BART_KERNEL_AVX512 void coil_covariance_avx512(const std::complex<float>* block, size_t image_size, size_t num_coils, std::complex<double>* cov)
+     {
+	  coil_covariance_body(block, image_size, num_coils, cov);
+     }
+
+     BART_KERNEL_AVX512 void root_sum_of_squares_avx512(const std::complex<float>* images, size_t image_size, size_t num_coils, std::complex<float>* out)
+     {
+	  root_sum_of_squares_body(images, image_size, num_coils, out);
+     }
+
+     BART_KERNEL_AVX512 void scale_avx512(std::complex<float> factor, const std::complex<float>* in, size_t size, std::complex<float>* out)
+     {
+	  scale_body(factor, in, size, out);
+     }
+
+     BART_KERNEL_AVX512 void conjugate_avx512(const std::complex<float>* in, size_t size, std::complex<float>* out)
+     {
+	  conjugate_body(in, size, out);
+     }
+
+     BART_KERNEL_AVX512 void saxpy_avx512(std::complex<float> factor, const std::complex<float>* x, const std::complex<float>* y, size_t size, std::complex<float>* out)
+     {
+	  saxpy_body(factor, x, y, size, out);
+     }
+
+     BART_KERNEL_AVX512 void multiply_avx512(const std::complex<float>* x, const std::complex<float>* y, bool conj_y, size_t size, std::complex<float>* out)
+     {
+	  multiply_body(x, y, conj_y, size, out);
+     }
+
+     // Indexed by BartCpuVariant
+     const BartKernels KERNELS[] = {
+	  {coil_covariance_generic, root_sum_of_squares_generic, scale_generic, conjugate_generic, saxpy_generic, multiply_generic},
+	  {coil_covariance_avx2, root_sum_of_squares_avx2, scale_avx2, conjugate_avx2, saxpy_avx2, multiply_avx2},
+	  {coil_covariance_avx512, root_sum_of_squares_avx512, scale_avx512, conjugate_avx512, saxpy_avx512, multiply_avx512}};
+#else
+     const BartKernels KERNELS[] = {
+	  {coil_covariance_generic, root_sum_of_squares_generic, scale_generic, conjugate_generic, saxpy_generic, multiply_generic}};
+#endif
+
+     std::atomic<int> forced_variant(-1);
+
+     BartCpuVariant detect()
+     {
+#ifdef BART_CPU_DISPATCH
+	  __builtin_cpu_init();
+	  if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq") && __builtin_cpu_supports("avx512bw")
+	      && __builtin_cpu_supports("avx512vl") && __builtin_cpu_supports("fma"))
+	       return BartCpuVariant::avx512;
+	  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+	       return BartCpuVariant::avx2;
+#endif
+	  return BartCpuVariant::generic;
+     }
+}
+
+namespace Gadgetron {
+
+     const char* to_string(BartCpuVariant variant)
+     {
+	  switch (variant) {
+	  case BartCpuVariant::avx2:
+	       return "avx2";
+	  case BartCpuVariant::avx512:
+	       return "avx512";
+	  default:
+	       return "generic";
+	  }
+     }
+
+     BartCpuVariant detect_bart_cpu_variant()
+     {
+	  static const auto detected = internal::detect();
+	  return detected;
+     }
+
+     BartCpuVariant bart_cpu_variant()
+     {
+	  const auto forced = internal::forced_variant.load(std::memory_order_relaxed);
+	  return forced < 0 ? detect_bart_cpu_variant() : static_cast<BartCpuVariant>(forced);
+     }
+
+     bool force_bart_cpu_variant(const std::string& name)
+     {
+	  if (name == "auto") {
+	       internal::forced_variant = -1;
+	       return true;
+	  }
+
+	  for (auto variant: {BartCpuVariant::generic, BartCpuVariant::avx2, BartCpuVariant::avx512}) {
+	       if (name != to_string(variant))
+		    continue;
+	       // Each variant requires the instruction sets of the previous ones
+	       if (static_cast<int>(variant) > static_cast<int>(detect_bart_cpu_variant()))
+		    return false;
+	       internal::forced_variant = static_cast<int>(variant);
+	       return true;
+	  }
+	  return false;
+     }
+
+     const BartKernels& bart_kernels()
+     {
+	  return internal::KERNELS[static_cast<int>(bart_cpu_variant())];
+     }
+} // namespace Gadgetron
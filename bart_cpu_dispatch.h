@@ -0,0 +1,61 @@
+/****************************************************************************************************************************
+ * Description: Runtime CPU dispatch of the native kernels of the BartGadget
+ *
+ * The kernels of the gadget itself (coil covariance of the coil compression,
+ * root sum of squares of the previews, elementwise commands run natively) are
+ * compiled for several instruction sets into the same binary: generic x86-64,
+ * AVX2+FMA and AVX-512. The best variant supported by the CPU is selected the
+ * first time a kernel is used (from CPUID), unless a variant is forced, eg. to
+ * compare them.
+ * Other compilers and architectures only have the generic variant.
+ * The copies between buffers go through memcpy, already dispatched by the C
+ * library.
+ ****************************************************************************************************************************/
+
+#ifndef BART_CPU_DISPATCH_H
+#define BART_CPU_DISPATCH_H
+
+#include <complex>
+#include <cstddef>
+#include <string>
+
+namespace Gadgetron {
+
+     enum class BartCpuVariant { generic, avx2, avx512 };
+
+     const char* to_string(BartCpuVariant variant);
+
+     struct BartKernels
+     {
+	  //! Accumulates the upper triangle of the coil covariance A^H A of a [image_size x num_coils] block into cov (row major)
+	  void (*coil_covariance)(const std::complex<float>* block, size_t image_size, size_t num_coils, std::complex<double>* cov);
+	  //! Root sum of squares over the coils of a [image_size x num_coils] block
+	  void (*root_sum_of_squares)(const std::complex<float>* images, size_t image_size, size_t num_coils, std::complex<float>* out);
+
+	  /* Elementwise kernels, out may be any of the inputs (in place) */
+	  //! out = factor * in
+	  void (*scale)(std::complex<float> factor, const std::complex<float>* in, size_t size, std::complex<float>* out);
+	  //! out = conj(in)
+	  void (*conjugate)(const std::complex<float>* in, size_t size, std::complex<float>* out);
+	  //! out = factor * x + y
+	  void (*saxpy)(std::complex<float> factor, const std::complex<float>* x, const std::complex<float>* y, size_t size, std::complex<float>* out);
+	  //! out = x * y, or x * conj(y)
+	  void (*multiply)(const std::complex<float>* x, const std::complex<float>* y, bool conj_y, size_t size, std::complex<float>* out);
+     };
+
+     //! Best variant supported by the CPU
+     BartCpuVariant detect_bart_cpu_variant();
+
+     //! Variant of the kernels in use
+     BartCpuVariant bart_cpu_variant();
+
+     //! Force a variant (generic, avx2 or avx512) for the whole process, or auto to go back to the detected one
+     /*!
+      * Fails (and changes nothing) for an unknown variant or one the CPU does not support.
+      */
+     bool force_bart_cpu_variant(const std::string& name);
+
+     const BartKernels& bart_kernels();
+} // namespace Gadgetron
+
+#endif //BART_CPU_DISPATCH_H
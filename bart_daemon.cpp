@@ -0,0 +1,1050 @@
+/****************************************************************************************************************************
+ * Description: Local BART reconstruction daemon shared by several Gadgetron chains
+ ****************************************************************************************************************************/
+
+#include "bart_daemon.h"
+#include "bart_fair_share.h"
+#include "bart_result_cache.h"
+#include "log.h"
+#include <boost/filesystem.hpp>
+#include <chrono>
+#include <cstring>
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <numeric>
+#include <set>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <grp.h>
+#include <poll.h>
+#include <pwd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif /* !_WIN32 */
+
+#ifndef _WIN32
+
+namespace internal {
+     constexpr uint32_t BART_DAEMON_MAGIC = 0x54524142;	// "BART"
+     constexpr uint32_t BART_DAEMON_VERSION = 7;
+     constexpr uint64_t NO_DEADLINE = ~0UL;
+     constexpr uint64_t MAX_MESSAGE_SIZE = 64UL << 20;
+
+     // Status of the messages telling the client which command of its job runs, before the reply
+     constexpr uint64_t PROGRESS_STATUS = 2;
+
+     // Smallest encoding of an input (name, dimensions and segment name, all empty) and of a command line
+     constexpr uint64_t MIN_INPUT_SIZE = 3 * sizeof(uint64_t);
+     constexpr uint64_t MIN_COMMAND_SIZE = sizeof(uint64_t);
+
+     // Options of a job besides its commands, sent as one bit mask
+     constexpr uint64_t PROFILE_FLAG = 1;
+     constexpr uint64_t HARDWARE_EVENTS_FLAG = 2;
+     constexpr uint64_t COPIES_FLAG = 4;
+
+     // How long the daemon keeps the name of an output segment for the client to map it
+     constexpr int OUTPUT_ACK_TIMEOUT_MS = 10000;
+
+     // -------------------------------------------------------------------------
+
+     class MessageWriter
+     {
+     public:
+	  void put(uint64_t value) { buf_.append(reinterpret_cast<const char*>(&value), sizeof(value)); }
+	  void put(const std::string& str)
+	       {
+		    put(static_cast<uint64_t>(str.size()));
+		    buf_.append(str);
+	       }
+	  void put(const std::vector<long>& values)
+	       {
+		    put(static_cast<uint64_t>(values.size()));
+		    for (auto v: values)
+			 put(static_cast<uint64_t>(v));
+	       }
+
+	  const std::string& str() const { return buf_; }
+
+     private:
+	  std::string buf_;
+     };
+
+     class MessageReader
+     {
+     public:
+	  MessageReader(const std::string& buf) : buf_(buf), pos_(0) {}
+
+	  bool get(uint64_t& value)
+	       {
+		    if (pos_ + sizeof(value) > buf_.size())
+			 return false;
+		    std::memcpy(&value, buf_.data() + pos_, sizeof(value));
+		    pos_ += sizeof(value);
+		    return true;
+	       }
+	  bool get(std::string& str)
+	       {
+		    uint64_t size(0);
+		    if (!get(size) || pos_ + size > buf_.size())
+			 return false;
+		    str.assign(buf_, pos_, size);
+		    pos_ += size;
+		    return true;
+	       }
+	  bool get(std::vector<long>& values)
+	       {
+		    uint64_t size(0);
+		    if (!get(size) || size > 16)
+			 return false;
+		    values.resize(size);
+		    for (auto& v: values) {
+			 uint64_t tmp(0);
+			 if (!get(tmp))
+			      return false;
+			 v = static_cast<long>(tmp);
+		    }
+		    return true;
+	       }
+
+	  //! Bytes not read yet, bounding the number of items a count may announce
+	  size_t remaining() const { return buf_.size() - pos_; }
+
+     private:
+	  const std::string& buf_;
+	  size_t pos_;
+     };
+
+     // -------------------------------------------------------------------------
+
+     bool write_all(int fd, const void* data, size_t size)
+     {
+	  auto p = static_cast<const char*>(data);
+	  while (size > 0) {
+	       auto n = ::send(fd, p, size, MSG_NOSIGNAL);
+	       if (n < 0 && errno == EINTR)
+		    continue;
+	       if (n <= 0)
+		    return false;
+	       p += n;
+	       size -= n;
+	  }
+	  return true;
+     }
+
+     bool read_all(int fd, void* data, size_t size)
+     {
+	  auto p = static_cast<char*>(data);
+	  while (size > 0) {
+	       auto n = ::recv(fd, p, size, 0);
+	       if (n < 0 && errno == EINTR)
+		    continue;
+	       if (n <= 0)
+		    return false;
+	       p += n;
+	       size -= n;
+	  }
+	  return true;
+     }
+
+     bool send_message(int fd, const std::string& msg)
+     {
+	  uint64_t size(msg.size());
+	  return write_all(fd, &size, sizeof(size)) && write_all(fd, msg.data(), msg.size());
+     }
+
+     bool receive_message(int fd, std::string& msg)
+     {
+	  uint64_t size(0);
+	  if (!read_all(fd, &size, sizeof(size)) || size > MAX_MESSAGE_SIZE)
+	       return false;
+	  msg.resize(size);
+	  return read_all(fd, &msg[0], size);
+     }
+
+     // -------------------------------------------------------------------------
+
+     std::string unique_segment_name(const char* prefix)
+     {
+	  static std::atomic<uint64_t> counter(0);
+	  return std::string("/bart_") + prefix + "_" + std::to_string(getpid()) + "_" + std::to_string(counter++);
+     }
+
+     //! Whether a segment name was made by unique_segment_name(prefix), the daemon opens no other
+     bool is_segment_name(const std::string& name, const char* prefix)
+     {
+	  const auto expected = std::string("/bart_") + prefix + "_";
+	  return name.compare(0, expected.size(), expected) == 0 && name.size() > expected.size()
+	       && name.find_first_not_of("0123456789_", expected.size()) == std::string::npos;
+     }
+
+     // BART tools reading or writing files which are not CFLs
+     const std::set<std::string> FILE_TOOLS{"toimg", "twixread", "vidtoimg", "ismrmrd", "fakeksp"};
+
+     //! Whether a name (or command line argument) can only refer to an in-memory CFL, not to a path
+     bool is_memory_operand(const std::string& token)
+     {
+	  return !token.empty() && token[0] != '.' && token[0] != '~'
+	       && token.find_first_not_of("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_-+.,:=") == std::string::npos;
+     }
+
+     //! Whether a command line of a job only runs a BART tool (or directive) on in-memory CFLs
+     bool is_allowed_command(const std::string& cmdline)
+     {
+	  std::istringstream in(cmdline);
+	  std::string token, tool;
+	  in >> token;
+	  if (token == "bart" && (!(in >> tool) || FILE_TOOLS.count(tool)))
+	       return false;
+	  if (token != "bart" && token != "foreach" && token != "end")
+	       return false;
+	  while (in >> token) {
+	       if (!is_memory_operand(token))
+		    return false;
+	  }
+	  return true;
+     }
+
+     //! Whether the array of these dimensions is non-empty and its size in bytes fits in size_t
+     bool are_valid_dims(const std::vector<long>& dims)
+     {
+	  size_t bytes(sizeof(std::complex<float>));
+	  for (auto d: dims) {
+	       if (d < 1 || static_cast<size_t>(d) > std::numeric_limits<size_t>::max() / bytes)
+		    return false;
+	       bytes *= static_cast<size_t>(d);
+	  }
+	  return true;
+     }
+
+     size_t get_number_of_bytes(const std::vector<long>& dims)
+     {
+	  return std::accumulate(dims.begin(), dims.end(), size_t(1), std::multiplies<size_t>()) * sizeof(std::complex<float>);
+     }
+
+     int connect_to(const std::string& socket_path)
+     {
+	  sockaddr_un addr{};
+	  if (socket_path.size() >= sizeof(addr.sun_path)) {
+	       GERROR("BART daemon socket path is too long: %s\n", socket_path.c_str());
+	       return -1;
+	  }
+	  addr.sun_family = AF_UNIX;
+	  std::strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+
+	  int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+	  if (fd < 0) {
+	       GERROR("Unable to create socket: %s\n", std::strerror(errno));
+	       return -1;
+	  }
+	  if (::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+	       GERROR("Unable to connect to the BART daemon at %s: %s\n", socket_path.c_str(), std::strerror(errno));
+	       ::close(fd);
+	       return -1;
+	  }
+	  return fd;
+     }
+
+     // Wait until the peer has something for us (or the job got cancelled)
+     bool wait_readable(int fd, const Gadgetron::BartCancellationToken* token)
+     {
+	  pollfd pfd{fd, POLLIN, 0};
+	  while (true) {
+	       if (token != nullptr && token->is_cancelled())
+		    return false;
+	       auto n = ::poll(&pfd, 1, 50);
+	       if (n > 0)
+		    return true;
+	       if (n < 0 && errno != EINTR)
+		    return false;
+	  }
+     }
+
+     // Cancel the job of a connection as soon as the client hangs up, and tell the client which command of the job runs
+     class HangupWatcher
+     {
+     public:
+	  HangupWatcher(int fd, std::shared_ptr<Gadgetron::BartCancellationToken> token, std::shared_ptr<const Gadgetron::BartJobProgress> progress) :
+	       is_done_(false),
+	       thread_([this, fd, token, progress] {
+			 // Clients do not send anything once the job is submitted: any event is a hang up
+			 pollfd pfd{fd, POLLIN, 0};
+#ifdef POLLRDHUP
+			 pfd.events |= POLLRDHUP;
+#endif /* POLLRDHUP */
+			 std::string last_cmdline;
+			 std::chrono::steady_clock::time_point last_start;
+			 while (!is_done_) {
+			      auto n = ::poll(&pfd, 1, 50);
+			      if (n > 0 || (n < 0 && errno != EINTR)) {
+				   GDEBUG("BART daemon client hung up, cancelling its job\n");
+				   token->cancel();
+				   break;
+			      }
+
+			      // The time limits of the job are enforced by the client (see run_with_time_limits())
+			      std::string cmdline, operands;
+			      std::chrono::steady_clock::duration elapsed;
+			      progress->current(cmdline, operands, elapsed);
+			      const auto start = std::chrono::steady_clock::now() - elapsed;
+			      if (cmdline.empty() || (cmdline == last_cmdline && start - last_start < std::chrono::milliseconds(1)))
+				   continue;
+			      last_cmdline = cmdline;
+			      last_start = start;
+			      MessageWriter message;
+			      message.put(PROGRESS_STATUS);
+			      message.put(cmdline);
+			      message.put(operands);
+			      message.put(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count()));
+			      if (!send_message(fd, message.str())) {
+				   GDEBUG("BART daemon client hung up, cancelling its job\n");
+				   token->cancel();
+				   break;
+			      }
+			 }
+		    })
+	  {}
+	  ~HangupWatcher()
+	       {
+		    is_done_ = true;
+		    thread_.join();
+	       }
+
+     private:
+	  std::atomic<bool> is_done_;
+	  std::thread thread_;
+     };
+
+     class MemCflGuard
+     {
+     public:
+	  // NB: the job may have moved to another instance of the pool by the time we are done
+	  MemCflGuard(Gadgetron::BartInstancePool::Lease& bart) : bart_(bart) {}
+	  ~MemCflGuard()
+	       {
+		    if (bart_)
+			 bart_->deallocate_all_mem_cfl();
+	       }
+     private:
+	  Gadgetron::BartInstancePool::Lease& bart_;
+     };
+
+     // Quota requested by a client within the limit of the daemon (0 for none)
+     template <typename T>
+     T capped_quota(T requested, T limit)
+     {
+	  if (limit == 0)
+	       return requested;
+	  return requested == 0 ? limit : std::min(requested, limit);
+     }
+}
+
+// =============================================================================
+
+namespace Gadgetron {
+
+     SharedMemorySegment::SharedMemorySegment(SharedMemorySegment&& other) noexcept :
+	  name_(std::move(other.name_)),
+	  data_(other.data_),
+	  size_(other.size_),
+	  is_owner_(other.is_owner_)
+     {
+	  other.data_ = nullptr;
+	  other.is_owner_ = false;
+     }
+
+     SharedMemorySegment& SharedMemorySegment::operator=(SharedMemorySegment&& other) noexcept
+     {
+	  if (this != &other) {
+	       reset();
+	       name_ = std::move(other.name_);
+	       data_ = other.data_;
+	       size_ = other.size_;
+	       is_owner_ = other.is_owner_;
+	       other.data_ = nullptr;
+	       other.is_owner_ = false;
+	  }
+	  return *this;
+     }
+
+     SharedMemorySegment::~SharedMemorySegment()
+     {
+	  reset();
+     }
+
+     void SharedMemorySegment::reset()
+     {
+	  if (data_ != nullptr) {
+	       munmap(data_, size_);
+	       data_ = nullptr;
+	  }
+	  if (is_owner_) {
+	       shm_unlink(name_.c_str());
+	       is_owner_ = false;
+	  }
+     }
+
+     bool SharedMemorySegment::create(const std::string& name, size_t bytes)
+     {
+	  reset();
+	  name_ = name;
+	  size_ = std::max(bytes, size_t(1));
+
+	  int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IWUSR);
+	  if (fd < 0) {
+	       GERROR("Unable to create shared memory segment %s: %s\n", name.c_str(), std::strerror(errno));
+	       return false;
+	  }
+	  is_owner_ = true;
+
+	  // The peer may be another user of the group the daemon allows (see BartDaemon::set_allowed_group())
+	  fchmod(fd, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+
+	  if (ftruncate(fd, size_) != 0) {
+	       GERROR("Unable to resize shared memory segment %s: %s\n", name.c_str(), std::strerror(errno));
+	       ::close(fd);
+	       return false;
+	  }
+
+	  auto data = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	  ::close(fd);
+	  if (data == MAP_FAILED) {
+	       GERROR("Unable to map shared memory segment %s: %s\n", name.c_str(), std::strerror(errno));
+	       return false;
+	  }
+	  data_ = data;
+	  return true;
+     }
+
+     bool SharedMemorySegment::open(const std::string& name, size_t bytes, bool take_ownership)
+     {
+	  reset();
+	  name_ = name;
+	  size_ = std::max(bytes, size_t(1));
+	  is_owner_ = take_ownership;
+
+	  int fd = shm_open(name.c_str(), O_RDWR, 0);
+	  if (fd < 0) {
+	       GERROR("Unable to open shared memory segment %s: %s\n", name.c_str(), std::strerror(errno));
+	       return false;
+	  }
+
+	  // Mapping past the end of the segment would fault on the first access
+	  struct stat st;
+	  if (fstat(fd, &st) != 0 || st.st_size < 0 || static_cast<size_t>(st.st_size) < size_) {
+	       GERROR("Shared memory segment %s is smaller than %zu bytes\n", name.c_str(), size_);
+	       ::close(fd);
+	       return false;
+	  }
+
+	  auto data = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	  ::close(fd);
+	  if (data == MAP_FAILED) {
+	       GERROR("Unable to map shared memory segment %s: %s\n", name.c_str(), std::strerror(errno));
+	       return false;
+	  }
+	  data_ = data;
+	  return true;
+     }
+
+     // =========================================================================
+
+     bool BartDaemonClient::submit(const BartJob& job, BartDaemonReply& reply)
+     {
+	  // Stage the inputs into shared memory
+	  std::vector<SharedMemorySegment> segments(job.inputs.size());
+	  internal::MessageWriter request;
+	  request.put(static_cast<uint64_t>(internal::BART_DAEMON_MAGIC));
+	  request.put(static_cast<uint64_t>(internal::BART_DAEMON_VERSION));
+
+	  request.put(static_cast<uint64_t>(job.inputs.size()));
+	  for (auto i(0UL); i < job.inputs.size(); ++i) {
+	       const auto& input = job.inputs[i];
+	       const auto bytes = internal::get_number_of_bytes(input.dims);
+	       if (!segments[i].create(internal::unique_segment_name("in"), bytes)) {
+		    return false;
+	       }
+	       std::memcpy(segments[i].data(), input.data, bytes);
+	       if (job.copies) {
+		    job.copies->allocated("daemon shared memory", bytes);
+		    job.copies->copied("daemon shared memory", bytes, true);
+	       }
+
+	       request.put(input.name);
+	       request.put(input.dims);
+	       request.put(segments[i].name());
+	  }
+
+	  // The daemon works on its own copy of the inputs
+	  for (const auto& input: job.inputs) {
+	       if (input.release)
+		    input.release();
+	  }
+
+	  request.put(static_cast<uint64_t>(job.commands.size()));
+	  for (const auto& cmdline: job.commands) {
+	       request.put(cmdline);
+	  }
+	  request.put(job.output);
+
+	  // Deadlines are sent relative to now as the clocks of the processes are unrelated
+	  if (job.schedule.deadline == std::chrono::steady_clock::time_point::max()) {
+	       request.put(internal::NO_DEADLINE);
+	  }
+	  else {
+	       auto remaining = std::chrono::duration_cast<std::chrono::microseconds>(job.schedule.deadline - std::chrono::steady_clock::now()).count();
+	       request.put(static_cast<uint64_t>(std::max<int64_t>(remaining, 0)));
+	  }
+	  request.put(static_cast<uint64_t>(static_cast<int64_t>(job.schedule.priority)));
+
+	  // Tenant with its weight (in thousandths) and quotas (CPU time in milliseconds), see BartFairShare
+	  double weight(1);
+	  BartFairShare::Quota quota;
+	  BartFairShare::get().tenant(job.schedule.tenant, weight, quota);
+	  request.put(job.schedule.tenant);
+	  request.put(static_cast<uint64_t>(weight * 1000));
+	  request.put(static_cast<uint64_t>(quota.cpu_seconds * 1000));
+	  request.put(static_cast<uint64_t>(quota.memory_bytes));
+
+	  // The calibration store and the profiling are those of the daemon, the accounting of the copies comes back with the reply
+	  request.put(job.calibration.key);
+	  request.put(static_cast<uint64_t>(job.calibration.inputs.size()));
+	  for (const auto& name: job.calibration.inputs) {
+	       request.put(name);
+	  }
+	  request.put((job.profile ? internal::PROFILE_FLAG : 0)
+		      | (job.count_hardware_events ? internal::HARDWARE_EVENTS_FLAG : 0)
+		      | (job.copies ? internal::COPIES_FLAG : 0));
+
+	  // Reserved by the daemon as by the gadget (in thousandths), see estimate_job_memory()
+	  request.put(static_cast<uint64_t>(std::max(job.memory_expansion, 0.0f) * 1000));
+
+	  // Submit and wait for the result
+	  int fd = internal::connect_to(socket_path_);
+	  if (fd < 0) {
+	       return false;
+	  }
+
+	  // NB: closing the connection is how the daemon learns that the job got cancelled
+	  std::string msg;
+	  auto ok = internal::send_message(fd, request.str());
+	  while (ok) {
+	       ok = internal::wait_readable(fd, job.cancellation.get()) && internal::receive_message(fd, msg);
+
+	       // The commands of the job starting, up to the reply
+	       internal::MessageReader progress(msg);
+	       uint64_t status(0), elapsed(0);
+	       std::string cmdline, operands;
+	       if (!ok || !progress.get(status) || status != internal::PROGRESS_STATUS)
+		    break;
+	       if (job.progress && progress.get(cmdline) && progress.get(operands) && progress.get(elapsed))
+		    job.progress->start_command(cmdline, operands, std::chrono::microseconds(elapsed));
+	  }
+	  if (!ok || is_cancelled(job)) {
+	       ::close(fd);
+	  }
+	  if (is_cancelled(job)) {
+	       GDEBUG("BART job cancelled while running in the daemon\n");
+	       return false;
+	  }
+	  if (!ok) {
+	       GERROR("Lost connection to the BART daemon at %s\n", socket_path_.c_str());
+	       return false;
+	  }
+
+	  internal::MessageReader response(msg);
+	  uint64_t status(1);
+	  std::string message, output_name;
+	  if (!response.get(status) || !response.get(message)) {
+	       GERROR("Invalid reply from the BART daemon\n");
+	       ::close(fd);
+	       return false;
+	  }
+	  if (status != 0) {
+	       GERROR("BART daemon failed to execute job: %s\n", message.c_str());
+	       ::close(fd);
+	       return false;
+	  }
+
+	  if (!response.get(reply.output.script_dims) || !response.get(reply.output.dims) || !response.get(output_name)) {
+	       GERROR("Invalid reply from the BART daemon\n");
+	       ::close(fd);
+	       return false;
+	  }
+
+	  // The daemon removes the name of the output segment once mapped (or once we hang up), the mapping stays ours
+	  uint64_t num_stages(0);
+	  if (!internal::are_valid_dims(reply.output.dims) || !internal::is_segment_name(output_name, "out") || !response.get(num_stages)) {
+	       GERROR("Invalid reply from the BART daemon\n");
+	       internal::send_message(fd, std::string("failed"));
+	       ::close(fd);
+	       return false;
+	  }
+	  for (auto i(0UL); i < num_stages; ++i) {
+	       std::string stage;
+	       uint64_t allocated(0), copied(0), zeroed(0);
+	       if (!response.get(stage) || !response.get(allocated) || !response.get(copied) || !response.get(zeroed)) {
+		    GERROR("Invalid reply from the BART daemon\n");
+		    internal::send_message(fd, std::string("failed"));
+		    ::close(fd);
+		    return false;
+	       }
+	       // NB: the copies made within the daemon are not checked against the stages allowed in strict mode
+	       if (job.copies) {
+		    job.copies->allocated(stage, allocated);
+		    job.copies->copied(stage, copied, false);
+		    job.copies->zeroed(stage, zeroed);
+	       }
+	  }
+
+	  ok = reply.segment.open(output_name, internal::get_number_of_bytes(reply.output.dims), false);
+	  internal::send_message(fd, std::string(ok ? "mapped" : "failed"));
+	  ::close(fd);
+	  if (!ok) {
+	       return false;
+	  }
+	  reply.output.data = static_cast<std::complex<float>*>(reply.segment.data());
+	  return true;
+     }
+
+     // =========================================================================
+
+     BartDaemon::BartDaemon(std::string socket_path, size_t memory_budget_bytes) :
+	  socket_path_(std::move(socket_path)),
+	  memory_budget_(memory_budget_bytes),
+	  listen_fd_(-1),
+	  is_stopping_(false)
+     {}
+
+     BartDaemon::~BartDaemon()
+     {
+	  stop();
+
+	  // Wait for the jobs in flight
+	  std::unique_lock<std::mutex> lock(mtx_);
+	  cv_.wait(lock, [this] { return active_connections_ == 0; });
+     }
+
+     void BartDaemon::set_tenant(const std::string& tenant, double weight, const BartFairShare::Quota& quota)
+     {
+	  configured_tenants_.insert(tenant);
+	  BartFairShare::get().set_tenant(tenant, weight, quota);
+     }
+
+     void BartDaemon::set_allowed_group(long gid)
+     {
+	  allowed_gid_ = gid;
+     }
+
+     void BartDaemon::set_tenant_limits(double max_weight, const BartFairShare::Quota& max_quota)
+     {
+	  max_tenant_weight_ = max_weight;
+	  max_tenant_quota_ = max_quota;
+     }
+
+     void BartDaemon::stop()
+     {
+	  is_stopping_ = true;
+	  int fd = listen_fd_.exchange(-1);
+	  if (fd >= 0) {
+	       ::shutdown(fd, SHUT_RDWR);
+	       ::close(fd);
+	  }
+     }
+
+     bool BartDaemon::run()
+     {
+	  sockaddr_un addr{};
+	  if (socket_path_.size() >= sizeof(addr.sun_path)) {
+	       GERROR("BART daemon socket path is too long: %s\n", socket_path_.c_str());
+	       return false;
+	  }
+	  addr.sun_family = AF_UNIX;
+	  std::strncpy(addr.sun_path, socket_path_.c_str(), sizeof(addr.sun_path) - 1);
+
+	  boost::system::error_code ec;
+	  boost::filesystem::create_directories(boost::filesystem::path(socket_path_).parent_path(), ec);
+	  ::unlink(socket_path_.c_str());
+
+	  int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+	  if (fd < 0
+	      || ::bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0
+	      || ::listen(fd, SOMAXCONN) != 0)
+	  {
+	       GERROR("Unable to listen on %s: %s\n", socket_path_.c_str(), std::strerror(errno));
+	       if (fd >= 0)
+		    ::close(fd);
+	       return false;
+	  }
+	  listen_fd_ = fd;
+
+	  // Only the user of the daemon (and its allowed group) may connect
+	  const auto mode = allowed_gid_ >= 0 ? S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP : S_IRUSR | S_IWUSR;
+	  if ((allowed_gid_ >= 0 && ::chown(socket_path_.c_str(), static_cast<uid_t>(-1), static_cast<gid_t>(allowed_gid_)) != 0)
+	      || ::chmod(socket_path_.c_str(), mode) != 0)
+	  {
+	       GERROR("Unable to restrict the access to %s: %s\n", socket_path_.c_str(), std::strerror(errno));
+	       stop();
+	       ::unlink(socket_path_.c_str());
+	       return false;
+	  }
+
+	  GINFO("BART daemon listening on %s (memory budget: %lu MB)\n", socket_path_.c_str(), memory_budget_ >> 20);
+
+	  while (!is_stopping_) {
+	       int client = ::accept(fd, nullptr, nullptr);
+	       if (client < 0) {
+		    if (errno == EINTR || errno == ECONNABORTED)
+			 continue;
+		    break;
+	       }
+	       if (!is_allowed_peer(client)) {
+		    ::close(client);
+		    continue;
+	       }
+
+	       {
+		    std::lock_guard<std::mutex> lock(mtx_);
+		    ++active_connections_;
+	       }
+	       std::thread([this, client] {
+			 // Whatever a client sends, the daemon serves the others
+			 try {
+			      serve(client);
+			 }
+			 catch (const std::exception& e) {
+			      GERROR("BART daemon connection failed: %s\n", e.what());
+			 }
+			 catch (...) {
+			      GERROR("BART daemon connection failed\n");
+			 }
+			 ::close(client);
+			 std::lock_guard<std::mutex> lock(mtx_);
+			 --active_connections_;
+			 cv_.notify_all();
+		    }).detach();
+	  }
+
+	  ::unlink(socket_path_.c_str());
+	  GINFO("BART daemon stopped\n");
+	  return true;
+     }
+
+     bool BartDaemon::is_allowed_peer(int fd) const
+     {
+	  uid_t uid(0);
+	  gid_t gid(0);
+#ifdef SO_PEERCRED
+	  ucred cred{};
+	  socklen_t size = sizeof(cred);
+	  const auto ok = getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &size) == 0;
+	  uid = cred.uid;
+	  gid = cred.gid;
+#else
+	  const auto ok = getpeereid(fd, &uid, &gid) == 0;
+#endif /* SO_PEERCRED */
+	  if (!ok) {
+	       GERROR("Unable to identify the client of the BART daemon: %s\n", std::strerror(errno));
+	       return false;
+	  }
+	  if (uid == 0 || uid == geteuid())
+	       return true;
+
+	  if (allowed_gid_ >= 0) {
+	       if (gid == static_cast<gid_t>(allowed_gid_))
+		    return true;
+
+	       // Supplementary groups of the user of the client
+	       passwd pwd{};
+	       passwd* result(nullptr);
+	       std::vector<char> buffer(16384);
+	       if (getpwuid_r(uid, &pwd, buffer.data(), buffer.size(), &result) == 0 && result != nullptr) {
+		    std::vector<gid_t> groups(256);
+		    int num_groups = static_cast<int>(groups.size());
+		    if (getgrouplist(pwd.pw_name, gid, groups.data(), &num_groups) >= 0
+			&& std::find(groups.begin(), groups.begin() + num_groups, static_cast<gid_t>(allowed_gid_)) != groups.begin() + num_groups)
+			 return true;
+	       }
+	  }
+
+	  GWARN("BART daemon: refusing connection of user %u\n", uid);
+	  return false;
+     }
+
+     bool BartDaemon::reserve_memory(size_t bytes, const BartJob& job)
+     {
+	  // Jobs are admitted in the same order as by the instance pool; a job larger than the whole budget runs alone
+	  std::unique_lock<std::mutex> lock(mtx_);
+	  auto me = waiting_.emplace(job.schedule, next_arrival_++);
+	  while (!cv_.wait_for(lock, std::chrono::milliseconds(50), [&] {
+			 return is_cancelled(job)
+			      || (BartInstancePool::next_waiting(waiting_) == me
+				  && (memory_budget_ == 0 || memory_in_use_ == 0 || memory_in_use_ + bytes <= memory_budget_));
+		    }))
+	       ;
+	  waiting_.erase(me);
+	  if (!is_cancelled(job))
+	       memory_in_use_ += bytes;
+	  cv_.notify_all();
+	  return !is_cancelled(job);
+     }
+
+     void BartDaemon::release_memory(size_t bytes)
+     {
+	  {
+	       std::lock_guard<std::mutex> lock(mtx_);
+	       memory_in_use_ -= bytes;
+	  }
+	  cv_.notify_all();
+     }
+
+     void BartDaemon::serve(int fd)
+     {
+	  std::string msg;
+	  if (!internal::receive_message(fd, msg)) {
+	       return;
+	  }
+
+	  auto send_error = [fd](const std::string& message) {
+	       internal::MessageWriter response;
+	       response.put(static_cast<uint64_t>(1));
+	       response.put(message);
+	       internal::send_message(fd, response.str());
+	  };
+
+	  // Parse the job and map its inputs
+	  internal::MessageReader request(msg);
+	  uint64_t magic(0), version(0), num_inputs(0), num_commands(0);
+	  if (!request.get(magic) || !request.get(version)
+	      || magic != internal::BART_DAEMON_MAGIC || version != internal::BART_DAEMON_VERSION
+	      || !request.get(num_inputs))
+	  {
+	       send_error("invalid request");
+	       return;
+	  }
+
+	  if (num_inputs > request.remaining() / internal::MIN_INPUT_SIZE) {
+	       send_error("invalid request");
+	       return;
+	  }
+
+	  BartJob job;
+	  std::vector<SharedMemorySegment> segments(num_inputs);
+	  for (auto i(0UL); i < num_inputs; ++i) {
+	       BartJobInput input;
+	       std::string segment_name;
+	       if (!request.get(input.name) || !request.get(input.dims) || !request.get(segment_name)) {
+		    send_error("invalid request");
+		    return;
+	       }
+	       if (!internal::are_valid_dims(input.dims)) {
+		    send_error("invalid dimensions of input " + input.name);
+		    return;
+	       }
+	       if (!internal::is_memory_operand(input.name) || !internal::is_segment_name(segment_name, "in")) {
+		    send_error("invalid input " + input.name);
+		    return;
+	       }
+	       const auto bytes = internal::get_number_of_bytes(input.dims);
+	       if (!segments[i].open(segment_name, bytes, false)) {
+		    send_error("unable to map input " + input.name);
+		    return;
+	       }
+	       input.data = static_cast<std::complex<float>*>(segments[i].data());
+	       job.inputs.push_back(std::move(input));
+	  }
+
+	  if (!request.get(num_commands) || num_commands > request.remaining() / internal::MIN_COMMAND_SIZE) {
+	       send_error("invalid request");
+	       return;
+	  }
+	  if (num_commands == 0) {
+	       send_error("BART job without any command");
+	       return;
+	  }
+	  job.commands.resize(num_commands);
+	  for (auto& cmdline: job.commands) {
+	       if (!request.get(cmdline)) {
+		    send_error("invalid request");
+		    return;
+	       }
+	       // Whoever may connect must not get the daemon to touch its files
+	       if (!internal::is_allowed_command(cmdline)) {
+		    send_error("command not allowed (only BART tools on in-memory CFLs): " + cmdline);
+		    return;
+	       }
+	  }
+	  uint64_t remaining(internal::NO_DEADLINE), priority(0), weight(1000), cpu_quota(0), memory_quota(0);
+	  if (!request.get(job.output) || !request.get(remaining) || !request.get(priority)
+	      || !request.get(job.schedule.tenant) || !request.get(weight) || !request.get(cpu_quota) || !request.get(memory_quota)) {
+	       send_error("invalid request");
+	       return;
+	  }
+	  if (!job.output.empty() && !internal::is_memory_operand(job.output)) {
+	       send_error("invalid output " + job.output);
+	       return;
+	  }
+
+	  uint64_t num_calibration_inputs(0), flags(0), memory_expansion(0);
+	  if (!request.get(job.calibration.key) || !request.get(num_calibration_inputs)
+	      || num_calibration_inputs > request.remaining() / internal::MIN_COMMAND_SIZE) {
+	       send_error("invalid request");
+	       return;
+	  }
+	  job.calibration.inputs.resize(num_calibration_inputs);
+	  for (auto& name: job.calibration.inputs) {
+	       if (!request.get(name)) {
+		    send_error("invalid request");
+		    return;
+	       }
+	  }
+	  if (!request.get(flags) || !request.get(memory_expansion)) {
+	       send_error("invalid request");
+	       return;
+	  }
+	  job.profile = (flags & internal::PROFILE_FLAG) != 0;
+	  job.count_hardware_events = (flags & internal::HARDWARE_EVENTS_FLAG) != 0;
+	  if (flags & internal::COPIES_FLAG) {
+	       job.copies = std::make_shared<BartCopyAccounting>();
+	  }
+	  job.memory_expansion = static_cast<float>(memory_expansion) / 1000;
+
+	  if (remaining != internal::NO_DEADLINE) {
+	       job.schedule.deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(remaining);
+	  }
+	  job.schedule.priority = static_cast<int>(static_cast<int64_t>(priority));
+
+	  // Tenants configured on the daemon keep their settings, the others get what their client asks for within the limits
+	  if (configured_tenants_.count(job.schedule.tenant) == 0) {
+	       BartFairShare::Quota quota;
+	       quota.cpu_seconds = internal::capped_quota(cpu_quota / 1000., max_tenant_quota_.cpu_seconds);
+	       quota.memory_bytes = internal::capped_quota(static_cast<size_t>(memory_quota), max_tenant_quota_.memory_bytes);
+	       BartFairShare::get().set_tenant(job.schedule.tenant, std::min(weight / 1000., max_tenant_weight_), quota);
+	  }
+
+	  // Admission and execution
+	  job.cancellation = std::make_shared<BartCancellationToken>();
+	  job.progress = std::make_shared<BartJobProgress>();
+	  auto watcher = std::make_unique<internal::HangupWatcher>(fd, job.cancellation, job.progress);
+
+	  // Jobs sent again by any chain of the node are served without running BART
+	  const auto use_result_cache = BartResultCache::get().is_enabled();
+	  const auto result_key = use_result_cache ? hash_bart_job(job) : 0;
+	  auto cached = use_result_cache ? BartResultCache::get().lookup(result_key) : nullptr;
+	  if (cached && (cached->dims.size() != 16
+			 || std::accumulate(cached->dims.begin(), cached->dims.end(), size_t(1), std::multiplies<size_t>()) != cached->data.size())) {
+	       // Eg. the images of the same job cached by a gadget sharing the directory of the cache
+	       cached.reset();
+	  }
+
+	  auto start = std::chrono::steady_clock::now();
+	  SharedMemorySegment output_segment;
+	  BartJobOutput output;
+	  bool ok(false);
+	  if (cached) {
+	       // The cache keeps the dimensions of the output of the script, reformatted as by BartJobRunner::finish()
+	       output.script_dims.assign(cached->dims.begin(), cached->dims.end());
+	       output.dims = output.script_dims;
+	       output.dims[4] = output.script_dims[9] * output.script_dims[4];
+	       output.dims[9] = 1;
+	       const auto bytes = cached->data.size() * sizeof(std::complex<float>);
+	       ok = output_segment.create(internal::unique_segment_name("out"), bytes);
+	       if (ok) {
+		    std::memcpy(output_segment.data(), cached->data.data(), bytes);
+	       }
+	  }
+	  else {
+	       const auto reserved = estimate_job_memory(job);
+	       const auto reservation = BartFairShare::get().reserve(job.schedule.tenant, reserved, job.cancellation.get());
+	       if (!reservation || !reserve_memory(reserved, job)) {
+		    return;
+	       }
+
+	       {
+		    auto bart = BartInstancePool::get().acquire(job.schedule, job.cancellation.get());
+		    internal::MemCflGuard mem_guard(bart);
+
+		    ok = bart && run_bart_job(bart, job, output);
+		    if (ok) {
+			 const auto bytes = internal::get_number_of_bytes(output.dims);
+			 ok = output_segment.create(internal::unique_segment_name("out"), bytes);
+			 if (ok) {
+			      std::memcpy(output_segment.data(), output.data, bytes);
+			 }
+			 if (ok && use_result_cache) {
+			      auto result = std::make_shared<BartResultCache::Result>();
+			      result->dims.assign(output.script_dims.begin(), output.script_dims.end());
+			      result->data.assign(output.data, output.data + bytes / sizeof(std::complex<float>));
+			      BartResultCache::get().insert(result_key, std::move(result));
+			 }
+		    }
+	       }
+	       release_memory(reserved);
+	  }
+
+	  // The client acknowledges the reply, which is no hang up
+	  watcher.reset();
+	  if (is_cancelled(job)) {
+	       GDEBUG("BART daemon job cancelled\n");
+	       return;
+	  }
+	  if (!ok) {
+	       send_error("BART job failed");
+	       return;
+	  }
+
+	  GDEBUG("BART daemon job done in %ld ms\n",
+		 std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count());
+
+	  internal::MessageWriter response;
+	  response.put(static_cast<uint64_t>(0));
+	  response.put(std::string());
+	  response.put(output.script_dims);
+	  response.put(output.dims);
+	  response.put(output_segment.name());
+	  const auto stages = job.copies ? job.copies->stages() : std::vector<std::pair<std::string, BartCopyAccounting::Counters>>();
+	  response.put(static_cast<uint64_t>(stages.size()));
+	  for (const auto& stage: stages) {
+	       response.put(stage.first);
+	       response.put(stage.second.allocated);
+	       response.put(stage.second.copied);
+	       response.put(stage.second.zeroed);
+	  }
+
+	  // The name of the segment goes once the client mapped it, or hung up without doing so: nothing is left behind
+	  pollfd pfd{fd, POLLIN, 0};
+	  std::string ack;
+	  if (!internal::send_message(fd, response.str()) || ::poll(&pfd, 1, internal::OUTPUT_ACK_TIMEOUT_MS) <= 0
+	      || !internal::receive_message(fd, ack) || ack != "mapped") {
+	       GDEBUG("BART daemon client did not map its output, removing it\n");
+	  }
+     }
+}
+
+#else
+
+namespace Gadgetron {
+
+     SharedMemorySegment::SharedMemorySegment(SharedMemorySegment&&) noexcept {}
+     SharedMemorySegment& SharedMemorySegment::operator=(SharedMemorySegment&&) noexcept { return *this; }
+     SharedMemorySegment::~SharedMemorySegment() {}
+     void SharedMemorySegment::reset() {}
+     bool SharedMemorySegment::create(const std::string&, size_t) { return false; }
+     bool SharedMemorySegment::open(const std::string&, size_t, bool) { return false; }
+
+     bool BartDaemonClient::submit(const BartJob&, BartDaemonReply&)
+     {
+	  GERROR("The BART daemon is not supported on this platform\n");
+	  return false;
+     }
+}
+
+#endif /* !_WIN32 */
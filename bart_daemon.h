@@ -0,0 +1,136 @@
+/****************************************************************************************************************************
+ * Description: Local BART reconstruction daemon shared by several Gadgetron chains
+ *
+ * Instead of running BART within each gadget, the BartGadget may submit its jobs
+ * to one long-lived daemon (gadgetron_bart_daemon) over a Unix domain socket.
+ * The input and output arrays are exchanged through POSIX shared memory, only
+ * the job description goes through the socket.
+ * The daemon owns the BART instances and the memory budget of the whole node
+ * and admits the jobs of all its clients earliest deadline first (or by fair
+ * share of the tenants of the jobs, see BartFairShare). The weights and quotas
+ * of the tenants are those configured on the daemon, or those requested by the
+ * clients within the limits of the daemon.
+ * The calibration store and the result cache of the daemon (when configured)
+ * are shared by all its clients, the accounting of the copies made within the
+ * daemon is sent back to the client with the result.
+ * Only the user of the daemon (or root, or the members of the group it allows)
+ * may connect, and only to run BART tools on the in-memory CFLs of its jobs:
+ * command lines with paths or file format tools (eg. toimg) are rejected.
+ ****************************************************************************************************************************/
+
+#ifndef BART_DAEMON_H
+#define BART_DAEMON_H
+
+#include "bart_executor.h"
+#include "bart_fair_share.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <set>
+#include <string>
+
+namespace Gadgetron {
+
+     //! POSIX shared memory segment mapped into the address space of the process
+     class SharedMemorySegment
+     {
+     public:
+	  SharedMemorySegment() = default;
+	  SharedMemorySegment(SharedMemorySegment&& other) noexcept;
+	  SharedMemorySegment& operator=(SharedMemorySegment&& other) noexcept;
+	  SharedMemorySegment(const SharedMemorySegment&) = delete;
+	  SharedMemorySegment& operator=(const SharedMemorySegment&) = delete;
+	  ~SharedMemorySegment();
+
+	  //! Create a new segment (the name is removed again when the segment is destroyed)
+	  bool create(const std::string& name, size_t bytes);
+	  //! Map an existing segment (the name is only removed if take_ownership is true)
+	  bool open(const std::string& name, size_t bytes, bool take_ownership);
+
+	  void* data() const { return data_; }
+	  size_t size() const { return size_; }
+	  const std::string& name() const { return name_; }
+
+     private:
+	  void reset();
+
+	  std::string name_;
+	  void* data_ = nullptr;
+	  size_t size_ = 0;
+	  bool is_owner_ = false;
+     };
+
+     //! Result of a job executed by the daemon
+     struct BartDaemonReply
+     {
+	  BartJobOutput output;			//!< output.data points into segment
+	  SharedMemorySegment segment;
+     };
+
+     class BartDaemonClient
+     {
+     public:
+	  explicit BartDaemonClient(std::string socket_path) : socket_path_(std::move(socket_path)) {}
+
+	  //! Submit a job to the daemon and wait for its completion
+	  /*!
+	   * The inputs are released as soon as they are staged into shared memory.
+	   */
+	  bool submit(const BartJob& job, BartDaemonReply& reply);
+
+     private:
+	  std::string socket_path_;
+     };
+
+     class BartDaemon
+     {
+     public:
+	  /*!
+	   * \param socket_path          Path of the Unix domain socket to listen on
+	   * \param memory_budget_bytes  Memory the running jobs may use, as estimated by estimate_job_memory() (0 for unlimited)
+	   */
+	  BartDaemon(std::string socket_path, size_t memory_budget_bytes);
+	  ~BartDaemon();
+
+	  //! Weight and quotas of a tenant, overriding the ones requested by the clients (before run())
+	  void set_tenant(const std::string& tenant, double weight, const BartFairShare::Quota& quota);
+
+	  //! Group whose members may submit jobs as well, besides the user of the daemon (before run())
+	  void set_allowed_group(long gid);
+
+	  //! Largest weight and quotas (0 for none) the clients may request for the other tenants (before run())
+	  void set_tenant_limits(double max_weight, const BartFairShare::Quota& max_quota);
+
+	  //! Serve jobs until stop() is called
+	  bool run();
+
+	  //! Stop accepting new jobs (async-signal-safe)
+	  void stop();
+
+     private:
+	  void serve(int fd);
+	  bool is_allowed_peer(int fd) const;
+	  bool reserve_memory(size_t bytes, const BartJob& job);
+	  void release_memory(size_t bytes);
+
+	  const std::string socket_path_;
+	  const size_t memory_budget_;
+	  std::set<std::string> configured_tenants_;
+	  long allowed_gid_ = -1;		//!< -1 for none
+	  double max_tenant_weight_ = 1;
+	  BartFairShare::Quota max_tenant_quota_;
+	  std::atomic<int> listen_fd_;
+	  std::atomic<bool> is_stopping_;
+
+	  std::mutex mtx_;
+	  std::condition_variable cv_;
+	  size_t memory_in_use_ = 0;
+	  BartInstancePool::Waiting waiting_;
+	  uint64_t next_arrival_ = 0;
+	  size_t active_connections_ = 0;
+     };
+} // namespace Gadgetron
+
+#endif //BART_DAEMON_H
@@ -0,0 +1,137 @@
+/****************************************************************************************************************************
+ * Description: Helpers shared by the on-disk caches of BART results
+ ****************************************************************************************************************************/
+
+#include "bart_disk_cache.h"
+#include "log.h"
+#include <algorithm>
+#include <boost/filesystem.hpp>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#include <io.h>
+#endif /* !_WIN32 */
+
+#if defined(__linux__)
+#include <sys/vfs.h>
+#endif /* __linux__ */
+
+namespace internal {
+     // Entries shared by several hosts could be modified under our feet (or mappings)
+     bool is_local_file_system(const std::string& directory)
+     {
+#if defined(__linux__)
+	  struct statfs fs;
+	  if (statfs(directory.c_str(), &fs) != 0)
+	       return false;
+	  switch (static_cast<unsigned long>(fs.f_type)) {
+	  case 0x6969UL:	// NFS
+	  case 0x517BUL:	// SMB
+	  case 0xFF534D42UL:	// CIFS
+	  case 0xFE534D42UL:	// SMB2
+	  case 0x65735546UL:	// FUSE (sshfs, ...)
+	  case 0x01021997UL:	// 9P
+	  case 0x47504653UL:	// GPFS
+	  case 0x0BD00BD0UL:	// Lustre
+	       return false;
+	  default:
+	       return true;
+	  }
+#else
+	  return true;
+#endif /* __linux__ */
+     }
+}
+
+namespace Gadgetron {
+
+     bool prepare_cache_directory(const std::string& directory)
+     {
+	  boost::system::error_code ec;
+	  boost::filesystem::create_directories(directory, ec);
+	  if (!boost::filesystem::is_directory(directory)) {
+	       GERROR("Unable to create cache directory %s\n", directory.c_str());
+	       return false;
+	  }
+	  if (!internal::is_local_file_system(directory)) {
+	       GERROR("Cache directory %s must be on a local file system\n", directory.c_str());
+	       return false;
+	  }
+	  return true;
+     }
+
+     void evict_least_recently_used(const std::string& directory, const std::string& extension, uintmax_t max_bytes)
+     {
+	  struct Item { std::time_t last_use; uintmax_t size; boost::filesystem::path path; };
+	  std::vector<Item> items;
+	  uintmax_t total(0);
+	  boost::system::error_code ec;
+	  for (boost::filesystem::directory_iterator it(directory, ec), end; !ec && it != end; it.increment(ec)) {
+	       if (it->path().extension() != extension)
+		    continue;
+	       Item item{boost::filesystem::last_write_time(it->path(), ec), boost::filesystem::file_size(it->path(), ec), it->path()};
+	       if (ec)
+		    continue;
+	       total += item.size;
+	       items.push_back(std::move(item));
+	  }
+
+	  std::sort(items.begin(), items.end(), [](const Item& a, const Item& b) { return a.last_use < b.last_use; });
+	  for (const auto& item: items) {
+	       if (total <= max_bytes)
+		    break;
+	       GDEBUG("Evicting %s\n", item.path.string().c_str());
+	       boost::filesystem::remove(item.path, ec);
+	       total -= item.size;
+	  }
+     }
+
+     void touch_cache_file(const std::string& path)
+     {
+#ifndef _WIN32
+	  utimensat(AT_FDCWD, path.c_str(), nullptr, 0);
+#else
+	  boost::system::error_code ec;
+	  boost::filesystem::last_write_time(path, std::time(nullptr), ec);
+#endif /* !_WIN32 */
+     }
+
+     std::string cache_file_path(const std::string& directory, uint64_t key, const std::string& extension)
+     {
+	  char name[32];
+	  std::snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(key));
+	  return (boost::filesystem::path(directory) / (name + extension)).string();
+     }
+
+     bool create_temporary_cache_file(const std::string& path, std::string& tmp_path)
+     {
+	  std::vector<char> name(path.begin(), path.end());
+	  const char suffix[] = ".tmpXXXXXX";
+	  name.insert(name.end(), suffix, suffix + sizeof(suffix));
+#ifndef _WIN32
+	  const auto fd = mkstemp(name.data());
+	  if (fd < 0) {
+	       GERROR("Unable to create a temporary file for %s: %s\n", path.c_str(), std::strerror(errno));
+	       return false;
+	  }
+	  // Readable by the other processes sharing the cache, as the entries written directly used to be
+	  fchmod(fd, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	  ::close(fd);
+#else
+	  if (_mktemp_s(name.data(), name.size()) != 0 || !std::ofstream(name.data(), std::ofstream::binary)) {
+	       GERROR("Unable to create a temporary file for %s\n", path.c_str());
+	       return false;
+	  }
+#endif /* !_WIN32 */
+	  tmp_path = name.data();
+	  return true;
+     }
+}
@@ -0,0 +1,29 @@
+/****************************************************************************************************************************
+ * Description: Helpers shared by the on-disk caches of BART results
+ ****************************************************************************************************************************/
+
+#ifndef BART_DISK_CACHE_H
+#define BART_DISK_CACHE_H
+
+#include <cstdint>
+#include <string>
+
+namespace Gadgetron {
+
+     //! Create the directory of a cache, refusing remote file systems (NFS, SMB, FUSE, ...)
+     bool prepare_cache_directory(const std::string& directory);
+
+     //! Remove the least recently used files (by modification time) with this extension until their total size fits
+     void evict_least_recently_used(const std::string& directory, const std::string& extension, uintmax_t max_bytes);
+
+     //! Mark a file as most recently used
+     void touch_cache_file(const std::string& path);
+
+     //! Path of the file of some entry, eg. <directory>/0123456789abcdef.cal
+     std::string cache_file_path(const std::string& directory, uint64_t key, const std::string& extension);
+
+     //! Create an empty file with a unique name next to path (eg. <path>.tmpAb12Cd), to write an entry aside before renaming it
+     bool create_temporary_cache_file(const std::string& path, std::string& tmp_path);
+} // namespace Gadgetron
+
+#endif //BART_DISK_CACHE_H
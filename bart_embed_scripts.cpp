@@ -0,0 +1,85 @@
+/****************************************************************************************************************************
+ * Description: Build step compiling the bundled BART scripts into the gadget library
+ *
+ * Usage: gadgetron_bart_embed_scripts <output.cpp> <script>...
+ *
+ * Each script is read and checked like the BartGadget would (see bart_script.h)
+ * and its commands are written out as a table, looked up by the file name of
+ * the script with find_embedded_bart_script(). The build fails on the first
+ * invalid script.
+ ****************************************************************************************************************************/
+
+#include "bart_script.h"
+#include <boost/filesystem.hpp>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+namespace internal {
+     std::string quote(const std::string& str)
+     {
+	  std::ostringstream quoted;
+	  quoted << '"';
+	  for (auto c: str) {
+	       if (c == '"' || c == '\\')
+		    quoted << '\\' << c;
+	       else if (c == '\t')
+		    quoted << "\\t";
+	       else
+		    quoted << c;
+	  }
+	  quoted << '"';
+	  return quoted.str();
+     }
+}
+
+int main(int argc, char** argv)
+{
+     if (argc < 3) {
+	  std::cerr << "Usage: " << argv[0] << " <output.cpp> <script>..." << std::endl;
+	  return 1;
+     }
+
+     std::ostringstream tables, index;
+     for (int k = 2; k < argc; ++k) {
+	  const std::string script(argv[k]);
+	  const auto name = boost::filesystem::path(script).filename().string();
+	  std::vector<std::string> commands;
+	  if (!Gadgetron::load_bart_script(script, commands) || !Gadgetron::check_bart_script(name, commands)) {
+	       std::cerr << "Invalid BART script: " << script << std::endl;
+	       return 1;
+	  }
+
+	  tables << "     const char* const BART_EMBEDDED_SCRIPT_" << k - 2 << "[] = {\n";
+	  for (size_t i = 0; i < commands.size(); ++i)
+	       tables << "\t  " << internal::quote(commands[i]) << (i + 1 < commands.size() ? ",\n" : "};\n\n");
+	  index << "\t  {" << internal::quote(name) << ", BART_EMBEDDED_SCRIPT_" << k - 2 << ", " << commands.size() << "}" << (k + 1 < argc ? ",\n" : "};\n");
+     }
+
+     std::ofstream output(argv[1]);
+     output << "// Generated by gadgetron_bart_embed_scripts from the bundled BART scripts, do not edit\n\n"
+	    << "#include \"bart_script.h\"\n#include <cstddef>\n\n"
+	    << "namespace internal {\n"
+	    << tables.str()
+	    << "     struct BartEmbeddedScript\n     {\n\t  const char* name;\n\t  const char* const* commands;\n\t  size_t count;\n     };\n\n"
+	    << "     const BartEmbeddedScript BART_EMBEDDED_SCRIPTS[] = {\n"
+	    << index.str()
+	    << "}\n\n"
+	    << "namespace Gadgetron {\n\n"
+	    << "     bool find_embedded_bart_script(const std::string& name, std::vector<std::string>& commands)\n     {\n"
+	    << "\t  for (const auto& script: internal::BART_EMBEDDED_SCRIPTS) {\n"
+	    << "\t       if (name == script.name) {\n"
+	    << "\t\t    commands.assign(script.commands, script.commands + script.count);\n"
+	    << "\t\t    return true;\n"
+	    << "\t       }\n"
+	    << "\t  }\n"
+	    << "\t  return false;\n"
+	    << "     }\n"
+	    << "} // namespace Gadgetron\n";
+     output.close();
+     if (!output) {
+	  std::cerr << "Unable to write " << argv[1] << std::endl;
+	  return 1;
+     }
+     return 0;
+}
@@ -0,0 +1,1372 @@
+/****************************************************************************************************************************
+ * Description: Execution of BART reconstruction jobs
+ ****************************************************************************************************************************/
+
+#include "bart_executor.h"
+#include "bart_calibration_store.h"
+#include "bart_cfl_registry.h"
+#include "bart_cpu_dispatch.h"
+#include "bart_fair_share.h"
+#include "bart_foreach.h"
+#include "bart_hash.h"
+#include "bart_perf_counters.h"
+#include "bart_permute.h"
+#include "bart_single_flight.h"
+#include "bart_thread_tuner.h"
+#include "log.h"
+#include <algorithm>
+#include <atomic>
+#include <boost/tokenizer.hpp>
+#include <cstring>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <set>
+#include <sstream>
+#include <thread>
+
+namespace internal {
+     using Gadgetron::BartInstancePool;
+     using Gadgetron::BartJob;
+
+     struct ParkedCfl
+     {
+	  std::string name;
+	  std::vector<long> dims;
+	  std::unique_ptr<std::complex<float>[]> data;
+     };
+
+     // Move the intermediate results of a job out of its BART instance, which is given up
+     std::vector<ParkedCfl> park_job(BartInstancePool::Lease& bart, const BartJob& job, const std::set<std::string>& names)
+     {
+	  std::set<std::string> inputs;
+	  for (const auto& input: job.inputs)
+	       inputs.insert(input.name);
+
+	  std::vector<ParkedCfl> parked;
+	  for (const auto& name: names) {
+	       if (inputs.count(name))
+		    continue;
+	       std::vector<long> dims(16, 1);
+	       auto data = static_cast<std::complex<float>*>(bart->load_mem_cfl(name.c_str(), dims.size(), dims.data()));
+	       if (data == nullptr)
+		    continue;
+	       const auto size = std::accumulate(dims.begin(), dims.end(), size_t(1), std::multiplies<size_t>());
+	       ParkedCfl cfl{name, dims, std::make_unique<std::complex<float>[]>(size)};
+	       std::copy(data, data + size, cfl.data.get());
+	       if (job.copies) {
+		    job.copies->allocated("preemption", size * sizeof(std::complex<float>));
+		    job.copies->copied("preemption", size * sizeof(std::complex<float>), true);
+	       }
+	       parked.push_back(std::move(cfl));
+	  }
+	  bart->deallocate_all_mem_cfl();
+
+	  GDEBUG("Preempting BART job: %lu intermediate result(s) parked\n", parked.size());
+	  bart.release();
+	  return parked;
+     }
+
+     // And back into the (possibly different) instance the job got
+     void restore_job(Gadgetron::BartInstance& bart, const BartJob& job, const std::vector<bool>& released, std::vector<ParkedCfl>& parked)
+     {
+	  for (size_t k = 0; k < job.inputs.size(); ++k) {
+	       const auto& input = job.inputs[k];
+	       if (!released[k])
+		    bart.register_mem_cfl_non_managed(input.name.c_str(), input.dims.size(), input.dims.data(), input.data);
+	  }
+	  for (auto& cfl: parked) {
+	       bart.register_mem_cfl_new(cfl.name.c_str(), cfl.dims.size(), cfl.dims.data(), cfl.data.release());
+	  }
+	  parked.clear();
+     }
+
+     // Dimensions of the in-memory CFLs used by a command, eg. "maps[192 192 1 12 4] "
+     std::string describe_operands(Gadgetron::BartCflRegistry& cfls, const std::string& cmdline)
+     {
+	  std::ostringstream operands;
+	  boost::char_separator<char> sep(" ");
+	  boost::tokenizer<boost::char_separator<char> > tokens(cmdline, sep);
+	  auto k(0UL);
+	  for (const auto& tok: tokens) {
+	       const auto cfl = k++ < 2 || tok[0] == '-' ? nullptr : cfls.find(tok);
+	       if (cfl == nullptr)
+		    continue;
+	       const auto& dims = cfl->dims;
+	       auto last = dims.size();
+	       while (last > 1 && dims[last-1] == 1)
+		    --last;
+	       operands << tok << "[";
+	       for (auto i(0UL); i < last; ++i)
+		    operands << (i ? " " : "") << dims[i];
+	       operands << "] ";
+	  }
+	  return operands.str();
+     }
+
+     // Command line with its operands replaced by their dimensions, eg. "fft -u 3 [192 192 1 12] out"
+     std::string command_signature(Gadgetron::BartCflRegistry& cfls, const std::string& cmdline)
+     {
+	  std::vector<std::string> tokens;
+	  boost::char_separator<char> sep(" ");
+	  boost::tokenizer<boost::char_separator<char> > tok(cmdline, sep);
+	  std::copy(tok.begin(), tok.end(), std::back_inserter(tokens));
+
+	  std::ostringstream signature;
+	  for (size_t k = 1; k < tokens.size(); ++k) {
+	       const auto cfl = k >= 2 && k + 1 < tokens.size() && tokens[k][0] != '-' ? cfls.find(tokens[k]) : nullptr;
+	       if (k + 1 == tokens.size() && k >= 2) {
+		    signature << " out";
+	       }
+	       else if (cfl != nullptr) {
+		    const auto& dims = cfl->dims;
+		    auto last = dims.size();
+		    while (last > 1 && dims[last-1] == 1)
+			 --last;
+		    signature << " [";
+		    for (auto i(0UL); i < last; ++i)
+			 signature << (i ? " " : "") << dims[i];
+		    signature << "]";
+	       }
+	       else {
+		    signature << (k > 1 ? " " : "") << tokens[k];
+	       }
+	  }
+	  return signature.str();
+     }
+
+     // Size of an in-memory CFL (0 if there is none with this name)
+     size_t cfl_bytes(Gadgetron::BartCflRegistry& cfls, const std::string& name)
+     {
+	  const auto cfl = name.empty() || name[0] == '-' ? nullptr : cfls.find(name);
+	  return cfl != nullptr ? cfl->bytes() : 0;
+     }
+
+     // Memory traffic of a command, estimated from the sizes of its operands
+     class CommandAccounting
+     {
+     public:
+	  CommandAccounting(Gadgetron::BartCflRegistry& cfls, const std::string& cmdline, Gadgetron::BartCopyAccounting* copies) : cfls_(cfls), copies_(copies)
+	       {
+		    if (!copies_)
+			 return;
+		    boost::char_separator<char> sep(" ");
+		    boost::tokenizer<boost::char_separator<char> > tok(cmdline, sep);
+		    std::copy(tok.begin(), tok.end(), std::back_inserter(tokens_));
+		    for (size_t k = 2; k + 1 < tokens_.size(); ++k)
+			 input_bytes_ += cfl_bytes(cfls_, tokens_[k]);
+	       }
+
+	  // Nothing is allocated for an output written into the buffer of an input
+	  void done(bool is_in_place) const
+	       {
+		    if (copies_ && tokens_.size() > 2)
+			 copies_->command(tokens_[1], input_bytes_, is_in_place ? 0 : cfl_bytes(cfls_, tokens_.back()));
+	       }
+
+     private:
+	  Gadgetron::BartCflRegistry& cfls_;
+	  Gadgetron::BartCopyAccounting* copies_;
+	  std::vector<std::string> tokens_;
+	  size_t input_bytes_ = 0;
+     };
+
+     // Write the permutation of the dimensions of CFL input into a new CFL output: dimension d of output is dimension order[d] of input
+     bool permute_cfl(Gadgetron::BartCflRegistry& cfls, const std::string& tool, std::vector<int> order, const std::string& input, const std::string& output)
+     {
+	  const auto cfl = cfls.find(input);
+	  if (cfl == nullptr) {
+	       GERROR("bart %s: no in-memory CFL named %s\n", tool.c_str(), input.c_str());
+	       return false;
+	  }
+	  const auto& dims = cfl->dims;
+	  for (auto d = static_cast<int>(order.size()); d < static_cast<int>(dims.size()); ++d)
+	       order.push_back(d);
+
+	  const auto size = std::accumulate(dims.begin(), dims.end(), size_t(1), std::multiplies<size_t>());
+	  auto out = std::make_unique<std::complex<float>[]>(size);
+	  if (order.size() != dims.size() || !Gadgetron::permute_dimensions(dims, order, cfl->data, out.get())) {
+	       GERROR("bart %s: the dimensions to permute are not a permutation of 0 to %zu\n", tool.c_str(), dims.size() - 1);
+	       return false;
+	  }
+
+	  std::vector<long> out_dims(dims.size());
+	  for (size_t d = 0; d < dims.size(); ++d)
+	       out_dims[d] = dims[order[d]];
+	  cfls.instance().register_mem_cfl_new(output.c_str(), out_dims.size(), out_dims.data(), out.release());
+	  return true;
+     }
+
+     bool parse_dimension(const std::string& tool, const std::string& token, int& d)
+     {
+	  std::istringstream in(token);
+	  if (!(in >> d) || !in.eof()) {
+	       GERROR("bart %s: invalid dimension %s\n", tool.c_str(), token.c_str());
+	       return false;
+	  }
+	  return true;
+     }
+
+     // bart transpose <dim1> <dim2> <input> <output>: BART's tool, swaps two dimensions
+     bool run_native_transpose(Gadgetron::BartCflRegistry& cfls, const std::vector<std::string>& tokens)
+     {
+	  int dim1, dim2;
+	  if (tokens.size() != 6) {
+	       GERROR("Usage: bart transpose <dim1> <dim2> <input> <output>\n");
+	       return false;
+	  }
+	  if (!parse_dimension("transpose", tokens[2], dim1) || !parse_dimension("transpose", tokens[3], dim2))
+	       return false;
+	  if (dim1 < 0 || dim2 < 0 || dim1 >= 16 || dim2 >= 16) {
+	       GERROR("bart transpose: the dimensions to swap are not in 0 to 15\n");
+	       return false;
+	  }
+
+	  std::vector<int> order(std::max(dim1, dim2) + 1);
+	  std::iota(order.begin(), order.end(), 0);
+	  std::swap(order[dim1], order[dim2]);
+	  return permute_cfl(cfls, "transpose", order, tokens[4], tokens[5]);
+     }
+
+     // bart permute <order...> <input> <output>: not a BART tool, dimension d of the output is dimension order[d] of the input (the missing ones are kept)
+     bool run_native_permute(Gadgetron::BartCflRegistry& cfls, const std::vector<std::string>& tokens)
+     {
+	  if (tokens.size() < 5) {
+	       GERROR("Usage: bart permute <order...> <input> <output>\n");
+	       return false;
+	  }
+
+	  std::vector<int> order;
+	  for (size_t k = 2; k + 2 < tokens.size(); ++k) {
+	       int d;
+	       if (!parse_dimension("permute", tokens[k], d))
+		    return false;
+	       order.push_back(d);
+	  }
+	  return permute_cfl(cfls, "permute", order, tokens[tokens.size() - 2], tokens.back());
+     }
+
+     std::vector<std::string> split_command_line(const std::string& cmdline)
+     {
+	  std::vector<std::string> tokens;
+	  boost::char_separator<char> sep(" ");
+	  boost::tokenizer<boost::char_separator<char> > tok(cmdline, sep);
+	  std::copy(tok.begin(), tok.end(), std::back_inserter(tokens));
+	  return tokens;
+     }
+
+     // Complex scale factor as written for BART, eg. "2", "-0.5", "1+2i" or "3i"
+     bool parse_complex(const std::string& token, std::complex<float>& value)
+     {
+	  std::istringstream in(token);
+	  float re(0), im(0);
+	  if (!(in >> re))
+	       return false;
+	  if (in.peek() == 'i') {
+	       in.get();
+	       im = re;
+	       re = 0;
+	  }
+	  else if (!in.eof() && (!(in >> im) || in.get() != 'i')) {
+	       return false;
+	  }
+	  value = std::complex<float>(re, im);
+	  return in.peek() == std::char_traits<char>::eof();
+     }
+
+     // BART commands computing each element of their output from the same element of their inputs
+     struct ElementwiseCommand
+     {
+	  enum class Op { scale, conj, saxpy, fmac } op;
+	  std::complex<float> factor = 1;
+	  bool conj_second = false;
+	  std::vector<std::string> inputs;
+	  std::string output;
+     };
+
+     // bart scale <factor> <input> <output>, bart conj <input> <output>, bart saxpy <factor> <input1> <input2> <output>
+     // and bart fmac [-C] <input1> <input2> <output> (the other options of fmac are left to BART)
+     bool parse_elementwise_command(const std::vector<std::string>& tokens, ElementwiseCommand& command)
+     {
+	  if (tokens.size() < 4 || tokens[0] != "bart")
+	       return false;
+	  const auto& tool = tokens[1];
+	  command.output = tokens.back();
+	  if (tool == "scale" && tokens.size() == 5) {
+	       command.op = ElementwiseCommand::Op::scale;
+	       command.inputs = {tokens[3]};
+	       return parse_complex(tokens[2], command.factor);
+	  }
+	  if (tool == "conj" && tokens.size() == 4) {
+	       command.op = ElementwiseCommand::Op::conj;
+	       command.inputs = {tokens[2]};
+	       return tokens[2][0] != '-';
+	  }
+	  if (tool == "saxpy" && tokens.size() == 6) {
+	       command.op = ElementwiseCommand::Op::saxpy;
+	       command.inputs = {tokens[3], tokens[4]};
+	       return parse_complex(tokens[2], command.factor);
+	  }
+	  if (tool == "fmac" && (tokens.size() == 5 || (tokens.size() == 6 && tokens[2] == "-C"))) {
+	       command.op = ElementwiseCommand::Op::fmac;
+	       command.conj_second = tokens.size() == 6;
+	       command.inputs = {tokens[tokens.size() - 3], tokens[tokens.size() - 2]};
+	       return command.inputs[0][0] != '-';
+	  }
+	  return false;
+     }
+
+     // The output goes into the buffer of the first input among those the job no longer needs (see dead_operands()), if any
+     bool run_native_elementwise(Gadgetron::BartCflRegistry& cfls, const std::string& cmdline, const ElementwiseCommand& command,
+				 const std::set<std::string>& consumable, bool& is_in_place)
+     {
+	  const auto tool = split_command_line(cmdline)[1];
+	  std::vector<long> dims;
+	  std::vector<std::complex<float>*> data;
+	  for (const auto& name: command.inputs) {
+	       const auto cfl = cfls.find(name);
+	       if (cfl == nullptr) {
+		    GERROR("bart %s: no in-memory CFL named %s\n", tool.c_str(), name.c_str());
+		    return false;
+	       }
+	       if (!data.empty() && cfl->dims != dims) {
+		    if (command.op == ElementwiseCommand::Op::fmac) {
+			 GDEBUG("bart fmac: inputs of different dimensions, left to BART\n");
+			 return Gadgetron::call_BART(cfls.instance(), cmdline);
+		    }
+		    GERROR("bart %s: the inputs have different dimensions\n", tool.c_str());
+		    return false;
+	       }
+	       dims = cfl->dims;
+	       data.push_back(cfl->data);
+	  }
+
+	  const auto size = std::accumulate(dims.begin(), dims.end(), size_t(1), std::multiplies<size_t>());
+	  std::unique_ptr<std::complex<float>[]> buffer;
+	  std::complex<float>* out = nullptr;
+	  for (size_t k = 0; k < command.inputs.size() && out == nullptr; ++k)
+	       if (consumable.count(command.inputs[k]))
+		    out = data[k];
+	  is_in_place = out != nullptr;
+	  if (!is_in_place) {
+	       buffer = std::make_unique<std::complex<float>[]>(size);
+	       out = buffer.get();
+	  }
+
+	  const auto& kernels = Gadgetron::bart_kernels();
+	  switch (command.op) {
+	  case ElementwiseCommand::Op::scale:
+	       kernels.scale(command.factor, data[0], size, out);
+	       break;
+	  case ElementwiseCommand::Op::conj:
+	       kernels.conjugate(data[0], size, out);
+	       break;
+	  case ElementwiseCommand::Op::saxpy:
+	       kernels.saxpy(command.factor, data[0], data[1], size, out);
+	       break;
+	  case ElementwiseCommand::Op::fmac:
+	       kernels.multiply(data[0], data[1], command.conj_second, size, out);
+	       break;
+	  }
+
+	  // Both names refer to the buffer from now on, it goes with the CFL owning it
+	  if (is_in_place)
+	       cfls.instance().register_mem_cfl_non_managed(command.output.c_str(), dims.size(), dims.data(), out);
+	  else
+	       cfls.instance().register_mem_cfl_new(command.output.c_str(), dims.size(), dims.data(), buffer.release());
+	  return true;
+     }
+
+     // Commands run by the gadget itself rather than by BART
+     bool is_native_command(const std::string& cmdline)
+     {
+	  ElementwiseCommand command;
+	  return cmdline.compare(0, 13, "bart permute ") == 0 || cmdline.compare(0, 15, "bart transpose ") == 0 ||
+		 parse_elementwise_command(split_command_line(cmdline), command);
+     }
+
+     bool call_native_command(Gadgetron::BartCflRegistry& cfls, const std::string& cmdline, const std::set<std::string>& consumable, bool& is_in_place)
+     {
+	  GDEBUG_STREAM("Executing native command (instance " << cfls.instance().index << "): " << cmdline);
+	  const auto tokens = split_command_line(cmdline);
+	  is_in_place = false;
+	  ElementwiseCommand command;
+	  if (parse_elementwise_command(tokens, command))
+	       return run_native_elementwise(cfls, cmdline, command, consumable, is_in_place);
+	  if (tokens[1] == "transpose")
+	       return run_native_transpose(cfls, tokens);
+	  return run_native_permute(cfls, tokens);
+     }
+
+     // Run a command with the number of threads chosen by the tuner, native commands may write into the buffers of the consumable operands
+     bool call_BART_tuned(Gadgetron::BartCflRegistry& cfls, const std::string& cmdline, const BartJob& job, const std::set<std::string>& consumable = std::set<std::string>())
+     {
+	  auto& bart = cfls.instance();
+	  const CommandAccounting accounting(cfls, cmdline, job.copies.get());
+	  auto& tuner = Gadgetron::BartThreadTuner::get();
+	  const auto signature = command_signature(cfls, cmdline);
+	  const auto is_native = is_native_command(cmdline);
+	  const auto decision = bart.set_num_threads && !is_native ? tuner.choose(signature) : Gadgetron::BartThreadTuner::Decision();
+
+	  const auto default_threads = decision.threads > 0 ? bart.get_max_threads() : 0;
+	  if (decision.threads > 0)
+	       bart.set_num_threads(decision.threads);
+
+	  Gadgetron::BartPerfCounters counters;
+	  const auto is_counting = job.count_hardware_events && counters.start(bart);
+
+	  const auto start = std::chrono::steady_clock::now();
+	  auto is_in_place = false;
+	  const auto ok = is_native ? call_native_command(cfls, cmdline, consumable, is_in_place) : Gadgetron::call_BART(bart, cmdline);
+	  const auto elapsed = std::chrono::steady_clock::now() - start;
+
+	  // A command may register any of its operands (eg. the two outputs of ecalib)
+	  const auto tokens = split_command_line(cmdline);
+	  for (size_t k = 2; k < tokens.size(); ++k)
+	       cfls.invalidate(tokens[k]);
+
+	  const auto events = is_counting ? counters.stop() : Gadgetron::BartPerfSample();
+	  if (ok) {
+	       accounting.done(is_in_place);
+	       Gadgetron::BartPerfProfile::get().add(signature.substr(0, signature.find(' ')), events);
+	  }
+
+	  if (decision.threads > 0) {
+	       bart.set_num_threads(default_threads);
+	       if (ok)
+		    tuner.record(signature, decision.threads, elapsed);
+	  }
+
+	  // CPU time of the tenant, assuming all the threads busy
+	  const auto threads = is_native ? 1 : decision.threads > 0 ? decision.threads : bart.get_max_threads ? bart.get_max_threads() : 1;
+	  Gadgetron::BartFairShare::get().charge(job.schedule.tenant, threads * std::chrono::duration<double>(elapsed).count());
+
+	  if (job.profile) {
+	       GINFO("BART profile: %s | %s | %.1f ms%s\n", signature.c_str(),
+		     decision.threads == 0 ? "default threads" : (std::to_string(decision.threads) + (decision.is_trial ? " threads (tuning)" : " threads (tuned)")).c_str(),
+		     std::chrono::duration<double, std::milli>(elapsed).count(), events.valid ? (" | " + events.describe()).c_str() : "");
+	  }
+	  return ok;
+     }
+
+     // Memory of the in-memory CFLs of a job, accounted to its tenant until the end of the job
+     class JobMemory
+     {
+     public:
+	  explicit JobMemory(const BartJob& job) : job_(job), is_enabled_(!job.schedule.tenant.empty() && Gadgetron::BartFairShare::get().is_enabled()) {}
+	  ~JobMemory() { set(0); }
+
+	  // The inputs count until they are released, the buffers shared by several CFLs (see dead_operands()) once
+	  void update(Gadgetron::BartCflRegistry& cfls, const std::set<std::string>& names, const std::vector<bool>& released)
+	  {
+	       if (!is_enabled_)
+		    return;
+	       auto live = names;
+	       for (size_t k = 0; k < job_.inputs.size(); ++k) {
+		    if (released[k])
+			 live.erase(job_.inputs[k].name);
+		    else
+			 live.insert(job_.inputs[k].name);
+	       }
+	       size_t bytes(0);
+	       std::set<const void*> buffers;
+	       for (const auto& name: live) {
+		    const auto cfl = name[0] == '-' ? nullptr : cfls.find(name);
+		    if (cfl != nullptr && buffers.insert(cfl->data).second)
+			 bytes += cfl->bytes();
+	       }
+	       set(bytes);
+	  }
+
+     private:
+	  void set(size_t bytes)
+	  {
+	       if (!is_enabled_ || bytes == bytes_)
+		    return;
+	       Gadgetron::BartFairShare::get().update_memory(job_.schedule.tenant, bytes_, bytes);
+	       bytes_ = bytes;
+	  }
+
+	  const BartJob& job_;
+	  const bool is_enabled_;
+	  size_t bytes_ = 0;
+     };
+
+     // Tokens of a command line that may refer to in-memory CFLs
+     void add_cfl_candidates(const std::string& cmdline, std::set<std::string>& names)
+     {
+	  boost::char_separator<char> sep(" ");
+	  boost::tokenizer<boost::char_separator<char> > tokens(cmdline, sep);
+	  auto k(0UL);
+	  for (const auto& tok: tokens) {
+	       // skip "bart <command>" and options
+	       if (k++ >= 2 && tok[0] != '-')
+		    names.insert(tok);
+	  }
+     }
+
+     // Number of commands of the job to run before each input is no longer read (0 if none reads it)
+     std::vector<size_t> input_last_use(const BartJob& job)
+     {
+	  std::vector<size_t> last_use(job.inputs.size(), 0);
+	  for (size_t i = 0; i < job.commands.size(); ++i) {
+	       std::set<std::string> tokens;
+	       add_cfl_candidates(job.commands[i], tokens);
+	       for (size_t k = 0; k < job.inputs.size(); ++k)
+		    if (tokens.count(job.inputs[k].name))
+			 last_use[k] = i + 1;
+	  }
+	  // The output is read after the last command
+	  for (size_t k = 0; k < job.inputs.size(); ++k)
+	       if (job.inputs[k].name == job.output)
+		    last_use[k] = job.commands.size() + 1;
+	  return last_use;
+     }
+
+     // Number of commands of the job to run before the last one reading and writing each CFL (by handle, 0 if none),
+     // and the CFLs needed whatever the commands
+     struct CflLiveness
+     {
+	  std::vector<size_t> last_read;
+	  std::vector<size_t> last_write;
+	  std::vector<bool> pinned;		// the inputs (borrowed), the output and the calibration results
+
+	  void pin(Gadgetron::BartCflRegistry::Handle handle)
+	  {
+	       if (pinned.size() <= handle)
+		    pinned.resize(handle + 1, false);
+	       pinned[handle] = true;
+	  }
+
+	  // Whether no command after command i reads or writes the CFL
+	  bool is_dead_after(Gadgetron::BartCflRegistry::Handle handle, size_t i) const
+	  {
+	       return (handle >= pinned.size() || !pinned[handle]) && (handle >= last_read.size() || last_read[handle] <= i + 1)
+		    && (handle >= last_write.size() || last_write[handle] <= i + 1);
+	  }
+     };
+
+     // Resolved once for all the commands, the commands of the foreach blocks counting as commands of the job: a CFL read
+     // by a block is live until its end
+     CflLiveness cfl_liveness(const BartJob& job, Gadgetron::BartCflRegistry& cfls)
+     {
+	  CflLiveness liveness;
+	  auto use = [&](std::vector<size_t>& last, const std::string& name, size_t i)
+	       {
+		    const auto handle = cfls.intern(name);
+		    if (last.size() <= handle)
+			 last.resize(handle + 1, 0);
+		    last[handle] = i + 1;
+	       };
+	  for (size_t i = 0; i < job.commands.size(); ++i) {
+	       const auto tokens = split_command_line(job.commands[i]);
+	       const auto is_end = Gadgetron::is_end_directive(job.commands[i]);
+	       const auto is_directive = is_end || Gadgetron::is_foreach_directive(job.commands[i]);
+	       for (size_t k = is_directive ? 1 : 2; k < tokens.size(); ++k) {
+		    if (tokens[k][0] == '-' && !is_directive)
+			 continue;
+		    if (is_end || (!is_directive && k + 1 == tokens.size()))
+			 use(liveness.last_write, tokens[k], i);
+		    else
+			 use(liveness.last_read, tokens[k], i);
+	       }
+	  }
+	  for (const auto& input: job.inputs)
+	       liveness.pin(cfls.intern(input.name));
+	  // A job without any command is rejected when started
+	  if (!job.output.empty() || !job.commands.empty())
+	       liveness.pin(cfls.intern(job.output.empty() ? Gadgetron::get_output_filename(job.commands.back()) : job.output));
+	  return liveness;
+     }
+
+     // Operands of command i whose buffer its output may go into, copy on write: no CFL sharing the buffer is needed afterwards
+     std::set<std::string> dead_operands(Gadgetron::BartCflRegistry& cfls, const std::string& cmdline, size_t i, const CflLiveness& liveness,
+					 const std::set<std::string>& names)
+     {
+	  std::set<std::string> dead;
+	  const auto tokens = split_command_line(cmdline);
+	  for (size_t k = 2; k + 1 < tokens.size(); ++k) {
+	       const auto& operand = tokens[k];
+	       const auto cfl = operand[0] == '-' ? nullptr : cfls.find(operand);
+	       if (cfl == nullptr || operand == tokens.back() || !liveness.is_dead_after(cfls.intern(operand), i))
+		    continue;
+	       const auto data = cfl->data;
+	       const auto is_shared = std::any_of(names.begin(), names.end(), [&](const std::string& name)
+						  {
+						       if (name == operand || name[0] == '-')
+							    return false;
+						       const auto handle = cfls.intern(name);
+						       const auto other = cfls.find(handle);
+						       return other != nullptr && other->data == data && !liveness.is_dead_after(handle, i);
+						  });
+	       if (!is_shared)
+		    dead.insert(operand);
+	  }
+	  return dead;
+     }
+
+     // Release the inputs no longer read once the first done commands of the job have run
+     void release_inputs(const BartJob& job, const std::vector<size_t>& last_use, size_t done, std::vector<bool>& released)
+     {
+	  for (size_t k = 0; k < job.inputs.size(); ++k) {
+	       const auto& input = job.inputs[k];
+	       if (released[k] || !input.release || last_use[k] > done)
+		    continue;
+	       GDEBUG("Releasing input %s after %lu command(s)\n", input.name.c_str(), done);
+	       input.release();
+	       released[k] = true;
+	  }
+     }
+
+     // Run the body of a foreach block once per slice, on the instance of the job and on the idle ones, and join the outputs
+     bool run_foreach(Gadgetron::BartCflRegistry& cfls, const Gadgetron::BartForeachBlock& block, const BartJob& job)
+     {
+	  auto& bart = cfls.instance();
+	  struct Operand
+	  {
+	       std::string name;
+	       std::vector<long> dims;
+	       std::complex<float>* data;
+	  };
+
+	  // Resolved before any other instance runs, the instance of the job is busy afterwards
+	  std::vector<Operand> sliced, shared;
+	  long count(-1);
+	  for (const auto& name: block.sliced) {
+	       const auto cfl = cfls.find(name);
+	       if (cfl == nullptr) {
+		    GERROR("foreach: no in-memory CFL named %s\n", name.c_str());
+		    return false;
+	       }
+	       Operand operand{name, cfl->dims, cfl->data};
+	       if (count >= 0 && operand.dims[block.dim] != count) {
+		    GERROR("foreach: %s has %ld slices along dimension %d, not %ld\n", name.c_str(), operand.dims[block.dim], block.dim, count);
+		    return false;
+	       }
+	       count = operand.dims[block.dim];
+	       sliced.push_back(std::move(operand));
+	  }
+	  if (count <= 0) {
+	       GERROR("foreach: nothing to slice along dimension %d\n", block.dim);
+	       return false;
+	  }
+
+	  std::set<std::string> reads;
+	  for (const auto& cmdline: block.body)
+	       add_cfl_candidates(cmdline, reads);
+	  for (const auto& name: reads) {
+	       const auto cfl = block.locals.count(name) ? nullptr : cfls.find(name);
+	       if (cfl != nullptr)
+		    shared.push_back(Operand{name, cfl->dims, cfl->data});
+	  }
+
+	  const auto limit = std::min(static_cast<size_t>(count), block.max_concurrency > 0 ? block.max_concurrency : static_cast<size_t>(count));
+	  std::vector<BartInstancePool::Lease> helpers;
+	  while (helpers.size() + 1 < limit) {
+	       auto lease = BartInstancePool::get().try_acquire();
+	       if (!lease)
+		    break;
+	       helpers.push_back(std::move(lease));
+	  }
+
+	  struct Joined
+	  {
+	       std::vector<long> dims;
+	       std::unique_ptr<std::complex<float>[]> data;
+	  };
+	  std::vector<Joined> joined(block.outputs.size());
+	  std::mutex joined_mtx;
+
+	  // The private CFLs of each slice get their own names: the runs on the instance of the job stay out of the way of its CFLs
+	  auto run_slice = [&](Gadgetron::BartInstance& instance, bool is_job_instance, long index)
+	       {
+		    Gadgetron::BartCflRegistry slice_cfls(instance);
+		    std::vector<std::unique_ptr<std::complex<float>[]>> gathered(sliced.size());
+		    for (size_t k = 0; k < sliced.size(); ++k) {
+			 auto dims = sliced[k].dims;
+			 const auto data = Gadgetron::slice_of(dims, block.dim, index, sliced[k].data, gathered[k]);
+			 dims[block.dim] = 1;
+			 if (gathered[k] && job.copies) {
+			      const auto bytes = std::accumulate(dims.begin(), dims.end(), size_t(1), std::multiplies<size_t>()) * sizeof(std::complex<float>);
+			      job.copies->allocated("foreach slicing", bytes);
+			      job.copies->copied("foreach slicing", bytes, false);
+			 }
+			 instance.register_mem_cfl_non_managed(block.slice_name(sliced[k].name, index).c_str(), dims.size(), dims.data(), data);
+		    }
+		    if (!is_job_instance) {
+			 for (const auto& operand: shared)
+			      instance.register_mem_cfl_non_managed(operand.name.c_str(), operand.dims.size(), operand.dims.data(), operand.data);
+		    }
+
+		    auto ok = true;
+		    for (const auto& cmdline: block.slice_commands(index)) {
+			 if (is_cancelled(job)) {
+			      GDEBUG("BART job cancelled before: %s\n", cmdline.c_str());
+			      ok = false;
+			      break;
+			 }
+			 if (job.progress)
+			      job.progress->start_slice_command(index, cmdline, describe_operands(slice_cfls, cmdline));
+			 if (!call_BART_tuned(slice_cfls, cmdline, job)) {
+			      ok = false;
+			      break;
+			 }
+		    }
+
+		    for (size_t k = 0; ok && k < block.outputs.size(); ++k) {
+			 const auto name = block.slice_name(block.outputs[k], index);
+			 const auto cfl = slice_cfls.find(name);
+			 if (cfl == nullptr || cfl->dims[block.dim] != 1) {
+			      GERROR("foreach: output %s of slice %ld is missing or not a single slice along dimension %d\n", block.outputs[k].c_str(), index, block.dim);
+			      ok = false;
+			      break;
+			 }
+			 auto dims = cfl->dims;
+			 dims[block.dim] = count;
+
+			 auto& output = joined[k];
+			 {
+			      std::lock_guard<std::mutex> lock(joined_mtx);
+			      if (!output.data) {
+				   output.dims = dims;
+				   const auto size = std::accumulate(dims.begin(), dims.end(), size_t(1), std::multiplies<size_t>());
+				   output.data = std::make_unique<std::complex<float>[]>(size);
+				   if (job.copies)
+					job.copies->allocated("foreach join", size * sizeof(std::complex<float>));
+			      }
+			      else if (output.dims != dims) {
+				   GERROR("foreach: the slices of output %s have different dimensions\n", block.outputs[k].c_str());
+				   ok = false;
+				   break;
+			      }
+			 }
+			 Gadgetron::insert_slice(dims, block.dim, index, cfl->data, output.data.get());
+			 if (job.copies)
+			      job.copies->copied("foreach join", cfl->bytes(), false);
+		    }
+
+		    if (job.progress)
+			 job.progress->finish_slice(index);
+
+		    // Only the joined outputs outlive the slice, the instance of the job keeps the CFLs of the job
+		    if (is_job_instance) {
+			 for (const auto& name: block.locals) {
+			      const auto slice_name = block.slice_name(name, index);
+			      if (slice_cfls.find(slice_name) != nullptr)
+				   instance.deallocate_mem_cfl(slice_name.c_str());
+			 }
+		    }
+		    else
+			 instance.deallocate_all_mem_cfl();
+		    return ok;
+	       };
+
+	  // Any instance takes the next slice, the outputs are joined in index order whatever the order the slices complete in
+	  std::atomic<long> next(0);
+	  std::atomic<bool> failed(false);
+	  auto run_slices = [&](Gadgetron::BartInstance& instance, bool is_job_instance)
+	       {
+		    for (auto index = next++; index < count && !failed; index = next++)
+			 if (!run_slice(instance, is_job_instance, index))
+			      failed = true;
+	       };
+
+	  GDEBUG("foreach: %ld slice(s) along dimension %d on %lu instance(s)\n", count, block.dim, helpers.size() + 1);
+	  std::vector<std::thread> threads;
+	  for (auto& helper: helpers)
+	       threads.emplace_back(run_slices, std::ref(*helper), false);
+	  run_slices(bart, true);
+	  for (auto& t: threads)
+	       t.join();
+	  if (failed)
+	       return false;
+
+	  for (size_t k = 0; k < block.outputs.size(); ++k) {
+	       bart.register_mem_cfl_new(block.outputs[k].c_str(), joined[k].dims.size(), joined[k].dims.data(), joined[k].data.release());
+	       cfls.invalidate(block.outputs[k]);
+	  }
+	  return true;
+     }
+
+     // Commands of a job only depending on its calibration inputs
+     struct CalibrationPlan
+     {
+	  std::vector<bool> is_calibration;	// for each command
+	  size_t last = 0;			// index of the last calibration command
+	  std::set<std::string> outputs;	// calibration results used by the other commands
+	  uint64_t key = 0;
+	  Gadgetron::BartCalibrationFingerprint fingerprint;
+
+	  bool empty() const { return outputs.empty(); }
+     };
+
+     CalibrationPlan plan_calibration(const BartJob& job)
+     {
+	  CalibrationPlan plan;
+	  if (job.calibration.key.empty() || job.calibration.inputs.empty())
+	       return plan;
+
+	  std::set<std::string> known, calibration;
+	  for (const auto& input: job.inputs)
+	       known.insert(input.name);
+	  for (const auto& name: job.calibration.inputs) {
+	       if (!known.count(name))
+		    return plan;
+	       calibration.insert(name);
+	  }
+
+	  // The output of a command is its last token, its inputs the known CFLs among the others
+	  plan.is_calibration.assign(job.commands.size(), false);
+	  Gadgetron::BartHashBuilder key;
+	  key.add(job.calibration.key);
+	  for (size_t i = 0; i < job.commands.size(); ++i) {
+	       std::set<std::string> tokens;
+	       std::vector<std::string> outputs;
+	       Gadgetron::BartForeachBlock block;
+	       const auto is_block = Gadgetron::is_foreach_directive(job.commands[i]);
+	       if (is_block) {
+		    // Never part of the calibration, a block reads whatever its commands read from outside of it
+		    if (!Gadgetron::parse_foreach_block(job.commands, i, block))
+			 return CalibrationPlan();
+		    for (const auto& cmdline: block.body)
+			 add_cfl_candidates(cmdline, tokens);
+		    for (const auto& name: block.locals)
+			 tokens.erase(name);
+		    tokens.insert(block.sliced.begin(), block.sliced.end());
+		    outputs = block.outputs;
+	       }
+	       else {
+		    add_cfl_candidates(job.commands[i], tokens);
+		    outputs.push_back(Gadgetron::get_output_filename(job.commands[i]));
+		    tokens.erase(outputs.back());
+	       }
+
+	       std::vector<std::string> inputs;
+	       std::copy_if(tokens.begin(), tokens.end(), std::back_inserter(inputs), [&](const std::string& name) { return known.count(name) > 0; });
+	       const auto is_calibration = !is_block && !inputs.empty() && std::all_of(inputs.begin(), inputs.end(), [&](const std::string& name) { return calibration.count(name) > 0; });
+
+	       known.insert(outputs.begin(), outputs.end());
+	       if (is_calibration) {
+		    plan.is_calibration[i] = true;
+		    plan.last = i;
+		    calibration.insert(outputs.back());
+		    key.add(job.commands[i]);
+	       }
+	       else {
+		    for (const auto& name: inputs)
+			 if (calibration.count(name))
+			      plan.outputs.insert(name);
+		    for (const auto& name: outputs)
+			 calibration.erase(name);
+	       }
+	       if (is_block)
+		    i = block.end;
+	  }
+	  const auto output = job.output.empty() ? Gadgetron::get_output_filename(job.commands.back()) : job.output;
+	  if (calibration.count(output))
+	       plan.outputs.insert(output);
+
+	  for (const auto& input: job.inputs) {
+	       if (std::find(job.calibration.inputs.begin(), job.calibration.inputs.end(), input.name) != job.calibration.inputs.end()) {
+		    key.add(input.dims);
+		    plan.fingerprint.add(input.dims, input.data);
+	       }
+	  }
+	  plan.key = key.digest();
+	  return plan;
+     }
+
+     void store_calibration(Gadgetron::BartCflRegistry& cfls, const CalibrationPlan& plan, Gadgetron::BartCopyAccounting* copies)
+     {
+	  std::vector<Gadgetron::BartCalibrationStore::Cfl> stored;
+	  for (const auto& name: plan.outputs) {
+	       const auto cfl = cfls.find(name);
+	       if (cfl == nullptr)
+		    return;
+	       if (copies)
+		    copies->copied("calibration store", cfl->bytes(), true);
+	       stored.push_back(Gadgetron::BartCalibrationStore::Cfl{name, cfl->dims, cfl->data});
+	  }
+	  Gadgetron::BartCalibrationStore::get().insert(plan.key, plan.fingerprint, stored);
+     }
+}
+
+namespace Gadgetron {
+
+     void BartJobProgress::start_command(const std::string& cmdline, const std::string& operands, std::chrono::steady_clock::duration elapsed)
+     {
+	  std::lock_guard<std::mutex> lock(mtx_);
+	  command_ = Command{cmdline, operands, std::chrono::steady_clock::now() - elapsed};
+     }
+
+     void BartJobProgress::start_slice_command(long slice, const std::string& cmdline, const std::string& operands)
+     {
+	  std::lock_guard<std::mutex> lock(mtx_);
+	  slices_[slice] = Command{cmdline, operands, std::chrono::steady_clock::now()};
+     }
+
+     void BartJobProgress::finish_slice(long slice)
+     {
+	  std::lock_guard<std::mutex> lock(mtx_);
+	  slices_.erase(slice);
+     }
+
+     void BartJobProgress::current(std::string& cmdline, std::string& operands, std::chrono::steady_clock::duration& elapsed) const
+     {
+	  std::lock_guard<std::mutex> lock(mtx_);
+	  auto command = &command_;
+	  for (const auto& slice: slices_)
+	       if (command == &command_ || slice.second.start < command->start)
+		    command = &slice.second;
+	  cmdline = command->cmdline;
+	  operands = command->operands;
+	  elapsed = command->cmdline.empty() ? std::chrono::steady_clock::duration::zero() : std::chrono::steady_clock::now() - command->start;
+     }
+
+     // =========================================================================
+
+     bool call_BART(BartInstance& bart, const std::string& cmdline)
+     {
+	  GDEBUG_STREAM("Executing BART command (instance " << bart.index << "): " << cmdline);
+	  enum { MAX_ARGS = 256 };
+
+	  // tokenize the command string into argc/argv (basic, hopefully enough)
+	  int argc(0);
+	  char* argv[MAX_ARGS];
+
+	  auto cmdline_s = std::make_unique<char[]>(cmdline.size()+1);
+	  strcpy(cmdline_s.get(), cmdline.c_str());
+
+	  char *p2 = strtok(cmdline_s.get(), " ");
+	  while (p2 && argc < MAX_ARGS-1)
+	  {
+	       argv[argc++] = p2;
+	       p2 = strtok(0, " ");
+	  }
+	  argv[argc] = nullptr;
+
+	  char out_str[512] = {'\0'};
+	  auto ret(bart.in_mem_bart_main(argc, argv, out_str));
+	  if (ret == 0) {
+	       if (strlen(out_str) > 0) {
+		    GINFO(out_str);
+	       }
+	       return true;
+	  }
+	  else {
+	       GERROR_STREAM("BART command failed with return code: " << ret);
+	       return false;
+	  }
+     }
+
+     std::string get_output_filename(const std::string& bartCommandLine)
+     {
+	  boost::char_separator<char> sep(" ");
+	  std::string outputFile;
+	  boost::tokenizer<boost::char_separator<char> > tokens(bartCommandLine, sep);
+	  for (auto tok: tokens)
+	       outputFile = tok;
+	  return outputFile;
+     }
+
+     struct BartJobRunner::State
+     {
+	  explicit State(const BartJob& job) : job(job), last_use(internal::input_last_use(job)), liveness(internal::cfl_liveness(job, cfls)),
+					       released(job.inputs.size(), false), memory(job) {}
+
+	  const BartJob& job;
+	  BartCflRegistry cfls;			// of the instance the job currently runs on
+	  std::set<std::string> cfl_names;
+	  const std::vector<size_t> last_use;
+	  internal::CflLiveness liveness;
+	  std::vector<bool> released;
+	  internal::JobMemory memory;
+	  internal::CalibrationPlan calibration;
+	  std::shared_ptr<const BartCalibrationStore::Entry> stored_calibration;
+	  BartSingleFlight::Ticket calibration_flight;
+	  std::vector<internal::ParkedCfl> parked;
+	  size_t next = 0;
+     };
+
+     BartJobRunner::BartJobRunner(const BartJob& job) : state_(std::make_unique<State>(job)) {}
+
+     BartJobRunner::~BartJobRunner() = default;
+
+     void BartJobRunner::keep(const std::string& name)
+     {
+	  state_->liveness.pin(state_->cfls.intern(name));
+     }
+
+     bool BartJobRunner::start(BartInstance& bart)
+     {
+	  auto& s = *state_;
+	  if (s.job.commands.empty())
+	  {
+	       GERROR("BART job without any command!\n");
+	       return false;
+	  }
+
+	  s.cfls.rebind(bart);
+	  for (const auto& input: s.job.inputs)
+	  {
+	       bart.register_mem_cfl_non_managed(input.name.c_str(), input.dims.size(), input.dims.data(), input.data);
+	  }
+	  s.memory.update(s.cfls, s.cfl_names, s.released);
+
+	  if (BartCalibrationStore::get().is_enabled())
+	       s.calibration = internal::plan_calibration(s.job);
+	  for (const auto& name: s.calibration.outputs)
+	  {
+	       s.liveness.pin(s.cfls.intern(name));
+	  }
+	  if (!s.calibration.empty())
+	  {
+	       s.stored_calibration = BartCalibrationStore::get().lookup(s.calibration.key, s.calibration.fingerprint);
+	       if (!s.stored_calibration)
+	       {
+		    // The jobs with the same calibration arriving together compute it once
+		    s.calibration_flight = BartSingleFlight::get().join(s.calibration.key);
+		    if (s.calibration_flight.is_leader())
+		    {
+			 // Stored by a flight which just landed
+			 s.stored_calibration = BartCalibrationStore::get().lookup(s.calibration.key, s.calibration.fingerprint);
+			 if (s.stored_calibration)
+			 {
+			      s.calibration_flight.done();
+			 }
+		    }
+	       }
+	       if (s.stored_calibration)
+	       {
+		    use_stored_calibration(bart);
+	       }
+	  }
+
+	  // The calibration fingerprint is taken from the inputs
+	  internal::release_inputs(s.job, s.last_use, 0, s.released);
+	  return true;
+     }
+
+     void BartJobRunner::use_stored_calibration(BartInstance& bart)
+     {
+	  auto& s = *state_;
+	  for (const auto& cfl: s.stored_calibration->cfls)
+	  {
+	       bart.register_mem_cfl_non_managed(cfl.name.c_str(), cfl.dims.size(), cfl.dims.data(), cfl.data);
+	       s.cfls.invalidate(cfl.name);
+	       s.cfl_names.insert(cfl.name);
+	  }
+     }
+
+     bool BartJobRunner::is_done() const
+     {
+	  return state_->next >= state_->job.commands.size();
+     }
+
+     bool BartJobRunner::is_waiting() const
+     {
+	  return !wait(std::chrono::milliseconds(0));
+     }
+
+     bool BartJobRunner::wait(std::chrono::milliseconds timeout) const
+     {
+	  return state_->calibration_flight.wait_for(timeout);
+     }
+
+     bool BartJobRunner::should_yield(const BartInstancePool::Lease& lease) const
+     {
+	  // The jobs waiting for the calibration of this one would wait for it too
+	  if (state_->calibration_flight.is_leader())
+	       return false;
+	  return !state_->cfl_names.empty() && lease.pool().should_yield(state_->job.schedule);
+     }
+
+     void BartJobRunner::park(BartInstancePool::Lease& lease)
+     {
+	  state_->parked = internal::park_job(lease, state_->job, state_->cfl_names);
+     }
+
+     void BartJobRunner::resume(BartInstance& bart)
+     {
+	  state_->cfls.rebind(bart);
+	  internal::restore_job(bart, state_->job, state_->released, state_->parked);
+     }
+
+     bool BartJobRunner::run_next(BartInstance& bart)
+     {
+	  auto& s = *state_;
+	  if (&s.cfls.instance() != &bart)
+	  {
+	       s.cfls.rebind(bart);
+	  }
+	  if (s.calibration_flight.is_follower())
+	  {
+	       // The calibration computed by the job this one waited for, unless it failed
+	       s.calibration_flight = BartSingleFlight::Ticket();
+	       s.stored_calibration = BartCalibrationStore::get().lookup(s.calibration.key, s.calibration.fingerprint);
+	       if (s.stored_calibration)
+	       {
+		    BartSingleFlight::get().saved();
+		    use_stored_calibration(bart);
+	       }
+	       else
+	       {
+		    GDEBUG("No calibration stored by the job waited for, computing it\n");
+	       }
+	  }
+	  const auto i = s.next++;
+	  const auto& cmdline = s.job.commands[i];
+	  if (is_foreach_directive(cmdline))
+	  {
+	       return run_foreach_block();
+	  }
+	  if (s.stored_calibration && s.calibration.is_calibration[i])
+	  {
+	       GDEBUG("Skipping calibration command: %s\n", cmdline.c_str());
+	       internal::release_inputs(s.job, s.last_use, i + 1, s.released);
+	       return true;
+	  }
+
+	  if (is_cancelled(s.job))
+	  {
+	       GDEBUG("BART job cancelled before: %s\n", cmdline.c_str());
+	       return false;
+	  }
+
+	  if (s.job.progress)
+	  {
+	       s.job.progress->start_command(cmdline, internal::describe_operands(s.cfls, cmdline));
+	  }
+
+	  const auto consumable = internal::is_native_command(cmdline) ? internal::dead_operands(s.cfls, cmdline, i, s.liveness, s.cfl_names) : std::set<std::string>();
+	  if (!internal::call_BART_tuned(s.cfls, cmdline, s.job, consumable))
+	  {
+	       return false;
+	  }
+	  internal::add_cfl_candidates(cmdline, s.cfl_names);
+	  s.memory.update(s.cfls, s.cfl_names, s.released);
+	  internal::release_inputs(s.job, s.last_use, i + 1, s.released);
+
+	  if (!s.calibration.empty() && !s.stored_calibration && i == s.calibration.last)
+	  {
+	       internal::store_calibration(s.cfls, s.calibration, s.job.copies.get());
+	       s.calibration_flight.done();
+	  }
+	  return true;
+     }
+
+     bool BartJobRunner::run_foreach_block()
+     {
+	  auto& s = *state_;
+	  const auto first = s.next - 1;
+	  BartForeachBlock block;
+	  if (!parse_foreach_block(s.job.commands, first, block))
+	  {
+	       return false;
+	  }
+	  s.next = block.end + 1;
+
+	  if (is_cancelled(s.job))
+	  {
+	       GDEBUG("BART job cancelled before: %s\n", s.job.commands[first].c_str());
+	       return false;
+	  }
+
+	  if (!internal::run_foreach(s.cfls, block, s.job))
+	  {
+	       return false;
+	  }
+	  s.cfl_names.insert(block.outputs.begin(), block.outputs.end());
+	  s.memory.update(s.cfls, s.cfl_names, s.released);
+	  internal::release_inputs(s.job, s.last_use, s.next, s.released);
+	  return true;
+     }
+
+     bool BartJobRunner::finish(BartInstance& bart, BartJobOutput& output)
+     {
+	  const auto& job = state_->job;
+	  std::string outputFile = job.output.empty() ? get_output_filename(job.commands.back()) : job.output;
+	  if (job.profile)
+	  {
+	       GINFO("BART profile: CFL registry: %s\n", BartCflRegistry::describe(state_->cfls.counters()).c_str());
+	  }
+
+	  // Reformat the data back to gadgetron format: merging the maps (dimension 4) with N (dimension 9 in the
+	  // scripts) only changes the dimensions of the output, its data stays where it is
+	  auto& header = output.script_dims;
+	  header.assign(16, 1);
+	  output.data = static_cast<std::complex<float>*>(bart.load_mem_cfl(outputFile.c_str(), header.size(), header.data()));
+	  if (output.data == nullptr)
+	  {
+	       GERROR("Failed to retrieve data from in-memory CFL file: %s\n", outputFile.c_str());
+	       return false;
+	  }
+
+	  output.dims = header;
+	  output.dims[4] = header[9] * header[4];
+	  output.dims[9] = 1;
+
+	  return true;
+     }
+
+     size_t estimate_job_memory(const BartJob& job)
+     {
+	  size_t input_bytes(0);
+	  for (const auto& input: job.inputs)
+	       input_bytes += std::accumulate(input.dims.begin(), input.dims.end(), size_t(1), std::multiplies<size_t>()) * sizeof(std::complex<float>);
+	  return static_cast<size_t>(input_bytes * std::max(job.memory_expansion, 1.0f));
+     }
+
+     bool run_bart_job(BartInstancePool::Lease& lease, const BartJob& job, BartJobOutput& output)
+     {
+	  BartJobRunner runner(job);
+	  if (!runner.start(*lease))
+	       return false;
+
+	  while (!runner.is_done())
+	  {
+	       if (runner.is_waiting())
+	       {
+		    // Another job computes the same calibration, the instance goes to the other jobs meanwhile
+		    auto& pool = lease.pool();
+		    runner.park(lease);
+		    while (!runner.wait(std::chrono::milliseconds(50)))
+		    {
+			 if (is_cancelled(job))
+			 {
+			      GDEBUG("BART job cancelled while waiting for its calibration\n");
+			      return false;
+			 }
+		    }
+		    lease = pool.acquire(job.schedule, job.cancellation.get());
+		    if (!lease)
+		    {
+			 GDEBUG("BART job cancelled while waiting for an instance\n");
+			 return false;
+		    }
+		    runner.resume(*lease);
+	       }
+
+	       if (runner.should_yield(lease))
+	       {
+		    // Give the BART instance up to a more urgent job and resume on the next available one
+		    auto& pool = lease.pool();
+		    runner.park(lease);
+		    lease = pool.acquire(job.schedule, job.cancellation.get());
+		    if (!lease)
+		    {
+			 GDEBUG("BART job cancelled while preempted\n");
+			 return false;
+		    }
+		    runner.resume(*lease);
+	       }
+
+	       if (!runner.run_next(*lease))
+		    return false;
+	  }
+	  return runner.finish(*lease, output);
+     }
+
+     bool run_shared_calibration(BartInstancePool::Lease& lease, const BartJob& job, const std::vector<std::vector<std::string>>& variants,
+				 std::vector<size_t>& shared, std::vector<BartCalibrationResult>& results)
+     {
+	  shared.clear();
+	  results.clear();
+	  const auto plan = internal::plan_calibration(job);
+	  if (plan.is_calibration.empty())
+	       return true;
+	  for (const auto& commands: variants)
+	  {
+	       if (commands.size() != job.commands.size())
+		    return true;
+	  }
+
+	  // Common: a calibration command the same in all the variants, not reading the results of the others
+	  std::set<std::string> produced, unshared;
+	  for (size_t i = 0; i < job.commands.size(); ++i)
+	  {
+	       if (!plan.is_calibration[i])
+		    continue;
+	       const auto output = get_output_filename(job.commands[i]);
+	       std::set<std::string> reads;
+	       internal::add_cfl_candidates(job.commands[i], reads);
+	       reads.erase(output);
+	       const auto is_common = std::all_of(variants.begin(), variants.end(), [&](const std::vector<std::string>& commands) { return commands[i] == job.commands[i]; })
+		    && std::none_of(reads.begin(), reads.end(), [&](const std::string& name) { return unshared.count(name) > 0; });
+	       if (is_common)
+	       {
+		    shared.push_back(i);
+		    produced.insert(output);
+	       }
+	       else
+	       {
+		    unshared.insert(output);
+	       }
+	  }
+	  if (shared.empty())
+	       return true;
+
+	  // Results read by the other commands
+	  std::set<std::string> needed;
+	  for (size_t i = 0; i < job.commands.size(); ++i)
+	  {
+	       if (std::find(shared.begin(), shared.end(), i) != shared.end())
+		    continue;
+	       std::set<std::string> reads;
+	       internal::add_cfl_candidates(job.commands[i], reads);
+	       for (const auto& name: reads)
+		    if (produced.count(name))
+			 needed.insert(name);
+	  }
+	  const auto output = job.output.empty() ? get_output_filename(job.commands.back()) : job.output;
+	  if (produced.count(output))
+	       needed.insert(output);
+
+	  BartJob calibration;
+	  for (const auto& input: job.inputs)
+	       calibration.inputs.push_back({input.name, input.dims, input.data, nullptr});
+	  for (auto i: shared)
+	       calibration.commands.push_back(job.commands[i]);
+	  calibration.schedule = job.schedule;
+	  calibration.cancellation = job.cancellation;
+	  calibration.progress = job.progress;
+	  calibration.profile = job.profile;
+	  calibration.copies = job.copies;
+	  calibration.count_hardware_events = job.count_hardware_events;
+
+	  BartJobRunner runner(calibration);
+	  for (const auto& name: needed)
+	       runner.keep(name);
+	  if (!runner.start(*lease))
+	       return false;
+	  while (!runner.is_done())
+	  {
+	       if (!runner.run_next(*lease))
+		    return false;
+	  }
+
+	  for (const auto& name: needed)
+	  {
+	       BartCalibrationResult result;
+	       result.name = name;
+	       result.dims.assign(16, 1);
+	       const auto data = static_cast<std::complex<float>*>(lease->load_mem_cfl(name.c_str(), result.dims.size(), result.dims.data()));
+	       if (data == nullptr)
+	       {
+		    GERROR("Failed to retrieve the shared calibration result %s\n", name.c_str());
+		    return false;
+	       }
+	       result.data.assign(data, data + std::accumulate(result.dims.begin(), result.dims.end(), size_t(1), std::multiplies<size_t>()));
+	       if (job.copies)
+	       {
+		    job.copies->allocated("shared calibration", result.data.size() * sizeof(std::complex<float>));
+		    job.copies->copied("shared calibration", result.data.size() * sizeof(std::complex<float>), true);
+	       }
+	       results.push_back(std::move(result));
+	  }
+	  return true;
+     }
+}
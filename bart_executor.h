@@ -0,0 +1,226 @@
+/****************************************************************************************************************************
+ * Description: Execution of BART reconstruction jobs
+ *
+ * A job is a list of named input arrays followed by the BART command lines to
+ * run on them. It is independent of the Gadgetron message types so that it can
+ * be executed either within the gadget or by the BART reconstruction daemon.
+ ****************************************************************************************************************************/
+
+#ifndef BART_EXECUTOR_H
+#define BART_EXECUTOR_H
+
+#include "bart_copy_accounting.h"
+#include "bart_instance.h"
+#include <chrono>
+#include <complex>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace Gadgetron {
+
+     struct BartJobInput
+     {
+	  std::string name;			//!< Name of the in-memory CFL
+	  std::vector<long> dims;
+	  std::complex<float>* data;		//!< Not owned, needs to outlive the job execution (or the call to release)
+	  std::function<void()> release;	//!< Optional, called once no remaining command of the job reads the input (possibly before the first one)
+     };
+
+     //! What a job is currently busy with (shared with whoever monitors it)
+     class BartJobProgress
+     {
+     public:
+	  //! A command starts (or started elapsed ago, eg. in the daemon)
+	  void start_command(const std::string& cmdline, const std::string& operands,
+			     std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::duration::zero());
+
+	  //! A command of the run for some slice of a foreach block starts, the slices running concurrently
+	  void start_slice_command(long slice, const std::string& cmdline, const std::string& operands);
+
+	  //! The run for some slice is over (successful or not)
+	  void finish_slice(long slice);
+
+	  //! Command being executed, dimensions of its operands and for how long it has been running
+	  /*!
+	   * While a foreach block runs, the command running for the longest time
+	   * among those of its slices (a single hanging slice times the job out).
+	   */
+	  void current(std::string& cmdline, std::string& operands, std::chrono::steady_clock::duration& elapsed) const;
+
+     private:
+	  struct Command
+	  {
+	       std::string cmdline;
+	       std::string operands;
+	       std::chrono::steady_clock::time_point start;
+	  };
+
+	  mutable std::mutex mtx_;
+	  Command command_;
+	  std::map<long, Command> slices_;	// by index, those running
+     };
+
+     //! Reuse of the calibration of earlier jobs (see BartCalibrationStore)
+     struct BartCalibrationRequest
+     {
+	  std::string key;			//!< Coil configuration and geometry of the scan (empty to disable)
+	  std::vector<std::string> inputs;	//!< Names of the inputs holding calibration k-space
+     };
+
+     //! Default estimate of the memory used by the BART commands per byte of input (intermediate results included)
+     constexpr float BART_MEMORY_EXPANSION = 8.0f;
+
+     struct BartJob
+     {
+	  std::vector<BartJobInput> inputs;
+	  std::vector<std::string> commands;	//!< BART command lines (parameters already substituted)
+	  std::string output;			//!< Name of the output CFL (defaults to the output of the last command)
+	  BartSchedulingInfo schedule;
+	  std::shared_ptr<BartCancellationToken> cancellation;	//!< Optional
+	  std::shared_ptr<BartJobProgress> progress;		//!< Optional
+	  std::shared_ptr<void> payload;			//!< Optional, keeps the memory of the inputs alive
+	  BartCalibrationRequest calibration;			//!< Optional
+	  bool profile = false;					//!< Log the duration of each command
+	  std::shared_ptr<BartCopyAccounting> copies;		//!< Optional, accounts for the traffic of each command and of the preemptions
+	  bool count_hardware_events = false;			//!< Collect the performance counters of each command (see BartPerfProfile)
+	  float memory_expansion = BART_MEMORY_EXPANSION;	//!< Memory used per byte of input, see estimate_job_memory()
+     };
+
+     struct BartJobOutput
+     {
+	  std::vector<long> script_dims;	//!< Dimensions of the output of the script (16D)
+	  std::vector<long> dims;		//!< Dimensions after reformatting into [E0,E1,E2,CHA,N*MAPS,S,LOC] (16D)
+	  std::complex<float>* data = nullptr;	//!< Owned by the BART instance, valid until its in-memory CFLs are deallocated
+     };
+
+     //! Step-wise execution of a job (see run_bart_job()), the caller getting the BART instances
+     /*!
+      * For executors which should not block while waiting for an instance (see
+      * bart_async.h). Between two commands, a job preempted by a more urgent one
+      * parks its intermediate results and gives its instance up, to resume on
+      * whichever instance its caller gets back.
+      */
+     class BartJobRunner
+     {
+     public:
+	  //! The job needs to outlive the runner
+	  explicit BartJobRunner(const BartJob& job);
+	  ~BartJobRunner();
+
+	  //! Keep a CFL the commands produce (besides the output) from being overwritten in place (before start())
+	  void keep(const std::string& name);
+
+	  //! Register the inputs (and the stored calibration, if any) into the instance
+	  bool start(BartInstance& bart);
+
+	  //! Whether all the commands ran
+	  bool is_done() const;
+
+	  //! Whether another job computes the calibration of this one (see BartSingleFlight), to wait for before the next command
+	  /*!
+	   * The job holds no result yet: its caller parks it meanwhile, not to keep an instance idle.
+	   */
+	  bool is_waiting() const;
+
+	  //! Wait for it up to timeout, false if still waiting
+	  bool wait(std::chrono::milliseconds timeout) const;
+
+	  //! Whether to give the instance up to a more urgent job before the next command
+	  bool should_yield(const BartInstancePool::Lease& lease) const;
+
+	  //! Move the intermediate results out of the instance and release it
+	  void park(BartInstancePool::Lease& lease);
+
+	  //! Register the inputs and the parked results into the instance the job got back
+	  void resume(BartInstance& bart);
+
+	  //! Run the next command, or foreach block (false on failure or cancellation)
+	  bool run_next(BartInstance& bart);
+
+	  //! Output of the job, reformatted into Gadgetron's dimension order
+	  bool finish(BartInstance& bart, BartJobOutput& output);
+
+	  BartJobRunner(const BartJobRunner&) = delete;
+	  BartJobRunner& operator=(const BartJobRunner&) = delete;
+
+     private:
+	  bool run_foreach_block();
+	  void use_stored_calibration(BartInstance& bart);
+
+	  struct State;
+	  std::unique_ptr<State> state_;
+     };
+
+     //! Execute a single BART command line on some BART instance
+     bool call_BART(BartInstance& bart, const std::string& cmdline);
+
+     //! Execute a job on some BART instance
+     /*!
+      * The inputs are registered as (non-managed) in-memory CFLs, all the commands
+      * of the job are run in order and the output is reformatted back into
+      * Gadgetron's dimension order.
+      *
+      * Between two commands, the job gives its instance up to any more urgent job
+      * waiting for one (see BartInstancePool::should_yield()): its intermediate
+      * results are moved out of the instance and registered again into whichever
+      * instance it gets back. A cancelled job stops before its next command and
+      * returns false.
+      *
+      * With a calibration request and the BartCalibrationStore enabled, the
+      * commands only depending on the calibration inputs are skipped if their
+      * outputs are found in the store (and stored otherwise), or computed once
+      * for concurrent jobs (see bart_single_flight.h).
+      *
+      * "bart transpose", the gadget-only "bart permute" (see bart_permute.h) and
+      * the elementwise "bart scale", "bart conj", "bart saxpy" and "bart fmac [-C]"
+      * (with inputs of the same dimensions) are run by the gadget itself rather
+      * than by BART.
+      *
+      * Copy on write: the elementwise commands write their output into the buffer
+      * of an input no later command needs (nor the caller: the inputs of the job,
+      * its output and the calibration results are kept), unless another CFL still
+      * needed shares the buffer; otherwise into a new one.
+      *
+      * \note The caller is responsible for deallocating the in-memory CFLs of the
+      *       instance once done with the output.
+      */
+     bool run_bart_job(BartInstancePool::Lease& bart, const BartJob& job, BartJobOutput& output);
+
+     //! Result of calibration commands run once for several jobs (see run_shared_calibration())
+     struct BartCalibrationResult
+     {
+	  std::string name;
+	  std::vector<long> dims;		//!< 16D
+	  std::vector<std::complex<float>> data;
+     };
+
+     //! Run the calibration commands common to several variants of a job once (eg. the blocks of an out-of-core reconstruction)
+     /*!
+      * The common commands are those only depending on the calibration inputs of the
+      * job (see BartCalibrationRequest) and on other common commands, and identical
+      * in every variant (each a list of commands as long as job.commands). Their
+      * results read by the other commands are copied out: each variant runs without
+      * the commands listed in shared, these results given as inputs instead.
+      * The job holds its instance until done.
+      */
+     bool run_shared_calibration(BartInstancePool::Lease& bart, const BartJob& job, const std::vector<std::vector<std::string>>& variants,
+				 std::vector<size_t>& shared, std::vector<BartCalibrationResult>& results);
+
+     //! Memory the job is admitted with (eg. against the memory quota of its tenant): its inputs times its memory expansion
+     size_t estimate_job_memory(const BartJob& job);
+
+     //! Whether the job got cancelled
+     inline bool is_cancelled(const BartJob& job)
+     {
+	  return job.cancellation && job.cancellation->is_cancelled();
+     }
+
+     //! Last token of a BART command line (ie. its output for most commands)
+     std::string get_output_filename(const std::string& bartCommandLine);
+} // namespace Gadgetron
+
+#endif //BART_EXECUTOR_H
@@ -0,0 +1,243 @@
+/****************************************************************************************************************************
+ * Description: Fair sharing of BART between the tenants of a node
+ ****************************************************************************************************************************/
+
+#include "bart_fair_share.h"
+#include "log.h"
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <sstream>
+
+namespace internal {
+     // How often jobs waiting for the memory quota of their tenant check whether they got cancelled
+     constexpr std::chrono::milliseconds QUOTA_POLL_INTERVAL(50);
+
+     // Tenants with less recent CPU time than this fraction of the total are idle and do not dilute the shares
+     constexpr double IDLE_FRACTION = 1e-3;
+}
+
+namespace Gadgetron {
+
+     BartFairShare::Reservation::Reservation(Reservation&& other) noexcept :
+	  owner_(other.owner_), tenant_(std::move(other.tenant_)), bytes_(other.bytes_), is_admitted_(other.is_admitted_)
+     {
+	  other.owner_ = nullptr;
+	  other.is_admitted_ = false;
+     }
+
+     BartFairShare::Reservation& BartFairShare::Reservation::operator=(Reservation&& other) noexcept
+     {
+	  if (this != &other) {
+	       release();
+	       owner_ = other.owner_;
+	       tenant_ = std::move(other.tenant_);
+	       bytes_ = other.bytes_;
+	       is_admitted_ = other.is_admitted_;
+	       other.owner_ = nullptr;
+	       other.is_admitted_ = false;
+	  }
+	  return *this;
+     }
+
+     void BartFairShare::Reservation::release()
+     {
+	  if (owner_) {
+	       owner_->release(tenant_, bytes_);
+	       owner_ = nullptr;
+	  }
+     }
+
+     // =========================================================================
+
+     BartFairShare& BartFairShare::get()
+     {
+	  static BartFairShare fair_share;
+	  return fair_share;
+     }
+
+     void BartFairShare::configure(std::chrono::seconds half_life)
+     {
+	  std::lock_guard<std::mutex> lock(mtx_);
+	  if (is_enabled_) {
+	       if (half_life != half_life_)
+		    GWARN("BART fair share already configured with a half-life of %ld s; ignoring new configuration\n", static_cast<long>(half_life_.count()));
+	       return;
+	  }
+	  is_enabled_ = true;
+	  half_life_ = std::max(half_life, std::chrono::seconds(1));
+     }
+
+     bool BartFairShare::is_enabled() const
+     {
+	  std::lock_guard<std::mutex> lock(mtx_);
+	  return is_enabled_;
+     }
+
+     void BartFairShare::set_tenant(const std::string& tenant, double weight, const Quota& quota)
+     {
+	  std::lock_guard<std::mutex> lock(mtx_);
+	  if (!is_enabled_ || tenant.empty())
+	       return;
+	  auto& t = find(tenant);
+	  t.usage.weight = weight > 0 ? weight : 1;
+	  t.usage.quota = quota;
+     }
+
+     void BartFairShare::tenant(const std::string& tenant, double& weight, Quota& quota) const
+     {
+	  std::lock_guard<std::mutex> lock(mtx_);
+	  const auto it = tenants_.find(tenant);
+	  const auto usage = it != tenants_.end() ? it->second.usage : Usage();
+	  weight = usage.weight;
+	  quota = usage.quota;
+     }
+
+     BartFairShare::Tenant& BartFairShare::find(const std::string& tenant)
+     {
+	  return tenants_[tenant];
+     }
+
+     void BartFairShare::decay(Tenant& tenant, std::chrono::steady_clock::time_point now) const
+     {
+	  const auto elapsed = std::chrono::duration<double>(now - tenant.decayed_at).count();
+	  if (elapsed <= 0)
+	       return;
+	  tenant.usage.recent_cpu_seconds *= std::exp2(-elapsed / half_life_.count());
+	  tenant.decayed_at = now;
+     }
+
+     int BartFairShare::standing(const std::string& tenant) const
+     {
+	  std::lock_guard<std::mutex> lock(mtx_);
+	  const auto me = tenants_.find(tenant);
+	  if (!is_enabled_ || me == tenants_.end())
+	       return 0;
+
+	  const auto now = std::chrono::steady_clock::now();
+	  double total(0);
+	  for (auto& t: tenants_) {
+	       decay(t.second, now);
+	       total += t.second.usage.recent_cpu_seconds;
+	  }
+
+	  const auto& usage = me->second.usage;
+	  if (usage.quota.cpu_seconds > 0 && usage.recent_cpu_seconds > usage.quota.cpu_seconds)
+	       return 2;
+	  if (total <= 0)
+	       return 0;
+
+	  // Share of the tenant among the active ones
+	  double total_weight(0);
+	  for (const auto& t: tenants_) {
+	       if (&t.second == &me->second || t.second.running > 0 || t.second.usage.recent_cpu_seconds > internal::IDLE_FRACTION * total)
+		    total_weight += t.second.usage.weight;
+	  }
+	  return usage.recent_cpu_seconds / total > usage.weight / total_weight ? 1 : 0;
+     }
+
+     bool BartFairShare::fits(const Tenant& tenant, size_t bytes) const
+     {
+	  return tenant.running == 0 || tenant.usage.quota.memory_bytes == 0 || tenant.usage.reserved_memory + bytes <= tenant.usage.quota.memory_bytes;
+     }
+
+     BartFairShare::Reservation BartFairShare::admit(const std::string& name, Tenant& tenant, size_t bytes)
+     {
+	  ++tenant.running;
+	  ++tenant.usage.jobs;
+	  tenant.usage.reserved_memory += bytes;
+	  return Reservation(this, name, bytes);
+     }
+
+     BartFairShare::Reservation BartFairShare::reserve(const std::string& tenant, size_t bytes, const BartCancellationToken* token)
+     {
+	  std::unique_lock<std::mutex> lock(mtx_);
+	  if (!is_enabled_ || tenant.empty())
+	       return Reservation(nullptr, tenant, 0);
+
+	  auto& t = find(tenant);
+	  auto is_cancelled = [token] { return token != nullptr && token->is_cancelled(); };
+	  if (!fits(t, bytes)) {
+	       ++t.usage.delayed_jobs;
+	       GDEBUG("BART job of %s waiting for its memory quota (%lu MB reserved, %lu MB requested)\n",
+		      tenant.c_str(), t.usage.reserved_memory >> 20, bytes >> 20);
+	  }
+	  while (!cv_.wait_for(lock, internal::QUOTA_POLL_INTERVAL, [&] { return is_cancelled() || fits(t, bytes); }))
+	       ;
+	  if (is_cancelled())
+	       return Reservation();
+	  return admit(tenant, t, bytes);
+     }
+
+     BartFairShare::Reservation BartFairShare::try_reserve(const std::string& tenant, size_t bytes, bool is_first_attempt)
+     {
+	  std::lock_guard<std::mutex> lock(mtx_);
+	  if (!is_enabled_ || tenant.empty())
+	       return Reservation(nullptr, tenant, 0);
+
+	  auto& t = find(tenant);
+	  if (!fits(t, bytes)) {
+	       if (is_first_attempt)
+		    ++t.usage.delayed_jobs;
+	       return Reservation();
+	  }
+	  return admit(tenant, t, bytes);
+     }
+
+     void BartFairShare::release(const std::string& tenant, size_t bytes)
+     {
+	  {
+	       std::lock_guard<std::mutex> lock(mtx_);
+	       auto& t = find(tenant);
+	       --t.running;
+	       t.usage.reserved_memory -= bytes;
+	  }
+	  cv_.notify_all();
+     }
+
+     void BartFairShare::charge(const std::string& tenant, double cpu_seconds)
+     {
+	  std::lock_guard<std::mutex> lock(mtx_);
+	  if (!is_enabled_ || tenant.empty())
+	       return;
+	  auto& t = find(tenant);
+	  decay(t, std::chrono::steady_clock::now());
+	  t.usage.cpu_seconds += cpu_seconds;
+	  t.usage.recent_cpu_seconds += cpu_seconds;
+     }
+
+     void BartFairShare::update_memory(const std::string& tenant, size_t previous_bytes, size_t bytes)
+     {
+	  std::lock_guard<std::mutex> lock(mtx_);
+	  if (!is_enabled_ || tenant.empty())
+	       return;
+	  auto& usage = find(tenant).usage;
+	  usage.memory_in_use = usage.memory_in_use + bytes > previous_bytes ? usage.memory_in_use + bytes - previous_bytes : 0;
+	  usage.peak_memory = std::max(usage.peak_memory, usage.memory_in_use);
+     }
+
+     std::map<std::string, BartFairShare::Usage> BartFairShare::usage() const
+     {
+	  std::lock_guard<std::mutex> lock(mtx_);
+	  const auto now = std::chrono::steady_clock::now();
+	  std::map<std::string, Usage> usage;
+	  for (auto& t: tenants_) {
+	       decay(t.second, now);
+	       usage[t.first] = t.second.usage;
+	  }
+	  return usage;
+     }
+
+     std::string BartFairShare::report() const
+     {
+	  std::ostringstream report;
+	  report << std::fixed << std::setprecision(1);
+	  for (const auto& t: usage()) {
+	       const auto& u = t.second;
+	       report << "  " << t.first << " (weight " << u.weight << "): " << u.jobs << " jobs (" << u.delayed_jobs << " delayed by the memory quota), "
+		      << u.cpu_seconds << " CPU s (" << u.recent_cpu_seconds << " recent), "
+		      << (u.memory_in_use >> 20) << " MB in use, " << (u.peak_memory >> 20) << " MB peak\n";
+	  }
+	  return report.str();
+     }
+} // namespace Gadgetron
@@ -0,0 +1,146 @@
+/****************************************************************************************************************************
+ * Description: Fair sharing of BART between the tenants of a node
+ *
+ * The jobs are accounted to tenants (a connection, an image series, a
+ * configuration...): CPU time of their BART commands (wall time times the
+ * number of threads) and memory of their in-memory CFLs. The CPU time decays
+ * with a half-life, so that the standing of a tenant reflects its recent usage.
+ *
+ * When BART instances are contended, the jobs of the tenants within their
+ * weighted share of the recent CPU time go first, then those beyond it, then
+ * those over their CPU quota; earliest deadline first within each class (see
+ * BartInstancePool). A tenant over its memory quota has its next jobs wait for
+ * its running ones.
+ ****************************************************************************************************************************/
+
+#ifndef BART_FAIR_SHARE_H
+#define BART_FAIR_SHARE_H
+
+#include "bart_instance.h"
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+
+namespace Gadgetron {
+
+     class BartFairShare
+     {
+     public:
+	  struct Quota
+	  {
+	       double cpu_seconds = 0;		//!< Recent CPU time (decayed), 0 for none
+	       size_t memory_bytes = 0;		//!< Memory reserved by the running jobs, 0 for none
+	  };
+
+	  struct Usage
+	  {
+	       double weight = 1;
+	       Quota quota;
+	       double cpu_seconds = 0;		//!< Since the start of the process
+	       double recent_cpu_seconds = 0;	//!< Decayed with the half-life
+	       size_t reserved_memory = 0;	//!< Estimated by the running jobs when admitted
+	       size_t memory_in_use = 0;	//!< In-memory CFLs of the running jobs
+	       size_t peak_memory = 0;
+	       uint64_t jobs = 0;
+	       uint64_t delayed_jobs = 0;	//!< Jobs which waited for the memory quota
+	  };
+
+	  //! Memory reserved for a job, given back on destruction
+	  class Reservation
+	  {
+	  public:
+	       Reservation() = default;
+	       Reservation(BartFairShare* owner, std::string tenant, size_t bytes) : owner_(owner), tenant_(std::move(tenant)), bytes_(bytes), is_admitted_(true) {}
+	       Reservation(Reservation&& other) noexcept;
+	       Reservation& operator=(Reservation&& other) noexcept;
+	       Reservation(const Reservation&) = delete;
+	       Reservation& operator=(const Reservation&) = delete;
+	       ~Reservation() { release(); }
+
+	       void release();
+
+	       //! False if the job got cancelled while waiting
+	       explicit operator bool() const { return is_admitted_; }
+
+	  private:
+	       BartFairShare* owner_ = nullptr;
+	       std::string tenant_;
+	       size_t bytes_ = 0;
+	       bool is_admitted_ = false;
+	  };
+
+	  //! Process-wide accounting, shared by all the BartGadget instances (or all the clients of the daemon)
+	  static BartFairShare& get();
+
+	  //! Enable fair sharing (it can only be configured once per process)
+	  void configure(std::chrono::seconds half_life);
+
+	  bool is_enabled() const;
+
+	  //! Weight (relative to the other tenants) and quotas of a tenant, the latest call wins
+	  void set_tenant(const std::string& tenant, double weight, const Quota& quota);
+
+	  //! Weight and quotas of a tenant (the defaults if unknown)
+	  void tenant(const std::string& tenant, double& weight, Quota& quota) const;
+
+	  //! Scheduling class of a tenant: 0 within its share of the recent CPU time, 1 beyond it, 2 over its CPU quota
+	  int standing(const std::string& tenant) const;
+
+	  //! Block until the memory quota of the tenant allows a job estimated to use this many bytes
+	  /*!
+	   * A tenant without any running job is always admitted. Without fair
+	   * sharing (or tenant), the reservation is admitted right away and accounts
+	   * for nothing.
+	   */
+	  Reservation reserve(const std::string& tenant, size_t bytes, const BartCancellationToken* token = nullptr);
+
+	  //! Reserve without waiting: the reservation is not admitted (false) if the memory quota does not allow the job yet
+	  /*!
+	   * \param is_first_attempt  Count the job as delayed if it does not fit
+	   */
+	  Reservation try_reserve(const std::string& tenant, size_t bytes, bool is_first_attempt);
+
+	  //! CPU time used by a command of the tenant
+	  void charge(const std::string& tenant, double cpu_seconds);
+
+	  //! Memory of the in-memory CFLs of a running job of the tenant, from previous_bytes to bytes
+	  void update_memory(const std::string& tenant, size_t previous_bytes, size_t bytes);
+
+	  std::map<std::string, Usage> usage() const;
+
+	  //! One line per tenant (empty if nothing was accounted)
+	  std::string report() const;
+
+	  BartFairShare(const BartFairShare&) = delete;
+	  BartFairShare& operator=(const BartFairShare&) = delete;
+
+     private:
+	  struct Tenant
+	  {
+	       Usage usage;
+	       uint64_t running = 0;
+	       std::chrono::steady_clock::time_point decayed_at = std::chrono::steady_clock::now();
+	  };
+
+	  BartFairShare() = default;
+
+	  Tenant& find(const std::string& tenant);
+	  void decay(Tenant& tenant, std::chrono::steady_clock::time_point now) const;
+	  void release(const std::string& tenant, size_t bytes);
+	  bool fits(const Tenant& tenant, size_t bytes) const;
+	  Reservation admit(const std::string& name, Tenant& tenant, size_t bytes);
+
+	  mutable std::mutex mtx_;
+	  std::condition_variable cv_;
+	  bool is_enabled_ = false;
+	  std::chrono::seconds half_life_{300};
+	  mutable std::map<std::string, Tenant> tenants_;
+     };
+} // namespace Gadgetron
+
+#endif //BART_FAIR_SHARE_H
@@ -0,0 +1,163 @@
+/****************************************************************************************************************************
+ * Description: Data-parallel loops of the BART command scripts
+ ****************************************************************************************************************************/
+
+#include "bart_foreach.h"
+#include "log.h"
+#include <algorithm>
+#include <boost/tokenizer.hpp>
+#include <functional>
+#include <iterator>
+#include <numeric>
+#include <set>
+#include <sstream>
+
+namespace internal {
+     // BART tools which may write several outputs (eg. ecalib <kspace> <sens> [<ev-maps>]): without knowing which of
+     // their operands are outputs, those cannot be told from the CFLs shared by all the runs of a block
+     const std::set<std::string> MULTI_OUTPUT_TOOLS = {"ecalib", "ecaltwo", "moba", "nlinv", "rtnlinv", "svd", "whiten"};
+
+     std::vector<std::string> split_script_line(const std::string& line)
+     {
+	  std::vector<std::string> tokens;
+	  boost::char_separator<char> sep(" ");
+	  boost::tokenizer<boost::char_separator<char> > tok(line, sep);
+	  std::copy(tok.begin(), tok.end(), std::back_inserter(tokens));
+	  return tokens;
+     }
+
+     bool parse_count(const std::string& token, long& value)
+     {
+	  std::istringstream in(token);
+	  return (in >> value) && in.eof();
+     }
+
+     // Elements per index of dim, and number of blocks of them (dimensions above dim)
+     void slice_layout(const std::vector<long>& dims, int dim, long& inner, long& outer)
+     {
+	  inner = std::accumulate(dims.begin(), dims.begin() + dim, 1L, std::multiplies<long>());
+	  outer = std::accumulate(dims.begin() + dim + 1, dims.end(), 1L, std::multiplies<long>());
+     }
+}
+
+namespace Gadgetron {
+
+     bool is_foreach_directive(const std::string& line)
+     {
+	  return line.compare(0, 8, "foreach ") == 0;
+     }
+
+     bool is_end_directive(const std::string& line)
+     {
+	  return line == "end" || line.compare(0, 4, "end ") == 0;
+     }
+
+     std::string BartForeachBlock::slice_name(const std::string& name, long index)
+     {
+	  return name + "_foreach" + std::to_string(index);
+     }
+
+     std::vector<std::string> BartForeachBlock::slice_commands(long index) const
+     {
+	  std::vector<std::string> commands;
+	  for (const auto& cmdline: body) {
+	       auto tokens = internal::split_script_line(cmdline);
+	       for (size_t k = 2; k < tokens.size(); ++k)
+		    if (tokens[k][0] != '-' && locals.count(tokens[k]))
+			 tokens[k] = slice_name(tokens[k], index);
+	       std::ostringstream command;
+	       for (size_t k = 0; k < tokens.size(); ++k)
+		    command << (k ? " " : "") << tokens[k];
+	       commands.push_back(command.str());
+	  }
+	  return commands;
+     }
+
+     bool parse_foreach_block(const std::vector<std::string>& commands, size_t first, BartForeachBlock& block)
+     {
+	  block = BartForeachBlock();
+	  const auto tokens = internal::split_script_line(commands[first]);
+
+	  // foreach <dim> in <cfl>... [max <n>]
+	  long dim;
+	  if (tokens.size() < 4 || !internal::parse_count(tokens[1], dim) || dim < 0 || dim >= 16 || tokens[2] != "in") {
+	       GERROR("Invalid foreach directive (should be: foreach <dim> in <cfl>... [max <n>]): %s\n", commands[first].c_str());
+	       return false;
+	  }
+	  block.dim = static_cast<int>(dim);
+	  auto last = tokens.size();
+	  if (last >= 6 && tokens[last - 2] == "max") {
+	       long max;
+	       if (!internal::parse_count(tokens[last - 1], max) || max < 1) {
+		    GERROR("Invalid concurrency limit of foreach directive: %s\n", commands[first].c_str());
+		    return false;
+	       }
+	       block.max_concurrency = static_cast<size_t>(max);
+	       last -= 2;
+	  }
+	  block.sliced.assign(tokens.begin() + 3, tokens.begin() + last);
+	  block.locals.insert(block.sliced.begin(), block.sliced.end());
+
+	  for (auto i = first + 1; i < commands.size(); ++i) {
+	       if (is_foreach_directive(commands[i])) {
+		    GERROR("Nested foreach directives are not supported: %s\n", commands[i].c_str());
+		    return false;
+	       }
+	       if (!is_end_directive(commands[i])) {
+		    block.body.push_back(commands[i]);
+		    const auto body_tokens = internal::split_script_line(commands[i]);
+		    if (body_tokens.size() > 1 && internal::MULTI_OUTPUT_TOOLS.count(body_tokens[1])) {
+			 GERROR("BART %s may write several outputs, which foreach blocks do not support (run it before the block): %s\n",
+				body_tokens[1].c_str(), commands[i].c_str());
+			 return false;
+		    }
+		    // The output of a command is its last operand
+		    if (body_tokens.size() > 2)
+			 block.locals.insert(body_tokens.back());
+		    continue;
+	       }
+
+	       const auto end_tokens = internal::split_script_line(commands[i]);
+	       block.outputs.assign(end_tokens.begin() + 1, end_tokens.end());
+	       block.end = i;
+	       if (block.body.empty() || block.outputs.empty()) {
+		    GERROR("foreach block without any command or output (should end with: end <cfl>...)\n");
+		    return false;
+	       }
+	       for (const auto& output: block.outputs) {
+		    if (!block.locals.count(output)) {
+			 GERROR("Output %s of foreach block is not produced by its commands\n", output.c_str());
+			 return false;
+		    }
+	       }
+	       return true;
+	  }
+
+	  GERROR("foreach block without end: %s\n", commands[first].c_str());
+	  return false;
+     }
+
+     std::complex<float>* slice_of(const std::vector<long>& dims, int dim, long index, std::complex<float>* data,
+				   std::unique_ptr<std::complex<float>[]>& buffer)
+     {
+	  long inner, outer;
+	  internal::slice_layout(dims, dim, inner, outer);
+	  if (outer == 1)
+	       return data + index * inner;
+
+	  buffer = std::make_unique<std::complex<float>[]>(inner * outer);
+	  for (long o = 0; o < outer; ++o) {
+	       const auto from = data + (o * dims[dim] + index) * inner;
+	       std::copy(from, from + inner, buffer.get() + o * inner);
+	  }
+	  return buffer.get();
+     }
+
+     void insert_slice(const std::vector<long>& dims, int dim, long index, const std::complex<float>* slice, std::complex<float>* data)
+     {
+	  long inner, outer;
+	  internal::slice_layout(dims, dim, inner, outer);
+	  for (long o = 0; o < outer; ++o)
+	       std::copy(slice + o * inner, slice + (o + 1) * inner, data + (o * dims[dim] + index) * inner);
+     }
+} // namespace Gadgetron
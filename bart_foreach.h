@@ -0,0 +1,69 @@
+/****************************************************************************************************************************
+ * Description: Data-parallel loops of the BART command scripts
+ *
+ *   foreach <dim> in <cfl>... [max <n>]
+ *   bart ...
+ *   end <cfl>...
+ *
+ * runs the commands of the block once per index of BART dimension <dim> of the
+ * CFLs listed after "in", each run seeing its slice of them under their own
+ * name, and joins the CFLs listed after "end" (produced by the commands of the
+ * block) along <dim> in index order. The other CFLs read by the block are
+ * shared by all the runs. The commands of the block must write their output
+ * as their last operand: tools which may write several outputs (ecalib, svd,
+ * nlinv, ...) are rejected.
+ *
+ * A block runs as a whole, in place of its commands in the job.
+ * The runs go to the instance of the job and to as many idle BART instances of
+ * the pool as available, up to <n> at a time (no limit by default).
+ * A slice is a view of its CFL (no copy) whenever the dimensions above <dim>
+ * are all singletons, and a gathered copy otherwise.
+ ****************************************************************************************************************************/
+
+#ifndef BART_FOREACH_H
+#define BART_FOREACH_H
+
+#include <complex>
+#include <cstddef>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace Gadgetron {
+
+     struct BartForeachBlock
+     {
+	  int dim = 0;
+	  std::vector<std::string> sliced;	//!< CFLs sliced along dim
+	  size_t max_concurrency = 0;		//!< 0 for no limit
+	  std::vector<std::string> body;	//!< BART command lines
+	  std::vector<std::string> outputs;	//!< CFLs joined along dim
+	  std::set<std::string> locals;		//!< Sliced CFLs and those produced by the body, private to each run
+	  size_t end = 0;			//!< Index of the "end" line among the commands
+
+	  //! Body of the run for a slice: its private CFLs renamed with a suffix
+	  std::vector<std::string> slice_commands(long index) const;
+
+	  //! Name of a private CFL in the run for a slice
+	  static std::string slice_name(const std::string& name, long index);
+     };
+
+     //! Whether a script line opens a block
+     bool is_foreach_directive(const std::string& line);
+
+     //! Whether a script line closes a block
+     bool is_end_directive(const std::string& line);
+
+     //! Parse the block opened at commands[first] (parameters already substituted)
+     bool parse_foreach_block(const std::vector<std::string>& commands, size_t first, BartForeachBlock& block);
+
+     //! Slice index along dim of an array: a view of data, or a copy gathered into buffer
+     std::complex<float>* slice_of(const std::vector<long>& dims, int dim, long index, std::complex<float>* data,
+				   std::unique_ptr<std::complex<float>[]>& buffer);
+
+     //! Copy a slice into the array it is part of (dims are those of the whole array)
+     void insert_slice(const std::vector<long>& dims, int dim, long index, const std::complex<float>* slice, std::complex<float>* data);
+} // namespace Gadgetron
+
+#endif //BART_FOREACH_H
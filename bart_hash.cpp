@@ -0,0 +1,99 @@
+/****************************************************************************************************************************
+ * Description: Fast non-cryptographic hashing (XXH64) used to key the caches of BART results
+ ****************************************************************************************************************************/
+
+#include "bart_hash.h"
+#include <cstdio>
+#include <cstring>
+
+namespace internal {
+     constexpr uint64_t PRIME64_1 = 11400714785074694791ULL;
+     constexpr uint64_t PRIME64_2 = 14029467366897019727ULL;
+     constexpr uint64_t PRIME64_3 = 1609587929392839161ULL;
+     constexpr uint64_t PRIME64_4 = 9650029242287828579ULL;
+     constexpr uint64_t PRIME64_5 = 2870177450012600261ULL;
+
+     inline uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+     inline uint64_t read64(const unsigned char* p) { uint64_t v; std::memcpy(&v, p, sizeof(v)); return v; }
+     inline uint32_t read32(const unsigned char* p) { uint32_t v; std::memcpy(&v, p, sizeof(v)); return v; }
+
+     inline uint64_t round(uint64_t acc, uint64_t input)
+     {
+	  acc += input * PRIME64_2;
+	  acc = rotl(acc, 31);
+	  return acc * PRIME64_1;
+     }
+
+     inline uint64_t merge_round(uint64_t acc, uint64_t val)
+     {
+	  acc ^= round(0, val);
+	  return acc * PRIME64_1 + PRIME64_4;
+     }
+}
+
+namespace Gadgetron {
+
+     // Reference: https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md (little-endian only)
+     uint64_t xxhash64(const void* data, size_t size, uint64_t seed)
+     {
+	  using namespace internal;
+	  auto p = static_cast<const unsigned char*>(data);
+	  const auto end = p + size;
+	  uint64_t h;
+
+	  if (size >= 32) {
+	       auto v1 = seed + PRIME64_1 + PRIME64_2;
+	       auto v2 = seed + PRIME64_2;
+	       auto v3 = seed;
+	       auto v4 = seed - PRIME64_1;
+	       const auto limit = end - 32;
+	       do {
+		    v1 = round(v1, read64(p));
+		    v2 = round(v2, read64(p + 8));
+		    v3 = round(v3, read64(p + 16));
+		    v4 = round(v4, read64(p + 24));
+		    p += 32;
+	       } while (p <= limit);
+
+	       h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+	       h = merge_round(h, v1);
+	       h = merge_round(h, v2);
+	       h = merge_round(h, v3);
+	       h = merge_round(h, v4);
+	  }
+	  else {
+	       h = seed + PRIME64_5;
+	  }
+
+	  h += static_cast<uint64_t>(size);
+
+	  for (; p + 8 <= end; p += 8) {
+	       h ^= round(0, read64(p));
+	       h = rotl(h, 27) * PRIME64_1 + PRIME64_4;
+	  }
+	  if (p + 4 <= end) {
+	       h ^= static_cast<uint64_t>(read32(p)) * PRIME64_1;
+	       h = rotl(h, 23) * PRIME64_2 + PRIME64_3;
+	       p += 4;
+	  }
+	  for (; p < end; ++p) {
+	       h ^= (*p) * PRIME64_5;
+	       h = rotl(h, 11) * PRIME64_1;
+	  }
+
+	  h ^= h >> 33;
+	  h *= PRIME64_2;
+	  h ^= h >> 29;
+	  h *= PRIME64_3;
+	  h ^= h >> 32;
+	  return h;
+     }
+
+     std::string BartHashBuilder::hex() const
+     {
+	  char buf[17];
+	  std::snprintf(buf, sizeof(buf), "%016llx", static_cast<unsigned long long>(digest_));
+	  return buf;
+     }
+}
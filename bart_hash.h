@@ -0,0 +1,42 @@
+/****************************************************************************************************************************
+ * Description: Fast non-cryptographic hashing (XXH64) used to key the caches of BART results
+ ****************************************************************************************************************************/
+
+#ifndef BART_HASH_H
+#define BART_HASH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+namespace Gadgetron {
+
+     //! XXH64 digest of a buffer
+     uint64_t xxhash64(const void* data, size_t size, uint64_t seed = 0);
+
+     //! Digest of a sequence of values (each one being hashed with the digest of the previous ones as seed)
+     class BartHashBuilder
+     {
+     public:
+	  BartHashBuilder& add(const void* data, size_t size) { digest_ = xxhash64(data, size, digest_); return *this; }
+	  BartHashBuilder& add(const std::string& str) { return add(str.data(), str.size()); }
+
+	  template <typename T, typename = typename std::enable_if<std::is_arithmetic<T>::value>::type>
+	  BartHashBuilder& add(T value) { return add(&value, sizeof(value)); }
+
+	  template <typename T>
+	  BartHashBuilder& add(const std::vector<T>& values) { add(values.size()); return add(values.data(), values.size() * sizeof(T)); }
+
+	  uint64_t digest() const { return digest_; }
+
+	  //! Digest as 16 hexadecimal digits (eg. for file names)
+	  std::string hex() const;
+
+     private:
+	  uint64_t digest_ = 0;
+     };
+} // namespace Gadgetron
+
+#endif //BART_HASH_H
@@ -0,0 +1,346 @@
+/****************************************************************************************************************************
+ * Description: Pool of BART instances used by the BartGadget
+ ****************************************************************************************************************************/
+
+#include "bart_instance.h"
+#include "bart_fair_share.h"
+#include "log.h"
+#include <algorithm>
+#include <iterator>
+
+#if defined(__linux__)
+#include <dlfcn.h>
+#endif /* __linux__ */
+
+#include "bart_api.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif /* _OPENMP */
+
+namespace internal {
+     // glibc supports at most 16 link namespaces, one of which is the base namespace
+     constexpr size_t MAX_ISOLATED_INSTANCES = 15;
+
+     // How often jobs waiting for an instance check whether they got cancelled
+     constexpr std::chrono::milliseconds CANCELLATION_POLL_INTERVAL(50);
+
+#if defined(__linux__)
+     template <typename func_t>
+     bool resolve(void* handle, const char* symbol, func_t& func)
+     {
+	  func = reinterpret_cast<func_t>(dlsym(handle, symbol));
+	  if (func == nullptr) {
+	       GERROR("Unable to resolve symbol %s in BART instance: %s\n", symbol, dlerror());
+	       return false;
+	  }
+	  return true;
+     }
+
+     std::unique_ptr<Gadgetron::BartInstance> load_isolated_instance(size_t index, const std::string& library_path)
+     {
+	  auto handle = dlmopen(LM_ID_NEWLM, library_path.c_str(), RTLD_NOW | RTLD_LOCAL);
+	  if (handle == nullptr) {
+	       GERROR("Failed to load BART instance %lu from %s: %s\n", index, library_path.c_str(), dlerror());
+	       return nullptr;
+	  }
+
+	  auto bart = std::make_unique<Gadgetron::BartInstance>();
+	  bart->index = index;
+	  bart->handle = handle;
+
+	  if (!resolve(handle, "load_mem_cfl", bart->load_mem_cfl)
+	      || !resolve(handle, "register_mem_cfl_malloc", bart->register_mem_cfl_malloc)
+	      || !resolve(handle, "register_mem_cfl_new", bart->register_mem_cfl_new)
+	      || !resolve(handle, "register_mem_cfl_non_managed", bart->register_mem_cfl_non_managed)
+	      || !resolve(handle, "in_mem_bart_main", bart->in_mem_bart_main)
+	      || !resolve(handle, "deallocate_mem_cfl", bart->deallocate_mem_cfl)
+	      || !resolve(handle, "deallocate_all_mem_cfl", bart->deallocate_all_mem_cfl))
+	  {
+	       dlclose(handle);
+	       return nullptr;
+	  }
+
+	  // Optional: the OpenMP runtime of the namespace of the instance
+	  bart->set_num_threads = reinterpret_cast<void (*)(int)>(dlsym(handle, "omp_set_num_threads"));
+	  bart->get_max_threads = reinterpret_cast<int (*)()>(dlsym(handle, "omp_get_max_threads"));
+	  bart->parallel = reinterpret_cast<void (*)(void (*)(void*), void*, unsigned, unsigned)>(dlsym(handle, "GOMP_parallel"));
+	  if (bart->set_num_threads == nullptr || bart->get_max_threads == nullptr || bart->parallel == nullptr) {
+	       bart->set_num_threads = nullptr;
+	       bart->get_max_threads = nullptr;
+	       bart->parallel = nullptr;
+	  }
+	  return bart;
+     }
+#endif /* __linux__ */
+
+#ifdef _OPENMP
+     // As GOMP_parallel(): 0 threads stands for the default team size, the flags (thread affinity) are left to the runtime
+     void run_on_team(void (*fn)(void*), void* data, unsigned num_threads, unsigned /* flags */)
+     {
+#pragma omp parallel num_threads(num_threads != 0 ? static_cast<int>(num_threads) : omp_get_max_threads())
+	  fn(data);
+     }
+#endif /* _OPENMP */
+
+     std::unique_ptr<Gadgetron::BartInstance> make_linked_instance()
+     {
+	  auto bart = std::make_unique<Gadgetron::BartInstance>();
+	  bart->index = 0;
+	  bart->handle = nullptr;
+	  bart->load_mem_cfl = &::load_mem_cfl;
+	  bart->register_mem_cfl_malloc = &::register_mem_cfl_malloc;
+	  bart->register_mem_cfl_new = &::register_mem_cfl_new;
+	  bart->register_mem_cfl_non_managed = &::register_mem_cfl_non_managed;
+	  bart->in_mem_bart_main = &::in_mem_bart_main;
+	  bart->deallocate_mem_cfl = &::deallocate_mem_cfl;
+	  bart->deallocate_all_mem_cfl = &::deallocate_all_mem_cfl;
+#ifdef _OPENMP
+	  bart->set_num_threads = &::omp_set_num_threads;
+	  bart->get_max_threads = &::omp_get_max_threads;
+	  bart->parallel = &run_on_team;
+#else
+	  bart->set_num_threads = nullptr;
+	  bart->get_max_threads = nullptr;
+	  bart->parallel = nullptr;
+#endif /* _OPENMP */
+	  return bart;
+     }
+}
+
+// =============================================================================
+
+namespace Gadgetron {
+
+     BartInstancePool::Lease& BartInstancePool::Lease::operator=(Lease&& other) noexcept
+     {
+	  if (this != &other) {
+	       release();
+	       pool_ = other.pool_;
+	       bart_ = other.bart_;
+	       other.bart_ = nullptr;
+	  }
+	  return *this;
+     }
+
+     void BartInstancePool::Lease::release()
+     {
+	  if (bart_ != nullptr) {
+	       pool_->give_back(bart_);
+	       bart_ = nullptr;
+	  }
+     }
+
+     // =========================================================================
+
+     BartInstancePool& BartInstancePool::get()
+     {
+	  static BartInstancePool pool;
+	  return pool;
+     }
+
+     BartInstancePool::~BartInstancePool()
+     {
+#if defined(__linux__)
+	  for (auto& bart: instances_) {
+	       if (bart->handle != nullptr) {
+		    dlclose(bart->handle);
+	       }
+	  }
+#endif /* __linux__ */
+     }
+
+     bool BartInstancePool::configure(size_t count, const std::string& library_path)
+     {
+	  std::lock_guard<std::mutex> lock(mtx_);
+
+	  if (is_configured_) {
+	       if (count != requested_count_ || library_path != library_path_) {
+		    GWARN("BART instance pool already configured with %lu instance(s); ignoring new configuration\n", instances_.size());
+	       }
+	       return !instances_.empty();
+	  }
+
+	  is_configured_ = true;
+	  requested_count_ = count;
+	  library_path_ = library_path;
+
+	  if (count > 1 && !library_path.empty()) {
+#if defined(__linux__)
+	       if (count > internal::MAX_ISOLATED_INSTANCES) {
+		    GWARN("Too many isolated BART instances requested (%lu), limiting to %lu\n", count, internal::MAX_ISOLATED_INSTANCES);
+		    count = internal::MAX_ISOLATED_INSTANCES;
+	       }
+
+	       for (auto i(0UL); i < count; ++i) {
+		    auto bart = internal::load_isolated_instance(i, library_path);
+		    if (!bart) {
+			 break;
+		    }
+		    instances_.push_back(std::move(bart));
+	       }
+
+	       if (!instances_.empty()) {
+		    GDEBUG("Loaded %lu isolated BART instance(s) from %s\n", instances_.size(), library_path.c_str());
+	       }
+	       else {
+		    GWARN("Unable to load any isolated BART instance, falling back to the linked BART\n");
+	       }
+#else
+	       GWARN("Isolated BART instances are only supported on Linux, falling back to the linked BART\n");
+#endif /* __linux__ */
+	  }
+
+	  if (instances_.empty()) {
+	       instances_.push_back(internal::make_linked_instance());
+	  }
+
+	  for (auto& bart: instances_) {
+	       available_.push_back(bart.get());
+	  }
+	  return true;
+     }
+
+     BartInstancePool::Lease BartInstancePool::acquire(const BartSchedulingInfo& info, const BartCancellationToken* token)
+     {
+	  std::unique_lock<std::mutex> lock(mtx_);
+	  if (!is_configured_) {
+	       // Nobody configured the pool: use the BART linked into the gadget
+	       lock.unlock();
+	       configure(1, "");
+	       lock.lock();
+	  }
+
+	  auto is_cancelled = [token] { return token != nullptr && token->is_cancelled(); };
+	  auto me = waiting_.emplace(info, next_arrival_++);
+	  while (!cv_.wait_for(lock, internal::CANCELLATION_POLL_INTERVAL,
+			       [&] { return is_cancelled() || (!available_.empty() && next_waiting(waiting_) == me); }))
+	       ;
+	  waiting_.erase(me);
+
+	  if (is_cancelled()) {
+	       lock.unlock();
+	       dispatch();
+	       return Lease();
+	  }
+
+	  auto bart = available_.back();
+	  available_.pop_back();
+
+	  // Someone else might be served too
+	  lock.unlock();
+	  dispatch();
+	  return Lease(this, bart);
+     }
+
+     void BartInstancePool::acquire_async(const BartSchedulingInfo& info, const BartCancellationToken* token, std::function<void(Lease)> ready)
+     {
+	  {
+	       std::unique_lock<std::mutex> lock(mtx_);
+	       if (!is_configured_) {
+		    lock.unlock();
+		    configure(1, "");
+		    lock.lock();
+	       }
+	       const auto arrival = next_arrival_++;
+	       waiting_.emplace(info, arrival);
+	       async_waiters_.emplace(arrival, AsyncWaiter{token, std::move(ready)});
+	  }
+	  dispatch();
+     }
+
+     BartInstancePool::Lease BartInstancePool::try_acquire()
+     {
+	  std::lock_guard<std::mutex> lock(mtx_);
+	  if (available_.empty() || !waiting_.empty())
+	       return Lease();
+	  auto bart = available_.back();
+	  available_.pop_back();
+	  return Lease(this, bart);
+     }
+
+     void BartInstancePool::dispatch()
+     {
+	  std::vector<std::pair<std::function<void(Lease)>, BartInstance*>> served;
+	  {
+	       std::lock_guard<std::mutex> lock(mtx_);
+	       for (auto it = waiting_.begin(); it != waiting_.end();) {
+		    const auto async = async_waiters_.find(it->second);
+		    if (async != async_waiters_.end() && async->second.token != nullptr && async->second.token->is_cancelled()) {
+			 served.emplace_back(std::move(async->second.ready), nullptr);
+			 async_waiters_.erase(async);
+			 it = waiting_.erase(it);
+		    }
+		    else {
+			 ++it;
+		    }
+	       }
+
+	       // The synchronous waiters serve themselves
+	       while (!available_.empty() && !waiting_.empty()) {
+		    const auto next = next_waiting(waiting_);
+		    const auto async = async_waiters_.find(next->second);
+		    if (async == async_waiters_.end())
+			 break;
+		    served.emplace_back(std::move(async->second.ready), available_.back());
+		    available_.pop_back();
+		    async_waiters_.erase(async);
+		    waiting_.erase(next);
+	       }
+	  }
+	  cv_.notify_all();
+
+	  for (auto& s: served)
+	       s.first(s.second != nullptr ? Lease(this, s.second) : Lease());
+     }
+
+     bool BartInstancePool::should_yield(const BartSchedulingInfo& info) const
+     {
+	  std::lock_guard<std::mutex> lock(mtx_);
+	  if (!available_.empty() || waiting_.empty())
+	       return false;
+
+	  const auto next = next_waiting(waiting_);
+	  const auto& fair_share = BartFairShare::get();
+	  if (fair_share.is_enabled()) {
+	       const auto next_standing = fair_share.standing(next->first.tenant), standing = fair_share.standing(info.tenant);
+	       if (next_standing != standing)
+		    return next_standing < standing;
+	  }
+	  return next->first < info;
+     }
+
+     BartInstancePool::Waiting::const_iterator BartInstancePool::next_waiting(const Waiting& waiting)
+     {
+	  const auto& fair_share = BartFairShare::get();
+	  auto next = waiting.begin();
+	  if (next == waiting.end() || !fair_share.is_enabled())
+	       return next;
+
+	  // The most urgent job of the best standing tenants
+	  auto best = fair_share.standing(next->first.tenant);
+	  for (auto it = std::next(next); it != waiting.end() && best > 0; ++it) {
+	       const auto standing = fair_share.standing(it->first.tenant);
+	       if (standing < best) {
+		    best = standing;
+		    next = it;
+	       }
+	  }
+	  return next;
+     }
+
+     size_t BartInstancePool::size() const
+     {
+	  std::lock_guard<std::mutex> lock(mtx_);
+	  return instances_.size();
+     }
+
+     void BartInstancePool::give_back(BartInstance* bart)
+     {
+	  {
+	       std::lock_guard<std::mutex> lock(mtx_);
+	       available_.push_back(bart);
+	  }
+	  dispatch();
+     }
+}
@@ -0,0 +1,201 @@
+/****************************************************************************************************************************
+ * Description: Pool of BART instances used by the BartGadget
+ *
+ * BART keeps its state (in-memory CFL registry, option parsing, longjmp error
+ * handling) in process-wide globals. By default, a single instance bound to the
+ * BART objects linked into the gadget is used and every reconstruction is
+ * serialized on it.
+ * When BART has been compiled into a separate shared object (see the
+ * BART_ISOLATED_INSTANCES CMake option), several copies of it can be loaded into
+ * separate dlmopen() link namespaces, each one with its own fully isolated state,
+ * allowing as many reconstructions to run concurrently within the same process.
+ ****************************************************************************************************************************/
+
+#ifndef BART_INSTANCE_H
+#define BART_INSTANCE_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace Gadgetron {
+
+     //! Scheduling metadata of a BART job
+     /*!
+      * Jobs waiting for a BART instance are served earliest deadline first, ties
+      * being broken by priority (higher first) and then by arrival order.
+      * Jobs without a deadline are served in arrival order after all the others.
+      */
+     struct BartSchedulingInfo
+     {
+	  std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+	  int priority = 0;
+	  std::string tenant;	//!< Who the job is accounted to (see BartFairShare), empty for nobody
+
+	  bool operator<(const BartSchedulingInfo& other) const
+	       {
+		    if (deadline != other.deadline)
+			 return deadline < other.deadline;
+		    return priority > other.priority;
+	       }
+     };
+
+     //! Cooperative cancellation of BART jobs
+     /*!
+      * Jobs check their token while waiting for resources and between two BART
+      * commands (a BART command cannot be interrupted once started).
+      */
+     class BartCancellationToken
+     {
+     public:
+	  BartCancellationToken() = default;
+	  //! Token also cancelled whenever its parent is
+	  explicit BartCancellationToken(std::shared_ptr<const BartCancellationToken> parent) : parent_(std::move(parent)) {}
+
+	  void cancel() { is_cancelled_ = true; }
+	  bool is_cancelled() const { return is_cancelled_ || (parent_ && parent_->is_cancelled()); }
+
+     private:
+	  std::atomic<bool> is_cancelled_{false};
+	  const std::shared_ptr<const BartCancellationToken> parent_;
+     };
+
+     //! Function table of one BART instance
+     struct BartInstance
+     {
+	  size_t index;
+	  void* handle;		//!< dlmopen() handle (nullptr for the BART linked into the gadget)
+
+	  void* (*load_mem_cfl)(const char* name, unsigned int D, long dimensions[]);
+	  void (*register_mem_cfl_malloc)(const char* name, unsigned int D, const long dimensions[], void* ptr);
+	  void (*register_mem_cfl_new)(const char* name, unsigned int D, const long dimensions[], void* ptr);
+	  void (*register_mem_cfl_non_managed)(const char* name, unsigned int D, const long dims[], void* ptr);
+	  int (*in_mem_bart_main)(int argc, char* argv[], char* out);
+	  void (*deallocate_mem_cfl)(const char* name);
+	  void (*deallocate_all_mem_cfl)();
+
+	  // OpenMP runtime used by the instance (nullptr if BART was built without OpenMP)
+	  void (*set_num_threads)(int);
+	  int (*get_max_threads)();
+	  //! Runs fn(data) on each thread of the OpenMP team of the calling thread, as GOMP_parallel() does
+	  void (*parallel)(void (*fn)(void*), void* data, unsigned num_threads, unsigned flags);
+     };
+
+     class BartInstancePool
+     {
+     public:
+	  //! Exclusive access to one BART instance, returned to the pool on destruction
+	  class Lease
+	  {
+	  public:
+	       Lease() = default;
+	       Lease(BartInstancePool* pool, BartInstance* bart) : pool_(pool), bart_(bart) {}
+	       Lease(Lease&& other) noexcept : pool_(other.pool_), bart_(other.bart_) { other.bart_ = nullptr; }
+	       Lease& operator=(Lease&& other) noexcept;
+	       Lease(const Lease&) = delete;
+	       Lease& operator=(const Lease&) = delete;
+	       ~Lease() { release(); }
+
+	       void release();
+
+	       BartInstancePool& pool() const { return *pool_; }
+
+	       explicit operator bool() const { return bart_ != nullptr; }
+	       BartInstance& operator*() const { return *bart_; }
+	       BartInstance* operator->() const { return bart_; }
+
+	  private:
+	       BartInstancePool* pool_ = nullptr;
+	       BartInstance* bart_ = nullptr;
+	  };
+
+	  //! Process-wide pool shared by all BartGadget instances
+	  static BartInstancePool& get();
+
+	  //! Setup the pool
+	  /*!
+	   * With count <= 1 or an empty library path, a single instance bound to
+	   * the BART linked into the gadget is used (all reconstructions are
+	   * serialized on it).
+	   * Otherwise, count copies of the BART shared object found at library_path
+	   * are loaded into separate link namespaces (Linux only).
+	   *
+	   * The pool can only be configured once per process; subsequent calls with a
+	   * different configuration are ignored (with a warning).
+	   *
+	   * \return true if the pool is usable (possibly with fewer instances than requested)
+	   */
+	  bool configure(size_t count, const std::string& library_path);
+
+	  //! Block until a BART instance is available for this job (see BartSchedulingInfo)
+	  /*!
+	   * With fair sharing, the jobs are first ordered by the standing of their
+	   * tenant (see BartFairShare::standing()).
+	   *
+	   * \return An empty lease if the job got cancelled while waiting
+	   */
+	  Lease acquire(const BartSchedulingInfo& info = BartSchedulingInfo(), const BartCancellationToken* token = nullptr);
+
+	  //! Get a BART instance without blocking: ready is called with the lease once it is the turn of the job
+	  /*!
+	   * ready is called by whichever thread makes the instance available (possibly
+	   * this one), with an empty lease if the job got cancelled while waiting (as
+	   * noticed by dispatch()). It should not run the job itself.
+	   */
+	  void acquire_async(const BartSchedulingInfo& info, const BartCancellationToken* token, std::function<void(Lease)> ready);
+
+	  //! Get an idle BART instance right away, as long as no job is waiting for one (empty lease otherwise)
+	  Lease try_acquire();
+
+	  //! Hand the available instances to the asynchronous waiters whose turn it is, and drop the cancelled ones
+	  void dispatch();
+
+	  //! Whether a more urgent job is waiting while all the instances are busy
+	  bool should_yield(const BartSchedulingInfo& info) const;
+
+	  size_t size() const;
+
+	  //! Jobs waiting for an instance, most urgent first, with their order of arrival
+	  using Waiting = std::multiset<std::pair<BartSchedulingInfo, uint64_t>>;
+
+	  //! Waiting job to serve next (the first one unless fair sharing reorders them)
+	  static Waiting::const_iterator next_waiting(const Waiting& waiting);
+
+	  BartInstancePool(const BartInstancePool&) = delete;
+	  BartInstancePool& operator=(const BartInstancePool&) = delete;
+
+     private:
+	  BartInstancePool() = default;
+	  ~BartInstancePool();
+
+	  void give_back(BartInstance* bart);
+
+	  mutable std::mutex mtx_;
+	  std::condition_variable cv_;
+	  bool is_configured_ = false;
+	  size_t requested_count_ = 0;
+	  std::string library_path_;
+	  std::vector<std::unique_ptr<BartInstance>> instances_;
+	  std::vector<BartInstance*> available_;
+	  Waiting waiting_;
+	  struct AsyncWaiter
+	  {
+	       const BartCancellationToken* token;
+	       std::function<void(Lease)> ready;
+	  };
+	  std::map<uint64_t, AsyncWaiter> async_waiters_;	//!< By arrival
+	  uint64_t next_arrival_ = 0;
+     };
+} // namespace Gadgetron
+
+#endif //BART_INSTANCE_H
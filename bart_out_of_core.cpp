@@ -0,0 +1,163 @@
+/****************************************************************************************************************************
+ * Description: Out-of-core reconstruction of datasets larger than the memory
+ ****************************************************************************************************************************/
+
+#include "bart_out_of_core.h"
+#include "hoNDFFT.h"
+#include "log.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <functional>
+#include <numeric>
+
+#ifndef _WIN32
+#include <stdlib.h>
+#include <unistd.h>
+#endif
+
+namespace Gadgetron {
+
+     namespace {
+	  size_t number_of_lines(const std::vector<long>& dims)
+	  {
+	       return std::accumulate(dims.begin() + 1, dims.end(), size_t(1), std::multiplies<size_t>());
+	  }
+
+	  // Lines transformed at once when spilling
+	  constexpr size_t SPILL_CHUNK_LINES = 4096;
+     }
+
+#ifndef _WIN32
+
+     std::unique_ptr<BartScratchArray> BartScratchArray::create(const std::string& directory, const std::vector<long>& dims, long block_size)
+     {
+	  const auto bytes = dims[0] * number_of_lines(dims) * sizeof(std::complex<float>);
+
+	  auto path = directory;
+	  if (!path.empty() && path.back() != '/')
+	       path += '/';
+	  path += "bart_scratch_XXXXXX";
+
+	  int fd = mkstemp(&path[0]);
+	  if (fd < 0) {
+	       GERROR("Unable to create BART scratch file %s: %s\n", path.c_str(), std::strerror(errno));
+	       return nullptr;
+	  }
+	  // Only reachable through the descriptor, removed whatever happens to the process
+	  unlink(path.c_str());
+
+	  if (ftruncate(fd, static_cast<off_t>(bytes)) != 0) {
+	       GERROR("Unable to allocate %zu bytes for BART scratch file %s: %s\n", bytes, path.c_str(), std::strerror(errno));
+	       ::close(fd);
+	       return nullptr;
+	  }
+	  return std::unique_ptr<BartScratchArray>(new BartScratchArray(dims, block_size, fd));
+     }
+
+     BartScratchArray::~BartScratchArray()
+     {
+	  ::close(fd_);
+     }
+
+     bool BartScratchArray::write(long start, long size, size_t first_line, size_t count, const std::complex<float>* data) const
+     {
+	  const auto offset = (start * number_of_lines(dims_) + first_line * size) * sizeof(std::complex<float>);
+	  auto p = reinterpret_cast<const char*>(data);
+	  for (size_t done = 0, bytes = size * count * sizeof(std::complex<float>); done < bytes; ) {
+	       const auto n = pwrite(fd_, p + done, bytes - done, static_cast<off_t>(offset + done));
+	       if (n < 0 && errno == EINTR)
+		    continue;
+	       if (n <= 0) {
+		    GERROR("Unable to write BART scratch file: %s\n", std::strerror(errno));
+		    return false;
+	       }
+	       done += n;
+	  }
+	  return true;
+     }
+
+     bool BartScratchArray::read_block(long start, std::complex<float>* block) const
+     {
+	  const auto num_lines = number_of_lines(dims_);
+	  const auto size = std::min(block_size_, dims_[0] - start);
+	  const auto offset = start * num_lines * sizeof(std::complex<float>);
+	  auto p = reinterpret_cast<char*>(block);
+	  for (size_t done = 0, bytes = size * num_lines * sizeof(std::complex<float>); done < bytes; ) {
+	       const auto n = pread(fd_, p + done, bytes - done, static_cast<off_t>(offset + done));
+	       if (n < 0 && errno == EINTR)
+		    continue;
+	       if (n <= 0) {
+		    GERROR("Unable to read BART scratch file: %s\n", std::strerror(errno));
+		    return false;
+	       }
+	       done += n;
+	  }
+	  return true;
+     }
+
+#else
+
+     std::unique_ptr<BartScratchArray> BartScratchArray::create(const std::string&, const std::vector<long>&, long)
+     {
+	  GERROR("Out-of-core BART reconstructions are not supported on this platform\n");
+	  return nullptr;
+     }
+
+     BartScratchArray::~BartScratchArray() = default;
+
+     bool BartScratchArray::write(long, long, size_t, size_t, const std::complex<float>*) const
+     {
+	  return false;
+     }
+
+     bool BartScratchArray::read_block(long, std::complex<float>*) const
+     {
+	  return false;
+     }
+
+#endif /* _WIN32 */
+
+     long readout_block_size(const std::vector<long>& dims, size_t fixed_bytes, size_t budget_bytes, double expansion)
+     {
+	  const auto available = budget_bytes / std::max(expansion, 1.0) - fixed_bytes;
+	  if (available <= 0) {
+	       GWARN("The calibration data alone exceeds the BART memory budget, reconstructing one readout position at a time\n");
+	       return 1;
+	  }
+	  const auto bytes_per_position = number_of_lines(dims) * sizeof(std::complex<float>);
+	  return std::max(1L, std::min(dims[0], static_cast<long>(available / bytes_per_position)));
+     }
+
+     bool spill_to_hybrid_space(const hoNDArray<std::complex<float>>& kspace, const BartScratchArray& scratch)
+     {
+	  const auto readout = kspace.get_size(0);
+	  const auto num_lines = kspace.get_number_of_elements() / readout;
+	  const auto block_size = scratch.block_size();
+
+	  // Each chunk of lines goes to every block as one contiguous write
+	  hoNDArray<std::complex<float>> chunk;
+	  std::vector<std::complex<float>> part;
+	  for (size_t line = 0; line < num_lines; line += SPILL_CHUNK_LINES) {
+	       const auto count = std::min(SPILL_CHUNK_LINES, num_lines - line);
+	       chunk.create(std::vector<size_t>{readout, count});
+	       std::copy(kspace.begin() + line * readout, kspace.begin() + (line + count) * readout, chunk.begin());
+	       hoNDFFT<float>::instance()->ifft1c(chunk);
+	       for (long start = 0; start < static_cast<long>(readout); start += block_size) {
+		    const auto size = std::min(block_size, static_cast<long>(readout) - start);
+		    part.resize(size * count);
+		    for (size_t k = 0; k < count; ++k)
+			 std::copy(chunk.begin() + k * readout + start, chunk.begin() + k * readout + start + size, part.begin() + k * size);
+		    if (!scratch.write(start, size, line, count, part.data()))
+			 return false;
+	       }
+	  }
+	  return true;
+     }
+
+     void paste_readout_block(const std::complex<float>* block, long start, long size, long readout, size_t num_lines, std::complex<float>* images)
+     {
+	  for (size_t line = 0; line < num_lines; ++line)
+	       std::copy(block + line * size, block + (line + 1) * size, images + line * readout + start);
+     }
+} // namespace Gadgetron
@@ -0,0 +1,71 @@
+/****************************************************************************************************************************
+ * Description: Out-of-core reconstruction of datasets larger than the memory
+ *
+ * Once inverse Fourier transformed along the readout, the k-space of a Cartesian
+ * dataset is made of independent slices (one per readout position), which can be
+ * reconstructed in blocks. The hybrid-space data is kept in a scratch file laid
+ * out block after block, each block one contiguous range read back on its own,
+ * so that the memory used by BART is bounded by the size of a block instead of
+ * the dataset.
+ ****************************************************************************************************************************/
+
+#ifndef BART_OUT_OF_CORE_H
+#define BART_OUT_OF_CORE_H
+
+#include "hoNDArray.h"
+#include <complex>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace Gadgetron {
+
+     //! Complex array ([readout,...]) kept in an (already unlinked) scratch file, one block of readout positions after the other
+     /*!
+      * The block starting at readout position start is stored as [size,...] at
+      * offset start * number of lines (in elements).
+      */
+     class BartScratchArray
+     {
+     public:
+	  //! \return nullptr if the file could not be created
+	  static std::unique_ptr<BartScratchArray> create(const std::string& directory, const std::vector<long>& dims, long block_size);
+
+	  BartScratchArray(const BartScratchArray&) = delete;
+	  BartScratchArray& operator=(const BartScratchArray&) = delete;
+	  ~BartScratchArray();
+
+	  const std::vector<long>& dims() const { return dims_; }
+	  long block_size() const { return block_size_; }
+
+	  //! Write the readout positions [start, start + size) of count lines from first_line on, given as [size, count]
+	  bool write(long start, long size, size_t first_line, size_t count, const std::complex<float>* data) const;
+
+	  //! Read the block starting at readout position start ([size,...])
+	  bool read_block(long start, std::complex<float>* block) const;
+
+     private:
+	  BartScratchArray(std::vector<long> dims, long block_size, int fd) : dims_(std::move(dims)), block_size_(block_size), fd_(fd) {}
+
+	  std::vector<long> dims_;
+	  long block_size_;
+	  int fd_;
+     };
+
+     //! Number of readout positions per block for a job on dims ([E0,...]) to fit the budget
+     /*!
+      * \param fixed_bytes Size of the inputs given whole to every block (eg. the calibration k-space and sensitivities)
+      * \param expansion   Memory used by the BART commands per byte of input
+      * \return dims[0] if the whole dataset fits
+      */
+     long readout_block_size(const std::vector<long>& dims, size_t fixed_bytes, size_t budget_bytes, double expansion);
+
+     //! Copy k-space into the scratch array, inverse Fourier transformed along the readout
+     bool spill_to_hybrid_space(const hoNDArray<std::complex<float>>& kspace, const BartScratchArray& scratch);
+
+     //! Scatter a block ([size,...]) into the readout positions [start, start + size) of images ([readout,...])
+     void paste_readout_block(const std::complex<float>* block, long start, long size, long readout, size_t num_lines, std::complex<float>* images);
+} // namespace Gadgetron
+
+#endif //BART_OUT_OF_CORE_H
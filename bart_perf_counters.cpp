@@ -0,0 +1,206 @@
+/****************************************************************************************************************************
+ * Description: Hardware performance counters of BART commands
+ ****************************************************************************************************************************/
+
+#include "bart_perf_counters.h"
+#include "bart_instance.h"
+#include "log.h"
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+#include <sstream>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace internal {
+     // Cleared on the first failure, not to retry (and warn) for every command
+     std::atomic<bool> are_counters_available{true};
+
+#ifdef __linux__
+     const uint64_t COUNTED_EVENTS[] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES};
+     constexpr size_t NUM_COUNTED_EVENTS = sizeof(COUNTED_EVENTS) / sizeof(COUNTED_EVENTS[0]);
+
+     // Counter of the calling thread
+     int open_counter(uint64_t event)
+     {
+	  perf_event_attr attr;
+	  std::memset(&attr, 0, sizeof(attr));
+	  attr.size = sizeof(attr);
+	  attr.type = PERF_TYPE_HARDWARE;
+	  attr.config = event;
+	  attr.disabled = 1;
+	  attr.inherit = 1;		// threads created by the command
+	  attr.exclude_kernel = 1;	// allowed with perf_event_paranoid = 2
+	  attr.exclude_hv = 1;
+	  attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+	  return static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+     }
+
+     // Scaled for the time the counter was multiplexed out
+     uint64_t read_counter(int fd)
+     {
+	  uint64_t values[3] = {0, 0, 0};
+	  if (read(fd, values, sizeof(values)) != sizeof(values) || values[2] == 0)
+	       return 0;
+	  return values[2] < values[1] ? static_cast<uint64_t>(double(values[0]) * values[1] / values[2]) : values[0];
+     }
+#endif
+}
+
+namespace Gadgetron {
+
+     double BartPerfSample::bandwidth() const
+     {
+	  const auto seconds = std::chrono::duration<double>(elapsed).count();
+	  return seconds > 0 ? bytes_from_memory() / seconds : 0.;
+     }
+
+     std::string BartPerfSample::describe() const
+     {
+	  char buff[256];
+	  snprintf(buff, sizeof(buff), "%.2g cycles, IPC %.2f, %.2g LLC misses, %.2f GB/s, %.3f bytes/instruction",
+		   double(cycles), ipc(), double(cache_misses), bandwidth() / 1e9, bytes_per_instruction());
+	  return buff;
+     }
+
+     BartPerfCounters::~BartPerfCounters()
+     {
+	  close_all();
+     }
+
+     void BartPerfCounters::close_all()
+     {
+#ifdef __linux__
+	  for (auto fd: fds_)
+	       ::close(fd);
+#endif
+	  fds_.clear();
+     }
+
+     bool BartPerfCounters::start(const BartInstance& bart)
+     {
+	  close_all();
+	  if (!internal::are_counters_available)
+	       return false;
+
+#ifdef __linux__
+	  // One set of counters per thread of the OpenMP team the command will run on (the calling thread
+	  // included), as the runtime of the instance reuses the same threads for all the parallel regions
+	  int error = 0;
+	  if (bart.parallel != nullptr) {
+	       struct Team
+	       {
+		    BartPerfCounters* counters;
+		    std::atomic<int> error;
+	       } team{this, {0}};
+	       bart.parallel([](void* data) {
+		    auto& team = *static_cast<Team*>(data);
+		    if (const auto thread_error = team.counters->open_thread_counters())
+			 team.error = thread_error;
+	       }, &team, 0, 0);
+	       error = team.error;
+	  } else {
+	       error = open_thread_counters();
+	  }
+
+	  if (error != 0) {
+	       if (internal::are_counters_available.exchange(false))
+		    GWARN("Hardware performance counters are not available (%s), BART commands are not counted\n", std::strerror(error));
+	       close_all();
+	       return false;
+	  }
+
+	  for (auto fd: fds_)
+	       ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+	  start_ = std::chrono::steady_clock::now();
+	  return true;
+#else
+	  if (internal::are_counters_available.exchange(false))
+	       GWARN("Hardware performance counters are not available on this platform\n");
+	  return false;
+#endif
+     }
+
+     int BartPerfCounters::open_thread_counters()
+     {
+#ifdef __linux__
+	  int fds[internal::NUM_COUNTED_EVENTS];
+	  for (size_t k = 0; k < internal::NUM_COUNTED_EVENTS; ++k) {
+	       fds[k] = internal::open_counter(internal::COUNTED_EVENTS[k]);
+	       if (fds[k] < 0) {
+		    // Never keep part of the counters of a thread
+		    const auto error = errno;
+		    for (size_t i = 0; i < k; ++i)
+			 ::close(fds[i]);
+		    return error;
+	       }
+	  }
+	  std::lock_guard<std::mutex> lock(mtx_);
+	  fds_.insert(fds_.end(), std::begin(fds), std::end(fds));
+	  return 0;
+#else
+	  return ENOSYS;
+#endif
+     }
+
+     BartPerfSample BartPerfCounters::stop()
+     {
+	  BartPerfSample sample;
+#ifdef __linux__
+	  if (fds_.empty())
+	       return sample;
+	  sample.elapsed = std::chrono::steady_clock::now() - start_;
+	  for (auto fd: fds_)
+	       ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+	  for (size_t i = 0; i + 2 < fds_.size(); i += 3) {
+	       sample.cycles += internal::read_counter(fds_[i]);
+	       sample.instructions += internal::read_counter(fds_[i + 1]);
+	       sample.cache_misses += internal::read_counter(fds_[i + 2]);
+	  }
+	  sample.valid = sample.cycles > 0;
+	  close_all();
+#endif
+	  return sample;
+     }
+
+     // =========================================================================
+
+     BartPerfProfile& BartPerfProfile::get()
+     {
+	  static BartPerfProfile profile;
+	  return profile;
+     }
+
+     void BartPerfProfile::add(const std::string& command, const BartPerfSample& sample)
+     {
+	  if (!sample.valid)
+	       return;
+	  std::lock_guard<std::mutex> lock(mtx_);
+	  auto& totals = commands_[command];
+	  ++totals.calls;
+	  totals.sum.valid = true;
+	  totals.sum.cycles += sample.cycles;
+	  totals.sum.instructions += sample.instructions;
+	  totals.sum.cache_misses += sample.cache_misses;
+	  totals.sum.elapsed += sample.elapsed;
+     }
+
+     std::string BartPerfProfile::report() const
+     {
+	  std::lock_guard<std::mutex> lock(mtx_);
+	  std::ostringstream report;
+	  for (const auto& command: commands_) {
+	       report << "  " << command.first << " (" << command.second.calls << " calls, "
+		      << std::chrono::duration<double, std::milli>(command.second.sum.elapsed).count() << " ms): "
+		      << command.second.sum.describe() << "\n";
+	  }
+	  return report.str();
+     }
+} // namespace Gadgetron
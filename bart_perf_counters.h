@@ -0,0 +1,99 @@
+/****************************************************************************************************************************
+ * Description: Hardware performance counters of BART commands
+ *
+ * Cycles, instructions and last level cache misses of a command are counted
+ * with perf_event_open(), on the thread running it and the OpenMP team of that
+ * thread in the BART instance, so that compute-bound and memory-bound commands
+ * can be told apart. Commands running concurrently on other instances are not
+ * counted.
+ * Where the counters are not available (other platforms, containers or VMs
+ * without a PMU, perf_event_paranoid too high), nothing is counted.
+ ****************************************************************************************************************************/
+
+#ifndef BART_PERF_COUNTERS_H
+#define BART_PERF_COUNTERS_H
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace Gadgetron {
+
+     struct BartInstance;
+
+     struct BartPerfSample
+     {
+	  bool valid = false;
+	  uint64_t cycles = 0;
+	  uint64_t instructions = 0;
+	  uint64_t cache_misses = 0;		//!< Last level cache
+	  std::chrono::steady_clock::duration elapsed{};
+
+	  double ipc() const { return cycles ? double(instructions) / cycles : 0.; }
+	  //! Memory traffic estimated from the cache misses (one cache line each)
+	  double bytes_from_memory() const { return cache_misses * 64.; }
+	  double bandwidth() const;		//!< In bytes per second
+	  double bytes_per_instruction() const { return instructions ? bytes_from_memory() / instructions : 0.; }
+
+	  //! eg. "2.1e+09 cycles, IPC 1.85, 1.2e+06 LLC misses, 0.8 GB/s"
+	  std::string describe() const;
+     };
+
+     //! Counters of the commands run between start() and stop()
+     class BartPerfCounters
+     {
+     public:
+	  BartPerfCounters() = default;
+	  BartPerfCounters(const BartPerfCounters&) = delete;
+	  BartPerfCounters& operator=(const BartPerfCounters&) = delete;
+	  ~BartPerfCounters();
+
+	  //! Count the calling thread and its OpenMP team in the runtime of bart
+	  /*!
+	   * \return false if the counters are not available (reported once per process)
+	   */
+	  bool start(const BartInstance& bart);
+	  BartPerfSample stop();
+
+     private:
+	  void close_all();
+	  //! Counters of the calling thread (and of the threads it creates), errno if they cannot be opened
+	  int open_thread_counters();
+
+	  std::mutex mtx_;		//!< Counters opened by the OpenMP team
+	  std::vector<int> fds_;		//!< cycles, instructions and cache misses of each thread
+	  std::chrono::steady_clock::time_point start_;
+     };
+
+     //! Counters aggregated per BART command (eg. "pics"), over the whole process
+     class BartPerfProfile
+     {
+     public:
+	  static BartPerfProfile& get();
+
+	  void add(const std::string& command, const BartPerfSample& sample);
+
+	  //! One line per command, with derived IPC and bandwidth (empty if nothing was counted)
+	  std::string report() const;
+
+	  BartPerfProfile(const BartPerfProfile&) = delete;
+	  BartPerfProfile& operator=(const BartPerfProfile&) = delete;
+
+     private:
+	  BartPerfProfile() = default;
+
+	  struct Totals
+	  {
+	       uint64_t calls = 0;
+	       BartPerfSample sum;
+	  };
+
+	  mutable std::mutex mtx_;
+	  std::map<std::string, Totals> commands_;
+     };
+} // namespace Gadgetron
+
+#endif //BART_PERF_COUNTERS_H
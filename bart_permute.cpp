@@ -0,0 +1,174 @@
+/****************************************************************************************************************************
+ * Description: Permutation of the dimensions of multi-dimensional arrays
+ ****************************************************************************************************************************/
+
+#include "bart_permute.h"
+#include <algorithm>
+#include <functional>
+#include <numeric>
+
+namespace internal {
+     using cfloat = std::complex<float>;
+
+     constexpr int MAX_RANK = 16;
+     // Tiles of 32 x 32 complex floats (8 KiB) when the contiguous dimension moves
+     constexpr long TILE = 32;
+
+     // Drop the singleton dimensions and merge the input dimensions staying next to each other in the output
+     void reduce(const std::vector<long>& dims, const std::vector<int>& order, std::vector<long>& reduced_dims, std::vector<int>& reduced_order)
+     {
+	  std::vector<std::pair<int, int>> groups;	// [first, last] input dimensions of each output dimension
+	  for (auto d: order) {
+	       if (dims[d] == 1)
+		    continue;
+	       const auto follows = !groups.empty() && d > groups.back().second
+		    && std::all_of(dims.begin() + groups.back().second + 1, dims.begin() + d, [](long n) { return n == 1; });
+	       if (follows)
+		    groups.back().second = d;
+	       else
+		    groups.emplace_back(d, d);
+	  }
+
+	  std::vector<int> by_input(groups.size());
+	  std::iota(by_input.begin(), by_input.end(), 0);
+	  std::sort(by_input.begin(), by_input.end(), [&](int a, int b) { return groups[a].first < groups[b].first; });
+
+	  reduced_dims.assign(groups.size(), 1);
+	  reduced_order.assign(groups.size(), 0);
+	  for (size_t k = 0; k < by_input.size(); ++k) {
+	       const auto& group = groups[by_input[k]];
+	       reduced_dims[k] = std::accumulate(dims.begin() + group.first, dims.begin() + group.second + 1, 1L, std::multiplies<long>());
+	       reduced_order[by_input[k]] = static_cast<int>(k);
+	  }
+     }
+
+     // Output dimension d is input dimension order[d]; the dimensions are reduced (see reduce())
+     template <int RANK_MAX>
+     inline void permute_kernel(int rank, const int* order, const long* dims, const cfloat* in, cfloat* out)
+     {
+	  long in_strides[RANK_MAX] = {}, out_dims[RANK_MAX] = {}, src[RANK_MAX] = {}, dst[RANK_MAX] = {}, index[RANK_MAX] = {};
+	  long stride = 1;
+	  for (int i = 0; i < rank; ++i) {
+	       in_strides[i] = stride;
+	       stride *= dims[i];
+	  }
+	  stride = 1;
+	  for (int d = 0; d < rank; ++d) {
+	       out_dims[d] = dims[order[d]];
+	       src[d] = in_strides[order[d]];
+	       dst[d] = stride;
+	       stride *= out_dims[d];
+	  }
+	  const auto total = stride;
+
+	  // Output dimension of the contiguous input dimension
+	  int inner = 0;
+	  while (order[inner] != 0)
+	       ++inner;
+	  const auto plane = inner == 0 ? out_dims[0] : out_dims[0] * out_dims[inner];
+
+	  for (long done = 0; done < total; done += plane) {
+	       long in_offset = 0, out_offset = 0;
+	       for (int d = 1; d < rank; ++d) {
+		    if (d != inner) {
+			 in_offset += index[d] * src[d];
+			 out_offset += index[d] * dst[d];
+		    }
+	       }
+
+	       if (inner == 0) {
+		    std::copy(in + in_offset, in + in_offset + out_dims[0], out + out_offset);
+	       }
+	       else {
+		    const auto n0 = out_dims[0], n1 = out_dims[inner], s0 = src[0], d1 = dst[inner];
+		    const auto from = in + in_offset;
+		    const auto to = out + out_offset;
+		    for (long j0 = 0; j0 < n1; j0 += TILE) {
+			 const auto j1 = std::min(j0 + TILE, n1);
+			 for (long i0 = 0; i0 < n0; i0 += TILE) {
+			      const auto i1 = std::min(i0 + TILE, n0);
+			      for (long j = j0; j < j1; ++j)
+				   for (long i = i0; i < i1; ++i)
+					to[i + j * d1] = from[i * s0 + j];
+			 }
+		    }
+	       }
+
+	       for (int d = 1; d < rank; ++d) {
+		    if (d == inner)
+			 continue;
+		    if (++index[d] < out_dims[d])
+			 break;
+		    index[d] = 0;
+	       }
+	  }
+     }
+
+     // Rank and order known at compile time: the strides and loops are resolved by the compiler
+     template <int... ORDER>
+     struct FixedPermutation
+     {
+	  static constexpr int RANK = sizeof...(ORDER);
+
+	  static void apply(const long* dims, const cfloat* in, cfloat* out)
+	       {
+		    static constexpr int order[RANK] = {ORDER...};
+		    permute_kernel<RANK>(RANK, order, dims, in, out);
+	       }
+     };
+
+     struct Specialization
+     {
+	  std::vector<int> order;
+	  void (*apply)(const long* dims, const cfloat* in, cfloat* out);
+     };
+
+     // The reduced permutations of the usual layout changes
+     const Specialization SPECIALIZATIONS[] = {
+	  {{1, 0}, FixedPermutation<1, 0>::apply},			// eg. [image, coils] -> [coils, image]
+	  {{0, 2, 1}, FixedPermutation<0, 2, 1>::apply},		// eg. CHA <-> N, images kept whole
+	  {{1, 0, 2}, FixedPermutation<1, 0, 2>::apply},		// transposes of a batch
+	  {{2, 1, 0}, FixedPermutation<2, 1, 0>::apply},
+	  {{1, 2, 0}, FixedPermutation<1, 2, 0>::apply},
+	  {{2, 0, 1}, FixedPermutation<2, 0, 1>::apply},
+	  {{0, 2, 1, 3}, FixedPermutation<0, 2, 1, 3>::apply},		// CHA <-> N, per slice or location
+	  {{1, 0, 3, 2}, FixedPermutation<1, 0, 3, 2>::apply}};
+}
+
+namespace Gadgetron {
+
+     bool permute_dimensions(const std::vector<long>& dims, const std::vector<int>& order, const std::complex<float>* in, std::complex<float>* out)
+     {
+	  if (order.size() != dims.size() || dims.size() > static_cast<size_t>(internal::MAX_RANK))
+	       return false;
+	  std::vector<bool> seen(dims.size(), false);
+	  for (auto d: order) {
+	       if (d < 0 || d >= static_cast<int>(dims.size()) || seen[d])
+		    return false;
+	       seen[d] = true;
+	  }
+
+	  const auto total = std::accumulate(dims.begin(), dims.end(), 1L, std::multiplies<long>());
+	  if (total == 0)
+	       return true;
+
+	  std::vector<long> reduced_dims;
+	  std::vector<int> reduced_order;
+	  internal::reduce(dims, order, reduced_dims, reduced_order);
+
+	  // Only a change of the dimensions (eg. singleton dimensions moved around)
+	  if (reduced_order.size() <= 1) {
+	       std::copy(in, in + total, out);
+	       return true;
+	  }
+
+	  for (const auto& s: internal::SPECIALIZATIONS) {
+	       if (s.order == reduced_order) {
+		    s.apply(reduced_dims.data(), in, out);
+		    return true;
+	       }
+	  }
+	  internal::permute_kernel<internal::MAX_RANK>(static_cast<int>(reduced_order.size()), reduced_order.data(), reduced_dims.data(), in, out);
+	  return true;
+     }
+} // namespace Gadgetron
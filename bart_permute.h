@@ -0,0 +1,37 @@
+/****************************************************************************************************************************
+ * Description: Permutation of the dimensions of multi-dimensional arrays
+ *
+ * Moves data between Gadgetron's [E0,E1,E2,CHA,N,S,LOC] order and the orders
+ * the scripts work in (eg. virtual coils moved to dimension 4) without going
+ * through BART's generic 16-dimensional loops:
+ *  - singleton dimensions are dropped and dimensions staying next to each
+ *    other are merged, so that most permutations reduce to a plain copy or a
+ *    permutation of 2 or 3 dimensions,
+ *  - the common reduced permutations have kernels specialized at compile time
+ *    (rank and order known to the compiler),
+ *  - permutations moving the contiguous dimension are tiled so that both the
+ *    reads and the writes stay in cache,
+ *  - any other permutation goes through a generic kernel.
+ * Scripts use it through "bart transpose", run natively, and the gadget-only
+ * "bart permute" command (see bart_executor.h).
+ ****************************************************************************************************************************/
+
+#ifndef BART_PERMUTE_H
+#define BART_PERMUTE_H
+
+#include <complex>
+#include <vector>
+
+namespace Gadgetron {
+
+     //! Permute the dimensions of an array: dimension d of the output is dimension order[d] of the input
+     /*!
+      * \param dims  Dimensions of the input (Fortran order, as BART)
+      * \param order Permutation of 0 .. dims.size() - 1
+      * \param out   Does not overlap in
+      * \return false if order is not a permutation of the dimensions
+      */
+     bool permute_dimensions(const std::vector<long>& dims, const std::vector<int>& order, const std::complex<float>* in, std::complex<float>* out);
+} // namespace Gadgetron
+
+#endif //BART_PERMUTE_H
@@ -0,0 +1,178 @@
+/****************************************************************************************************************************
+ * Description: gadgetron_bart_daemon, local BART reconstruction daemon
+ *
+ * Serves the jobs of all the BartGadget instances of the node configured with
+ * BartEngine=daemon (see bart_daemon.h)
+ ****************************************************************************************************************************/
+
+#include "bart_calibration_store.h"
+#include "bart_daemon.h"
+#include "bart_fair_share.h"
+#include "bart_perf_counters.h"
+#include "bart_result_cache.h"
+#include "bart_thread_tuner.h"
+#include "log.h"
+#include <boost/program_options.hpp>
+#include <csignal>
+#include <grp.h>
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+namespace po = boost::program_options;
+
+namespace internal {
+     Gadgetron::BartDaemon* daemon_instance = nullptr;
+
+     void handle_signal(int)
+     {
+	  if (daemon_instance != nullptr) {
+	       daemon_instance->stop();
+	  }
+     }
+
+     // name:weight[:cpu_quota_seconds[:memory_quota_mb]]
+     bool parse_tenant(const std::string& spec, std::string& name, double& weight, Gadgetron::BartFairShare::Quota& quota)
+     {
+	  std::istringstream fields(spec);
+	  std::string field;
+	  if (!std::getline(fields, name, ':') || name.empty() || !std::getline(fields, field, ':'))
+	       return false;
+	  try {
+	       weight = std::stod(field);
+	       if (std::getline(fields, field, ':'))
+		    quota.cpu_seconds = std::stod(field);
+	       if (std::getline(fields, field, ':'))
+		    quota.memory_bytes = std::stoul(field) << 20;
+	  }
+	  catch (const std::exception&) {
+	       return false;
+	  }
+	  return weight > 0 && fields.eof();
+     }
+}
+
+int main(int argc, char** argv)
+{
+     std::string socket_path;
+     std::string group;
+     std::string library_path;
+     size_t num_instances(1);
+     size_t memory_budget_mb(0);
+     std::string thread_table_path;
+     int max_threads(0);
+     int fair_share_half_life(0);
+     std::vector<std::string> tenants;
+     double max_tenant_weight(1);
+     double max_tenant_cpu_quota(0);
+     size_t max_tenant_memory_quota_mb(0);
+     std::string calibration_store_path;
+     size_t calibration_store_size_mb(0);
+     float calibration_reuse_threshold(0);
+     size_t result_cache_size_mb(0);
+     std::string result_cache_path;
+     size_t result_cache_disk_size_mb(0);
+
+     po::options_description desc("Allowed options");
+     desc.add_options()
+	  ("help,h", "Produce help message")
+	  ("socket,s", po::value<std::string>(&socket_path)->default_value("/tmp/gadgetron/bart_daemon.sock"), "Unix domain socket to listen on (only accessible to the user of the daemon)")
+	  ("group,g", po::value<std::string>(&group)->default_value(""), "Group whose members may submit jobs as well (empty for none)")
+	  ("instances,n", po::value<size_t>(&num_instances)->default_value(1), "Number of isolated BART instances (> 1 requires --library)")
+	  ("library,l", po::value<std::string>(&library_path)->default_value(""), "BART shared object loaded by each isolated instance")
+	  ("memory-budget,m", po::value<size_t>(&memory_budget_mb)->default_value(0), "Memory available to the running jobs in MB (0 for unlimited)")
+	  ("thread-table,t", po::value<std::string>(&thread_table_path)->default_value(""), "File the tuned numbers of threads of the BART commands are saved to")
+	  ("max-threads", po::value<int>(&max_threads)->default_value(0), "Largest number of threads tried for a BART command (0 for the number of hardware threads)")
+	  ("fair-share-half-life", po::value<int>(&fair_share_half_life)->default_value(0), "Schedule the tenants of the jobs by fair share of the CPU time, decayed with this half-life in seconds (0 to schedule the jobs by deadline only)")
+	  ("tenant", po::value<std::vector<std::string>>(&tenants), "Weight and quotas of a tenant as name:weight[:cpu_quota_seconds[:memory_quota_mb]], the ones requested by the clients are ignored (repeatable)")
+	  ("max-tenant-weight", po::value<double>(&max_tenant_weight)->default_value(1), "Largest weight the clients may request for the other tenants")
+	  ("max-tenant-cpu-quota", po::value<double>(&max_tenant_cpu_quota)->default_value(0), "Largest CPU quota in seconds the clients may request for the other tenants (0 for none)")
+	  ("max-tenant-memory-quota", po::value<size_t>(&max_tenant_memory_quota_mb)->default_value(0), "Largest memory quota in MB the clients may request for the other tenants (0 for none)")
+	  ("calibration-store", po::value<std::string>(&calibration_store_path)->default_value(""), "Directory of the calibration store shared by the clients (on a local file system, empty for none)")
+	  ("calibration-store-size", po::value<size_t>(&calibration_store_size_mb)->default_value(2048), "Size of the calibration store in MB, least recently used calibrations are removed beyond it")
+	  ("calibration-reuse-threshold", po::value<float>(&calibration_reuse_threshold)->default_value(0.95f), "Minimal correlation between the calibration data of a job and the stored one for the stored calibration to be reused")
+	  ("result-cache-size", po::value<size_t>(&result_cache_size_mb)->default_value(0), "Size in MB of the results of the jobs of all the clients kept in memory (0 for no result cache)")
+	  ("result-cache", po::value<std::string>(&result_cache_path)->default_value(""), "Directory to keep the cached results on (local) disk as well (empty for memory only)")
+	  ("result-cache-disk-size", po::value<size_t>(&result_cache_disk_size_mb)->default_value(10240), "Size in MB of the results kept on disk by the result cache");
+
+     po::variables_map vm;
+     try
+     {
+	  po::store(po::parse_command_line(argc, argv, desc), vm);
+	  po::notify(vm);
+     }
+     catch (const po::error& e)
+     {
+	  std::cerr << e.what() << std::endl << desc << std::endl;
+	  return 1;
+     }
+
+     if (vm.count("help")) {
+	  std::cout << desc << std::endl;
+	  return 0;
+     }
+
+     if (!Gadgetron::BartInstancePool::get().configure(num_instances, library_path)) {
+	  GERROR("Unable to setup any BART instance\n");
+	  return 1;
+     }
+
+     Gadgetron::BartThreadTuner::get().configure(true, thread_table_path, max_threads);
+
+     if (fair_share_half_life > 0) {
+	  Gadgetron::BartFairShare::get().configure(std::chrono::seconds(fair_share_half_life));
+     }
+
+     if (!calibration_store_path.empty()
+	 && !Gadgetron::BartCalibrationStore::get().configure(calibration_store_path, calibration_store_size_mb << 20, calibration_reuse_threshold)) {
+	  GWARN("Running without calibration store\n");
+     }
+
+     if (result_cache_size_mb > 0
+	 && !Gadgetron::BartResultCache::get().configure(result_cache_size_mb << 20, result_cache_path, result_cache_disk_size_mb << 20)) {
+	  GWARN("Running without result cache\n");
+     }
+
+     Gadgetron::BartDaemon daemon(socket_path, memory_budget_mb << 20);
+     if (!group.empty()) {
+	  const auto entry = getgrnam(group.c_str());
+	  if (entry == nullptr) {
+	       std::cerr << "Unknown group: " << group << std::endl;
+	       return 1;
+	  }
+	  daemon.set_allowed_group(entry->gr_gid);
+     }
+     for (const auto& spec: tenants) {
+	  std::string name;
+	  double weight(1);
+	  Gadgetron::BartFairShare::Quota quota;
+	  if (!internal::parse_tenant(spec, name, weight, quota)) {
+	       std::cerr << "Invalid tenant: " << spec << std::endl << desc << std::endl;
+	       return 1;
+	  }
+	  daemon.set_tenant(name, weight, quota);
+     }
+     Gadgetron::BartFairShare::Quota max_tenant_quota;
+     max_tenant_quota.cpu_seconds = max_tenant_cpu_quota;
+     max_tenant_quota.memory_bytes = max_tenant_memory_quota_mb << 20;
+     daemon.set_tenant_limits(max_tenant_weight, max_tenant_quota);
+     internal::daemon_instance = &daemon;
+     std::signal(SIGINT, internal::handle_signal);
+     std::signal(SIGTERM, internal::handle_signal);
+
+     const auto ok = daemon.run();
+     const auto report = Gadgetron::BartFairShare::get().report();
+     if (!report.empty()) {
+	  GINFO("BART usage per tenant:\n%s", report.c_str());
+     }
+     const auto events = Gadgetron::BartPerfProfile::get().report();
+     if (!events.empty()) {
+	  GINFO("BART hardware events of the BART commands:\n%s", events.c_str());
+     }
+     if (Gadgetron::BartResultCache::get().is_enabled()) {
+	  const auto stats = Gadgetron::BartResultCache::get().statistics();
+	  GINFO("BART result cache hit rate %.1f%% (%lu lookups, %lu memory hits, %lu disk hits, %lu insertions, %lu evictions)\n",
+		100. * stats.hit_rate(), stats.lookups, stats.memory_hits, stats.disk_hits, stats.insertions, stats.evictions);
+     }
+     return ok ? 0 : 1;
+}
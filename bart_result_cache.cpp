@@ -0,0 +1,233 @@
+/****************************************************************************************************************************
+ * Description: Cache of the results of BART jobs, keyed by the content of the jobs
+ ****************************************************************************************************************************/
+
+#include "bart_result_cache.h"
+#include "bart_disk_cache.h"
+#include "bart_hash.h"
+#include "log.h"
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <numeric>
+
+// Build of the gadget and of BART, set by CMake
+#ifndef BART_RESULT_CACHE_SALT
+#define BART_RESULT_CACHE_SALT "unknown build"
+#endif /* BART_RESULT_CACHE_SALT */
+
+namespace internal {
+     constexpr uint32_t RESULT_MAGIC = 0x53455242;	// "BRES"
+     constexpr uint32_t RESULT_VERSION = 1;
+     constexpr uint64_t MAX_RESULT_DIMS = 16;
+
+     struct FileHeader
+     {
+	  uint32_t magic;
+	  uint32_t version;
+	  uint64_t key;
+	  uint64_t num_dims;		// followed by the dimensions (uint64_t), then the data
+     };
+
+     size_t get_number_of_bytes(const Gadgetron::BartResultCache::Result& result)
+     {
+	  return result.data.size() * sizeof(std::complex<float>);
+     }
+}
+
+namespace Gadgetron {
+
+     uint64_t hash_bart_job(const BartJob& job)
+     {
+	  // Another build of BART (or of the native commands) may compute different results
+	  BartHashBuilder hash;
+	  hash.add(std::string(BART_RESULT_CACHE_SALT));
+	  hash.add(job.inputs.size());
+	  for (const auto& input: job.inputs) {
+	       const auto size = std::accumulate(input.dims.begin(), input.dims.end(), size_t(1), std::multiplies<size_t>());
+	       hash.add(input.name).add(input.dims).add(input.data, size * sizeof(std::complex<float>));
+	  }
+	  hash.add(job.commands.size());
+	  for (const auto& cmdline: job.commands)
+	       hash.add(cmdline);
+	  return hash.add(job.output).digest();
+     }
+
+     // =========================================================================
+
+     BartResultCache& BartResultCache::get()
+     {
+	  static BartResultCache cache;
+	  return cache;
+     }
+
+     bool BartResultCache::configure(size_t memory_bytes, const std::string& directory, size_t disk_bytes)
+     {
+	  std::lock_guard<std::mutex> lock(mtx_);
+	  if (is_configured_) {
+	       if (memory_bytes != memory_bytes_ || directory != directory_)
+		    GWARN("BART result cache already configured, ignoring the new configuration\n");
+	       return is_enabled_;
+	  }
+	  is_configured_ = true;
+
+	  if (!directory.empty() && !prepare_cache_directory(directory))
+	       return false;
+
+	  memory_bytes_ = memory_bytes;
+	  directory_ = directory;
+	  disk_bytes_ = disk_bytes;
+	  is_enabled_ = memory_bytes_ > 0 || !directory_.empty();
+	  return is_enabled_;
+     }
+
+     bool BartResultCache::is_enabled() const
+     {
+	  std::lock_guard<std::mutex> lock(mtx_);
+	  return is_enabled_;
+     }
+
+     BartResultCache::Statistics BartResultCache::statistics() const
+     {
+	  std::lock_guard<std::mutex> lock(mtx_);
+	  return stats_;
+     }
+
+     std::shared_ptr<const BartResultCache::Result> BartResultCache::lookup(uint64_t key)
+     {
+	  {
+	       std::lock_guard<std::mutex> lock(mtx_);
+	       ++stats_.lookups;
+	       auto it = index_.find(key);
+	       if (it != index_.end()) {
+		    lru_.splice(lru_.begin(), lru_, it->second);
+		    ++stats_.memory_hits;
+		    return it->second->second;
+	       }
+	       if (directory_.empty())
+		    return nullptr;
+	  }
+
+	  auto result = read_from_disk(key);
+	  if (result) {
+	       std::lock_guard<std::mutex> lock(mtx_);
+	       ++stats_.disk_hits;
+	       insert_in_memory(key, result);
+	  }
+	  return result;
+     }
+
+     void BartResultCache::insert(uint64_t key, std::shared_ptr<const Result> result)
+     {
+	  {
+	       std::lock_guard<std::mutex> lock(mtx_);
+	       if (!is_enabled_)
+		    return;
+	       ++stats_.insertions;
+	       insert_in_memory(key, result);
+	  }
+	  write_to_disk(key, *result);
+     }
+
+     void BartResultCache::insert_in_memory(uint64_t key, std::shared_ptr<const Result> result)
+     {
+	  const auto size = internal::get_number_of_bytes(*result);
+	  if (size > memory_bytes_)
+	       return;
+
+	  auto it = index_.find(key);
+	  if (it != index_.end()) {
+	       memory_in_use_ -= internal::get_number_of_bytes(*it->second->second);
+	       lru_.erase(it->second);
+	       index_.erase(it);
+	  }
+
+	  while (!lru_.empty() && memory_in_use_ + size > memory_bytes_) {
+	       memory_in_use_ -= internal::get_number_of_bytes(*lru_.back().second);
+	       index_.erase(lru_.back().first);
+	       lru_.pop_back();
+	       ++stats_.evictions;
+	  }
+
+	  lru_.emplace_front(key, std::move(result));
+	  index_[key] = lru_.begin();
+	  memory_in_use_ += size;
+     }
+
+     std::shared_ptr<const BartResultCache::Result> BartResultCache::read_from_disk(uint64_t key) const
+     {
+	  const auto path = cache_file_path(directory_, key, ".res");
+	  std::ifstream file(path, std::ifstream::binary);
+	  if (!file)
+	       return nullptr;
+
+	  internal::FileHeader header;
+	  if (!file.read(reinterpret_cast<char*>(&header), sizeof(header))
+	      || header.magic != internal::RESULT_MAGIC || header.version != internal::RESULT_VERSION
+	      || header.key != key || header.num_dims > internal::MAX_RESULT_DIMS)
+	  {
+	       GWARN("Ignoring invalid BART result %s\n", path.c_str());
+	       return nullptr;
+	  }
+
+	  // No result larger than the disk cache is ever written: bound the size before allocating it
+	  std::vector<uint64_t> dims(header.num_dims);
+	  file.read(reinterpret_cast<char*>(dims.data()), dims.size() * sizeof(uint64_t));
+	  const auto max_elements = disk_bytes_ / sizeof(std::complex<float>);
+	  size_t elements(1);
+	  for (auto d: dims) {
+	       if (!file || d == 0 || elements > max_elements / d) {
+		    GWARN("Ignoring invalid BART result %s\n", path.c_str());
+		    return nullptr;
+	       }
+	       elements *= d;
+	  }
+
+	  auto result = std::make_shared<Result>();
+	  result->dims.assign(dims.begin(), dims.end());
+	  result->data.resize(elements);
+	  if (!file.read(reinterpret_cast<char*>(result->data.data()), internal::get_number_of_bytes(*result))) {
+	       GWARN("Ignoring truncated BART result %s\n", path.c_str());
+	       return nullptr;
+	  }
+
+	  touch_cache_file(path);
+	  return result;
+     }
+
+     void BartResultCache::write_to_disk(uint64_t key, const Result& result) const
+     {
+	  if (directory_.empty() || internal::get_number_of_bytes(result) > disk_bytes_)
+	       return;
+
+	  // Written aside and renamed, so that concurrent readers never see a partial result
+	  const auto path = cache_file_path(directory_, key, ".res");
+	  std::string tmp_path;
+	  if (!create_temporary_cache_file(path, tmp_path))
+	       return;
+	  {
+	       internal::FileHeader header{internal::RESULT_MAGIC, internal::RESULT_VERSION, key, result.dims.size()};
+	       std::vector<uint64_t> dims(result.dims.begin(), result.dims.end());
+	       std::ofstream file(tmp_path, std::ofstream::binary);
+	       file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	       file.write(reinterpret_cast<const char*>(dims.data()), dims.size() * sizeof(uint64_t));
+	       file.write(reinterpret_cast<const char*>(result.data.data()), internal::get_number_of_bytes(result));
+	       if (!file) {
+		    GERROR("Unable to write BART result %s\n", tmp_path.c_str());
+		    file.close();
+		    std::remove(tmp_path.c_str());
+		    return;
+	       }
+	  }
+#ifdef _WIN32
+	  std::remove(path.c_str());
+#endif /* _WIN32 */
+	  if (std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+	       GERROR("Unable to store BART result %s\n", path.c_str());
+	       std::remove(tmp_path.c_str());
+	       return;
+	  }
+
+	  evict_least_recently_used(directory_, ".res", disk_bytes_);
+     }
+}
@@ -0,0 +1,95 @@
+/****************************************************************************************************************************
+ * Description: Cache of the results of BART jobs, keyed by the content of the jobs
+ *
+ * Research pipelines often send the same raw data through the same chain again
+ * (retries, parameter sweeps over downstream gadgets, failover replays). Jobs
+ * with identical inputs and commands are served from memory (or from the local
+ * disk) without running BART.
+ ****************************************************************************************************************************/
+
+#ifndef BART_RESULT_CACHE_H
+#define BART_RESULT_CACHE_H
+
+#include "bart_executor.h"
+#include <complex>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace Gadgetron {
+
+     //! Digest of everything a job depends on: its inputs (names, dimensions and data), commands and output, and the build
+     uint64_t hash_bart_job(const BartJob& job);
+
+     class BartResultCache
+     {
+     public:
+	  struct Result
+	  {
+	       std::vector<size_t> dims;
+	       std::vector<std::complex<float>> data;
+	  };
+
+	  struct Statistics
+	  {
+	       uint64_t lookups = 0;
+	       uint64_t memory_hits = 0;
+	       uint64_t disk_hits = 0;
+	       uint64_t insertions = 0;
+	       uint64_t evictions = 0;		//!< From memory
+
+	       double hit_rate() const { return lookups ? static_cast<double>(memory_hits + disk_hits) / lookups : 0.; }
+	  };
+
+	  //! Process-wide cache
+	  static BartResultCache& get();
+
+	  /*!
+	   * \param memory_bytes  Size of the results kept in memory
+	   * \param directory     Where to keep the results on disk (empty for none, must be on a local file system)
+	   * \param disk_bytes    Size of the results kept on disk
+	   *
+	   * The least recently used results are evicted first. The cache can only be
+	   * configured once per process.
+	   */
+	  bool configure(size_t memory_bytes, const std::string& directory, size_t disk_bytes);
+
+	  bool is_enabled() const;
+
+	  std::shared_ptr<const Result> lookup(uint64_t key);
+	  void insert(uint64_t key, std::shared_ptr<const Result> result);
+
+	  Statistics statistics() const;
+
+	  BartResultCache(const BartResultCache&) = delete;
+	  BartResultCache& operator=(const BartResultCache&) = delete;
+
+     private:
+	  using lru_list_t = std::list<std::pair<uint64_t, std::shared_ptr<const Result>>>;
+
+	  BartResultCache() = default;
+
+	  void insert_in_memory(uint64_t key, std::shared_ptr<const Result> result);
+	  std::shared_ptr<const Result> read_from_disk(uint64_t key) const;
+	  void write_to_disk(uint64_t key, const Result& result) const;
+
+	  mutable std::mutex mtx_;
+	  bool is_configured_ = false;
+	  bool is_enabled_ = false;
+	  size_t memory_bytes_ = 0;
+	  std::string directory_;
+	  size_t disk_bytes_ = 0;
+
+	  lru_list_t lru_;	//!< Most recently used first
+	  std::unordered_map<uint64_t, lru_list_t::iterator> index_;
+	  size_t memory_in_use_ = 0;
+	  Statistics stats_;
+     };
+} // namespace Gadgetron
+
+#endif //BART_RESULT_CACHE_H
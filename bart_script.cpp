@@ -0,0 +1,198 @@
+/****************************************************************************************************************************
+ * Description: BART command scripts
+ ****************************************************************************************************************************/
+
+#include "bart_script.h"
+#include "bart_foreach.h"
+#include "log.h"
+#include <algorithm>
+#include <cctype>
+#include <fstream>
+#include <sstream>
+#include <utility>
+
+namespace internal {
+     using Gadgetron::Default_parameters;
+
+     const std::pair<const char*, uint16_t Default_parameters::*> DEFAULT_PARAMETERS[] = {
+	  {"recon_matrix_x", &Default_parameters::recon_matrix_x},
+	  {"recon_matrix_y", &Default_parameters::recon_matrix_y},
+	  {"recon_matrix_z", &Default_parameters::recon_matrix_z},
+	  {"FOV_x", &Default_parameters::FOV_x},
+	  {"FOV_y", &Default_parameters::FOV_y},
+	  {"FOV_z", &Default_parameters::FOV_z},
+	  {"acc_factor_PE1", &Default_parameters::acc_factor_PE1},
+	  {"acc_factor_PE2", &Default_parameters::acc_factor_PE2},
+	  {"reference_lines_PE1", &Default_parameters::reference_lines_PE1},
+	  {"reference_lines_PE2", &Default_parameters::reference_lines_PE2},
+	  {"virtual_channels", &Default_parameters::virtual_channels},
+	  {"last_virtual_channel", &Default_parameters::last_virtual_channel},
+	  {"readout_block_start", &Default_parameters::readout_block_start},
+	  {"readout_block_last", &Default_parameters::readout_block_last},
+	  {"readout_block_size", &Default_parameters::readout_block_size}};
+
+     const std::pair<const char*, uint16_t Default_parameters::*>* find_default_parameter(const std::string& name)
+     {
+	  for (const auto& parameter: DEFAULT_PARAMETERS)
+	       if (name == parameter.first)
+		    return &parameter;
+	  return nullptr;
+     }
+
+     void trim_script_line(std::string &str)
+     {
+	  str.erase(str.begin(), std::find_if(str.begin(), str.end(), [](int s) {return !std::isspace(s); }));
+	  str.erase(std::find_if(str.rbegin(), str.rend(), [](int s) {return !std::isspace(s);}).base(), str.end());
+     }
+}
+
+namespace Gadgetron {
+
+     bool load_bart_script(const std::string& script, std::vector<std::string>& commands)
+     {
+	  std::fstream inputFile(script);
+	  if (!inputFile)
+	  {
+	       GERROR("Unable to open %s\n", script.c_str());
+	       return false;
+	  }
+
+	  std::string Line;
+	  auto is_in_block = false;
+	  while (getline(inputFile, Line))
+	  {
+	       // crop comment
+	       Line = Line.substr(0, Line.find_first_of("#"));
+
+	       internal::trim_script_line(Line);
+	       const auto is_directive = is_foreach_directive(Line) || is_end_directive(Line);
+	       if (Line.empty() || (Line.compare(0, 4, "bart") != 0 && !is_directive))
+		    continue;
+
+	       // The blocks are parsed once their parameters are substituted, only their nesting is checked here
+	       if (is_directive && is_foreach_directive(Line) == is_in_block)
+	       {
+		    GERROR("%s: %s\n", script.c_str(), is_in_block ? "nested foreach directives are not supported" : "end directive outside of any foreach block");
+		    return false;
+	       }
+	       if (is_directive)
+		    is_in_block = !is_in_block;
+
+	       commands.push_back(Line);
+	  }
+	  if (is_in_block)
+	  {
+	       GERROR("%s: foreach block without end\n", script.c_str());
+	       return false;
+	  }
+	  return true;
+     }
+
+     void replace_default_parameters(std::string& str, const Default_parameters& dp)
+     {
+	  std::string::size_type pos = 0u;
+	  while ((pos = str.find('$', pos)) != std::string::npos)
+	  {
+	       auto pos_end = str.find(' ', pos);
+	       auto pos_diff = pos_end - pos;
+	       std::string tmp = str.substr(pos, pos_diff);
+	       tmp.erase(0, 1);
+	       const auto parameter = internal::find_default_parameter(tmp);
+	       if (parameter != nullptr)
+		    str.replace(pos, pos_diff, std::to_string(dp.*(parameter->second)));
+	       else {
+		    GERROR( "Unknown default parameter, please see the complete list of available parameters...");
+	       }
+	       pos = pos_end;
+	  }
+     }
+
+     std::vector<std::string> staging_commands(const std::vector<long>& dims, long readout_size, bool has_reference, bool has_trajectory)
+     {
+	  std::vector<std::string> commands;
+
+	  // The calibration data keeps the whole readout, see $readout_block_start to extract a block out of its results
+	  if (has_reference)
+	  {
+	       std::ostringstream cmd;
+	       cmd << "bart resize -c 0 " << dims[0] << " 1 " << dims[1] << " 2 " << dims[2] << " meas_gadgetron_ref reference_data";
+	       commands.push_back(cmd.str());
+	  }
+
+	  auto stage = [&](const std::string& input, const std::string& output) {
+	       std::ostringstream cmd;
+	       if (dims[4] != 1)
+		    cmd << "bart reshape 1023 " << readout_size << " " << dims[1] << " " << dims[2] << " " << dims[3] << " 1 1 1 " << dims[5] << " " << dims[6] << " " << dims[4] << " " << input << " " << output;
+	       else
+		    cmd << "bart fcopy " << input << " " << output;
+	       commands.push_back(cmd.str());
+	  };
+	  stage("meas_gadgetron", "input_data");
+	  if (has_trajectory)
+	       stage("meas_gadgetron_traj", "traj_data");
+	  return commands;
+     }
+
+     void set_readout_block(Default_parameters& dp, long start, long size)
+     {
+	  dp.readout_block_start = static_cast<uint16_t>(start);
+	  dp.readout_block_last = static_cast<uint16_t>(start + size - 1);
+	  dp.readout_block_size = static_cast<uint16_t>(size);
+     }
+
+     bool check_bart_script(const std::string& name, const std::vector<std::string>& commands)
+     {
+	  if (commands.empty())
+	  {
+	       GERROR("%s: no BART command\n", name.c_str());
+	       return false;
+	  }
+
+	  // Only the syntax is checked: any value of the parameters does
+	  Default_parameters dp;
+	  for (const auto& parameter: internal::DEFAULT_PARAMETERS)
+	       dp.*(parameter.second) = 1;
+
+	  auto ok = true;
+	  std::vector<std::string> substituted;
+	  for (const auto& line: commands)
+	  {
+	       auto is_valid = true;
+	       for (auto pos = line.find('$'); pos != std::string::npos; pos = line.find('$', pos + 1))
+	       {
+		    const auto parameter = line.substr(pos + 1, line.find(' ', pos) - pos - 1);
+		    if (internal::find_default_parameter(parameter) == nullptr)
+		    {
+			 GERROR("%s: unknown parameter $%s in: %s\n", name.c_str(), parameter.c_str(), line.c_str());
+			 is_valid = false;
+		    }
+	       }
+	       if (!is_foreach_directive(line) && !is_end_directive(line) && line.compare(0, 5, "bart ") != 0)
+	       {
+		    GERROR("%s: BART command without any tool: %s\n", name.c_str(), line.c_str());
+		    is_valid = false;
+	       }
+
+	       ok = ok && is_valid;
+	       substituted.push_back(line);
+	       if (is_valid)
+		    replace_default_parameters(substituted.back(), dp);
+	  }
+	  if (!ok)
+	       return false;
+
+	  for (size_t i = 0; i < substituted.size(); ++i)
+	  {
+	       BartForeachBlock block;
+	       if (!is_foreach_directive(substituted[i]))
+		    continue;
+	       if (!parse_foreach_block(substituted, i, block))
+	       {
+		    GERROR("%s: invalid foreach block\n", name.c_str());
+		    return false;
+	       }
+	       i = block.end;
+	  }
+	  return true;
+     }
+} // namespace Gadgetron
@@ -0,0 +1,74 @@
+/****************************************************************************************************************************
+ * Description: BART command scripts
+ *
+ * A script is a shell script whose lines starting with "bart" are the BART
+ * commands to run, in order. They may refer to the parameters of the dataset
+ * (see Default_parameters), eg. "bart ecalib -r$reference_lines_PE1 ...".
+ * Commands can be run once per slice of some BART dimension by enclosing them
+ * in a "foreach <dim> in <cfl>... [max <n>]" ... "end <cfl>..." block (see
+ * bart_foreach.h).
+ ****************************************************************************************************************************/
+
+#ifndef BART_SCRIPT_H
+#define BART_SCRIPT_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace Gadgetron {
+
+     // The user is free to add more parameters as the need arises.
+     struct Default_parameters 
+     {
+	  uint16_t recon_matrix_x;
+	  uint16_t recon_matrix_y;
+	  uint16_t recon_matrix_z;
+	  uint16_t FOV_x;
+	  uint16_t FOV_y;
+	  uint16_t FOV_z;
+	  uint16_t acc_factor_PE1;
+	  uint16_t acc_factor_PE2;
+	  uint16_t reference_lines_PE1;
+	  uint16_t reference_lines_PE2;
+	  uint16_t virtual_channels;		// per dataset, see VirtualCoilEnergyFraction
+	  uint16_t last_virtual_channel;	// virtual_channels - 1 (eg. for bart extract)
+	  uint16_t readout_block_start;		// out-of-core mode only (first readout position of the block)
+	  uint16_t readout_block_last;
+	  uint16_t readout_block_size;
+     };
+
+     //! Read the BART commands of a script (parameters not substituted yet)
+     bool load_bart_script(const std::string& script, std::vector<std::string>& commands);
+
+     //! Substitute the $parameters of a command line
+     void replace_default_parameters(std::string& str, const Default_parameters& dp);
+
+     //! Commands staging the inputs of the gadget as the CFLs the scripts read
+     /*!
+      * reference_data (meas_gadgetron_ref zero-padded to the readout and lines
+      * of the k-space), input_data (meas_gadgetron, its averages moved to the
+      * last BART dimension) and traj_data (meas_gadgetron_traj, likewise).
+      *
+      * \param dims		k-space [E0,E1,E2,CHA,N,S,LOC]
+      * \param readout_size	Readout positions of meas_gadgetron (less than dims[0] for a block of an out-of-core reconstruction)
+      */
+     std::vector<std::string> staging_commands(const std::vector<long>& dims, long readout_size, bool has_reference, bool has_trajectory);
+
+     //! Set $readout_block_start, $readout_block_last and $readout_block_size to the readout positions [start, start + size)
+     void set_readout_block(Default_parameters& dp, long start, long size);
+
+     //! Check a script before it runs: BART command lines, known $parameters and well-formed foreach blocks
+     bool check_bart_script(const std::string& name, const std::vector<std::string>& commands);
+
+     //! Commands of a script bundled with the gadget (false if none has this name)
+     /*!
+      * The bundled scripts are checked and compiled into the gadget library at
+      * build time (bart_embedded_scripts.cpp, generated by
+      * gadgetron_bart_embed_scripts), so that the gadget still runs them where
+      * they are not installed.
+      */
+     bool find_embedded_bart_script(const std::string& name, std::vector<std::string>& commands);
+} // namespace Gadgetron
+
+#endif //BART_SCRIPT_H
@@ -0,0 +1,464 @@
+/****************************************************************************************************************************
+ * Description: gadgetron_bart_script_tuner, trade-off between the reconstruction time and the image quality of a script
+ *
+ * The options of the BART commands of a script (eg. the iterations and the
+ * regularization of pics, the kernel size and the threshold of ecalib) and the
+ * number of virtual coils are swept over candidate values, on phantoms or on
+ * captured datasets of a protocol. Every combination is timed and its NRMSE
+ * measured against a reference: the phantom itself, or the reconstruction of
+ * the captured data by a high quality script (by default the script tuned).
+ * The Pareto front of the latency against the NRMSE is written as JSON, along
+ * with a tuned copy of the script: the fastest combination whose NRMSE is no
+ * worse than the one of the original script, up to some tolerance.
+ *
+ *   gadgetron_bart_script_tuner -s Sample_Grappa_Recon.sh --protocol knee
+ *        --sweep pics:-i=20,30,50,100,150 --sweep pics:-r=0.01,0.1
+ *        --sweep VirtualCoilEnergyFraction=0.9,0.95,0.99
+ ****************************************************************************************************************************/
+
+#include "bart_benchmark_data.h"
+#include "bart_coil_compression.h"
+#include "bart_executor.h"
+#include "log.h"
+#include <boost/program_options.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace po = boost::program_options;
+
+#ifndef BART_BENCHMARK_SCRIPT_DIR
+#define BART_BENCHMARK_SCRIPT_DIR "."
+#endif
+
+namespace internal {
+     using Gadgetron::BartBenchmarkDataset;
+
+     // Either an option of a BART tool ("pics:-i=20,50,100") or a property of the BartGadget ("VirtualCoilEnergyFraction=0.9,0.95")
+     struct Sweep
+     {
+	  std::string tool;
+	  std::string flag;
+	  std::string property;
+	  std::vector<std::string> values;
+
+	  std::string name() const { return property.empty() ? tool + " " + flag : property; }
+     };
+
+     const char* const SWEEPABLE_PROPERTIES[] = {"VirtualCoilEnergyFraction", "MaxVirtualChannels"};
+
+     struct Candidate
+     {
+	  std::vector<std::string> values;	// one per sweep, empty to keep the value of the script
+	  bool ok = false;
+	  double latency = 0;			// ms, sum over the datasets of the median latency
+	  double nrmse = 0;			// worst over the datasets
+	  bool pareto = false;
+
+	  std::string label(const std::vector<Sweep>& sweeps) const
+	       {
+		    std::string label;
+		    for (size_t s = 0; s < sweeps.size(); ++s)
+			 if (!values[s].empty())
+			      label += (label.empty() ? "" : " ") + sweeps[s].name() + "=" + values[s];
+		    return label.empty() ? "script" : label;
+	       }
+     };
+
+     bool parse_sweep(const std::string& spec, Sweep& sweep)
+     {
+	  const auto equal = spec.find('=');
+	  if (equal == std::string::npos)
+	       return false;
+	  const auto key = spec.substr(0, equal);
+	  const auto colon = key.find(':');
+	  if (colon == std::string::npos) {
+	       if (std::find(std::begin(SWEEPABLE_PROPERTIES), std::end(SWEEPABLE_PROPERTIES), key) == std::end(SWEEPABLE_PROPERTIES))
+		    return false;
+	       sweep.property = key;
+	  }
+	  else {
+	       sweep.tool = key.substr(0, colon);
+	       sweep.flag = key.substr(colon + 1);
+	       if (sweep.tool.empty() || sweep.flag.size() < 2 || sweep.flag[0] != '-')
+		    return false;
+	  }
+
+	  std::istringstream in(spec.substr(equal + 1));
+	  std::string value;
+	  while (std::getline(in, value, ','))
+	       if (!value.empty())
+		    sweep.values.push_back(value);
+	  return !sweep.values.empty();
+     }
+
+     std::vector<std::string> split_command(const std::string& command)
+     {
+	  std::istringstream in(command);
+	  std::vector<std::string> tokens;
+	  std::string token;
+	  while (in >> token)
+	       tokens.push_back(token);
+	  return tokens;
+     }
+
+     // Set an option of a command line of the tool, whether its value is attached (-i150) or not (-i 150)
+     std::string set_option(const std::string& command, const std::string& tool, const std::string& flag, const std::string& value)
+     {
+	  auto tokens = split_command(command);
+	  if (tokens.size() < 2 || tokens[0] != "bart" || tokens[1] != tool)
+	       return command;
+
+	  const auto is_long = flag.compare(0, 2, "--") == 0;
+	  bool found = false;
+	  for (size_t i = 2; i < tokens.size() && !found; ++i) {
+	       if (tokens[i] == flag && !is_long && i + 1 < tokens.size()) {
+		    tokens[i + 1] = value;
+		    found = true;
+	       }
+	       else if (tokens[i].compare(0, flag.size(), flag) == 0 && (!is_long || tokens[i][flag.size()] == '=')) {
+		    tokens[i] = flag + (is_long ? "=" : "") + value;
+		    found = true;
+	       }
+	  }
+	  if (!found)
+	       tokens.insert(tokens.begin() + 2, flag + (is_long ? "=" : "") + value);
+
+	  std::string result;
+	  for (const auto& t: tokens)
+	       result += (result.empty() ? "" : " ") + t;
+	  return result;
+     }
+
+     std::vector<std::string> apply_options(const std::vector<std::string>& commands, const std::vector<Sweep>& sweeps, const Candidate& candidate)
+     {
+	  auto result = commands;
+	  for (size_t s = 0; s < sweeps.size(); ++s)
+	       if (!candidate.values[s].empty() && sweeps[s].property.empty())
+		    for (auto& command: result)
+			 command = set_option(command, sweeps[s].tool, sweeps[s].flag, candidate.values[s]);
+	  return result;
+     }
+
+     // The parameters of the dataset, with the virtual coils the BartGadget would select with the swept properties
+     Gadgetron::Default_parameters apply_properties(const BartBenchmarkDataset& dataset, const std::vector<double>& energies,
+						    const std::vector<Sweep>& sweeps, const Candidate& candidate)
+     {
+	  Gadgetron::BartCoilCompression coil_compression;
+	  bool changed = false;
+	  for (size_t s = 0; s < sweeps.size(); ++s) {
+	       if (candidate.values[s].empty() || sweeps[s].property.empty())
+		    continue;
+	       changed = true;
+	       if (sweeps[s].property == "VirtualCoilEnergyFraction")
+		    coil_compression.energy_fraction = std::stod(candidate.values[s]);
+	       else if (sweeps[s].property == "MaxVirtualChannels")
+		    coil_compression.max_channels = std::stoi(candidate.values[s]);
+	  }
+
+	  auto result = dataset.parameters;
+	  if (changed) {
+	       // As the BartGadget (and the datasets)
+	       const auto count = Gadgetron::select_virtual_coils(energies, coil_compression.energy_fraction, coil_compression.min_channels, coil_compression.max_channels);
+	       result.virtual_channels = static_cast<uint16_t>(count);
+	       result.last_virtual_channel = static_cast<uint16_t>(count - 1);
+	  }
+	  return result;
+     }
+
+     // The script as is first, then every combination of the swept values
+     std::vector<Candidate> enumerate_candidates(const std::vector<Sweep>& sweeps)
+     {
+	  std::vector<Candidate> candidates(1);
+	  candidates[0].values.assign(sweeps.size(), "");
+
+	  std::vector<size_t> index(sweeps.size(), 0);
+	  while (!sweeps.empty()) {
+	       Candidate c;
+	       for (size_t s = 0; s < sweeps.size(); ++s)
+		    c.values.push_back(sweeps[s].values[index[s]]);
+	       candidates.push_back(c);
+
+	       size_t s = 0;
+	       while (s < sweeps.size() && ++index[s] == sweeps[s].values.size())
+		    index[s++] = 0;
+	       if (s == sweeps.size())
+		    break;
+	  }
+	  return candidates;
+     }
+
+     void mark_pareto_front(std::vector<Candidate>& candidates)
+     {
+	  for (auto& c: candidates) {
+	       c.pareto = c.ok && std::none_of(candidates.begin(), candidates.end(), [&](const Candidate& o) {
+			 return o.ok && o.latency <= c.latency && o.nrmse <= c.nrmse && (o.latency < c.latency || o.nrmse < c.nrmse);
+		    });
+	  }
+     }
+
+     // Fastest candidate no worse than the script (the first candidate) up to the tolerance
+     size_t recommend(const std::vector<Candidate>& candidates, double tolerance)
+     {
+	  size_t best = 0;
+	  for (size_t i = 1; i < candidates.size(); ++i) {
+	       const auto& c = candidates[i];
+	       if (c.ok && c.nrmse <= candidates[0].nrmse + tolerance && c.latency < candidates[best].latency)
+		    best = i;
+	  }
+	  return best;
+     }
+
+     // The script with the options of its BART commands replaced (comments and $parameters are kept)
+     bool write_tuned_script(const std::string& script, const std::string& path, const std::string& protocol,
+			     const std::vector<Sweep>& sweeps, const Candidate& candidate)
+     {
+	  std::ifstream in(script);
+	  std::ofstream out(path);
+	  if (!in || !out) {
+	       GERROR("Unable to write %s from %s\n", path.c_str(), script.c_str());
+	       return false;
+	  }
+
+	  std::string line;
+	  bool header = true;
+	  while (std::getline(in, line)) {
+	       if (header && line.compare(0, 2, "#!") != 0) {
+		    header = false;
+		    out << "# Tuned for protocol " << protocol << " by gadgetron_bart_script_tuner: " << candidate.label(sweeps) << "\n";
+		    for (size_t s = 0; s < sweeps.size(); ++s)
+			 if (!sweeps[s].property.empty() && !candidate.values[s].empty())
+			      out << "# (set the " << sweeps[s].property << " property of the BartGadget to " << candidate.values[s] << ")\n";
+	       }
+
+	       const auto comment = line.find('#');
+	       const auto code = line.substr(0, comment);
+	       const auto first = code.find_first_not_of(" \t");
+	       if (first == std::string::npos || code.compare(first, 4, "bart") != 0) {
+		    out << line << "\n";
+		    continue;
+	       }
+
+	       const auto command = apply_options({code.substr(first)}, sweeps, candidate)[0];
+	       if (split_command(command) == split_command(code))
+		    out << line << "\n";
+	       else
+		    out << code.substr(0, first) << command << (comment == std::string::npos ? "" : " " + line.substr(comment)) << "\n";
+	  }
+	  return static_cast<bool>(out);
+     }
+
+     void write_json(std::ostream& out, const std::string& protocol, const std::string& script, double tolerance, const std::vector<std::string>& datasets,
+		     const std::vector<Sweep>& sweeps, const std::vector<Candidate>& candidates, size_t recommended)
+     {
+	  using Gadgetron::json_string;
+	  out << std::setprecision(6) << "{\n  \"protocol\": " << json_string(protocol) << ",\n  \"script\": " << json_string(script)
+	      << ",\n  \"tolerance\": " << tolerance << ",\n  \"datasets\": [";
+	  for (size_t i = 0; i < datasets.size(); ++i)
+	       out << (i ? ", " : "") << json_string(datasets[i]);
+	  out << "],\n  \"candidates\": [";
+	  for (size_t i = 0; i < candidates.size(); ++i) {
+	       const auto& c = candidates[i];
+	       out << (i ? "," : "") << "\n    {\"label\": " << json_string(c.label(sweeps)) << ", \"values\": {";
+	       bool first = true;
+	       for (size_t s = 0; s < sweeps.size(); ++s) {
+		    if (c.values[s].empty())
+			 continue;
+		    out << (first ? "" : ", ") << json_string(sweeps[s].name()) << ": " << json_string(c.values[s]);
+		    first = false;
+	       }
+	       out << "}, \"status\": " << (c.ok ? "\"ok\"" : "\"failed\"");
+	       if (c.ok)
+		    out << ", \"latency_ms\": " << c.latency << ", \"nrmse\": " << c.nrmse << ", \"pareto\": " << (c.pareto ? "true" : "false");
+	       out << "}";
+	  }
+	  out << "\n  ],\n  \"pareto_front\": [";
+	  std::vector<size_t> front;
+	  for (size_t i = 0; i < candidates.size(); ++i)
+	       if (candidates[i].pareto)
+		    front.push_back(i);
+	  std::sort(front.begin(), front.end(), [&](size_t a, size_t b) { return candidates[a].latency < candidates[b].latency; });
+	  for (size_t i = 0; i < front.size(); ++i)
+	       out << (i ? ", " : "") << front[i];
+	  out << "],\n  \"recommended\": " << recommended << "\n}\n";
+     }
+}
+
+int main(int argc, char** argv)
+{
+     std::string scripts_dir;
+     std::string script;
+     std::string reference_script;
+     std::string protocol;
+     std::vector<std::string> sweep_specs;
+     std::vector<std::string> case_specs;
+     std::vector<std::string> data_paths;
+     std::vector<std::string> ref_paths;
+     std::string acc;
+     std::string output_path;
+     std::string tuned_path;
+     uint64_t seed(1);
+     double noise(0);
+     double tolerance(0.01);
+     size_t repeats(3);
+
+     po::options_description desc("Allowed options");
+     desc.add_options()
+	  ("help,h", "Produce help message")
+	  ("scripts-dir,d", po::value<std::string>(&scripts_dir)->default_value(BART_BENCHMARK_SCRIPT_DIR), "Directory of the BART scripts")
+	  ("script,s", po::value<std::string>(&script)->default_value("Sample_Grappa_Recon.sh"), "BART script to tune")
+	  ("reference-script", po::value<std::string>(&reference_script), "High quality BART script the reconstructions are compared to (defaults to the phantom itself, or to the script tuned for captured data)")
+	  ("protocol,p", po::value<std::string>(&protocol), "Name of the protocol the script is tuned for (defaults to the name of the script)")
+	  ("sweep", po::value<std::vector<std::string>>(&sweep_specs)->composing(), "Values of an option of a BART tool (eg. pics:-i=20,50,100) or of VirtualCoilEnergyFraction or MaxVirtualChannels (eg. MaxVirtualChannels=4,6,8) (repeatable)")
+	  ("case,c", po::value<std::vector<std::string>>(&case_specs)->composing(), "Phantom <nx>x<ny>x<nz>/<coils>/<acc_factor_PE1>x<acc_factor_PE2>/<reference_lines_PE1>x<reference_lines_PE2> (repeatable)")
+	  ("data", po::value<std::vector<std::string>>(&data_paths)->composing(), "Captured undersampled data, as BART files [E0,E1,E2,CHA,N,S,LOC] (repeatable)")
+	  ("ref", po::value<std::vector<std::string>>(&ref_paths)->composing(), "Captured calibration data of each --data, as BART files (repeatable)")
+	  ("acc", po::value<std::string>(&acc)->default_value("2x1"), "<acc_factor_PE1>x<acc_factor_PE2> of the captured data")
+	  ("seed", po::value<uint64_t>(&seed)->default_value(1), "Seed of the coil sensitivities and of the noise of the phantoms")
+	  ("noise", po::value<double>(&noise)->default_value(0.), "Standard deviation of the noise of the phantoms, relative to the RMS of the k-space")
+	  ("tolerance", po::value<double>(&tolerance)->default_value(0.01), "NRMSE the recommended candidate may lose over the script")
+	  ("repeats,r", po::value<size_t>(&repeats)->default_value(3), "Number of reconstructions of each dataset timed per candidate")
+	  ("output,o", po::value<std::string>(&output_path)->default_value("bart_script_tuner.json"), "JSON file the candidates are written to (- for the standard output)")
+	  ("tuned-script", po::value<std::string>(&tuned_path), "Where the recommended script is written (defaults to <protocol>_<script>)");
+
+     po::variables_map vm;
+     try
+     {
+	  po::store(po::parse_command_line(argc, argv, desc), vm);
+	  po::notify(vm);
+     }
+     catch (const po::error& e)
+     {
+	  std::cerr << e.what() << std::endl << desc << std::endl;
+	  return 1;
+     }
+
+     if (vm.count("help")) {
+	  std::cout << desc << std::endl;
+	  return 0;
+     }
+
+     if (protocol.empty())
+	  protocol = script.substr(0, script.rfind('.'));
+     if (tuned_path.empty())
+	  tuned_path = protocol + "_" + script;
+
+     std::vector<internal::Sweep> sweeps;
+     for (const auto& spec: sweep_specs) {
+	  internal::Sweep sweep;
+	  if (!internal::parse_sweep(spec, sweep)) {
+	       std::cerr << "Invalid sweep: " << spec << std::endl;
+	       return 1;
+	  }
+	  sweeps.push_back(sweep);
+     }
+
+     char x = 0;
+     long acc1 = 0, acc2 = 0;
+     std::istringstream acc_in(acc);
+     if (data_paths.size() != ref_paths.size() || !(acc_in >> acc1 >> x >> acc2) || x != 'x' || acc1 < 1 || acc2 < 1) {
+	  std::cerr << "Each --data needs a --ref, and --acc is <acc_factor_PE1>x<acc_factor_PE2>" << std::endl;
+	  return 1;
+     }
+     if (case_specs.empty() && data_paths.empty())
+	  case_specs = {"128x128x1/8/2x1/24x1", "64x64x32/8/2x2/20x12"};
+
+     if (!Gadgetron::BartInstancePool::get().configure(1, "")) {
+	  GERROR("Unable to setup BART\n");
+	  return 1;
+     }
+
+     std::vector<Gadgetron::BartBenchmarkDataset> datasets;
+     for (const auto& spec: case_specs) {
+	  Gadgetron::BartPhantomCase c;
+	  if (!Gadgetron::parse_phantom_case(spec, c)) {
+	       std::cerr << "Invalid case: " << spec << std::endl;
+	       return 1;
+	  }
+	  datasets.emplace_back();
+	  if (!Gadgetron::make_phantom_dataset(c, seed, noise, datasets.back()))
+	       return 1;
+     }
+     for (size_t i = 0; i < data_paths.size(); ++i) {
+	  datasets.emplace_back();
+	  if (!Gadgetron::load_captured_dataset(data_paths[i], ref_paths[i], static_cast<uint16_t>(acc1), static_cast<uint16_t>(acc2), datasets.back()))
+	       return 1;
+     }
+
+     std::vector<std::string> commands;
+     if (!Gadgetron::load_bart_script(scripts_dir + "/" + script, commands))
+	  return 1;
+
+     // The references of the datasets
+     std::vector<std::string> reference_commands;
+     if (reference_script.empty())
+	  reference_commands = commands;
+     else if (!Gadgetron::load_bart_script(scripts_dir + "/" + reference_script, reference_commands))
+	  return 1;
+     std::vector<std::vector<float>> references;
+     std::vector<std::vector<double>> energies;
+     std::vector<std::string> names;
+     for (const auto& dataset: datasets) {
+	  names.push_back(dataset.name);
+	  energies.push_back(Gadgetron::coil_compression_energies(dataset.ref_dims, dataset.ref.data()));
+	  if (reference_script.empty() && !dataset.truth.empty()) {
+	       references.push_back(dataset.truth);
+	       continue;
+	  }
+	  const auto run = Gadgetron::run_benchmark_script(dataset, dataset.parameters, reference_commands, 1);
+	  if (!run.ok) {
+	       GERROR("Unable to reconstruct the reference of %s\n", dataset.name.c_str());
+	       return 1;
+	  }
+	  references.emplace_back();
+	  for (const auto& v: run.image)
+	       references.back().push_back(std::abs(v));
+     }
+
+     auto candidates = internal::enumerate_candidates(sweeps);
+     for (auto& c: candidates) {
+	  const auto candidate_commands = internal::apply_options(commands, sweeps, c);
+	  c.ok = true;
+	  for (size_t d = 0; d < datasets.size() && c.ok; ++d) {
+	       const auto parameters = internal::apply_properties(datasets[d], energies[d], sweeps, c);
+	       const auto run = Gadgetron::run_benchmark_script(datasets[d], parameters, candidate_commands, repeats);
+	       c.ok = run.ok;
+	       if (run.ok) {
+		    c.latency += run.median_latency();
+		    c.nrmse = std::max(c.nrmse, Gadgetron::magnitude_nrmse(run.image, references[d]));
+	       }
+	  }
+	  std::cerr << c.label(sweeps) << ": " << (c.ok ? std::to_string(c.latency) + " ms, NRMSE " + std::to_string(c.nrmse) : std::string("failed")) << std::endl;
+     }
+     if (!candidates[0].ok) {
+	  GERROR("%s fails to reconstruct the datasets\n", script.c_str());
+	  return 1;
+     }
+
+     internal::mark_pareto_front(candidates);
+     const auto recommended = internal::recommend(candidates, tolerance);
+     std::cerr << "Recommended for " << protocol << ": " << candidates[recommended].label(sweeps) << " ("
+	       << candidates[recommended].latency << " ms instead of " << candidates[0].latency << " ms)" << std::endl;
+
+     if (!internal::write_tuned_script(scripts_dir + "/" + script, tuned_path, protocol, sweeps, candidates[recommended]))
+	  return 1;
+
+     if (output_path == "-") {
+	  internal::write_json(std::cout, protocol, script, tolerance, names, sweeps, candidates, recommended);
+     }
+     else {
+	  std::ofstream out(output_path);
+	  internal::write_json(out, protocol, script, tolerance, names, sweeps, candidates, recommended);
+	  if (!out) {
+	       GERROR("Unable to write %s\n", output_path.c_str());
+	       return 1;
+	  }
+     }
+     return 0;
+}
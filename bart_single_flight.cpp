@@ -0,0 +1,84 @@
+/****************************************************************************************************************************
+ * Description: Single-flight deduplication of the cacheable work of concurrent BART jobs
+ ****************************************************************************************************************************/
+
+#include "bart_single_flight.h"
+#include "log.h"
+
+namespace Gadgetron {
+
+     BartSingleFlight::Ticket& BartSingleFlight::Ticket::operator=(Ticket&& other) noexcept
+     {
+	  if (this != &other) {
+	       done();
+	       flights_ = other.flights_;
+	       key_ = other.key_;
+	       promise_ = std::move(other.promise_);
+	       future_ = std::move(other.future_);
+	       other.future_ = std::shared_future<void>();
+	  }
+	  return *this;
+     }
+
+     bool BartSingleFlight::Ticket::wait_for(std::chrono::milliseconds timeout) const
+     {
+	  return !future_.valid() || future_.wait_for(timeout) == std::future_status::ready;
+     }
+
+     void BartSingleFlight::Ticket::done()
+     {
+	  if (!promise_)
+	       return;
+	  // Out of the flights first: the jobs joining from now on look the result up themselves
+	  flights_->land(key_);
+	  promise_->set_value();
+	  promise_.reset();
+     }
+
+     // =========================================================================
+
+     BartSingleFlight& BartSingleFlight::get()
+     {
+	  static BartSingleFlight flights;
+	  return flights;
+     }
+
+     BartSingleFlight::Ticket BartSingleFlight::join(uint64_t key)
+     {
+	  Ticket ticket;
+	  ticket.flights_ = this;
+	  ticket.key_ = key;
+
+	  std::lock_guard<std::mutex> lock(mtx_);
+	  const auto flight = flights_.find(key);
+	  if (flight != flights_.end()) {
+	       ++stats_.waits;
+	       ticket.future_ = flight->second;
+	       GDEBUG("Waiting for the computation of %016llx by another job\n", static_cast<unsigned long long>(key));
+	  }
+	  else {
+	       ++stats_.flights;
+	       ticket.promise_ = std::make_unique<std::promise<void>>();
+	       flights_.emplace(key, ticket.promise_->get_future().share());
+	  }
+	  return ticket;
+     }
+
+     void BartSingleFlight::saved()
+     {
+	  std::lock_guard<std::mutex> lock(mtx_);
+	  ++stats_.saved;
+     }
+
+     BartSingleFlight::Statistics BartSingleFlight::statistics() const
+     {
+	  std::lock_guard<std::mutex> lock(mtx_);
+	  return stats_;
+     }
+
+     void BartSingleFlight::land(uint64_t key)
+     {
+	  std::lock_guard<std::mutex> lock(mtx_);
+	  flights_.erase(key);
+     }
+} // namespace Gadgetron
@@ -0,0 +1,90 @@
+/****************************************************************************************************************************
+ * Description: Single-flight deduplication of the cacheable work of concurrent BART jobs
+ *
+ * Jobs arriving together with the same calibration (eg. the slices of a
+ * multi-slice scan, or several connections of the same exam) would all miss
+ * the calibration store and compute the same coil compression and sensitivity
+ * maps, none of the results existing yet. The first job to join the flight of
+ * a key computes it, the others wait for it to be done and look the result up
+ * in the cache again; they compute it themselves if it is still not there
+ * (eg. the first job failed or got cancelled). The waiting jobs give their
+ * BART instance up meanwhile, the computing one keeps its instance until the
+ * result is stored.
+ ****************************************************************************************************************************/
+
+#ifndef BART_SINGLE_FLIGHT_H
+#define BART_SINGLE_FLIGHT_H
+
+#include <chrono>
+#include <cstdint>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+
+namespace Gadgetron {
+
+     class BartSingleFlight
+     {
+     public:
+	  struct Statistics
+	  {
+	       uint64_t flights = 0;	//!< Computations led
+	       uint64_t waits = 0;	//!< Jobs which waited for the computation of another one
+	       uint64_t saved = 0;	//!< Of which found its result, not computing it again
+	  };
+
+	  //! Place of a job in the flight of a key
+	  class Ticket
+	  {
+	  public:
+	       Ticket() = default;
+	       Ticket(Ticket&& other) noexcept { *this = std::move(other); }
+	       Ticket& operator=(Ticket&& other) noexcept;
+	       //! A leader which did not call done() before is done (eg. failed)
+	       ~Ticket() { done(); }
+
+	       bool is_leader() const { return promise_ != nullptr; }
+	       bool is_follower() const { return future_.valid(); }
+
+	       //! Follower: wait for the leader up to timeout, true once it is done
+	       bool wait_for(std::chrono::milliseconds timeout) const;
+
+	       //! Leader: the result is in the cache (or will never be), the followers go on
+	       void done();
+
+	  private:
+	       friend class BartSingleFlight;
+
+	       BartSingleFlight* flights_ = nullptr;
+	       uint64_t key_ = 0;
+	       std::unique_ptr<std::promise<void>> promise_;
+	       std::shared_future<void> future_;
+	  };
+
+	  //! Process-wide flights
+	  static BartSingleFlight& get();
+
+	  //! Leader ticket if no other job computes the key, follower ticket otherwise
+	  Ticket join(uint64_t key);
+
+	  //! A follower found the result of its leader
+	  void saved();
+
+	  Statistics statistics() const;
+
+	  BartSingleFlight(const BartSingleFlight&) = delete;
+	  BartSingleFlight& operator=(const BartSingleFlight&) = delete;
+
+     private:
+	  BartSingleFlight() = default;
+
+	  void land(uint64_t key);
+
+	  mutable std::mutex mtx_;
+	  std::map<uint64_t, std::shared_future<void>> flights_;
+	  Statistics stats_;
+     };
+} // namespace Gadgetron
+
+#endif //BART_SINGLE_FLIGHT_H
@@ -0,0 +1,147 @@
+/****************************************************************************************************************************
+ * Description: Online tuning of the number of threads used by BART commands
+ ****************************************************************************************************************************/
+
+#include "bart_thread_tuner.h"
+#include "bart_disk_cache.h"
+#include "log.h"
+#include <algorithm>
+#include <boost/filesystem.hpp>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <thread>
+
+namespace Gadgetron {
+
+     BartThreadTuner& BartThreadTuner::get()
+     {
+	  static BartThreadTuner tuner;
+	  return tuner;
+     }
+
+     void BartThreadTuner::configure(bool is_enabled, const std::string& table_path, int max_threads)
+     {
+	  std::lock_guard<std::mutex> lock(mtx_);
+	  if (is_configured_) {
+	       if (is_enabled != is_enabled_ || table_path != table_path_)
+		    GWARN("BART thread tuner already configured, ignoring the new configuration\n");
+	       return;
+	  }
+	  is_configured_ = true;
+	  is_enabled_ = is_enabled;
+	  table_path_ = table_path;
+
+	  if (max_threads <= 0)
+	       max_threads = std::max(static_cast<int>(std::thread::hardware_concurrency()), 1);
+
+	  // All the threads first (what BART would use anyway), then halving
+	  candidates_.push_back(max_threads);
+	  for (auto n = max_threads / 2; n >= 1; n /= 2)
+	       candidates_.push_back(n);
+
+	  load();
+     }
+
+     BartThreadTuner::Decision BartThreadTuner::choose(const std::string& signature)
+     {
+	  std::lock_guard<std::mutex> lock(mtx_);
+	  Decision decision;
+
+	  auto it = table_.find(signature);
+	  if (it != table_.end() && it->second.threads > 0) {
+	       decision.threads = it->second.threads;
+	       return decision;
+	  }
+	  if (!is_enabled_ || candidates_.empty())
+	       return decision;
+
+	  auto& entry = table_[signature];
+	  entry.timings.resize(candidates_.size());
+	  for (size_t i = 0; i < candidates_.size(); ++i) {
+	       if (entry.timings[i] == std::chrono::steady_clock::duration::zero()) {
+		    decision.threads = candidates_[i];
+		    decision.is_trial = true;
+		    break;
+	       }
+	  }
+	  return decision;
+     }
+
+     void BartThreadTuner::record(const std::string& signature, int threads, std::chrono::steady_clock::duration elapsed)
+     {
+	  std::lock_guard<std::mutex> lock(mtx_);
+	  auto it = table_.find(signature);
+	  if (it == table_.end() || it->second.threads > 0)
+	       return;
+
+	  auto& entry = it->second;
+	  auto candidate = std::find(candidates_.begin(), candidates_.end(), threads);
+	  if (candidate == candidates_.end())
+	       return;
+	  const auto index = candidate - candidates_.begin();
+	  entry.timings[index] = std::max(elapsed, std::chrono::steady_clock::duration(1));
+
+	  // Each trial is a whole command on production data: fewer threads are not tried once they stop helping
+	  const auto tried = entry.timings.begin() + index + 1;
+	  if (std::find(entry.timings.begin(), tried, std::chrono::steady_clock::duration::zero()) != tried)
+	       return;
+	  auto best = std::min_element(entry.timings.begin(), tried);
+	  if (best == tried - 1 && tried != entry.timings.end())
+	       return;
+
+	  entry.threads = candidates_[best - entry.timings.begin()];
+	  GDEBUG("BART thread tuner: %d thread(s) for %s (%.1f ms)\n", entry.threads, signature.c_str(),
+		 std::chrono::duration<double, std::milli>(*best).count());
+	  save();
+     }
+
+     // Table: one line per tuned signature, "<threads> <signature>"
+     void BartThreadTuner::load()
+     {
+	  if (table_path_.empty())
+	       return;
+
+	  boost::system::error_code ec;
+	  boost::filesystem::create_directories(boost::filesystem::path(table_path_).parent_path(), ec);
+
+	  std::ifstream file(table_path_);
+	  std::string line;
+	  while (std::getline(file, line)) {
+	       std::istringstream iss(line);
+	       int threads(0);
+	       std::string signature;
+	       if (!(iss >> threads) || threads <= 0 || !std::getline(iss >> std::ws, signature) || signature.empty())
+		    continue;
+	       table_[signature].threads = threads;
+	  }
+	  GDEBUG("BART thread tuner: %lu tuned signature(s) loaded from %s\n", table_.size(), table_path_.c_str());
+     }
+
+     void BartThreadTuner::save() const
+     {
+	  if (table_path_.empty())
+	       return;
+
+	  // The table may be shared with other processes (eg. the BART daemon): each writes aside, then renames
+	  std::string tmp_path;
+	  if (!create_temporary_cache_file(table_path_, tmp_path))
+	       return;
+	  {
+	       std::ofstream file(tmp_path);
+	       for (const auto& item: table_) {
+		    if (item.second.threads > 0)
+			 file << item.second.threads << " " << item.first << "\n";
+	       }
+	       if (!file) {
+		    GWARN("Unable to save the BART thread table to %s\n", tmp_path.c_str());
+		    std::remove(tmp_path.c_str());
+		    return;
+	       }
+	  }
+	  if (std::rename(tmp_path.c_str(), table_path_.c_str()) != 0) {
+	       GWARN("Unable to save the BART thread table to %s\n", table_path_.c_str());
+	       std::remove(tmp_path.c_str());
+	  }
+     }
+}
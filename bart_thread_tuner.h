@@ -0,0 +1,76 @@
+/****************************************************************************************************************************
+ * Description: Online tuning of the number of threads used by BART commands
+ *
+ * The best number of OpenMP (and FFTW) threads depends a lot on the command and
+ * on the size of its operands: an fft of a 2D slice does not scale like a pics
+ * of a 3D volume. The first runs of each (command, operand dimensions) signature
+ * try all the hardware threads then half as many at a time, until fewer threads
+ * get slower. The fastest count is then used for all the later runs and saved,
+ * so that the tuning survives restarts.
+ * Each command of a BART job runs with the number of threads chosen for its
+ * signature (tool and dimensions of its operands).
+ ****************************************************************************************************************************/
+
+#ifndef BART_THREAD_TUNER_H
+#define BART_THREAD_TUNER_H
+
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace Gadgetron {
+
+     class BartThreadTuner
+     {
+     public:
+	  struct Decision
+	  {
+	       int threads = 0;		//!< 0 to leave the number of threads alone
+	       bool is_trial = false;	//!< Whether the signature is still being tuned
+	  };
+
+	  //! Process-wide tuner
+	  static BartThreadTuner& get();
+
+	  /*!
+	   * \param is_enabled   Whether to tune the signatures (the tuned ones are used in any case)
+	   * \param table_path   File the tuned signatures are loaded from and saved to (empty for none)
+	   * \param max_threads  Largest number of threads to try (0 for the number of hardware threads)
+	   *
+	   * The tuner can only be configured once per process.
+	   */
+	  void configure(bool is_enabled, const std::string& table_path, int max_threads);
+
+	  //! Number of threads to run a command with this signature with
+	  Decision choose(const std::string& signature);
+
+	  //! Report how long a command took with the chosen number of threads
+	  void record(const std::string& signature, int threads, std::chrono::steady_clock::duration elapsed);
+
+	  BartThreadTuner(const BartThreadTuner&) = delete;
+	  BartThreadTuner& operator=(const BartThreadTuner&) = delete;
+
+     private:
+	  struct Entry
+	  {
+	       std::vector<std::chrono::steady_clock::duration> timings;	//!< For each candidate (zero until tried)
+	       int threads = 0;						//!< Once tuned
+	  };
+
+	  BartThreadTuner() = default;
+
+	  void load();
+	  void save() const;
+
+	  mutable std::mutex mtx_;
+	  bool is_configured_ = false;
+	  bool is_enabled_ = false;
+	  std::string table_path_;
+	  std::vector<int> candidates_;		//!< Thread counts to try, in order
+	  std::map<std::string, Entry> table_;
+     };
+} // namespace Gadgetron
+
+#endif //BART_THREAD_TUNER_H
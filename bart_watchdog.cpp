@@ -0,0 +1,120 @@
+/****************************************************************************************************************************
+ * Description: Time limits of BART jobs
+ ****************************************************************************************************************************/
+
+#include "bart_watchdog.h"
+#include "log.h"
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace internal {
+     // How often the watchdog looks at the progress of the job
+     constexpr std::chrono::milliseconds WATCHDOG_INTERVAL(10);
+
+     struct TaskState
+     {
+	  std::mutex mtx;
+	  std::condition_variable cv;
+	  bool is_done = false;
+	  bool is_successful = false;
+     };
+
+     long to_ms(std::chrono::steady_clock::duration d)
+     {
+	  return std::chrono::duration_cast<std::chrono::milliseconds>(d).count();
+     }
+}
+
+namespace Gadgetron {
+
+     const char* to_string(BartJobStatus status)
+     {
+	  switch (status) {
+	  case BartJobStatus::succeeded: return "succeeded";
+	  case BartJobStatus::failed: return "failed";
+	  case BartJobStatus::cancelled: return "cancelled";
+	  case BartJobStatus::timed_out: return "timed out";
+	  }
+	  return "unknown";
+     }
+
+     void BartAbandonedJobs::add(std::thread thread, std::function<bool()> is_finished)
+     {
+	  std::lock_guard<std::mutex> lock(mtx_);
+	  auto it = threads_.begin();
+	  while (it != threads_.end()) {
+	       if (it->second()) {
+		    it->first.join();
+		    it = threads_.erase(it);
+	       }
+	       else {
+		    ++it;
+	       }
+	  }
+	  threads_.emplace_back(std::move(thread), std::move(is_finished));
+     }
+
+     void BartAbandonedJobs::join_all()
+     {
+	  std::vector<std::pair<std::thread, std::function<bool()>>> threads;
+	  {
+	       std::lock_guard<std::mutex> lock(mtx_);
+	       threads.swap(threads_);
+	  }
+	  if (!threads.empty())
+	       GDEBUG("Waiting for %lu abandoned BART job(s) to finish their current command\n", threads.size());
+	  for (auto& thread: threads)
+	       thread.first.join();
+     }
+
+     BartJobStatus run_with_time_limits(std::function<bool()> task, const BartJob& job, const BartTimeLimits& limits, BartAbandonedJobs& abandoned)
+     {
+	  auto status_of = [&job](bool ok) {
+	       return ok ? BartJobStatus::succeeded : (is_cancelled(job) ? BartJobStatus::cancelled : BartJobStatus::failed);
+	  };
+
+	  if (limits.empty() || !job.cancellation || !job.progress) {
+	       return status_of(task());
+	  }
+
+	  auto state = std::make_shared<internal::TaskState>();
+	  std::thread thread([state, task] {
+		    auto ok = task();
+		    std::lock_guard<std::mutex> lock(state->mtx);
+		    state->is_done = true;
+		    state->is_successful = ok;
+		    state->cv.notify_all();
+	       });
+
+	  const auto start = std::chrono::steady_clock::now();
+	  std::unique_lock<std::mutex> lock(state->mtx);
+	  while (!state->cv.wait_for(lock, internal::WATCHDOG_INTERVAL, [&] { return state->is_done; }))
+	  {
+	       std::string cmdline, operands;
+	       std::chrono::steady_clock::duration elapsed;
+	       job.progress->current(cmdline, operands, elapsed);
+	       const auto total = std::chrono::steady_clock::now() - start;
+
+	       const auto command_expired = limits.command.count() > 0 && elapsed > limits.command;
+	       const auto job_expired = limits.job.count() > 0 && total > limits.job;
+	       if (command_expired || job_expired) {
+		    GERROR("BART job exceeded its %s time limit (%ld ms) after %ld ms; current command running for %ld ms: %s (operands: %s)\n",
+			   command_expired ? "per-command" : "per-job",
+			   command_expired ? static_cast<long>(limits.command.count()) : static_cast<long>(limits.job.count()),
+			   internal::to_ms(total), internal::to_ms(elapsed), cmdline.c_str(), operands.c_str());
+		    job.cancellation->cancel();
+		    lock.unlock();
+		    abandoned.add(std::move(thread), [state] {
+			      std::lock_guard<std::mutex> lock(state->mtx);
+			      return state->is_done;
+			 });
+		    return BartJobStatus::timed_out;
+	       }
+	  }
+	  lock.unlock();
+	  thread.join();
+	  return status_of(state->is_successful);
+     }
+}
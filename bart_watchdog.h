@@ -0,0 +1,77 @@
+/****************************************************************************************************************************
+ * Description: Time limits of BART jobs
+ *
+ * A BART command cannot be interrupted once started. In order to bound the
+ * latency of the gadget nevertheless, a job with time limits runs on its own
+ * thread while the caller waits for it. When a limit expires, the job is
+ * cancelled and abandoned: the caller can go on (eg. with some cheaper
+ * fallback), while the job finishes its current command in the background
+ * before releasing its BART instance. The threads of the abandoned jobs are
+ * joined by their owner (eg. when the gadget is closed).
+ * Jobs run by the daemon report their commands back to the client (see
+ * bart_daemon.h), so that the same limits apply.
+ ****************************************************************************************************************************/
+
+#ifndef BART_WATCHDOG_H
+#define BART_WATCHDOG_H
+
+#include "bart_executor.h"
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace Gadgetron {
+
+     struct BartTimeLimits
+     {
+	  std::chrono::milliseconds command{0};	//!< Limit for any single command (0 for none)
+	  std::chrono::milliseconds job{0};	//!< Limit for the whole job (0 for none)
+
+	  bool empty() const { return command.count() <= 0 && job.count() <= 0; }
+     };
+
+     enum class BartJobStatus { succeeded, failed, cancelled, timed_out };
+
+     //! Threads of the jobs abandoned by run_with_time_limits(), joined on destruction
+     class BartAbandonedJobs
+     {
+     public:
+	  BartAbandonedJobs() = default;
+	  BartAbandonedJobs(const BartAbandonedJobs&) = delete;
+	  BartAbandonedJobs& operator=(const BartAbandonedJobs&) = delete;
+	  ~BartAbandonedJobs() { join_all(); }
+
+	  //! Keep the thread of a job (the ones already finished are joined)
+	  void add(std::thread thread, std::function<bool()> is_finished);
+
+	  //! Wait for all the abandoned jobs to finish their current command
+	  void join_all();
+
+     private:
+	  std::mutex mtx_;
+	  std::vector<std::pair<std::thread, std::function<bool()>>> threads_;
+     };
+
+     //! Run a task executing some job, enforcing the time limits of the job
+     /*!
+      * Without any limit, the task is run by the calling thread.
+      * Otherwise it runs on a separate thread and the job gets cancelled as soon
+      * as a limit expires, the offending command being logged along with the
+      * dimensions of its operands.
+      *
+      * \param task       Executes job (should return false on failure)
+      * \param job        Needs a cancellation token and a progress tracker
+      * \param abandoned  Keeps the thread of the job if timed out
+      *
+      * \warning The task might outlive the call (if timed out): it must only
+      *          refer to data it shares the ownership of.
+      */
+     BartJobStatus run_with_time_limits(std::function<bool()> task, const BartJob& job, const BartTimeLimits& limits, BartAbandonedJobs& abandoned);
+
+     const char* to_string(BartJobStatus status);
+} // namespace Gadgetron
+
+#endif //BART_WATCHDOG_H
@@ -15,14 +15,27 @@
 #include <cstdlib>
 #include <ctime>
 #include <chrono>
+#include <cmath>
 #include <memory>
 #include <random>
 #include <functional>
-#include <mutex>
+#include <atomic>
 #include <boost/thread.hpp>
 #include <boost/lexical_cast.hpp>
-
-#include "bart_api.h"
+#include "bart_async.h"
+#include "bart_daemon.h"
+#include "bart_fair_share.h"
+#include "bart_calibration_store.h"
+#include "bart_cfl_registry.h"
+#include "bart_coil_compression.h"
+#include "bart_cpu_dispatch.h"
+#include "bart_out_of_core.h"
+#include "bart_perf_counters.h"
+#include "bart_script.h"
+#include "bart_result_cache.h"
+#include "bart_single_flight.h"
+#include "bart_thread_tuner.h"
+#include "hoNDFFT.h"
 
 
 namespace internal {
@@ -30,13 +43,12 @@ namespace internal {
      class ScopeGuard
      {
      public:
-	  ScopeGuard(std::string p) : p_(std::move(p)) {}
+	  ScopeGuard(std::string p) : is_active_(true), p_(std::move(p)) {}
 	  ~ScopeGuard()
 	       {
 		    if (is_active_) {
 			 cleanup(p_);
 		    }
-		    deallocate_all_mem_cfl();
 	       }
 
 	  void dismiss() { is_active_ = false; }
@@ -45,6 +57,20 @@ namespace internal {
 	  const std::string p_;
      };
 
+     class MemCflGuard
+     {
+     public:
+	  // NB: the job may have moved to another instance of the pool by the time we are done
+	  MemCflGuard(Gadgetron::BartInstancePool::Lease& bart) : bart_(bart) {}
+	  ~MemCflGuard()
+	       {
+		    if (bart_)
+			 bart_->deallocate_all_mem_cfl();
+	       }
+     private:
+	  Gadgetron::BartInstancePool::Lease& bart_;
+     };
+
      
      void cleanup(const std::string &createdFiles)
      {
@@ -66,23 +92,25 @@ namespace internal {
 	  ltrim(str);
 	  rtrim(str);
      }
-	
-     std::string get_output_filename(const std::string& bartCommandLine)
+
+     // Frees a buffer of the message once each of its users (inputs of a job) released it
+     std::function<void()> make_buffer_release(Gadgetron::hoNDArray<std::complex<float>>& buffer, int users)
+     {
+	  auto remaining = std::make_shared<std::atomic<int>>(users);
+	  return [&buffer, remaining]
+	       {
+		    if (--*remaining == 0)
+			 buffer.clear();
+	       };
+     }
+
+     // Default fair share tenant of a chain: its client (the scanner) if the header names it, otherwise its connection
+     std::string default_tenant(const ISMRMRD::IsmrmrdHeader& h)
      {
-	  boost::char_separator<char> sep(" ");
-#if 0
-	  boost::tokenizer<boost::char_separator<char>,
-			   std::string::reverse_iterator> tokens(bartCommandLine.rbegin(),
-								 bartCommandLine.rend());
-	  auto tok(*tokens.begin());
-	  return std::string(tok.rbegin(), tok.rend());
-#else 
-	  std::string outputFile;
-	  boost::tokenizer<boost::char_separator<char> > tokens(bartCommandLine, sep);
-	  for (auto tok: tokens)
-	       outputFile = tok;
-	  return outputFile;
-#endif /* 0 */
+	  if (h.acquisitionSystemInformation && h.acquisitionSystemInformation->stationName && !h.acquisitionSystemInformation->stationName->empty())
+	       return "station_" + *h.acquisitionSystemInformation->stationName;
+	  static std::atomic<unsigned long> num_connections(0);
+	  return "connection_" + std::to_string(++num_connections);
      }
 }
 
@@ -152,98 +180,119 @@ namespace Gadgetron {
 
      BartGadget::BartGadget() :
 	  BaseClass(),
-	  dp{}
+	  dp{},
+	  is_realtime_(false),
+	  cancellation_(std::make_shared<BartCancellationToken>()),
+	  abandoned_jobs_(std::make_shared<BartAbandonedJobs>())
      {}
 
-     void BartGadget::replace_default_parameters(std::string & str)
+     int BartGadget::close(unsigned long flags)
      {
-	  std::string::size_type pos = 0u;
-	  while ((pos = str.find('$', pos)) != std::string::npos)
-	  {
-	       auto pos_end = str.find(' ', pos);
-	       auto pos_diff = pos_end - pos;
-	       std::string tmp = str.substr(pos, pos_diff);
-	       tmp.erase(0, 1);
-	       if (tmp == std::string("recon_matrix_x"))
-		    str.replace(pos, pos_diff, std::to_string(dp.recon_matrix_x));
-	       else if (tmp == std::string("recon_matrix_y"))
-		    str.replace(pos, pos_diff, std::to_string(dp.recon_matrix_y));
-	       else if (tmp == std::string("recon_matrix_z"))
-		    str.replace(pos, pos_diff, std::to_string(dp.recon_matrix_z));
-	       else if (tmp == std::string("FOV_x"))
-		    str.replace(pos, pos_diff, std::to_string(dp.FOV_x));
-	       else if (tmp == std::string("FOV_y"))
-		    str.replace(pos, pos_diff, std::to_string(dp.FOV_y));
-	       else if (tmp == std::string("FOV_z"))
-		    str.replace(pos, pos_diff, std::to_string(dp.FOV_z));
-	       else if (tmp == std::string("acc_factor_PE1"))
-		    str.replace(pos, pos_diff, std::to_string(dp.acc_factor_PE1));
-	       else if (tmp == std::string("acc_factor_PE2"))
-		    str.replace(pos, pos_diff, std::to_string(dp.acc_factor_PE2));
-	       else if (tmp == std::string("reference_lines_PE1"))
-		    str.replace(pos, pos_diff, std::to_string(dp.reference_lines_PE1));
-	       else if (tmp == std::string("reference_lines_PE2"))
-		    str.replace(pos, pos_diff, std::to_string(dp.reference_lines_PE2));
-	       else {
-		    GERROR( "Unknown default parameter, please see the complete list of available parameters...");
-	       }
-	       pos = pos_end;
+	  if (flags != 0 && CancelJobsOnClose.value())
+	  {
+	       GDEBUG("BartGadget::close: Cancelling pending BART jobs\n");
+	       cancellation_->cancel();
 	  }
-     }
-
 
-     bool BartGadget::call_BART(std::string cmdline)
-     {
-	  GDEBUG_STREAM("Executing BART command: " << cmdline);
-	  enum { MAX_ARGS = 256 };
+	  if (flags != 0)
+	  {
+	       // Jobs abandoned by their time limits finish their current command before the gadget goes
+	       abandoned_jobs_->join_all();
+	  }
 
-	  // tokenize the command string into argc/argv (basic, hopefully enough)
-	  int argc(0);
-	  char* argv[MAX_ARGS];
+	  if (flags != 0 && UseResultCache.value() && BartResultCache::get().is_enabled())
+	  {
+	       const auto stats = BartResultCache::get().statistics();
+	       GINFO("BartGadget::close: Result cache hit rate %.1f%% (%lu lookups, %lu memory hits, %lu disk hits, %lu insertions, %lu evictions)\n",
+		     100. * stats.hit_rate(), stats.lookups, stats.memory_hits, stats.disk_hits, stats.insertions, stats.evictions);
+	  }
 
-	  auto cmdline_s = std::make_unique<char[]>(cmdline.size()+1);
-	  strcpy(cmdline_s.get(), cmdline.c_str());
+	  if (flags != 0 && UseCalibrationStore.value())
+	  {
+	       const auto stats = BartSingleFlight::get().statistics();
+	       GINFO("BartGadget::close: %lu calibration(s) not computed again (%lu job(s) waited for the %lu calibration(s) computed)\n",
+		     stats.saved, stats.waits, stats.flights);
+	  }
 
-	  char *p2 = strtok(cmdline_s.get(), " ");
-	  while (p2 && argc < MAX_ARGS-1)
+	  if (flags != 0 && UseFairShare.value())
 	  {
-	       argv[argc++] = p2;
-	       p2 = strtok(0, " ");
+	       const auto report = BartFairShare::get().report();
+	       if (!report.empty())
+		    GINFO("BartGadget::close: BART usage per tenant:\n%s", report.c_str());
 	  }
-	  argv[argc] = nullptr;
-	  
-	  // boost::char_separator<char> sep(" ");
-	  // boost::tokenizer<boost::char_separator<char>> tokens(cmdline.begin(),
-	  // 						       cmdline.end(),
-	  // 						       sep);
-	  // std::vector<std::unique_ptr<char[]>> tmp;
-	  // auto k(0UL);
-	  // for (auto tok: tokens) {
-	  //      tmp.push_back(std::make_unique<char[]>(tok.size()+1));
-	  //      strcpy(tmp.back().get(), tok.c_str());
-	  //      argv[k++] = tmp.back().get();
-	  // }
-	  // argc = tmp.size();
-
-	  char out_str[512] = {'\0'};
-	  auto ret(in_mem_bart_main(argc, argv, out_str));
-	  if (ret == 0) {
-	       if (strlen(out_str) > 0) {
-		    GINFO(out_str);
-	       }
-	       return true;
+
+	  if (flags != 0 && perform_timing.value())
+	  {
+	       GINFO("BartGadget::close: In-memory CFL registries: %s\n", BartCflRegistry::describe(BartCflRegistry::totals()).c_str());
 	  }
-	  else {
-	       GERROR_STREAM("BART command failed with return code: " << ret);
-	       return false;
+
+	  if (flags != 0 && CountHardwareEvents.value())
+	  {
+	       const auto report = BartPerfProfile::get().report();
+	       if (!report.empty())
+		    GINFO("BartGadget::close: Hardware performance counters of the BART commands:\n%s", report.c_str());
 	  }
+	  return BaseClass::close(flags);
      }
-     
-	
+
      int BartGadget::process_config(ACE_Message_Block * mb)
      {
 	  GADGET_CHECK_RETURN(BaseClass::process_config(mb) == GADGET_OK, GADGET_FAIL);
 
+	  const auto num_instances = static_cast<size_t>(std::max(NumberOfBartInstances.value(), 1));
+	  if (!BartInstancePool::get().configure(num_instances, num_instances > 1 ? BartInstanceLibrary_path.value() : std::string()))
+	  {
+	       GERROR("BartGadget::process_config: Unable to setup any BART instance\n");
+	       return GADGET_FAIL;
+	  }
+	  GDEBUG_CONDITION_STREAM(isVerboseON.value(), "BartGadget::process_config: Using " << BartInstancePool::get().size() << " BART instance(s)");
+
+	  if (BartEngine.value() != "in_process" && BartEngine.value() != "daemon")
+	  {
+	       GERROR("BartGadget::process_config: Unknown BART engine '%s' (should be one of: in_process, daemon)\n", BartEngine.value().c_str());
+	       return GADGET_FAIL;
+	  }
+	  GDEBUG_CONDITION_STREAM(isVerboseON.value() && BartEngine.value() == "daemon", "BartGadget::process_config: Submitting jobs to the BART daemon listening on " << BartDaemonSocket_path.value());
+
+	  if (TimeLimitAction.value() != "abort" && TimeLimitAction.value() != "fallback" && TimeLimitAction.value() != "preview")
+	  {
+	       GERROR("BartGadget::process_config: Unknown time limit action '%s' (should be one of: abort, fallback, preview)\n", TimeLimitAction.value().c_str());
+	       return GADGET_FAIL;
+	  }
+	  if (TimeLimitAction.value() == "fallback" && FallbackBartCommandScript_name.value().empty())
+	  {
+	       GERROR("BartGadget::process_config: The fallback time limit action requires FallbackBartCommandScript_name\n");
+	       return GADGET_FAIL;
+	  }
+
+	  // The scripts are checked before any data arrives
+	  script_commands_.clear();
+	  fallback_commands_.clear();
+	  out_of_core_commands_.clear();
+	  if (!load_script(BartCommandScript_name.value(), script_commands_))
+	  {
+	       return GADGET_FAIL;
+	  }
+	  if (TimeLimitAction.value() == "fallback" && !load_script(FallbackBartCommandScript_name.value(), fallback_commands_))
+	  {
+	       return GADGET_FAIL;
+	  }
+	  if (OutOfCoreMemoryBudgetInMegabytes.value() > 0)
+	  {
+	       if (OutOfCoreBartCommandScript_name.value().empty())
+		    GWARN("BartGadget::process_config: No OutOfCoreBartCommandScript_name, all the datasets are reconstructed in memory\n");
+	       else if (!load_script(OutOfCoreBartCommandScript_name.value(), out_of_core_commands_))
+		    return GADGET_FAIL;
+	  }
+
+	  // Only worth the SVD if some script asks for it
+	  auto uses_virtual_channels = [](const std::vector<std::string>& commands) {
+	       return std::any_of(commands.begin(), commands.end(), [](const std::string& cmd) {
+			 return cmd.find("$virtual_channels") != std::string::npos || cmd.find("$last_virtual_channel") != std::string::npos;
+		    });
+	  };
+	  needs_virtual_channels_ = uses_virtual_channels(script_commands_) || uses_virtual_channels(fallback_commands_) || uses_virtual_channels(out_of_core_commands_);
+
 	  /** Let's get some information about the incoming data **/
 	  ISMRMRD::IsmrmrdHeader h;
 	  try
@@ -255,6 +304,101 @@ namespace Gadgetron {
 	       GDEBUG("BartGadget::process_config: Failed to parse incoming ISMRMRD Header");
 	  }
 
+	  if (BartProtocolType.value() == "auto")
+	  {
+	       std::string protocol;
+	       if (h.measurementInformation && h.measurementInformation->protocolName)
+		    protocol = *h.measurementInformation->protocolName;
+	       std::transform(protocol.begin(), protocol.end(), protocol.begin(), ::tolower);
+	       is_realtime_ = protocol.find("realtime") != std::string::npos
+		    || protocol.find("real_time") != std::string::npos
+		    || protocol.find("real-time") != std::string::npos;
+	  }
+	  else if (BartProtocolType.value() == "realtime" || BartProtocolType.value() == "offline")
+	  {
+	       is_realtime_ = BartProtocolType.value() == "realtime";
+	  }
+	  else
+	  {
+	       GERROR("BartGadget::process_config: Unknown protocol type '%s' (should be one of: auto, realtime, offline)\n", BartProtocolType.value().c_str());
+	       return GADGET_FAIL;
+	  }
+	  GDEBUG_CONDITION_STREAM(isVerboseON.value(), "BartGadget::process_config: Scheduling jobs as " << (is_realtime_ ? "real-time" : "offline"));
+
+	  BartThreadTuner::get().configure(AutotuneBartThreads.value(), BartThreadTable_path.value(), MaxBartThreads.value());
+
+	  if (UseFairShare.value())
+	  {
+	       tenant_ = FairShareTenant.value().empty() ? internal::default_tenant(h) : FairShareTenant.value();
+	       BartFairShare::Quota quota;
+	       quota.cpu_seconds = std::max(CpuQuotaInSeconds.value(), 0.0f);
+	       quota.memory_bytes = static_cast<size_t>(std::max(MemoryQuotaInMegabytes.value(), 0)) << 20;
+	       BartFairShare::get().configure(std::chrono::seconds(FairShareHalfLifeInSeconds.value()));
+	       BartFairShare::get().set_tenant(tenant_, FairShareWeight.value(), quota);
+	       GDEBUG_CONDITION_STREAM(isVerboseON.value(), "BartGadget::process_config: Accounting the jobs to " << tenant_ << " (weight " << FairShareWeight.value() << ")");
+	  }
+
+	  use_async_ = AsyncExecution.value() && BartEngine.value() != "daemon";
+#ifdef BART_ASYNC_EXECUTION
+	  if (use_async_)
+	  {
+	       BartExecutor::get().configure(static_cast<size_t>(std::max(AsyncExecutorThreads.value(), 0)));
+	       GDEBUG_CONDITION_STREAM(isVerboseON.value(), "BartGadget::process_config: Running the jobs on " << BartExecutor::get().size() << " executor thread(s)");
+	  }
+#else
+	  if (use_async_)
+	  {
+	       GWARN("BartGadget::process_config: Asynchronous execution needs a C++20 build with coroutines, running the jobs synchronously\n");
+	       use_async_ = false;
+	  }
+#endif
+
+	  if (!force_bart_cpu_variant(CpuKernelVariant.value()))
+	  {
+	       GERROR("BartGadget::process_config: Unknown or unsupported CPU kernel variant '%s' (should be one of: auto, generic, avx2, avx512; this CPU supports up to %s)\n",
+		      CpuKernelVariant.value().c_str(), to_string(detect_bart_cpu_variant()));
+	       return GADGET_FAIL;
+	  }
+	  GDEBUG_CONDITION_STREAM(isVerboseON.value(), "BartGadget::process_config: Using the " << to_string(bart_cpu_variant()) << " CPU kernels");
+
+	  if (UseResultCache.value() && BartEngine.value() == "daemon")
+	  {
+	       GDEBUG_CONDITION_STREAM(isVerboseON.value(), "BartGadget::process_config: Results are cached by the BART daemon (see its --result-cache-size)");
+	  }
+	  else if (UseResultCache.value())
+	  {
+	       const auto memory_bytes = static_cast<size_t>(std::max(ResultCacheSizeInMegabytes.value(), 0)) << 20;
+	       const auto disk_bytes = static_cast<size_t>(std::max(ResultCacheDiskSizeInMegabytes.value(), 0)) << 20;
+	       if (!BartResultCache::get().configure(memory_bytes, ResultCache_path.value(), disk_bytes))
+	       {
+		    GWARN("BartGadget::process_config: Running without result cache\n");
+	       }
+	  }
+
+	  if (UseCalibrationStore.value())
+	  {
+	       const auto max_bytes = static_cast<size_t>(std::max(CalibrationStoreSizeInMegabytes.value(), 0)) << 20;
+	       if (!BartCalibrationStore::get().configure(CalibrationStore_path.value(), max_bytes, CalibrationReuseThreshold.value()))
+	       {
+		    GWARN("BartGadget::process_config: Running without calibration store\n");
+	       }
+
+	       // Coil configuration (the geometry is added for each dataset)
+	       std::ostringstream key;
+	       if (h.acquisitionSystemInformation)
+	       {
+		    const auto& sys = *h.acquisitionSystemInformation;
+		    key << "system=" << (sys.systemModel ? *sys.systemModel : "") << ";channels=" << (sys.receiverChannels ? *sys.receiverChannels : 0) << ";coils=";
+		    for (const auto& coil: sys.coilLabel)
+			 key << coil.coilNumber << ":" << coil.coilName << ",";
+	       }
+	       for (const auto& enc: h.encoding)
+	       {
+		    key << ";encoded=" << enc.encodedSpace.matrixSize.x << "x" << enc.encodedSpace.matrixSize.y << "x" << enc.encodedSpace.matrixSize.z
+			<< ";fov=" << enc.encodedSpace.fieldOfView_mm.x << "x" << enc.encodedSpace.fieldOfView_mm.y << "x" << enc.encodedSpace.fieldOfView_mm.z;
+	       }
+	       calibration_key_ = key.str();
+	  }
 
 	  for (const auto& enc: h.encoding)
 	  {
@@ -328,40 +472,177 @@ namespace Gadgetron {
 	  return GADGET_OK;
      }
 
-     int BartGadget::process(GadgetContainerMessage<IsmrmrdReconData>* m1)
-     {        
-	  static std::mutex mtx;
-	  std::lock_guard<std::mutex> guard(mtx);
+     BartSchedulingInfo BartGadget::make_scheduling_info() const
+     {
+	  BartSchedulingInfo info;
+	  info.priority = BartJobPriority.value();
+	  info.tenant = tenant_;
+
+	  const auto deadline_ms = is_realtime_ ? RealTimeDeadlineInMilliseconds.value() : OfflineDeadlineInMilliseconds.value();
+	  if (deadline_ms > 0)
+	       info.deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(deadline_ms);
+	  return info;
+     }
+
+     BartTimeLimits BartGadget::make_time_limits() const
+     {
+	  BartTimeLimits limits;
+	  limits.command = std::chrono::milliseconds(std::max(CommandTimeLimitInMilliseconds.value(), 0));
+	  limits.job = std::chrono::milliseconds(std::max(JobTimeLimitInMilliseconds.value(), 0));
+	  return limits;
+     }
 
-	  // Check status of bart commands script
-	  std::string CommandScript = AbsoluteBartCommandScript_path.value() + "/" + BartCommandScript_name.value();
-	  if (!boost::filesystem::exists(CommandScript))
+     std::shared_ptr<BartCopyAccounting> BartGadget::make_copy_accounting() const
+     {
+	  if (!AccountCopies.value())
+	       return nullptr;
+
+	  auto copies = std::make_shared<BartCopyAccounting>();
+	  if (StrictCopyAccounting.value())
 	  {
-	       GERROR("Can't find bart commands script: %s!\n", CommandScript.c_str());
-	       return GADGET_FAIL;
+	       std::set<std::string> allowed;
+	       boost::char_separator<char> sep(",");
+	       const auto stages = AllowedFullBufferCopies.value();
+	       boost::tokenizer<boost::char_separator<char> > tokens(stages, sep);
+	       for (auto stage: tokens)
+	       {
+		    internal::trim(stage);
+		    allowed.insert(stage);
+	       }
+	       copies->set_strict(std::move(allowed));
 	  }
+	  return copies;
+     }
 
-	  // set the permission for the script
-#ifdef _WIN32
-	  try
+     std::string BartGadget::make_calibration_key(const IsmrmrdDataBuffered& ref) const
+     {
+	  std::ostringstream key;
+	  key << calibration_key_;
+	  if (ref.headers_.get_number_of_elements() > 0)
 	  {
-	       boost::filesystem::permissions(CommandScript, boost::filesystem::all_all);
+	       // Rounded (to 0.01 mm for the positions) so that the same slice prescription gives the same key
+	       const auto& acq = ref.headers_[0];
+	       auto put = [&key](const char* name, const float (&v)[3]) {
+		    key << ";" << name << "=";
+		    for (auto x: v)
+			 key << std::lround(x * 100) << ",";
+	       };
+	       put("position", acq.position);
+	       put("read_dir", acq.read_dir);
+	       put("phase_dir", acq.phase_dir);
+	       put("slice_dir", acq.slice_dir);
+	       put("table", acq.patient_table_position);
 	  }
-	  catch (...)
+	  return key.str();
+     }
+
+     bool BartGadget::load_script(const std::string& name, std::vector<std::string>& commands) const
+     {
+	  // A script installed (and possibly edited) on disk always wins over the copy compiled into the gadget
+	  const auto script = AbsoluteBartCommandScript_path.value() + "/" + name;
+	  if (boost::filesystem::exists(script))
+	       return load_bart_script(script, commands) && check_bart_script(script, commands);
+
+	  if (UseEmbeddedScripts.value() && find_embedded_bart_script(name, commands))
 	  {
-	       GERROR("Error changing the permission of the command script.\n");
-	       return GADGET_FAIL;
+	       GINFO("BartGadget::process_config: %s not found, using the embedded %s\n", script.c_str(), name.c_str());
+	       return true;
 	  }
-#else
-	  // in case an older version of boost is used in non-win system
-	  // the system call is used
-	  int res = chmod(CommandScript.c_str(), S_IRUSR | S_IWUSR | S_IXUSR | S_IRGRP | S_IWGRP | S_IXGRP | S_IROTH | S_IWOTH | S_IXOTH);
-	  if (res != 0)
+
+	  GERROR("Can't find bart commands script: %s!\n", script.c_str());
+	  return false;
+     }
+
+     void BartGadget::append_script_commands(const std::vector<std::string>& script, std::vector<std::string>& commands)
+     {
+	  for (auto Line: script)
 	  {
-	       GERROR("Error changing the permission of the command script.\n");
-	       return GADGET_FAIL;
+	       replace_default_parameters(Line, dp);
+	       GDEBUG("%s\n", Line.c_str());
+	       commands.push_back(Line);
+	  }
+     }
+
+     uint16_t BartGadget::select_virtual_channels(const std::vector<long>& dims, const std::complex<float>* data) const
+     {
+	  const auto energies = coil_compression_energies(dims, data);
+	  const auto count = select_virtual_coils(energies, VirtualCoilEnergyFraction.value(), MinVirtualChannels.value(), MaxVirtualChannels.value());
+	  const auto num_coils = energies.size();
+
+	  GDEBUG_CONDITION_STREAM(isVerboseON.value(), "BartGadget::process: " << count << " virtual channel(s) out of " << num_coils
+				  << " retain " << VirtualCoilEnergyFraction.value() * 100 << "% of the energy");
+	  return static_cast<uint16_t>(count);
+     }
+
+     BartJobStatus BartGadget::run_job(BartJob job, IsmrmrdImageArray& imarray) const
+     {
+	  // Memory the job is admitted with against the quota of its tenant (the daemon estimates it alike)
+	  job.memory_expansion = OutOfCoreMemoryExpansion.value();
+	  const auto reserved_bytes = estimate_job_memory(job);
+
+	  // Everything the job refers to is shared with it, in case it outlives this call (see run_with_time_limits())
+	  auto shared_job = std::make_shared<const BartJob>(std::move(job));
+	  auto result = std::make_shared<IsmrmrdImageArray>();
+	  const auto use_daemon = BartEngine.value() == "daemon";
+	  const auto socket_path = BartDaemonSocket_path.value();
+
+	  const auto use_async = use_async_;
+
+	  auto task = [shared_job, result, use_daemon, socket_path, reserved_bytes, use_async]
+	       {
+		    const auto& job = *shared_job;
+		    if (use_daemon)
+		    {
+			 BartDaemonReply reply;
+			 if (!BartDaemonClient(socket_path).submit(job, reply))
+			      return false;
+			 extract_image_array(reply.output, *result, job.copies.get());
+			 return true;
+		    }
+
+#ifdef BART_ASYNC_EXECUTION
+		    if (use_async)
+		    {
+			 auto& executor = BartExecutor::get();
+			 return executor.run(run_bart_job_async(executor, job, reserved_bytes, [&job, &result](const BartJobOutput& output)
+				   {
+					extract_image_array(output, *result, job.copies.get());
+					return true;
+				   }));
+		    }
+#endif
+
+		    const auto reservation = BartFairShare::get().reserve(job.schedule.tenant, reserved_bytes, job.cancellation.get());
+		    if (!reservation)
+			 return false;
+
+		    // BART keeps global state: hold an instance exclusively for the whole job
+		    auto bart = BartInstancePool::get().acquire(job.schedule, job.cancellation.get());
+		    internal::MemCflGuard mem_guard(bart);
+
+		    BartJobOutput output;
+		    if (!bart || !run_bart_job(bart, job, output))
+			 return false;
+		    extract_image_array(output, *result, job.copies.get());
+		    return true;
+	       };
+
+	  const auto status = run_with_time_limits(task, *shared_job, make_time_limits(), *abandoned_jobs_);
+	  if (status == BartJobStatus::succeeded)
+	       imarray = std::move(*result);
+	  return status;
+     }
+
+     int BartGadget::process(GadgetContainerMessage<IsmrmrdReconData>* m1)
+     {        
+	  const auto schedule = make_scheduling_info();
+
+	  if (cancellation_->is_cancelled())
+	  {
+	       GDEBUG("BartGadget::process: Stream closed, dropping dataset\n");
+	       m1->release();
+	       return GADGET_OK;
 	  }
-#endif // _WIN32
 
 	  // Check status of the folder containing the generated files (*.hdr & *.cfl)
 
@@ -401,6 +682,9 @@ namespace Gadgetron {
 	       }
 	  }
 
+	  // The inputs of a timed out job remain in use until its current command returns
+	  std::shared_ptr<void> message(m1, [](GadgetContainerMessage<IsmrmrdReconData>* m) { m->release(); });
+
 	  /*** PROCESS EACH DATASET ***/
 
 	  auto it(0UL);
@@ -428,6 +712,51 @@ namespace Gadgetron {
 				      static_cast<long>(input.get_size(5)),
 				      static_cast<long>(input.get_size(6))};
 
+	       // Blocks of readout positions are only independent for Cartesian data, the calibration data being needed whole
+	       // (the block size is refined once the size of the calibration results is known, see run_out_of_core())
+	       const auto block_size = out_of_core_commands_.empty() || recon_bit.data_.trajectory_ || DIMS_ref == DIMS ? DIMS[0]
+		    : readout_block_size(DIMS, input_ref.get_number_of_bytes(), static_cast<size_t>(OutOfCoreMemoryBudgetInMegabytes.value()) << 20,
+					 OutOfCoreMemoryExpansion.value());
+	       if (block_size < DIMS[0])
+	       {
+		    if (needs_virtual_channels_)
+		    {
+			 dp.virtual_channels = select_virtual_channels(DIMS_ref, &input_ref[0]);
+			 dp.last_virtual_channel = dp.virtual_channels - 1;
+		    }
+
+		    IsmrmrdImageArray imarray;
+		    const auto copies = make_copy_accounting();
+		    const auto status = run_out_of_core(recon_bit, out_of_core_commands_, block_size, schedule, message, copies, imarray);
+		    if (status == BartJobStatus::timed_out)
+		    {
+			 GERROR("BartGadget::process: Skipping dataset %lu (time limit exceeded)\n", it);
+			 ++it;
+			 continue;
+		    }
+		    if (status != BartJobStatus::succeeded)
+		    {
+			 if (cancellation_->is_cancelled())
+			      break;
+			 return GADGET_FAIL;
+		    }
+
+		    if (copies)
+			 GINFO("BartGadget::process: Memory traffic of dataset %lu:\n%s", it, copies->report().c_str());
+
+		    compute_image_header(recon_bit, imarray, it);
+		    send_out_image_array(recon_bit, imarray, it, image_series.value() + (static_cast<int>(it) + 1), GADGETRON_IMAGE_REGULAR);
+		    ++it;
+		    continue;
+	       }
+
+	       BartJob job;
+	       job.schedule = schedule;
+	       job.payload = message;
+	       job.profile = perform_timing.value();
+	       job.count_hardware_events = CountHardwareEvents.value();
+	       job.copies = make_copy_accounting();
+
 	       // Grab a reference to the buffer containing the image trajectory data (if present)
 	       if (recon_bit.data_.trajectory_) {
 		    auto& traj = *recon_bit.data_.trajectory_;
@@ -439,8 +768,7 @@ namespace Gadgetron {
 						static_cast<long>(traj.get_size(4)),
 						static_cast<long>(traj.get_size(5)),
 						static_cast<long>(traj.get_size(6))};
-		    // write_BART_Files(std::string(generatedFilesFolder + "meas_gadgetron_traj"), DIMS, data);
-		    register_mem_cfl_non_managed("meas_gadgetron_traj", DIMS_traj.size(), &DIMS_traj[0], &input[0]);
+		    job.inputs.push_back({"meas_gadgetron_traj", DIMS_traj, &input[0], nullptr});
 	       }
 
 	       /* The reference data will be pointing to the image data if there is
@@ -448,164 +776,361 @@ namespace Gadgetron {
 		  into files if it's pointing to the raw data.*/
 	       if (DIMS_ref != DIMS)
 	       {
-		    // write_BART_Files(std::string(generatedFilesFolder + "meas_gadgetron_ref"), DIMS_ref, data_ref);
-		    register_mem_cfl_non_managed("meas_gadgetron_ref", DIMS.size(), &DIMS_ref[0], &input_ref[0]);
+		    job.inputs.push_back({"meas_gadgetron_ref", DIMS_ref, &input_ref[0], nullptr});
 	       }
 
-	       // write_BART_Files(std::string(generatedFilesFolder + "meas_gadgetron"), DIMS, data);
-	       register_mem_cfl_non_managed("meas_gadgetron", DIMS.size(), &DIMS[0], &input[0]);
+	       job.inputs.push_back({"meas_gadgetron", DIMS, &input[0], nullptr});
 
-	       /* Before calling Bart let's do some bookkeeping */
-	       std::replace(generatedFilesFolder.begin(), generatedFilesFolder.end(), '\\', '/');
+	       // The acquisition headers stay for compute_image_header(), the fallback and the preview need the k-space after the job
+	       if (ReleaseInputsEarly.value() && TimeLimitAction.value() == "abort")
+	       {
+		    // meas_gadgetron_traj points to the k-space as well
+		    const auto release_input = internal::make_buffer_release(input, recon_bit.data_.trajectory_ ? 2 : 1);
+		    for (auto& job_input: job.inputs)
+			 job_input.release = job_input.name == "meas_gadgetron_ref" ? internal::make_buffer_release(input_ref, 1) : release_input;
+	       }
 
-	       if (DIMS_ref != DIMS)
+	       if (UseCalibrationStore.value() && DIMS_ref != DIMS)
 	       {
-		    std::ostringstream cmd;
-		    cmd << "bart resize -c 0 " << DIMS[0] << " 1 " << DIMS[1] << " 2 " << DIMS[2] << " meas_gadgetron_ref reference_data";
-		    if (!call_BART(cmd.str()))
-		    {
-			 return GADGET_FAIL;
-		    }
+		    job.calibration.key = make_calibration_key(*recon_bit.ref_);
+		    job.calibration.inputs.push_back("meas_gadgetron_ref");
 	       }
 
-	       std::ostringstream cmd2;
-	       if (DIMS[4] != 1)
-		    cmd2 << "bart reshape 1023 " << DIMS[0] << " " << DIMS[1] << " " << DIMS[2] << " " << DIMS[3] << " 1 1 1 " << DIMS[5] << " " << DIMS[6] << " " << DIMS[4] << " meas_gadgetron input_data";
-	       else	
-		    cmd2 << "bart fcopy meas_gadgetron input_data";
+	       /* Before calling Bart let's do some bookkeeping */
+	       std::replace(generatedFilesFolder.begin(), generatedFilesFolder.end(), '\\', '/');
+
+	       job.commands = staging_commands(DIMS, DIMS[0], DIMS_ref != DIMS, static_cast<bool>(recon_bit.data_.trajectory_));
+	       set_readout_block(dp, 0, DIMS[0]);
 
-	       if (!call_BART(cmd2.str()))
+	       /*** CALL BART COMMAND LINE from the scripting file ***/
+
+	       if (needs_virtual_channels_)
 	       {
-		    return GADGET_FAIL;
+		    // From the calibration data, as the coil compression of the script
+		    dp.virtual_channels = DIMS_ref != DIMS ? select_virtual_channels(DIMS_ref, &input_ref[0]) : select_virtual_channels(DIMS, &input[0]);
+		    dp.last_virtual_channel = dp.virtual_channels - 1;
 	       }
 
-	       std::ostringstream cmd3;
-	       if (DIMS[4] != 1)
-		    cmd3 << "bart reshape 1023 " << DIMS[0] << " " << DIMS[1] << " " << DIMS[2] << " " << DIMS[3] << " 1 1 1 " << DIMS[5] << " " << DIMS[6] << " " << DIMS[4] << " meas_gadgetron_traj traj_data";
-	       else	
-		    cmd3 << "bart fcopy meas_gadgetron_traj traj_data";
+	       const auto staged_commands = job.commands;
+	       append_script_commands(script_commands_, job.commands);
+
+	       // Each job gets its own token: cancelling a timed out job should not affect the others
+	       job.cancellation = std::make_shared<BartCancellationToken>(cancellation_);
+	       job.progress = std::make_shared<BartJobProgress>();
 
-	       if (!call_BART(cmd3.str()))
+	       IsmrmrdImageArray imarray;
+
+	       // Inputs and (substituted) commands are all part of the key (the daemon has a cache of its own)
+	       const auto use_result_cache = UseResultCache.value() && BartEngine.value() != "daemon" && BartResultCache::get().is_enabled();
+	       const auto result_key = use_result_cache ? hash_bart_job(job) : 0;
+	       auto cached = use_result_cache ? BartResultCache::get().lookup(result_key) : nullptr;
+	       if (cached && (cached->dims.size() != 7
+			      || std::accumulate(cached->dims.begin(), cached->dims.end(), size_t(1), std::multiplies<size_t>()) != cached->data.size()))
 	       {
-		    return GADGET_FAIL;
+		    // Eg. an entry of the daemon sharing the directory of the cache
+		    GDEBUG_CONDITION_STREAM(isVerboseON.value(), "BartGadget::process: Ignoring cached result of unexpected dimensions for dataset " << it);
+		    cached.reset();
 	       }
 
-	       /*** CALL BART COMMAND LINE from the scripting file ***/
-
-	       std::string Commands_Line;
-	       std::fstream inputFile(CommandScript);
-	       if (inputFile)
+	       auto status = BartJobStatus::succeeded;
+	       if (cached)
 	       {
-		    std::string Line;
-		    while (getline(inputFile, Line))
+		    GDEBUG_CONDITION_STREAM(isVerboseON.value(), "BartGadget::process: Reusing cached result for dataset " << it);
+		    imarray.data_.create(cached->dims);
+		    std::copy(cached->data.begin(), cached->data.end(), imarray.data_.begin());
+		    if (job.copies)
 		    {
-			 // crop comment
-			 Line = Line.substr(0, Line.find_first_of("#"));
-
-			 internal::trim(Line);
-			 if (Line.empty() || Line.compare(0, 4, "bart") != 0)
-			      continue;
-				
-			 replace_default_parameters(Line);
-			 GDEBUG("%s\n", Line.c_str());
-
-			 if (!call_BART(Line))
+			 job.copies->allocated("result cache", imarray.data_.get_number_of_bytes());
+			 job.copies->copied("result cache", imarray.data_.get_number_of_bytes(), true);
+		    }
+	       }
+	       else
+	       {
+		    status = run_job(job, imarray);
+		    if (status == BartJobStatus::succeeded && use_result_cache)
+		    {
+			 auto result = std::make_shared<BartResultCache::Result>();
+			 for (size_t d = 0; d < imarray.data_.get_number_of_dimensions(); ++d)
+			      result->dims.push_back(imarray.data_.get_size(d));
+			 result->data.assign(imarray.data_.begin(), imarray.data_.end());
+			 if (job.copies)
 			 {
-			      return GADGET_FAIL;
+			      job.copies->allocated("result cache", imarray.data_.get_number_of_bytes());
+			      job.copies->copied("result cache", imarray.data_.get_number_of_bytes(), true);
 			 }
-
-			 Commands_Line = Line;
+			 BartResultCache::get().insert(result_key, std::move(result));
 		    }
 	       }
-	       else
+
+	       if (status == BartJobStatus::timed_out && TimeLimitAction.value() == "fallback")
+	       {
+		    GWARN("BartGadget::process: Falling back to %s\n", FallbackBartCommandScript_name.value().c_str());
+		    job.commands = staged_commands;
+		    append_script_commands(fallback_commands_, job.commands);
+		    job.cancellation = std::make_shared<BartCancellationToken>(cancellation_);
+		    job.progress = std::make_shared<BartJobProgress>();
+		    status = run_job(std::move(job), imarray);
+	       }
+	       else if (status == BartJobStatus::timed_out && TimeLimitAction.value() == "preview")
+	       {
+		    GWARN("BartGadget::process: Sending a zero-filled preview instead\n");
+		    make_preview(input, imarray, job.copies.get());
+		    status = BartJobStatus::succeeded;
+	       }
+
+	       if (status != BartJobStatus::succeeded)
 	       {
-		    GERROR("Unable to open %s\n", CommandScript.c_str());
+		    // Cancelled: the remaining datasets are dropped as well
+		    if (cancellation_->is_cancelled())
+			 break;
+		    if (status == BartJobStatus::timed_out)
+		    {
+			 GERROR("BartGadget::process: Skipping dataset %lu (time limit exceeded)\n", it);
+			 ++it;
+			 continue;
+		    }
 		    return GADGET_FAIL;
 	       }
 
-	       std::string outputFile = internal::get_output_filename(Commands_Line);
-	       std::string outputFileReshape = outputFile + "_reshape";
+	       if (isBartFileBeingStored.value())
+		    cleanup_guard.dismiss();
+
+	       if (job.copies)
+		    GINFO("BartGadget::process: Memory traffic of dataset %lu:\n%s", it, job.copies->report().c_str());
+
+	       compute_image_header(recon_bit, imarray, it);
+	       send_out_image_array(recon_bit, imarray, it, image_series.value() + (static_cast<int>(it) + 1), GADGETRON_IMAGE_REGULAR);
+	       ++it;
+	  }
+
+	  return GADGET_OK;
+     }
+
+     BartJobStatus BartGadget::run_out_of_core(IsmrmrdReconBit& recon_bit, const std::vector<std::string>& script, long block_size,
+					       const BartSchedulingInfo& schedule, const std::shared_ptr<void>& message,
+					       const std::shared_ptr<BartCopyAccounting>& copies, IsmrmrdImageArray& imarray)
+     {
+	  auto& input_ref = (*recon_bit.ref_).data_;
+	  auto& input = recon_bit.data_.data_;
+
+	  std::vector<long> DIMS_ref, DIMS;
+	  for (size_t d = 0; d < 7; ++d)
+	  {
+	       DIMS_ref.push_back(static_cast<long>(input_ref.get_size(d)));
+	       DIMS.push_back(static_cast<long>(input.get_size(d)));
+	  }
+	  const auto num_lines = static_cast<size_t>(input.get_number_of_elements() / DIMS[0]);
 
-	       // Reformat the data back to gadgetron format
-	       std::vector<long> header(16);
-	       load_mem_cfl(outputFile.c_str(), header.size(), header.data());
-	       // auto header = read_BART_hdr(generatedFilesFolder + outputFile);
-	       std::ostringstream cmd4;
-	       cmd4 << "bart reshape 1023 " << header[0] << " " << header[1] << " " << header[2] << " " << header[3] << " " << header[9] * header[4] <<
-		    " " << header[5] << " " << header[6] << " " << header[7] << " " << header[8] << " 1 " << outputFile << " " << outputFileReshape;
+	  // Commands of the block of readout positions [start, start + size)
+	  auto block_commands = [&](long start, long size)
+	       {
+		    auto commands = staging_commands(DIMS, size, true, false);
+		    set_readout_block(dp, start, size);
+		    append_script_commands(script, commands);
+		    return commands;
+	       };
+
+	  // The calibration commands the same for all the blocks (eg. the sensitivities of the whole volume) run once
+	  BartJob calibration;
+	  calibration.schedule = schedule;
+	  calibration.profile = perform_timing.value();
+	  calibration.count_hardware_events = CountHardwareEvents.value();
+	  calibration.copies = copies;
+	  calibration.cancellation = std::make_shared<BartCancellationToken>(cancellation_);
+	  calibration.inputs.push_back({"meas_gadgetron_ref", DIMS_ref, &input_ref[0], nullptr});
+	  calibration.calibration.key = UseCalibrationStore.value() ? make_calibration_key(*recon_bit.ref_) : "out-of-core";
+	  calibration.calibration.inputs.push_back("meas_gadgetron_ref");
+	  // A block of another start and size (the size may only shrink below) tells the commands depending on the block
+	  calibration.commands = block_commands(0, block_size);
+	  const std::vector<std::vector<std::string>> variants{block_commands(DIMS[0] - 1, 1)};
+
+	  std::vector<size_t> shared;
+	  auto results = std::make_shared<std::vector<BartCalibrationResult>>();
+	  {
+	       auto bart = BartInstancePool::get().acquire(schedule, calibration.cancellation.get());
+	       internal::MemCflGuard mem_guard(bart);
+	       if (!bart || !run_shared_calibration(bart, calibration, variants, shared, *results))
+		    return BartJobStatus::failed;
+	  }
 
-	       if (!call_BART(cmd4.str()))
+	  // Every block gets the calibration data and the shared results whole
+	  auto fixed_bytes = input_ref.get_number_of_bytes();
+	  for (const auto& result: *results)
+	       fixed_bytes += result.data.size() * sizeof(std::complex<float>);
+	  block_size = readout_block_size(DIMS, fixed_bytes, static_cast<size_t>(OutOfCoreMemoryBudgetInMegabytes.value()) << 20,
+					  OutOfCoreMemoryExpansion.value());
+	  const auto num_blocks = (DIMS[0] + block_size - 1) / block_size;
+
+	  GDEBUG_CONDITION_STREAM(isVerboseON.value(), "BartGadget::process: Reconstructing " << input.get_number_of_bytes() / (1 << 20)
+				  << " MB out of core, in " << num_blocks << " block(s) of " << block_size << " readout positions ("
+				  << shared.size() << " calibration command(s) run once)");
+
+	  auto scratch = BartScratchArray::create(OutOfCoreScratch_path.value(), DIMS, block_size);
+	  if (!scratch || !spill_to_hybrid_space(input, *scratch))
+	       return BartJobStatus::failed;
+
+	  // From now on, the data of the dataset only lives in the scratch file
+	  if (copies)
+	       copies->copied("out-of-core spill", input.get_number_of_bytes(), true);
+	  input.clear();
+
+	  // Shared with the block jobs, which may outlive this call when timed out
+	  auto block = std::make_shared<std::vector<std::complex<float>>>(block_size * num_lines);
+	  if (copies)
+	       copies->allocated("out-of-core blocks", block->size() * sizeof(std::complex<float>));
+
+	  std::vector<long> DIMS_OUT;
+	  for (long start = 0; start < DIMS[0]; start += block_size)
+	  {
+	       const auto size = std::min(block_size, DIMS[0] - start);
+	       if (!scratch->read_block(start, block->data()))
+		    return BartJobStatus::failed;
+	       if (copies)
+		    copies->copied("out-of-core blocks", size * num_lines * sizeof(std::complex<float>), false);
+
+	       auto DIMS_block = DIMS;
+	       DIMS_block[0] = size;
+
+	       BartJob job;
+	       job.schedule = schedule;
+	       job.payload = std::shared_ptr<void>(block.get(), [message, block, results](void*) {});
+	       job.profile = perform_timing.value();
+	       job.count_hardware_events = CountHardwareEvents.value();
+	       job.copies = copies;
+	       job.inputs.push_back({"meas_gadgetron_ref", DIMS_ref, &input_ref[0], nullptr});
+	       job.inputs.push_back({"meas_gadgetron", DIMS_block, block->data(), nullptr});
+	       for (auto& result: *results)
+		    job.inputs.push_back({result.name, result.dims, result.data.data(), nullptr});
+
+	       if (UseCalibrationStore.value() && shared.empty())
 	       {
-		    return GADGET_FAIL;
+		    job.calibration.key = make_calibration_key(*recon_bit.ref_);
+		    job.calibration.inputs.push_back("meas_gadgetron_ref");
 	       }
-	  
-	       /**** READ FROM BART FILES ***/
-	       std::vector<long> DIMS_OUT(16);
-	       auto data(reinterpret_cast<std::complex<float>*>(load_mem_cfl(outputFileReshape.c_str(), DIMS_OUT.size(), DIMS_OUT.data())));
 
-	       if (data == 0 || data == nullptr)
+	       const auto commands = block_commands(start, size);
+	       for (size_t i = 0; i < commands.size(); ++i)
 	       {
-		    GERROR("Failed to retrieve data from in-memory CFL file!");
-		    return GADGET_FAIL;
+		    if (std::find(shared.begin(), shared.end(), i) == shared.end())
+			 job.commands.push_back(commands[i]);
 	       }
 
-	       // std::vector<std::size_t> DIMS_OUT;
-	       // std::vector<std::complex<float>> data;
-	       // std::tie(DIMS_OUT, data) = read_BART_files(generatedFilesFolder + outputfileReshape);
+	       job.cancellation = std::make_shared<BartCancellationToken>(cancellation_);
+	       job.progress = std::make_shared<BartJobProgress>();
 
-	       if (isBartFileBeingStored.value())
-		    cleanup_guard.dismiss();
+	       IsmrmrdImageArray block_images;
+	       const auto status = run_job(std::move(job), block_images);
+	       if (status != BartJobStatus::succeeded)
+		    return status;
 
-	       IsmrmrdImageArray imarray;
+	       // Stream the block into the images of the whole dataset
+	       auto& data = block_images.data_;
+	       std::vector<long> DIMS_block_out;
+	       for (size_t d = 0; d < data.get_number_of_dimensions(); ++d)
+		    DIMS_block_out.push_back(static_cast<long>(data.get_size(d)));
+	       if (DIMS_block_out.empty() || DIMS_block_out[0] != size)
+	       {
+		    GERROR("BartGadget::process: The out-of-core script must keep the readout positions of its block (%ld expected)\n", size);
+		    return BartJobStatus::failed;
+	       }
+	       DIMS_block_out[0] = DIMS[0];
+	       if (DIMS_OUT.empty())
+	       {
+		    DIMS_OUT = DIMS_block_out;
+		    imarray.data_.create(std::vector<size_t>(DIMS_OUT.begin(), DIMS_OUT.end()));
+		    if (copies)
+			 copies->allocated("out-of-core assembly", imarray.data_.get_number_of_bytes());
+	       }
+	       else if (DIMS_block_out != DIMS_OUT)
+	       {
+		    GERROR("BartGadget::process: The blocks of an out-of-core reconstruction have inconsistent dimensions\n");
+		    return BartJobStatus::failed;
+	       }
+	       paste_readout_block(data.begin(), start, size, DIMS[0], data.get_number_of_elements() / size, imarray.data_.begin());
+	       if (copies)
+		    copies->copied("out-of-core assembly", data.get_number_of_bytes(), false);
+	  }
+	  return BartJobStatus::succeeded;
+     }
 
-	       // Grab data from BART files
-	       std::vector<size_t> BART_DATA_dims{
-		    static_cast<size_t>(std::accumulate(DIMS_OUT.begin(), DIMS_OUT.end(), 1, std::multiplies<size_t>()))};
-	       hoNDArray<std::complex<float>> DATA(BART_DATA_dims, data);
-	       // hoNDArray<std::complex<float>> DATA(BART_DATA_dims, &data[0]);
-
-	       // The image array data will be [E0,E1,E2,1,N,S,LOC]
-	       std::vector<size_t> data_dims(DIMS_OUT.begin(), DIMS_OUT.begin()+7);
-	       DATA.reshape(data_dims);
-
-	       // Extract the first image from each time frame (depending on the number of maps generated by the user)
-	       std::vector<size_t> data_dims_Final{static_cast<size_t>(DIMS_OUT[0]),
-						   static_cast<size_t>(DIMS_OUT[1]),
-						   static_cast<size_t>(DIMS_OUT[2]),
-						   static_cast<size_t>(DIMS_OUT[3]),
-						   static_cast<size_t>(DIMS_OUT[4] / header[4]),
-						   static_cast<size_t>(DIMS_OUT[5]),
-						   static_cast<size_t>(DIMS_OUT[6])};
-	       assert(header[4] > 0);
-	       imarray.data_.create(data_dims_Final);
-
-	       std::vector<std::complex<float> > DATA_Final;
-	       DATA_Final.reserve(std::accumulate(data_dims_Final.begin(), data_dims_Final.end(), 1, std::multiplies<size_t>()));
-
-	       //Each chunk will be [E0,E1,E2,CHA] big
-	       std::vector<size_t> chunk_dims{data_dims_Final[0], data_dims_Final[1], data_dims_Final[2], data_dims_Final[3]};
-	       const std::vector<size_t> Temp_one_1d(1, chunk_dims[0] * chunk_dims[1] * chunk_dims[2] * chunk_dims[3]);
+     void BartGadget::extract_image_array(const BartJobOutput& output, IsmrmrdImageArray& imarray, BartCopyAccounting* copies)
+     {
+	  const auto& header = output.script_dims;
+	  const auto& DIMS_OUT = output.dims;
+
+	  // Grab data from BART files
+	  std::vector<size_t> BART_DATA_dims{
+	       static_cast<size_t>(std::accumulate(DIMS_OUT.begin(), DIMS_OUT.end(), 1, std::multiplies<size_t>()))};
+	  hoNDArray<std::complex<float>> DATA(BART_DATA_dims, output.data);
+
+	  // The image array data will be [E0,E1,E2,1,N,S,LOC]
+	  std::vector<size_t> data_dims(DIMS_OUT.begin(), DIMS_OUT.begin()+7);
+	  DATA.reshape(data_dims);
+
+	  // Extract the first image from each time frame (depending on the number of maps generated by the user)
+	  std::vector<size_t> data_dims_Final{static_cast<size_t>(DIMS_OUT[0]),
+					      static_cast<size_t>(DIMS_OUT[1]),
+					      static_cast<size_t>(DIMS_OUT[2]),
+					      static_cast<size_t>(DIMS_OUT[3]),
+					      static_cast<size_t>(DIMS_OUT[4] / header[4]),
+					      static_cast<size_t>(DIMS_OUT[5]),
+					      static_cast<size_t>(DIMS_OUT[6])};
+	  assert(header[4] > 0);
+	  imarray.data_.create(data_dims_Final);
+
+	  std::vector<std::complex<float> > DATA_Final;
+	  DATA_Final.reserve(std::accumulate(data_dims_Final.begin(), data_dims_Final.end(), 1, std::multiplies<size_t>()));
+
+	  //Each chunk will be [E0,E1,E2,CHA] big
+	  std::vector<size_t> chunk_dims{data_dims_Final[0], data_dims_Final[1], data_dims_Final[2], data_dims_Final[3]};
+	  const std::vector<size_t> Temp_one_1d(1, chunk_dims[0] * chunk_dims[1] * chunk_dims[2] * chunk_dims[3]);
 	  
-	       for (uint16_t loc = 0; loc < data_dims[6]; ++loc) {
-		    for (uint16_t s = 0; s < data_dims[5]; ++s) {
-			 for (uint16_t n = 0; n < data_dims[4]; n += header[4]) {
-			      //Grab a wrapper around the relevant chunk of data [E0,E1,E2,CHA] for this loc, n, and s
-			      auto chunk = hoNDArray<std::complex<float> >(chunk_dims, &DATA(0, 0, 0, 0, n, s, loc));
-			      chunk.reshape(Temp_one_1d);
-			      DATA_Final.insert(DATA_Final.end(), chunk.begin(), chunk.end());
-			 }
+	  for (uint16_t loc = 0; loc < data_dims[6]; ++loc) {
+	       for (uint16_t s = 0; s < data_dims[5]; ++s) {
+		    for (uint16_t n = 0; n < data_dims[4]; n += header[4]) {
+			 //Grab a wrapper around the relevant chunk of data [E0,E1,E2,CHA] for this loc, n, and s
+			 auto chunk = hoNDArray<std::complex<float> >(chunk_dims, &DATA(0, 0, 0, 0, n, s, loc));
+			 chunk.reshape(Temp_one_1d);
+			 DATA_Final.insert(DATA_Final.end(), chunk.begin(), chunk.end());
 		    }
 	       }
+	  }
 
-	       std::copy(DATA_Final.begin(), DATA_Final.end(), imarray.data_.begin());
+	  std::copy(DATA_Final.begin(), DATA_Final.end(), imarray.data_.begin());
 
-	       compute_image_header(recon_bit, imarray, it);
-	       send_out_image_array(recon_bit, imarray, it, image_series.value() + (static_cast<int>(it) + 1), GADGETRON_IMAGE_REGULAR);
-	       ++it;
+	  if (copies)
+	  {
+	       // Into DATA_Final, then into the image array
+	       const auto bytes = DATA_Final.size() * sizeof(std::complex<float>);
+	       copies->allocated("image extraction", 2 * bytes);
+	       copies->copied("image extraction", bytes, bytes == DATA.get_number_of_bytes());
+	       copies->copied("image extraction", bytes, true);
 	  }
+     }
 
-	  m1->release();
-	  return GADGET_OK;
+     void BartGadget::make_preview(const hoNDArray<std::complex<float>>& kspace, IsmrmrdImageArray& imarray, BartCopyAccounting* copies)
+     {
+	  // k-space is [E0,E1,E2,CHA,N,S,LOC], the preview [E0,E1,E2,1,N,S,LOC] (root sum of squares over the coils)
+	  hoNDArray<std::complex<float>> images(kspace);
+	  if (copies)
+	  {
+	       copies->allocated("preview", kspace.get_number_of_bytes());
+	       copies->copied("preview", kspace.get_number_of_bytes(), true);
+	  }
+	  if (kspace.get_size(2) > 1)
+	       hoNDFFT<float>::instance()->ifft3c(images);
+	  else
+	       hoNDFFT<float>::instance()->ifft2c(images);
+
+	  const auto image_size = kspace.get_size(0) * kspace.get_size(1) * kspace.get_size(2);
+	  const auto num_coils = kspace.get_size(3);
+	  const auto num_images = kspace.get_size(4) * kspace.get_size(5) * kspace.get_size(6);
+
+	  imarray.data_.create(std::vector<size_t>{kspace.get_size(0), kspace.get_size(1), kspace.get_size(2), 1,
+			       kspace.get_size(4), kspace.get_size(5), kspace.get_size(6)});
+	  const auto& kernels = bart_kernels();
+	  for (size_t n = 0; n < num_images; ++n)
+	       kernels.root_sum_of_squares(images.begin() + image_size * num_coils * n, image_size, num_coils, imarray.data_.begin() + image_size * n);
      }
 
      GADGET_FACTORY_DECLARE(BartGadget)
@@ -20,7 +20,12 @@
 #include <algorithm>
 #include <iterator>
 #include <string>
+#include <memory>
 #include "gadgetron_home.h"
+#include "bart_instance.h"
+#include "bart_executor.h"
+#include "bart_watchdog.h"
+#include "bart_script.h"
 
 #if defined (WIN32)
 #ifdef __BUILD_GADGETRON_bartgadget__
@@ -35,21 +40,6 @@
 
 namespace Gadgetron {
 	
-     // The user is free to add more parameters as the need arises.
-     struct Default_parameters 
-     {
-	  uint16_t recon_matrix_x;
-	  uint16_t recon_matrix_y;
-	  uint16_t recon_matrix_z;
-	  uint16_t FOV_x;
-	  uint16_t FOV_y;
-	  uint16_t FOV_z;
-	  uint16_t acc_factor_PE1;
-	  uint16_t acc_factor_PE2;
-	  uint16_t reference_lines_PE1;
-	  uint16_t reference_lines_PE2;
-     };
-
      class EXPORTGADGETS_bartgadget BartGadget final : public GenericReconGadget
      {
 
@@ -66,6 +56,7 @@ namespace Gadgetron {
 	  GADGET_PROPERTY(BartWorkingDirectory_path, std::string, "Absolute path to temporary file location", "/tmp/gadgetron/");
 	  GADGET_PROPERTY(AbsoluteBartCommandScript_path, std::string, "Absolute path to bart script(s)", get_gadgetron_home().string() + "/share/gadgetron/bart");
 	  GADGET_PROPERTY(BartCommandScript_name, std::string, "Script file containing BART command(s) to be loaded", "");
+	  GADGET_PROPERTY(UseEmbeddedScripts, bool, "Fall back to the copies of the bundled scripts (Sample_*.sh) compiled into the gadget when they are not found in AbsoluteBartCommandScript_path", true);
 	  GADGET_PROPERTY(isBartFileBeingStored, bool, "Store BART file on the disk", false);
 	  GADGET_PROPERTY(image_series, int, "Set image series", 0);
 
@@ -73,15 +64,115 @@ namespace Gadgetron {
 	  GADGET_PROPERTY(isBartFolderBeingCachedToVM, bool, "Mount bart directory to virtual memory (tmpfs) for better performance", false);
 	  GADGET_PROPERTY(AllocateMemorySizeInMegabytes, int, "Allocate memory to bart directory", 50);
 
+	  /*Isolated BART instances: requires BART to be compiled as a separate shared object (BART_ISOLATED_INSTANCES CMake option)*/
+	  GADGET_PROPERTY(NumberOfBartInstances, int, "Number of isolated BART instances running concurrently within the process (1 to use the BART linked into the gadget)", 1);
+	  GADGET_PROPERTY(BartInstanceLibrary_path, std::string, "Absolute path to the BART shared object loaded by each isolated instance", get_gadgetron_home().string() + "/lib/libgadgetron_bart_instance.so");
+
+	  /*Shared reconstruction daemon: BART jobs of all the Gadgetron chains of the node are run by one gadgetron_bart_daemon process*/
+	  GADGET_PROPERTY(BartEngine, std::string, "Where to run the BART commands: in_process or daemon (which has its own calibration store and result cache, shared by all its clients)", "in_process");
+	  GADGET_PROPERTY(BartDaemonSocket_path, std::string, "Absolute path to the Unix domain socket of the BART reconstruction daemon", "/tmp/gadgetron/bart_daemon.sock");
+
+	  /*Scheduling of the jobs competing for BART (earliest deadline first)*/
+	  GADGET_PROPERTY(BartProtocolType, std::string, "Type of protocol used to derive the deadline of the jobs: auto, realtime or offline", "auto");
+	  GADGET_PROPERTY(RealTimeDeadlineInMilliseconds, int, "Deadline of the jobs of real-time protocols, relative to their arrival", 1000);
+	  GADGET_PROPERTY(OfflineDeadlineInMilliseconds, int, "Deadline of the jobs of offline protocols, relative to their arrival (0 for none)", 600000);
+	  GADGET_PROPERTY(BartJobPriority, int, "Priority of the jobs among those with the same deadline (higher first)", 0);
+
+	  /*Fair share: BART is shared by the chains of the process (or the clients of the daemon), the tenants using less than their weighted share of its recent CPU time go first*/
+	  GADGET_PROPERTY(UseFairShare, bool, "Account the CPU time and memory of the jobs to a tenant and schedule the tenants fairly (the half-life applies to the whole process)", false);
+	  GADGET_PROPERTY(FairShareTenant, std::string, "Tenant the jobs of this chain are accounted to, eg. to share one among chains (empty for station_<stationName> of the header, or else connection_<n> for each connection)", "");
+	  GADGET_PROPERTY(FairShareWeight, float, "Weight of the tenant relative to the others (eg. 4 for clinical chains and 1 for research ones)", 1.0f);
+	  GADGET_PROPERTY(FairShareHalfLifeInSeconds, int, "Half-life of the CPU time the fair share is computed from", 300);
+	  GADGET_PROPERTY(CpuQuotaInSeconds, float, "Recent CPU time (decayed with the half-life) beyond which the jobs of the tenant wait for those of all the others (0 for none)", 0.0f);
+	  GADGET_PROPERTY(MemoryQuotaInMegabytes, int, "Memory the running jobs of the tenant may use, estimated with OutOfCoreMemoryExpansion (0 for none)", 0);
+
+	  /*Asynchronous execution (C++20 builds only): the jobs waiting for a BART instance or their memory quota do not hold any thread, the gadget still waits for the images of its dataset*/
+	  GADGET_PROPERTY(AsyncExecution, bool, "Run the in-process jobs as coroutines multiplexed onto a few executor threads (shared by the whole process)", false);
+	  GADGET_PROPERTY(AsyncExecutorThreads, int, "Number of executor threads (0 for the number of hardware threads), the first configuration wins", 0);
+
+	  /*CAUTION: the stream is also closed at the end of a normal acquisition, datasets still queued for this gadget are then dropped*/
+	  GADGET_PROPERTY(CancelJobsOnClose, bool, "Cancel the queued and running reconstructions when the stream is closed (eg. client disconnection or scan abort)", false);
+
+	  /*Latency guarantees: a BART command cannot be interrupted, a timed out job keeps its BART instance busy until its current command returns*/
+	  GADGET_PROPERTY(CommandTimeLimitInMilliseconds, int, "Maximum duration of any single BART command of a job (0 for none)", 0);
+	  GADGET_PROPERTY(JobTimeLimitInMilliseconds, int, "Maximum duration of a whole BART job, including the wait for a BART instance (0 for none)", 0);
+	  GADGET_PROPERTY(TimeLimitAction, std::string, "What to do with a dataset whose job timed out: abort, fallback (to FallbackBartCommandScript_name) or preview (zero-filled)", "abort");
+	  GADGET_PROPERTY(FallbackBartCommandScript_name, std::string, "Cheaper script file to run instead of BartCommandScript_name when a job timed out", "");
+
+	  /*Calibration store: reuse the coil compression and sensitivity maps of earlier scans with the same coils and geometry (local disk only)*/
+	  GADGET_PROPERTY(UseCalibrationStore, bool, "Reuse the outputs of the calibration commands of earlier scans with the same coil configuration and geometry", false);
+	  GADGET_PROPERTY(CalibrationStore_path, std::string, "Absolute path to the calibration store (must be on a local file system)", "/tmp/gadgetron/bart_calibration/");
+	  GADGET_PROPERTY(CalibrationStoreSizeInMegabytes, int, "Size of the calibration store, least recently used calibrations are removed beyond it", 2048);
+	  GADGET_PROPERTY(CalibrationReuseThreshold, float, "Minimal correlation between the calibration data of a scan and the stored one for the stored calibration to be reused", 0.95f);
+
+	  /*Result cache: identical datasets going through the same script are served without running BART*/
+	  GADGET_PROPERTY(UseResultCache, bool, "Reuse the images of earlier datasets with identical data, trajectory and BART commands (with BartEngine daemon, only the cache of the daemon is used)", false);
+	  GADGET_PROPERTY(ResultCacheSizeInMegabytes, int, "Size of the images kept in memory by the result cache", 1024);
+	  GADGET_PROPERTY(ResultCache_path, std::string, "Absolute path to keep the cached images on (local) disk as well (empty for memory only)", "");
+	  GADGET_PROPERTY(ResultCacheDiskSizeInMegabytes, int, "Size of the images kept on disk by the result cache", 10240);
+
+	  /*Early release: the k-space, reference and trajectory of a dataset are freed as soon as its BART job no longer reads them, instead of with the message*/
+	  GADGET_PROPERTY(ReleaseInputsEarly, bool, "Free the input buffers of each dataset after the last BART command reading them (only with TimeLimitAction abort, the acquisition headers are kept)", true);
+
+	  /*Thread tuning: the first runs of each (command, dimensions) signature try different numbers of threads, the fastest is kept*/
+	  GADGET_PROPERTY(AutotuneBartThreads, bool, "Tune the number of threads of each BART command for the dimensions of its operands (requires BART built with OpenMP)", true);
+	  GADGET_PROPERTY(BartThreadTable_path, std::string, "File the tuned numbers of threads are saved to (empty to tune again after each restart)", "/tmp/gadgetron/bart_thread_table.txt");
+	  GADGET_PROPERTY(MaxBartThreads, int, "Largest number of threads tried by the tuner (0 for the number of hardware threads)", 0);
+
+	  /*Coil compression: $virtual_channels is the smallest number of virtual coils retaining this fraction of the energy of the calibration data*/
+	  GADGET_PROPERTY(VirtualCoilEnergyFraction, float, "Fraction of the singular value energy of the coils retained by $virtual_channels", 0.95f);
+	  GADGET_PROPERTY(MinVirtualChannels, int, "Lower bound of $virtual_channels", 1);
+	  GADGET_PROPERTY(MaxVirtualChannels, int, "Upper bound of $virtual_channels (0 for the number of coils)", 0);
+
+	  /*Out-of-core mode: datasets too large for the memory budget are spilled to a scratch file and reconstructed in blocks of readout positions (Cartesian, with separate calibration data)*/
+	  GADGET_PROPERTY(OutOfCoreMemoryBudgetInMegabytes, int, "Memory available to the BART job of one dataset, larger datasets are reconstructed out of core (0 to always reconstruct in memory)", 0);
+	  GADGET_PROPERTY(OutOfCoreMemoryExpansion, float, "Estimated memory used by the BART commands per byte of input (intermediate results included), also for the memory quotas and the daemon", BART_MEMORY_EXPANSION);
+	  GADGET_PROPERTY(OutOfCoreBartCommandScript_name, std::string, "Script run on each block, its input_data is already inverse Fourier transformed along the readout", "");
+	  GADGET_PROPERTY(OutOfCoreScratch_path, std::string, "Absolute path to the directory of the scratch files (local disk)", "/tmp/gadgetron/");
+
+	  /*Copy accounting: bytes allocated, copied and zeroed per stage of the gadget and per BART command, reported for each dataset*/
+	  GADGET_PROPERTY(AccountCopies, bool, "Count the bytes allocated, copied and zeroed by each stage of the reconstruction and each BART command", false);
+	  GADGET_PROPERTY(StrictCopyAccounting, bool, "Flag the copies of whole buffers made by stages not listed in AllowedFullBufferCopies", false);
+	  GADGET_PROPERTY(AllowedFullBufferCopies, std::string, "Comma-separated list of the stages expected to copy whole buffers (eg. bart fcopy,image extraction)", "");
+
+	  /*Hardware performance counters (perf_event_open): cycles, instructions and last level cache misses of each BART command, reported when the stream is closed*/
+	  GADGET_PROPERTY(CountHardwareEvents, bool, "Collect the hardware performance counters of each BART command (Linux, needs perf_event_paranoid <= 2)", false);
+
+	  /*CPU dispatch: the native kernels of the gadget are built for several instruction sets, the best one supported by the CPU is used (the choice applies to the whole process)*/
+	  GADGET_PROPERTY(CpuKernelVariant, std::string, "Variant of the native kernels: auto, generic, avx2 or avx512 (forcing one is meant for benchmarking)", "auto");
+
 	  int process_config(ACE_Message_Block* mb);
 	  int process(GadgetContainerMessage<IsmrmrdReconData>* m1);		
+	  int close(unsigned long flags);
 
      private:
 	  Default_parameters dp;
+	  bool is_realtime_;
+	  bool use_async_;
+	  std::shared_ptr<BartCancellationToken> cancellation_;
+	  std::shared_ptr<BartAbandonedJobs> abandoned_jobs_;
+	  std::string calibration_key_;
+	  std::string tenant_;
+	  std::vector<std::string> script_commands_;
+	  std::vector<std::string> fallback_commands_;
+	  std::vector<std::string> out_of_core_commands_;
+	  bool needs_virtual_channels_;
 		
-	  void replace_default_parameters(std::string &str);
-	  
-	  bool call_BART(std::string cmdline);	  
+	  BartSchedulingInfo make_scheduling_info() const;
+	  BartTimeLimits make_time_limits() const;
+	  std::shared_ptr<BartCopyAccounting> make_copy_accounting() const;
+	  std::string make_calibration_key(const IsmrmrdDataBuffered& ref) const;
+
+	  bool load_script(const std::string& name, std::vector<std::string>& commands) const;
+	  void append_script_commands(const std::vector<std::string>& script, std::vector<std::string>& commands);
+	  uint16_t select_virtual_channels(const std::vector<long>& dims, const std::complex<float>* data) const;
+	  BartJobStatus run_job(BartJob job, IsmrmrdImageArray& imarray) const;
+	  BartJobStatus run_out_of_core(IsmrmrdReconBit& recon_bit, const std::vector<std::string>& script, long block_size,
+					const BartSchedulingInfo& schedule, const std::shared_ptr<void>& message,
+					const std::shared_ptr<BartCopyAccounting>& copies, IsmrmrdImageArray& imarray);
+
+	  static void extract_image_array(const BartJobOutput& output, IsmrmrdImageArray& imarray, BartCopyAccounting* copies);
+	  static void make_preview(const hoNDArray<std::complex<float>>& kspace, IsmrmrdImageArray& imarray, BartCopyAccounting* copies);
      };
 
      // Read BART files